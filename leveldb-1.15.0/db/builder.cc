@@ -28,10 +28,10 @@ Status BuildTable(const std::string& dbname,
   std::string fname = TableFileName(dbname, meta->number);
   if (iter->Valid()) {
     WritableFile* file;
-	hlsm::runtime::table_level.add(meta->number, 0);
+	hlsm::runtime::placement.set_level(meta->number, 0);
     s = env->NewWritableFile(fname, &file);
     if (!s.ok()) {
-      hlsm::runtime::table_level.remove(meta->number);
+      hlsm::runtime::placement.remove(meta->number);
       return s;
     }
 
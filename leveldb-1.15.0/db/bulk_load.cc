@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <map>
+
+#include "leveldb/bulk_load.h"
+#include "leveldb/env.h"
+#include "leveldb/hlsm.h"
+#include "leveldb/table_builder.h"
+#include "port/port.h"
+#include "db/db_impl.h"
+#include "db/dbformat.h"
+#include "db/filename.h"
+#include "db/lazy_version_edit.h"
+#include "db/lazy_version_set.h"
+#include "db/table_cache.h"
+#include "db/version_set.h"
+#include "util/mutexlock.h"
+
+/*
+ * Bulk load: tables are built from sorted partitions by a few loader
+ * 	threads and added to their levels with one version edit
+ *
+ * 	partitions --(threads)--> tables --(one edit)--> levels (and lazy levels)
+ *
+ * In hLSM mode every table is written to both devices like a level-0 table,
+ * 	and the lazy edit places it as AddLazyFileByRawLevel() does for a
+ * 	flush: in the delta levels of two-phase levels, in the mirror levels
+ * 	otherwise.  The delta level of a logical level is closed after its
+ * 	X.L part, so that later compaction outputs start a new one.
+ */
+
+namespace leveldb {
+
+struct DBImpl::BulkLoadState {
+  DBImpl* db;
+  const std::vector<BulkLoadPartition*>* partitions;
+  std::vector<FileMetaData>* files;		// one per partition
+  std::map<int, SequenceNumber> sequence;	// of each level; read-only
+						//	once the loaders start
+
+  port::Mutex mu;
+  port::CondVar cv;
+  size_t next;		// partition to build next
+  int running;		// loader threads
+  Status status;	// first error
+
+  BulkLoadState() : cv(&mu), next(0), running(0) { }
+};
+
+namespace {
+
+struct BySmallest {
+  const std::vector<BulkLoadPartition*>* partitions;
+  const std::vector<FileMetaData>* files;
+  const InternalKeyComparator* icmp;
+
+  bool operator()(size_t a, size_t b) const {
+    const int la = (*partitions)[a]->level();
+    const int lb = (*partitions)[b]->level();
+    if (la != lb) return la < lb;
+    return icmp->Compare((*files)[a].smallest, (*files)[b].smallest) < 0;
+  }
+};
+
+}  // namespace
+
+void DBImpl::BulkLoadWorker(void* arg) {
+  BulkLoadState* state = reinterpret_cast<BulkLoadState*>(arg);
+  while (true) {
+    size_t i;
+    {
+      MutexLock l(&state->mu);
+      if (state->next >= state->partitions->size() || !state->status.ok()) {
+        break;
+      }
+      i = state->next++;
+    }
+    BulkLoadPartition* partition = (*state->partitions)[i];
+    Status s = state->db->BuildBulkTable(partition,
+        state->sequence.find(partition->level())->second, &(*state->files)[i]);
+    if (!s.ok()) {
+      MutexLock l(&state->mu);
+      if (state->status.ok()) state->status = s;
+    }
+  }
+
+  MutexLock l(&state->mu);
+  state->running--;
+  state->cv.SignalAll();
+}
+
+Status DBImpl::BuildBulkTable(BulkLoadPartition* partition, SequenceNumber seq,
+                              FileMetaData* meta) {
+  {
+    MutexLock l(&mutex_);
+    meta->number = versions_->NewFileNumber();
+    pending_outputs_.insert(meta->number);
+  }
+  meta->file_size = 0;
+
+  // The level decides whether the table is mirrored; hLSM keeps a copy on
+  // the secondary for the lazy levels whatever the level
+  hlsm::runtime::placement.set_level(meta->number,
+      hlsm::config::mode.ishLSM() ? 0 : partition->level());
+  std::string fname = TableFileName(dbname_, meta->number);
+  WritableFile* file;
+  Status s = env_->NewWritableFile(fname, &file);
+  if (!s.ok()) {
+    hlsm::runtime::placement.remove(meta->number);
+    return s;
+  }
+
+  TableBuilder* builder = new TableBuilder(options_, file);
+  const Comparator* ucmp = user_comparator();
+  std::string last_key;
+  InternalKey ikey;
+  Slice key, value;
+  bool empty = true;
+  while (partition->Next(&key, &value)) {
+    if (!empty && ucmp->Compare(key, last_key) <= 0) {
+      s = Status::InvalidArgument("bulk load keys out of order", key);
+      break;
+    }
+    ikey.SetFrom(ParsedInternalKey(key, seq, kTypeValue));
+    if (empty) meta->smallest = ikey;
+    builder->Add(ikey.Encode(), value);
+    last_key.assign(key.data(), key.size());
+    empty = false;
+  }
+  if (s.ok()) s = partition->status();
+  meta->largest = ikey;
+
+  if (s.ok() && !empty) {
+    s = builder->Finish();
+    if (s.ok()) meta->file_size = builder->FileSize();
+  } else {
+    builder->Abandon();
+  }
+  delete builder;
+
+  if (s.ok()) s = file->Sync();
+  if (s.ok()) s = file->Close();
+  delete file;
+
+  if (s.ok() && meta->file_size > 0) {
+    // Verify that the table is usable
+    Iterator* it = table_cache_->NewIterator(ReadOptions(), meta->number,
+                                             meta->file_size);
+    s = it->status();
+    delete it;
+  }
+  if (!s.ok() || meta->file_size == 0) {
+    meta->file_size = 0;
+    env_->DeleteFile(fname);
+    hlsm::runtime::placement.remove(meta->number);
+  }
+  return s;
+}
+
+Status DBImpl::InstallBulkTables(const std::vector<BulkLoadPartition*>& partitions,
+                                 std::vector<FileMetaData>* files) {
+  mutex_.AssertHeld();
+  std::vector<size_t> order;
+  for (size_t i = 0; i < files->size(); i++) {
+    if ((*files)[i].file_size > 0) order.push_back(i);
+  }
+  BySmallest cmp;
+  cmp.partitions = &partitions;
+  cmp.files = files;
+  cmp.icmp = &internal_comparator_;
+  std::sort(order.begin(), order.end(), cmp);
+
+  // Tables of a level are disjoint and nothing at or above their level
+  // overlaps them, so no older entry shadows a loaded one
+  Version* base = versions_->current();
+  for (size_t j = 0; j < order.size(); j++) {
+    const int level = partitions[order[j]]->level();
+    const FileMetaData& f = (*files)[order[j]];
+    if (j > 0 && partitions[order[j-1]]->level() == level &&
+        user_comparator()->Compare((*files)[order[j-1]].largest.user_key(),
+                                   f.smallest.user_key()) >= 0) {
+      return Status::InvalidArgument("bulk load partitions overlap",
+                                     f.smallest.user_key());
+    }
+    const Slice smallest = f.smallest.user_key();
+    const Slice largest = f.largest.user_key();
+    for (int l = 0; l <= level; l++) {
+      if (base->OverlapInLevel(l, &smallest, &largest)) {
+        return Status::InvalidArgument("bulk load overlaps the database",
+                                       smallest);
+      }
+    }
+  }
+
+  // The delta levels a logical level fills must not wrap onto the ones
+  // still waiting for a merge
+  VersionEdit* edit = NewVersionEdit(versions_);
+  Version* current_lazy = NULL;
+  CALL_IF_HLSM(current_lazy = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy());
+  bool placed = true;
+  for (size_t j = 0; placed && j < order.size(); j++) {
+    const int level = partitions[order[j]]->level();
+    const FileMetaData& f = (*files)[order[j]];
+    edit->AddFile(level, f.number, f.file_size, f.smallest, f.largest);
+    CALL_IF_HLSM(placed = reinterpret_cast<LazyVersionEdit*>(edit)
+        ->AddLazyFileByRawLevel(level, f.number, f.file_size, f.smallest, f.largest,
+            current_lazy));
+    const bool level_done = (j + 1 == order.size() ||
+                             partitions[order[j+1]]->level() != level);
+    if (placed && level_done && (level % 2 == 1 || j + 1 == order.size())) {
+      CALL_IF_HLSM(placed = reinterpret_cast<LazyVersionEdit*>(edit)
+          ->CloseActiveDeltaLevelByRawLevel(level));
+    }
+  }
+  if (!placed) {
+    delete edit;
+    return Status::InvalidArgument(
+        "bulk load needs more delta levels than are free");
+  }
+
+  Status s = versions_->LogAndApply(edit, &mutex_);
+  delete edit;
+  if (!s.ok()) {
+    return s;
+  }
+  InstallSuperVersion();
+
+  for (size_t j = 0; j < order.size(); j++) {
+    const int level = partitions[order[j]]->level();
+    const FileMetaData& f = (*files)[order[j]];
+    hlsm::runtime::placement.set_level(f.number, level);
+    CompactionStats stats;
+    stats.bytes_written = f.file_size;
+    stats_[level].Add(stats);
+  }
+  Log(options_.info_log, "Bulk load: %d tables added", int(order.size()));
+  return s;
+}
+
+Status DBImpl::BulkLoad(const BulkLoadOptions& options,
+                        const std::vector<BulkLoadPartition*>& partitions) {
+  BulkLoadState state;
+  for (size_t i = 0; i < partitions.size(); i++) {
+    const int level = partitions[i]->level();
+    if (level < 0 || level >= config::kNumLevels) {
+      return Status::InvalidArgument("bulk load level out of range");
+    }
+    state.sequence[level] = 0;
+  }
+  if (partitions.empty()) {
+    return Status::OK();
+  }
+
+  // Deeper levels get older sequence numbers
+  SequenceNumber seq;
+  Status s = ReserveSequence(state.sequence.size(), &seq);
+  if (!s.ok()) {
+    return s;
+  }
+  for (std::map<int, SequenceNumber>::iterator it = state.sequence.begin();
+       it != state.sequence.end(); ++it) {
+    it->second = seq--;
+  }
+
+  std::vector<FileMetaData> files(partitions.size());
+  state.db = this;
+  state.partitions = &partitions;
+  state.files = &files;
+  const int threads = std::max(1, std::min(options.threads, int(partitions.size())));
+  state.running = threads;
+  for (int t = 0; t < threads; t++) {
+    env_->StartThread(&DBImpl::BulkLoadWorker, &state);
+  }
+  {
+    MutexLock l(&state.mu);
+    while (state.running > 0) {
+      state.cv.Wait();
+    }
+    s = state.status;
+  }
+
+  MutexLock l(&mutex_);
+  if (s.ok()) {
+    s = InstallBulkTables(partitions, &files);
+  }
+  for (size_t i = 0; i < files.size(); i++) {
+    pending_outputs_.erase(files[i].number);
+  }
+  if (!s.ok()) {
+    DeleteObsoleteFiles();	// the tables built
+    for (size_t i = 0; i < files.size(); i++) {
+      if (files[i].file_size > 0) {
+        hlsm::runtime::placement.remove(files[i].number);
+      }
+    }
+  } else {
+    MaybeScheduleCompaction();
+  }
+  return s;
+}
+
+}  // namespace leveldb
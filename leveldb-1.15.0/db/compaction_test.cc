@@ -0,0 +1,115 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <vector>
+
+#include "leveldb/db.h"
+#include "leveldb/hlsm_param.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class CompactionTest {
+ public:
+  std::string dbname_;
+  Options options_;
+  DB* db_;
+  int target_file_size_;
+
+  CompactionTest() : db_(NULL) {
+    dbname_ = test::TmpDir() + "/compaction_test";
+    target_file_size_ = config::kTargetFileSize;
+    config::kTargetFileSize = 4 << 10;  // several versions per table
+    options_.create_if_missing = true;
+    options_.compression = kNoCompression;
+    DestroyDB(dbname_, options_);
+    hlsm::config::primary_storage_path = dbname_.c_str();
+    ASSERT_OK(DB::Open(options_, dbname_, &db_));
+  }
+
+  ~CompactionTest() {
+    delete db_;
+    DestroyDB(dbname_, options_);
+    config::kTargetFileSize = target_file_size_;
+    hlsm::config::primary_storage_path = NULL;
+  }
+
+  std::string Key(int i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "key%06d", i);
+    return buf;
+  }
+
+  std::string Value(int i, int round) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%06d@%04d", i, round);
+    return std::string(buf) + std::string(90, 'v');
+  }
+
+  std::string Get(int i, const Snapshot* snapshot) {
+    ReadOptions options;
+    options.snapshot = snapshot;
+    std::string value;
+    Status s = db_->Get(options, Key(i), &value);
+    return s.ok() ? value : s.ToString();
+  }
+};
+
+namespace {
+// User key of the "'key' @ seq : type" form InternalKey::DebugString() has
+std::string DebugUserKey(const std::string& s, size_t pos) {
+  const size_t start = s.find('\'', pos) + 1;
+  return s.substr(start, s.find("' @", start) - start);
+}
+}  // namespace
+
+TEST(CompactionTest, UserKeyInOneOutput) {
+  const int kKeys = 50;
+  const int kRounds = 30;
+  std::vector<const Snapshot*> snapshots;
+  for (int round = 0; round < kRounds; round++) {
+    for (int i = 0; i < kKeys; i++) {
+      ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, round)));
+    }
+    snapshots.push_back(db_->GetSnapshot());
+  }
+  db_->CompactRange(NULL, NULL);
+
+  // Within a level, no table starts with the user key the one before
+  // it ends with
+  std::string sstables;
+  ASSERT_TRUE(db_->GetProperty("leveldb.sstables", &sstables));
+  int tables = 0;
+  std::string last_largest;
+  size_t pos = 0;
+  while ((pos = sstables.find('\n', pos)) != std::string::npos) {
+    pos++;
+    if (pos >= sstables.size()) break;
+    if (sstables.compare(pos, 3, "---") == 0) {
+      last_largest.clear();
+      continue;
+    }
+    const size_t range = sstables.find('[', pos);
+    const std::string smallest = DebugUserKey(sstables, range);
+    const std::string largest =
+        DebugUserKey(sstables, sstables.find(" .. ", range));
+    ASSERT_NE(last_largest, smallest);
+    last_largest = largest;
+    tables++;
+  }
+  ASSERT_GT(tables, 10);
+
+  for (int round = 0; round < kRounds; round++) {
+    for (int i = 0; i < kKeys; i++) {
+      ASSERT_EQ(Value(i, round), Get(i, snapshots[round]));
+    }
+    db_->ReleaseSnapshot(snapshots[round]);
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -4,6 +4,7 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <math.h>
 #include <stdlib.h>
 #include <time.h>
 #include <sys/types.h>
@@ -16,8 +17,10 @@
 #include "leveldb/env.h"
 #include "leveldb/write_batch.h"
 #include "leveldb/hlsm.h"
+#include "leveldb/slice_transform.h"
 #include "port/port.h"
 #include "util/crc32c.h"
+#include "util/env_sim.h"
 #include "util/histogram.h"
 #include "util/mutexlock.h"
 #include "util/random.h"
@@ -40,10 +43,21 @@
 //      seekrandom    -- N random seeks
 //      crc32c        -- repeated crc32c of 4K of data
 //      acquireload   -- load N*1000 times
+//      rwrandom      -- closed-loop reads and writes at --read_percent
+//      openloop      -- reads and writes issued at --target_qps whether or
+//                       not earlier ones have returned; latencies count from
+//                       the time a request was due
+//      ycsbload      -- put the YCSB items of --write_key_from/upto
+//      ycsb          -- YCSB core workload --workload=a..f
 //   Meta operations:
 //      compact     -- Compact the entire DB
 //      stats       -- Print DB stats
 //      sstables    -- Print sstable info
+//      metrics     -- Print the hLSM metrics (needs --hlsm_metrics=1)
+//      iostats     -- Print I/O per device and level (hlsm.io-stats)
+//      lazylevels  -- Print the lazy levels in hLSM mode (hlsm.lazy-levels)
+//      queuestats  -- Print the helper queues (hlsm.queue-stats)
+//      writerate   -- Print the rate writers are paced at (hlsm.delayed-write-rate)
 //      heapprofile -- Dump a heap profile (if supported by this port)
 static const char* FLAGS_benchmarks =
     "fillseq,"
@@ -88,10 +102,23 @@ static bool FLAGS_histogram = false;
 // (initialized to default value by "main")
 static int FLAGS_write_buffer_size = 0;
 
+// Number of full memtables that may wait for their flush (use default if == 0)
+static int FLAGS_max_immutable_memtables = 0;
+
+// Structure of the memtable: skiplist, hash (hash-linked-list) or vector
+static leveldb::MemTableRepType FLAGS_memtable_rep = leveldb::kSkipListRep;
+
+// Number of buckets of a hash memtable (use default if == 0)
+static int FLAGS_memtable_hash_buckets = 0;
+
 // Number of bytes to use as a cache of uncompressed data.
 // Negative means use default settings.
 static int FLAGS_cache_size = -1;
 
+// Number of bytes to use as a cache of rows found by point lookups.
+// Zero means no row cache.
+static int FLAGS_row_cache_size = 0;
+
 // Maximum number of files to keep open at the same time (use default if == 0)
 static int FLAGS_open_files = 0;
 
@@ -99,6 +126,18 @@ static int FLAGS_open_files = 0;
 // Negative means use default settings.
 static int FLAGS_bloom_bits = -1;
 
+// Give data blocks a hash index for point lookups
+static bool FLAGS_data_block_hash_index = false;
+
+// Split the index and filter of a table into partitions
+static bool FLAGS_partition_index_and_filters = false;
+
+// Length of the key prefixes in the prefix filters of tables (0: none)
+static int FLAGS_prefix_size = 0;
+
+// Seek in prefix_same_as_start mode in seekrandom and the YCSB scans
+static bool FLAGS_prefix_seek = false;
+
 // If true, do not destroy the existing database.  If you set this
 // flag and also specify a benchmark that wants a fresh database, that
 // benchmark will fail.
@@ -107,6 +146,26 @@ static bool FLAGS_use_existing_db = false;
 // Use the db with the following name.
 static const char* FLAGS_db = NULL;
 
+// If true, run against simulated devices instead of the raw file system:
+// --db is modeled as FLAGS_sim_primary (a disk unless --sim_primary=ssd)
+// and the secondary storage path as FLAGS_sim_secondary (a flash device
+// unless --sim_secondary=hdd).  The --sim_hdd_* flags tune the primary
+// device and the --sim_ssd_* flags the secondary one.
+static bool FLAGS_sim_env = false;
+static leveldb::SimDeviceOptions FLAGS_sim_primary;
+static leveldb::SimDeviceOptions FLAGS_sim_secondary = leveldb::SimSSDOptions();
+
+// Per-device I/O traces of the simulated env go to <prefix>.primary and
+// <prefix>.secondary.
+static const char* FLAGS_sim_trace = "";
+
+static leveldb::Env* FLAGS_env = NULL;
+
+// Clock of the benchmark: the simulated one of --sim_env if it is set
+static leveldb::Env* BenchEnv() {
+  return FLAGS_env != NULL ? FLAGS_env : leveldb::Env::Default();
+}
+
 /************* Extened Flags *****************/
 //Percent of read requests in r/w benchmark
 static int FLAGS_read_percent = 100;
@@ -122,6 +181,18 @@ static int64_t FLAGS_read_span = -1;
 
 static double FLAGS_countdown = -1;
 
+//Requests per second of all threads in openloop, due at fixed intervals
+//or, with --arrival=poisson, at exponentially distributed ones
+static double FLAGS_target_qps = 0;
+static bool FLAGS_poisson_arrival = true;
+
+//YCSB core workload (a-f) of the ycsb benchmark, and its key distribution
+//if not the workload's own: uniform, zipfian, scrambled, latest or hotspot
+static char FLAGS_workload = 'a';
+static const char* FLAGS_ycsb_distribution = NULL;
+static int FLAGS_ycsb_max_scan = 100;
+static hlsm::AcknowledgedCounter ycsb_inserts;	// items of the inserts
+
 static double rwrandom_wspeed = 0;
 
 static int FLAGS_random_seed = 301;
@@ -131,6 +202,7 @@ static volatile int rwrandom_read_completed = 0;
 static volatile int rwrandom_write_completed = 0;
 static int RW_RELAX=1024;
 static const int RW_WAIT_US=2048;
+static const int OPEN_LOOP_SPIN_US=100;	// openloop spins instead of sleeping this close to a due time
 static int monitor_interval = -1; //microseconds
 static bool first_monitor_interval = true;
 static FILE* monitor_log = stdout;
@@ -198,6 +270,52 @@ static void AppendWithSpace(std::string* str, Slice msg) {
   str->append(msg.data(), msg.size());
 }
 
+// Key of item k in the r/w benchmarks
+static void FormatRWKey(int64_t k, char* key, size_t size) {
+  if (FLAGS_ycsb_compatible) {
+    snprintf(key, size, "user%019lld", hlsm::YCSBKey_hash(k));
+  } else {
+    snprintf(key, size, "%020lu", k);
+  }
+}
+
+// Operation mix of the YCSB core workloads; the fractions add up to 1
+enum YCSBOp { kYCSBRead, kYCSBUpdate, kYCSBInsert, kYCSBScan,
+              kYCSBReadModifyWrite, kNumYCSBOps };
+
+struct YCSBWorkload {
+  char name;
+  double read;
+  double update;
+  double insert;
+  double scan;
+  double read_modify_write;
+  const char* distribution;
+};
+
+static const YCSBWorkload kYCSBWorkloads[] = {
+  { 'a', 0.50, 0.50, 0,    0,    0,    "scrambled" },	// update heavy
+  { 'b', 0.95, 0.05, 0,    0,    0,    "scrambled" },	// read mostly
+  { 'c', 1,    0,    0,    0,    0,    "scrambled" },	// read only
+  { 'd', 0.95, 0,    0.05, 0,    0,    "latest" },	// read latest
+  { 'e', 0,    0,    0.05, 0.95, 0,    "scrambled" },	// short ranges
+  { 'f', 0.50, 0,    0,    0,    0.50, "scrambled" },	// read-modify-write
+};
+
+static const YCSBWorkload& YCSBWorkloadOf(char name) {
+  return kYCSBWorkloads[name - 'a'];
+}
+
+static bool IsYCSBDistribution(const char* name) {
+  static const char* kDistributions[] = {
+    "uniform", "zipfian", "scrambled", "latest", "hotspot", NULL };
+  for (int i = 0; kDistributions[i] != NULL; i++) {
+    if (strcmp(name, kDistributions[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
 class Stats {
  private:
   double start_;
@@ -231,7 +349,7 @@ class Stats {
     write_done_ = 0;
     bytes_ = 0;
     seconds_ = 0;
-    start_ = Env::Default()->NowMicros();
+    start_ = BenchEnv()->NowMicros();
     finish_ = start_;
     message_.clear();
   }
@@ -253,7 +371,7 @@ class Stats {
   }
 
   void Stop() {
-    finish_ = Env::Default()->NowMicros();
+    finish_ = BenchEnv()->NowMicros();
     seconds_ = (finish_ - start_) * 1e-6;
   }
 
@@ -263,7 +381,7 @@ class Stats {
 
   void FinishedReadOp() {
     if (monitor_interval != -1) {
-      double now = Env::Default()->NowMicros();
+      double now = BenchEnv()->NowMicros();
       double micros = now - last_op_finish_;
       read_hist_.Add(micros);
       intv_read_hist_.AtomicAdd(micros);	
@@ -275,7 +393,7 @@ class Stats {
 
   void FinishedWriteOp() {
     if (monitor_interval != -1) {
-      double now = Env::Default()->NowMicros();
+      double now = BenchEnv()->NowMicros();
       double micros = now - last_op_finish_;
       write_hist_.Add(micros);
       intv_write_hist_.AtomicAdd(micros); 
@@ -285,9 +403,28 @@ class Stats {
     FinishedSingleOp();
   }
 
+  // Latency measured by the caller, e.g. from the time an open-loop request was due
+  void FinishedReadOp(double micros) {
+    read_hist_.Add(micros);
+    if (monitor_interval != -1)
+      intv_read_hist_.AtomicAdd(micros);
+    read_done_++;
+
+    FinishedSingleOp();
+  }
+
+  void FinishedWriteOp(double micros) {
+    write_hist_.Add(micros);
+    if (monitor_interval != -1)
+      intv_write_hist_.AtomicAdd(micros);
+    write_done_++;
+
+    FinishedSingleOp();
+  }
+
   void FinishedSingleOp() {
     if (FLAGS_histogram) {
-      double now = Env::Default()->NowMicros();
+      double now = BenchEnv()->NowMicros();
       double micros = now - last_op_finish_;
       hist_.Add(micros);
       if (micros > 20000) {
@@ -310,20 +447,28 @@ class Stats {
       fflush(stderr);
     }
 
-    intv_end_ = Env::Default()->NowMicros();
+    intv_end_ = BenchEnv()->NowMicros();
     if (monitor_interval != -1 && intv_end_ - intv_start_ > monitor_interval) {
     	intv_mu_.Lock();
     	if (intv_end_ - intv_start_ > monitor_interval) {
     		if (first_monitor_interval) {
-    			fprintf(monitor_log, "\nPID\tTID\tRL\tWL\tRD\tWD\tRT\tWT\n");
+    			fprintf(monitor_log, "\nPID\tTID\tRL\tWL\tRD\tWD\tRT\tWT"
+    					"\tR50\tR99\tR999\tW50\tW99\tW999\n");
     			first_monitor_interval = false;
     		}
-    		fprintf(monitor_log, "%d\t%d\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n",
+    		fprintf(monitor_log, "%d\t%d\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f"
+    				"\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n",
     				pid_, tid_,
 					intv_read_hist_.Average(), intv_write_hist_.Average(), 
 					intv_read_hist_.StandardDeviation(), intv_write_hist_.StandardDeviation(), 
 					intv_read_hist_.Num() * 1000000 /(intv_end_ - intv_start_),
-					intv_write_hist_.Num() * 1000000 /(intv_end_ - intv_start_));
+					intv_write_hist_.Num() * 1000000 /(intv_end_ - intv_start_),
+					IntervalPercentile(intv_read_hist_, 50),
+					IntervalPercentile(intv_read_hist_, 99),
+					IntervalPercentile(intv_read_hist_, 99.9),
+					IntervalPercentile(intv_write_hist_, 50),
+					IntervalPercentile(intv_write_hist_, 99),
+					IntervalPercentile(intv_write_hist_, 99.9));
 
     		intv_start_ = intv_end_;
     		intv_read_hist_.Clear();
@@ -333,6 +478,10 @@ class Stats {
     }
   }
 
+  static double IntervalPercentile(const Histogram& hist, double p) {
+    return (hist.Num() > 0) ? hist.Percentile(p) : 0;
+  }
+
   void AddBytes(int64_t n) {
     bytes_ += n;
   }
@@ -410,7 +559,9 @@ struct ThreadState {
 class Benchmark {
  private:
   Cache* cache_;
+  Cache* row_cache_;
   const FilterPolicy* filter_policy_;
+  const SliceTransform* prefix_extractor_;
   DB* db_;
   int num_;
   int value_size_;
@@ -496,9 +647,14 @@ class Benchmark {
  public:
   Benchmark()
   : cache_(FLAGS_cache_size >= 0 ? NewLRUCache(FLAGS_cache_size) : NULL),
+    row_cache_(FLAGS_row_cache_size > 0 ? NewLRUCache(FLAGS_row_cache_size)
+               : NULL),
     filter_policy_(FLAGS_bloom_bits >= 0
                    ? NewBloomFilterPolicy(FLAGS_bloom_bits)
                    : NULL),
+    prefix_extractor_(FLAGS_prefix_size > 0
+                      ? NewFixedPrefixTransform(FLAGS_prefix_size)
+                      : NULL),
     db_(NULL),
     num_(FLAGS_num),
     value_size_(FLAGS_value_size),
@@ -520,7 +676,9 @@ class Benchmark {
   ~Benchmark() {
     delete db_;
     delete cache_;
+    delete row_cache_;
     delete filter_policy_;
+    delete prefix_extractor_;
   }
 
   void Run() {
@@ -611,9 +769,28 @@ class Benchmark {
         PrintStats("leveldb.stats");
       } else if (name == Slice("sstables")) {
         PrintStats("leveldb.sstables");
+      } else if (name == Slice("metrics")) {
+        PrintStats("hlsm.metrics");
+      } else if (name == Slice("iostats")) {
+        PrintStats("hlsm.io-stats");
+      } else if (name == Slice("lazylevels")) {
+        PrintStats("hlsm.lazy-levels");
+      } else if (name == Slice("queuestats")) {
+        PrintStats("hlsm.queue-stats");
+      } else if (name == Slice("writerate")) {
+        PrintStats("hlsm.delayed-write-rate");
       } else if (name == Slice("rwrandom")) {
         method = &Benchmark::RWRandom_Write;
         monitor_interval = 2000000;
+      } else if (name == Slice("ycsbload")) {
+        fresh_db = true;
+        method = &Benchmark::YCSBLoad;
+      } else if (name == Slice("ycsb")) {
+        ycsb_inserts.reset(FLAGS_read_span);
+        method = &Benchmark::YCSB;
+      } else if (name == Slice("openloop")) {
+        method = &Benchmark::OpenLoop;
+        monitor_interval = 2000000;
       } else {
         if (name != Slice()) {  // No error message for empty name
           fprintf(stderr, "unknown benchmark '%s'\n", name.ToString().c_str());
@@ -687,7 +864,7 @@ class Benchmark {
 	//Intialization for request latency monitoring
 	intv_read_hist_.Clear();
 	intv_write_hist_.Clear();
-	intv_start_ = Env::Default()->NowMicros();
+	intv_start_ = BenchEnv()->NowMicros();
 
     ThreadArg* arg = new ThreadArg[n];
     for (int i = 0; i < n; i++) {
@@ -811,10 +988,24 @@ class Benchmark {
     Options options;
     options.create_if_missing = !FLAGS_use_existing_db;
     options.block_cache = cache_;
+    options.row_cache = row_cache_;
     options.write_buffer_size = FLAGS_write_buffer_size;
+    if (FLAGS_max_immutable_memtables > 0) {
+      options.max_immutable_memtables = FLAGS_max_immutable_memtables;
+    }
+    options.memtable_rep = FLAGS_memtable_rep;
+    if (FLAGS_memtable_hash_buckets > 0) {
+      options.memtable_hash_buckets = FLAGS_memtable_hash_buckets;
+    }
     options.max_open_files = FLAGS_open_files;
     options.filter_policy = filter_policy_;
+    options.data_block_hash_index = FLAGS_data_block_hash_index;
+    options.partition_index_and_filters = FLAGS_partition_index_and_filters;
+    options.prefix_extractor = prefix_extractor_;
     options.compression = leveldb::kNoCompression;
+    if (FLAGS_env != NULL) {
+      options.env = FLAGS_env;
+    }
     Status s = DB::Open(options, FLAGS_db, &db_);
     if (!s.ok()) {
       fprintf(stderr, "open error: %s\n", s.ToString().c_str());
@@ -861,7 +1052,7 @@ class Benchmark {
   }
 
   void ReadSequential(ThreadState* thread) {
-    Iterator* iter = db_->NewIterator(ReadOptions());
+    Iterator* iter = db_->NewIterator(ReadOptions(), true);
     int i = 0;
     int64_t bytes = 0;
     for (iter->SeekToFirst(); i < reads_ && iter->Valid(); iter->Next()) {
@@ -874,7 +1065,7 @@ class Benchmark {
   }
 
   void ReadReverse(ThreadState* thread) {
-    Iterator* iter = db_->NewIterator(ReadOptions());
+    Iterator* iter = db_->NewIterator(ReadOptions(), true);
     int i = 0;
     int64_t bytes = 0;
     for (iter->SeekToLast(); i < reads_ && iter->Valid(); iter->Prev()) {
@@ -938,12 +1129,8 @@ class Benchmark {
       char key[100];
       time(&now);
       const int64_t k = (thread->rand->Next64() % FLAGS_read_span) + FLAGS_read_from;
-      if (FLAGS_ycsb_compatible) {
-        snprintf(key, sizeof(key), "user%019lld", hlsm::YCSBKey_hash(k));
-      } else {
-        snprintf(key, sizeof(key), "%020lu", k);
-      }
-      DEBUG_MEASURE_RECORD(2, (s = db_->Get(options, key, &value)), "RW--Get" );
+      FormatRWKey(k, key, sizeof(key));
+      HLSM_MEASURE(hlsm::metrics::kBenchGet, (s = db_->Get(options, key, &value)));
       isFound = s.ok();
 
       done++;
@@ -1033,11 +1220,7 @@ class Benchmark {
           rwrandom_write_completed < 
             (rwrandom_read_completed + rwrandom_write_completed) * ((double)(100 - FLAGS_read_percent) / 100)  + RW_RELAX) ) {
         const uint64_t k = FLAGS_write_from + (thread->rand->Next64() % FLAGS_write_span);
-        if (FLAGS_ycsb_compatible) {
-          snprintf(key, sizeof(key), "user%019lld", hlsm::YCSBKey_hash(k));
-        } else {
-          snprintf(key, sizeof(key), "%020lu", k);
-        }
+        FormatRWKey(k, key, sizeof(key));
         batch.Put(key, gen.Generate(value_size_));
         bytes += value_size_ + strlen(key);
         bnum ++;
@@ -1045,7 +1228,7 @@ class Benchmark {
 
         if (bnum == entries_per_batch_) {
           bnum = 0;
-          DEBUG_MEASURE_RECORD(2, (s = db_->Write(write_options_, &batch)), "RW--Write");
+          HLSM_MEASURE(hlsm::metrics::kBenchWrite, (s = db_->Write(write_options_, &batch)));
           batch.Clear();
           if (!s.ok()) {
             fprintf(stderr, "put error: %s\n", s.ToString().c_str());
@@ -1077,6 +1260,231 @@ class Benchmark {
       done, difftime(now, begin), ct_waited/1000000, c_waited);
 
   }
+
+  // Gap to the next request of a thread issuing rate requests per second
+  static double NextArrivalMicros(Random* rand, double rate) {
+    if (!FLAGS_poisson_arrival)
+      return 1e6 / rate;
+    // exponential; u in (0, 1]
+    const double u = (rand->Next() + 1.0) / 2147483647.0;
+    return -::log(u) * 1e6 / rate;
+  }
+
+  /*
+   * Open-loop reads and writes: the threads together issue FLAGS_target_qps
+   *	requests per second, FLAGS_read_percent of them reads, on a schedule
+   *	that does not wait for earlier requests.  The latency of a request is
+   *	measured from the time it was due, so a stall also counts against
+   *	every request that should have started during it.  Runs for
+   *	FLAGS_countdown seconds, or until the threads issued num_ requests.
+   */
+  void OpenLoop(ThreadState* thread) {
+    if (FLAGS_target_qps <= 0) {
+      thread->stats.AddMessage("(openloop needs --target_qps)");
+      return;
+    }
+    Env* env = BenchEnv();
+    const double rate = FLAGS_target_qps / FLAGS_threads;
+    Random rand(FLAGS_random_seed + thread->tid);	// own schedule and keys per thread
+    RandomGenerator gen;
+    ReadOptions options;
+    std::string value;
+    Status s;
+
+    const double begin = env->NowMicros();
+    const double end = begin + FLAGS_countdown * 1e6;
+    const int limit = (FLAGS_countdown > 0) ? -1 : num_ / FLAGS_threads;
+    // fixed arrivals of different threads interleave evenly
+    double due = begin + (FLAGS_poisson_arrival ?
+        NextArrivalMicros(&rand, rate) : 1e6 / rate * thread->tid / FLAGS_threads);
+    int reads = 0, found = 0, writes = 0, late = 0;
+    for (int i = 0; limit < 0 || i < limit; i++) {
+      if (FLAGS_countdown > 0 && due > end)
+        break;
+
+      double now = env->NowMicros();
+      if (due - now > OPEN_LOOP_SPIN_US)
+        env->SleepForMicroseconds(static_cast<int>(due - now) - OPEN_LOOP_SPIN_US);
+      while ((now = env->NowMicros()) < due)
+        ;
+      if (now - due > 1000)
+        late++;
+
+      char key[100];
+      const bool isRead = static_cast<int>(rand.Uniform(100)) < FLAGS_read_percent;
+      const int64_t k = isRead ? (rand.Next64() % FLAGS_read_span) + FLAGS_read_from
+                               : (rand.Next64() % FLAGS_write_span) + FLAGS_write_from;
+      FormatRWKey(k, key, sizeof(key));
+
+      if (isRead) {
+        HLSM_MEASURE(hlsm::metrics::kBenchGet, (s = db_->Get(options, key, &value)));
+        reads++;
+        if (s.ok())
+          found++;
+        thread->stats.FinishedReadOp(env->NowMicros() - due);
+      } else {
+        HLSM_MEASURE(hlsm::metrics::kBenchWrite,
+            (s = db_->Put(write_options_, key, gen.Generate(value_size_))));
+        if (!s.ok()) {
+          fprintf(stderr, "put error: %s\n", s.ToString().c_str());
+          exit(1);
+        }
+        writes++;
+        thread->stats.AddBytes(value_size_ + strlen(key));
+        thread->stats.FinishedWriteOp(env->NowMicros() - due);
+      }
+      due += NextArrivalMicros(&rand, rate);
+    }
+
+    char msg[100];
+    snprintf(msg, sizeof(msg), "(%d of %d found, %d writes, %d late by 1ms+ in one thread)",
+             found, reads, writes, late);
+    thread->stats.AddMessage(msg);
+  }
+
+  // Key chooser of the ycsb benchmark over items [0, records)
+  hlsm::YCSBGenerator* NewYCSBKeyChooser(const std::string& distribution,
+                                         long long records, uint64_t seed) {
+    if (distribution == "uniform")
+      return new hlsm::UniformGenerator(0, records - 1, seed);
+    if (distribution == "zipfian")
+      return new hlsm::ZipfianGenerator(0, records - 1, seed);
+    if (distribution == "latest")
+      return new hlsm::SkewedLatestGenerator(ycsb_inserts.last(), seed);
+    if (distribution == "hotspot")
+      return new hlsm::HotspotGenerator(0, records - 1, seed);
+    return new hlsm::ScrambledZipfianGenerator(0, records - 1, seed);
+  }
+
+  /*
+   * YCSB core workload FLAGS_workload on the items [0, FLAGS_read_span),
+   *	stored under the keys from FLAGS_read_from on.  Inserts add items
+   *	after them.  As in YCSB, the zipfian choosers cover the items
+   *	expected to be inserted too, and items not inserted yet are drawn
+   *	again.  Each thread runs reads_ operations, or FLAGS_countdown seconds.
+   */
+  void YCSB(ThreadState* thread) {
+    const YCSBWorkload& w = YCSBWorkloadOf(FLAGS_workload);
+    const std::string distribution = (FLAGS_ycsb_distribution != NULL) ?
+        FLAGS_ycsb_distribution : w.distribution;
+    const uint64_t seed = (uint64_t)FLAGS_random_seed * 1000003 + thread->tid;
+    const long long expected_inserts = (long long)(reads_ * FLAGS_threads * w.insert * 2);
+    hlsm::YCSBRandom rand(seed);
+    hlsm::YCSBGenerator* chooser = NewYCSBKeyChooser(distribution,
+        FLAGS_read_span + expected_inserts, seed + 1);
+    hlsm::UniformGenerator scan_length(1, FLAGS_ycsb_max_scan, seed + 2);
+
+    Env* env = BenchEnv();
+    RandomGenerator gen;
+    ReadOptions options;
+    ReadOptions scan_options;
+    scan_options.prefix_same_as_start = FLAGS_prefix_seek;
+    std::string value;
+    Status s;
+    int done[kNumYCSBOps] = { 0 };
+    int found = 0;
+    time_t begin, now;
+    time(&begin);
+
+    for (int i = 0; i < reads_; i++) {
+      const double r = rand.nextDouble();
+      const YCSBOp op = (r < w.read) ? kYCSBRead :
+          (r < w.read + w.update) ? kYCSBUpdate :
+          (r < w.read + w.update + w.insert) ? kYCSBInsert :
+          (r < w.read + w.update + w.insert + w.scan) ? kYCSBScan : kYCSBReadModifyWrite;
+
+      long long item;
+      if (op == kYCSBInsert) {
+        item = ycsb_inserts.next();
+      } else {
+        do {
+          item = chooser->next();
+        } while (item > *ycsb_inserts.last());
+      }
+      char key[100];
+      FormatRWKey(FLAGS_read_from + item, key, sizeof(key));
+
+      const double start = env->NowMicros();
+      switch (op) {
+        case kYCSBRead:
+          HLSM_MEASURE(hlsm::metrics::kBenchGet, (s = db_->Get(options, key, &value)));
+          if (s.ok())
+            found++;
+          break;
+        case kYCSBScan: {
+          Iterator* iter = db_->NewIterator(scan_options);
+          const long long length = scan_length.next();
+          iter->Seek(key);
+          for (long long j = 0; j < length && iter->Valid(); j++)
+            iter->Next();
+          delete iter;
+          break;
+        }
+        case kYCSBReadModifyWrite:
+          HLSM_MEASURE(hlsm::metrics::kBenchGet, (s = db_->Get(options, key, &value)));
+          if (s.ok())
+            found++;
+          // fall through
+        case kYCSBUpdate:
+        case kYCSBInsert:
+          HLSM_MEASURE(hlsm::metrics::kBenchWrite,
+              (s = db_->Put(write_options_, key, gen.Generate(value_size_))));
+          if (!s.ok()) {
+            fprintf(stderr, "put error: %s\n", s.ToString().c_str());
+            exit(1);
+          }
+          thread->stats.AddBytes(value_size_ + strlen(key));
+          break;
+        default:
+          break;
+      }
+      if (op == kYCSBInsert)
+        ycsb_inserts.acknowledge(item);
+
+      done[op]++;
+      if (op == kYCSBRead || op == kYCSBScan)
+        thread->stats.FinishedReadOp(env->NowMicros() - start);
+      else
+        thread->stats.FinishedWriteOp(env->NowMicros() - start);
+
+      if (FLAGS_countdown > 0 && (i+1) % 100 == 0) {
+        time(&now);
+        if (difftime(now, begin) > FLAGS_countdown)
+          break;
+      }
+    }
+    delete chooser;
+
+    char msg[200];
+    snprintf(msg, sizeof(msg), "(workload %c, %s: %d reads %d found, %d updates, "
+             "%d inserts, %d scans, %d read-modify-writes in one thread)",
+             w.name, distribution.c_str(), done[kYCSBRead] + done[kYCSBReadModifyWrite],
+             found, done[kYCSBUpdate], done[kYCSBInsert], done[kYCSBScan],
+             done[kYCSBReadModifyWrite]);
+    thread->stats.AddMessage(msg);
+  }
+
+  // Load phase of YCSB: the threads put the items [FLAGS_write_from, FLAGS_write_upto)
+  void YCSBLoad(ThreadState* thread) {
+    RandomGenerator gen;
+    Status s;
+    int64_t bytes = 0;
+    const int64_t per_thread = (FLAGS_write_span + FLAGS_threads - 1) / FLAGS_threads;
+    const int64_t from = FLAGS_write_from + per_thread * thread->tid;
+    const int64_t upto = std::min(from + per_thread, FLAGS_write_from + FLAGS_write_span);
+    for (int64_t k = from; k < upto; k++) {
+      char key[100];
+      FormatRWKey(k, key, sizeof(key));
+      s = db_->Put(write_options_, key, gen.Generate(value_size_));
+      if (!s.ok()) {
+        fprintf(stderr, "put error: %s\n", s.ToString().c_str());
+        exit(1);
+      }
+      bytes += value_size_ + strlen(key);
+      thread->stats.FinishedSingleOp();
+    }
+    thread->stats.AddBytes(bytes);
+  }
 /*modification required for key*/
 
   void ReadMissing(ThreadState* thread) {
@@ -1108,6 +1516,7 @@ class Benchmark {
 
   void SeekRandom(ThreadState* thread) {
     ReadOptions options;
+    options.prefix_same_as_start = FLAGS_prefix_seek;
     std::string value;
     int found = 0;
     for (int i = 0; i < reads_; i++) {
@@ -1227,11 +1636,25 @@ int main(int argc, char** argv) {
   FLAGS_open_files = leveldb::Options().max_open_files;
   std::string default_db_path;
 
+  // Device presets go first so that the --sim_hdd_* and --sim_ssd_* flags
+  // tune them wherever they are given
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--sim_primary=hdd") == 0) {
+      FLAGS_sim_primary = leveldb::SimDeviceOptions();
+    } else if (strcmp(argv[i], "--sim_primary=ssd") == 0) {
+      FLAGS_sim_primary = leveldb::SimSSDOptions();
+    } else if (strcmp(argv[i], "--sim_secondary=hdd") == 0) {
+      FLAGS_sim_secondary = leveldb::SimDeviceOptions();
+    } else if (strcmp(argv[i], "--sim_secondary=ssd") == 0) {
+      FLAGS_sim_secondary = leveldb::SimSSDOptions();
+    }
+  }
+
   for (int i = 1; i < argc; i++) {
     double d;
-    int n;
+    int n, m;
     int64_t n64;
-    char junk;
+    char junk, junk2;
     if (leveldb::Slice(argv[i]).starts_with("--benchmarks=")) {
       FLAGS_benchmarks = argv[i] + strlen("--benchmarks=");
     } else if (sscanf(argv[i], "--compression_ratio=%lf%c", &d, &junk) == 1) {
@@ -1242,6 +1665,17 @@ int main(int argc, char** argv) {
     } else if (sscanf(argv[i], "--use_existing_db=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       FLAGS_use_existing_db = n;
+    } else if (sscanf(argv[i], "--data_block_hash_index=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_data_block_hash_index = n;
+    } else if (sscanf(argv[i], "--partition_index_and_filters=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_partition_index_and_filters = n;
+    } else if (sscanf(argv[i], "--prefix_size=%d%c", &n, &junk) == 1) {
+      FLAGS_prefix_size = n;
+    } else if (sscanf(argv[i], "--prefix_seek=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_prefix_seek = n;
     } else if (sscanf(argv[i], "--num=%d%c", &n, &junk) == 1) {
       FLAGS_num = n;
       if (FLAGS_read_upto == -1) {
@@ -1260,8 +1694,20 @@ int main(int argc, char** argv) {
       FLAGS_value_size = n;
     } else if (sscanf(argv[i], "--write_buffer_size=%d%c", &n, &junk) == 1) {
       FLAGS_write_buffer_size = n;
+    } else if (sscanf(argv[i], "--max_immutable_memtables=%d%c", &n, &junk) == 1) {
+      FLAGS_max_immutable_memtables = n;
+    } else if (strcmp(argv[i], "--memtable_rep=skiplist") == 0) {
+      FLAGS_memtable_rep = leveldb::kSkipListRep;
+    } else if (strcmp(argv[i], "--memtable_rep=hash") == 0) {
+      FLAGS_memtable_rep = leveldb::kHashLinkListRep;
+    } else if (strcmp(argv[i], "--memtable_rep=vector") == 0) {
+      FLAGS_memtable_rep = leveldb::kVectorRep;
+    } else if (sscanf(argv[i], "--memtable_hash_buckets=%d%c", &n, &junk) == 1) {
+      FLAGS_memtable_hash_buckets = n;
     } else if (sscanf(argv[i], "--cache_size=%d%c", &n, &junk) == 1) {
       FLAGS_cache_size = n;
+    } else if (sscanf(argv[i], "--row_cache_size=%d%c", &n, &junk) == 1) {
+      FLAGS_row_cache_size = n;
     } else if (sscanf(argv[i], "--bloom_bits=%d%c", &n, &junk) == 1) {
       FLAGS_bloom_bits = n;
     } else if (sscanf(argv[i], "--bloom_bits_use=%d%c", &n, &junk) == 1) {
@@ -1287,6 +1733,20 @@ int main(int argc, char** argv) {
       hlsm::runtime::use_cursor_compaction = n;
     } else if (strncmp(argv[i], "--hlsm_secondary_storage_path=", 30) == 0) {
       hlsm::config::secondary_storage_path = argv[i] + 30;
+    } else if (sscanf(argv[i], "--hlsm_delta_merge_trigger=%d%c", &n, &junk) == 1) {
+      hlsm::config::delta_merge_trigger = n;
+    } else if (sscanf(argv[i], "--hlsm_delta_merge_overlap_trigger=%d%c", &n, &junk) == 1) {
+      hlsm::config::delta_merge_overlap_trigger = n;
+    } else if (sscanf(argv[i], "--hlsm_two_phase_end_level=%d%c", &n, &junk) == 1) {
+      hlsm::config::two_phase_end_level = n;
+    } else if (sscanf(argv[i], "--hlsm_level_tuning_interval=%d%c", &n, &junk) == 1) {
+      hlsm::config::level_tuning_interval = n;
+    } else if (sscanf(argv[i], "--hlsm_secondary_capacity_mb=%d%c", &n, &junk) == 1) {
+      hlsm::config::secondary_capacity_mb = n;
+    } else if (sscanf(argv[i], "--hlsm_secondary_high_watermark=%lf%c", &d, &junk) == 1) {
+      hlsm::config::secondary_high_watermark = d;
+    } else if (sscanf(argv[i], "--hlsm_secondary_low_watermark=%lf%c", &d, &junk) == 1) {
+      hlsm::config::secondary_low_watermark = d;
     } else if (sscanf(argv[i], "--file_size=%d%c", &n, &junk) == 1) {
       leveldb::config::kTargetFileSize = n * 1048576; // in MiB
     } else if (sscanf(argv[i], "--level0_size=%d%c", &n, &junk) == 1) {
@@ -1299,28 +1759,106 @@ int main(int argc, char** argv) {
       hlsm::config::kMaxLevel = n;
     } else if (sscanf(argv[i], "--countdown=%lf%c", &d, &junk) == 1) {
       FLAGS_countdown = d;
+    } else if (sscanf(argv[i], "--target_qps=%lf%c", &d, &junk) == 1) {
+      FLAGS_target_qps = d;
+    } else if (strcmp(argv[i], "--arrival=poisson") == 0) {
+      FLAGS_poisson_arrival = true;
+    } else if (strcmp(argv[i], "--arrival=fixed") == 0) {
+      FLAGS_poisson_arrival = false;
+    } else if (sscanf(argv[i], "--workload=%c%c", &junk, &junk2) == 1 &&
+               junk >= 'a' && junk <= 'f') {
+      FLAGS_workload = junk;
+    } else if (strncmp(argv[i], "--ycsb_distribution=", 20) == 0 &&
+               leveldb::IsYCSBDistribution(argv[i] + 20)) {
+      FLAGS_ycsb_distribution = argv[i] + 20;
+    } else if (sscanf(argv[i], "--ycsb_max_scan=%d%c", &n, &junk) == 1 && n > 0) {
+      FLAGS_ycsb_max_scan = n;
     } else if (sscanf(argv[i], "--random_seed=%lf%c", &d, &junk) == 1) {
       FLAGS_random_seed = d;
     } else if (sscanf(argv[i], "--debug_level=%d%c", &n, &junk) == 1) {
       hlsm::config::debug_level = n;
+    } else if (sscanf(argv[i], "--hlsm_metrics=%d%c", &n, &junk) == 1) {
+      hlsm::config::collect_metrics = n;
     } else if (sscanf(argv[i], "--level0_stop_write_trigger=%d%c", &n, &junk) == 1) {
       hlsm::config::kL0_StopWritesTrigger = n;
+    } else if (sscanf(argv[i], "--delayed_write_rate_kb=%d%c", &n, &junk) == 1) {
+      hlsm::config::delayed_write_rate_kb = n;
+    } else if (sscanf(argv[i], "--soft_pending_compaction_mb=%d%c", &n, &junk) == 1) {
+      hlsm::config::soft_pending_compaction_mb = n;
+    } else if (sscanf(argv[i], "--hard_pending_compaction_mb=%d%c", &n, &junk) == 1) {
+      hlsm::config::hard_pending_compaction_mb = n;
     } else if (sscanf(argv[i], "--preload_metadata=%d%c", &n, &junk) == 1) {
       hlsm::config::preload_metadata = n;
     } else if (sscanf(argv[i], "--run_compaction=%d%c", &n, &junk) == 1) {
       hlsm::config::run_compaction = n;
     } else if (sscanf(argv[i], "--iterator_prefetch=%d%c", &n, &junk) == 1) {
       hlsm::config::iterator_prefetch = n;
+    } else if (sscanf(argv[i], "--max_readahead_kb=%d%c", &n, &junk) == 1) {
+      hlsm::config::max_readahead_kb = n;
     } else if (sscanf(argv[i], "--raw_prefetch=%d%c", &n, &junk) == 1) {
       hlsm::config::raw_prefetch = n;
     } else if (sscanf(argv[i], "--ycsb_compatible=%n%c", &n, &junk) == 1) {
       FLAGS_ycsb_compatible = n;
     } else if (sscanf(argv[i], "--compaction_limit_mb_per_sec=%d%c", &n, &junk) == 1) {
       hlsm::runtime::compaction_throttler = new hlsm::Throttler((uint64_t)n * 1024 * 1024);
+    } else if (sscanf(argv[i], "--migration_limit_mb_per_sec=%d%c", &n, &junk) == 1) {
+      hlsm::runtime::migration_throttler = new hlsm::Throttler((uint64_t)n * 1024 * 1024);
+    } else if (sscanf(argv[i], "--migration_chunk_kb=%d%c", &n, &junk) == 1) {
+      hlsm::config::migration_chunk_size = n * 1024;
     } else if (strncmp(argv[i], "--debug_file=", 13) == 0) {
       hlsm::config::debug_file = argv[i] + 13;
     } else if (strncmp(argv[i], "--monitor_log=", 14) == 0) {
       monitor_log = fopen(argv[i] + 14, "w");
+    } else if (sscanf(argv[i], "--bg_low_threads=%d%c", &n, &junk) == 1) {
+      leveldb::Env::Default()->SetBackgroundThreads(n, leveldb::Env::LOW);
+    } else if (sscanf(argv[i], "--bg_high_threads=%d%c", &n, &junk) == 1) {
+      leveldb::Env::Default()->SetBackgroundThreads(n, leveldb::Env::HIGH);
+    } else if (sscanf(argv[i], "--bg_io_ioprio=%d,%d%c", &n, &m, &junk) == 2) {
+      leveldb::Env::Default()->SetBackgroundThreadsIOPriority(n, m, leveldb::Env::IO);
+    } else if (strncmp(argv[i], "--bg_cpus=", 10) == 0) {
+      std::vector<int> cpus;
+      for (const char* p = argv[i] + 10; *p != '\0'; ) {
+        char* end;
+        const long cpu = strtol(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0')) {
+          fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+          exit(1);
+        }
+        cpus.push_back(cpu);
+        p = (*end == ',') ? end + 1 : end;
+      }
+      for (int pri = 0; pri < leveldb::Env::TOTAL; pri++) {
+        leveldb::Env::Default()->SetBackgroundThreadsAffinity(
+            cpus, static_cast<leveldb::Env::Priority>(pri));
+      }
+    } else if (sscanf(argv[i], "--sim_env=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_sim_env = n;
+    } else if (strncmp(argv[i], "--sim_trace=", 12) == 0) {
+      FLAGS_sim_trace = argv[i] + 12;
+    } else if (strcmp(argv[i], "--sim_primary=hdd") == 0 ||
+               strcmp(argv[i], "--sim_primary=ssd") == 0 ||
+               strcmp(argv[i], "--sim_secondary=hdd") == 0 ||
+               strcmp(argv[i], "--sim_secondary=ssd") == 0) {
+      // Applied above
+    } else if (sscanf(argv[i], "--sim_hdd_seek_us=%d%c", &n, &junk) == 1) {
+      FLAGS_sim_primary.seek_micros = n;
+    } else if (sscanf(argv[i], "--sim_hdd_rpm=%d%c", &n, &junk) == 1) {
+      FLAGS_sim_primary.rpm = n;
+    } else if (sscanf(argv[i], "--sim_hdd_mbps=%d%c", &n, &junk) == 1) {
+      FLAGS_sim_primary.read_mb_per_sec = n;
+      FLAGS_sim_primary.write_mb_per_sec = n;
+    } else if (sscanf(argv[i], "--sim_ssd_channels=%d%c", &n, &junk) == 1) {
+      FLAGS_sim_secondary.channels = n;
+    } else if (sscanf(argv[i], "--sim_ssd_latency_us=%d,%d%c", &n, &m, &junk) == 2) {
+      FLAGS_sim_secondary.read_latency_micros = n;
+      FLAGS_sim_secondary.write_latency_micros = m;
+    } else if (sscanf(argv[i], "--sim_ssd_mbps=%d,%d%c", &n, &m, &junk) == 2) {
+      FLAGS_sim_secondary.read_mb_per_sec = n;
+      FLAGS_sim_secondary.write_mb_per_sec = m;
+    } else if (sscanf(argv[i], "--sim_queue_depth=%d%c", &n, &junk) == 1) {
+      FLAGS_sim_primary.queue_depth = n;
+      FLAGS_sim_secondary.queue_depth = n;
     } else {
       fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
       exit(1);
@@ -1342,6 +1880,11 @@ int main(int argc, char** argv) {
       FLAGS_db = default_db_path.c_str();
   }
 
+  if (FLAGS_sim_env) {
+    FLAGS_env = leveldb::NewSimEnv(leveldb::Env::Default(), FLAGS_sim_primary,
+                                   FLAGS_sim_secondary, FLAGS_sim_trace);
+  }
+
   leveldb::Benchmark benchmark;
   benchmark.Run();
   return 0;
@@ -4,19 +4,17 @@
 #include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
+#include <vector>
 
-#include "db/db_impl.h"
 #include "db/hlsm_impl.h"
-#include "db/version_set.h"
 #include "leveldb/cache.h"
 #include "leveldb/db.h"
 #include "leveldb/env.h"
-#include "leveldb/write_batch.h"
+#include "leveldb/filter_policy.h"
 #include "leveldb/hlsm.h"
+#include "leveldb/slice_transform.h"
 #include "port/port.h"
-#include "util/crc32c.h"
-#include "util/histogram.h"
-#include "util/mutexlock.h"
 #include "util/random.h"
 #include "util/testutil.h"
 
@@ -39,6 +37,15 @@ static double FLAGS_compression_ratio = 0;
 // Negative means use default settings.
 static int FLAGS_bloom_bits = -1;
 
+// Give data blocks a hash index for point lookups
+static bool FLAGS_data_block_hash_index = false;
+
+// Split the index and filter of a table into partitions
+static bool FLAGS_partition_index_and_filters = false;
+
+// Length of the key prefixes in the prefix filters of tables (0: none)
+static int FLAGS_prefix_size = 0;
+
 // Maximum number of files to keep open at the same time (use default if == 0)
 static int FLAGS_open_files = 16000;
 
@@ -52,6 +59,7 @@ static int64_t FLAGS_write_span = -1;
 
 static int FLAGS_cache_size = 131072;
 static int FLAGS_random_seed = 301;
+static int FLAGS_threads = 4;	// tables built at the same time
 static int FLAGS_ycsb_compatible = 0;
 
 // generate more files per level (than maximum number of files before triggering compaction)
@@ -61,11 +69,11 @@ static int kv_pair_overhead_bytes = 30;
 
 using namespace leveldb;
 
-// Helper for quickly generating random data from db_bench.cc
+// Helper for quickly generating random data from db_bench.cc; the data is
+//	shared by the loader threads, each reading from its own position
 class RandomGenerator {
  private:
   std::string data_;
-  int pos_;
 
  public:
   RandomGenerator() {
@@ -80,30 +88,81 @@ class RandomGenerator {
       test::CompressibleString(&rnd, FLAGS_compression_ratio, 100, &piece);
       data_.append(piece);
     }
-    pos_ = 0;
   }
 
-  Slice Generate(size_t len) {
-    if (pos_ + len > data_.size()) {
-      pos_ = 0;
+  Slice Generate(size_t len, size_t* pos) const {
+    if (*pos + len > data_.size()) {
+      *pos = 0;
       assert(len < data_.size());
     }
-    pos_ += len;
-    return Slice(data_.data() + pos_ - len, len);
+    *pos += len;
+    return Slice(data_.data() + *pos - len, len);
   }
 };
 
+// Keys of one table: nkeys numbers drawn from [from, from+span), or with
+//	--ycsb_compatible the hashed key numbers pool[begin, end)
+class GenPartition : public BulkLoadPartition {
+ public:
+  GenPartition(int level, const RandomGenerator* gen, int64_t from, int64_t span,
+               int nkeys, uint32_t seed)
+      : level_(level), gen_(gen), pos_(0), from_(from), span_(span),
+        nkeys_(nkeys), seed_(seed), pool_(NULL), next_(0) { }
+  GenPartition(int level, const RandomGenerator* gen,
+               const std::vector<long long>* pool, size_t begin, size_t end)
+      : level_(level), gen_(gen), pos_(0), from_(0), span_(0), nkeys_(0),
+        seed_(0), pool_(pool), next_(begin), end_(end) { }
+
+  virtual int level() const { return level_; }
+
+  virtual bool Next(Slice* key, Slice* value) {
+    if (pool_ != NULL) {
+      if (next_ >= end_)
+        return false;
+      snprintf(key_, sizeof(key_), "user%019lld", (*pool_)[next_++]);
+    } else {
+      if (next_ == 0)
+        DrawKeys();
+      if (next_ >= keys_.size())
+        return false;
+      snprintf(key_, sizeof(key_), "%020lu", keys_[next_++]);
+    }
+    *key = Slice(key_);
+    *value = gen_->Generate(FLAGS_value_size, &pos_);
+    return true;
+  }
+
+ private:
+  // Sorted once the table is built, so that only the tables being built hold keys
+  void DrawKeys() {
+    Random rand(seed_);
+    keys_.resize(nkeys_);
+    for (int i = 0; i < nkeys_; i++)
+      keys_[i] = from_ + (rand.Next64() % span_);
+    std::sort(keys_.begin(), keys_.end());
+    keys_.erase(std::unique(keys_.begin(), keys_.end()), keys_.end());
+  }
+
+  int level_;
+  const RandomGenerator* gen_;
+  size_t pos_;
+  int64_t from_;
+  int64_t span_;
+  int nkeys_;
+  uint32_t seed_;
+  std::vector<uint64_t> keys_;
+  const std::vector<long long>* pool_;
+  size_t next_;
+  size_t end_;
+  char key_[100];
+};
+
 class Generator {
 private:
 	Cache* cache_;
 	const FilterPolicy* filter_policy_;
+	const SliceTransform* prefix_extractor_;
 	DB* db_;
-	int num_;
-	int value_size_;
-
-	Random rand_;
-	WriteOptions write_options_;
-	int entries_per_batch_;
 
   Options options_;
 
@@ -113,12 +172,10 @@ public:
   filter_policy_(FLAGS_bloom_bits >= 0
   		? NewBloomFilterPolicy(FLAGS_bloom_bits)
   				: NULL),
-  				  db_(NULL),
-  				  num_(FLAGS_num),
-  				  value_size_(FLAGS_value_size),
-  				  entries_per_batch_(64),
-  				  rand_(FLAGS_random_seed),
-  				  write_options_(WriteOptions()){
+  prefix_extractor_(FLAGS_prefix_size > 0
+  		? NewFixedPrefixTransform(FLAGS_prefix_size)
+  				: NULL),
+  				  db_(NULL) {
 		std::vector<std::string> files;
 		Env::Default()->GetChildren(FLAGS_db, &files);
 		for (size_t i = 0; i < files.size(); i++) {
@@ -135,6 +192,7 @@ public:
 		delete db_;
 		delete cache_;
 		delete filter_policy_;
+		delete prefix_extractor_;
 		fprintf(stdout, "DB generation completes\n");
 	}
 
@@ -145,6 +203,9 @@ public:
     options_.write_buffer_size = FLAGS_write_buffer_size;
     options_.max_open_files = FLAGS_open_files;
     options_.filter_policy = filter_policy_;
+    options_.data_block_hash_index = FLAGS_data_block_hash_index;
+    options_.partition_index_and_filters = FLAGS_partition_index_and_filters;
+    options_.prefix_extractor = prefix_extractor_;
     options_.compression = leveldb::kNoCompression;
     Status s = DB::Open(options_, FLAGS_db, &db_);
     if (!s.ok()) {
@@ -153,92 +214,76 @@ public:
     }
   }
 
+	/*
+	 * Fill the levels from level 1 on with the files that fit in each
+	 *	(plus --extra_files_per_level) until --num keys are placed.  Without
+	 *	--ycsb_compatible, each file of a level draws its keys from its own
+	 *	slice of the key range; with it, a level takes the next key numbers,
+	 *	hashed and sorted, and its files take consecutive runs of them.
+	 *	All tables are built by BulkLoad() and added in one version edit.
+	 */
 	int Run() {
 		Open();
 
-		RandomGenerator gen;
-		WriteBatch batch;
-		batch.Clear();
-		Status s;
-		hlsm::YCSBKeyGenerator *ycsb_gen;
-
-		int done = 0, bnum = 0;
-		char key[100];
-
-		int keynum_per_file = (int) leveldb::config::kTargetFileSize/ (FLAGS_value_size + kv_pair_overhead_bytes);
-
-		//skip level 0
-		int level = 0;
-		int clevel_max_fnum = 0;
-		int clevel_fnum = clevel_max_fnum;
-		int64_t file_key_start, file_key_span;
-
-		for (int i = 0; done < FLAGS_num; i++) {
-			// current level is finished, move to next level
-			if (clevel_max_fnum == 0
-					|| (level == 1 && clevel_fnum >= clevel_max_fnum + std::min(FLAGS_extra_files_per_level, clevel_max_fnum/2))
-					|| clevel_fnum >= clevel_max_fnum + FLAGS_extra_files_per_level) {
-				if (level % 2 == 1) {
-					reinterpret_cast<DBImpl*>(db_)->AdvanceHLSMActiveDeltaLevel(level);
-				}
-				level++;
-				clevel_max_fnum = hlsm::max_fnum_in_level(level);
-				clevel_fnum = 0;
-
-				// reinitialize ycsb generator for the new level
-				if (FLAGS_ycsb_compatible) {
-					ycsb_gen = new hlsm::YCSBKeyGenerator(i,
-							std::min(clevel_max_fnum + FLAGS_extra_files_per_level, (FLAGS_num - i)/keynum_per_file + 2),
-							keynum_per_file);
-					DEBUG_INFO(2, "New level %d starts with %d (YCSBKeyGen), #keys = %d\n", level, i,
-							(clevel_max_fnum + FLAGS_extra_files_per_level) *
-							(int) leveldb::config::kTargetFileSize /
-							(FLAGS_value_size + kv_pair_overhead_bytes));
-				}
+		const RandomGenerator gen;
+		std::vector<BulkLoadPartition*> partitions;
+		std::vector<std::vector<long long>*> pools;
+		const int keynum_per_file = (int) leveldb::config::kTargetFileSize/ (FLAGS_value_size + kv_pair_overhead_bytes);
 
-				file_key_span = (int) (FLAGS_write_span / (clevel_max_fnum + FLAGS_extra_files_per_level));
-				file_key_start = FLAGS_write_from;
-				DEBUG_INFO(2, "start: %ld, span: %ld, fnum_max: %d, level: %d\n",
-						file_key_start, file_key_span, clevel_max_fnum, level);
+		int done = 0;
+		for (int level = 1; done < FLAGS_num; level++) {
+			if (level >= config::kNumLevels) {
+				fprintf(stderr, "%d keys do not fit in %d levels\n", FLAGS_num, config::kNumLevels);
+				exit(1);
 			}
-
+			const int max_fnum = hlsm::max_fnum_in_level(level);
+			if (max_fnum == 0)
+				continue;
+			const int fnum = (level == 1) ? max_fnum + std::min(FLAGS_extra_files_per_level, max_fnum/2)
+					: max_fnum + FLAGS_extra_files_per_level;
+			const int nkeys = (int) std::min((int64_t) fnum * keynum_per_file, (int64_t) FLAGS_num - done);
+
+			std::vector<long long>* pool = NULL;
 			if (FLAGS_ycsb_compatible) {
-				snprintf(key, sizeof(key), "user%019lld", ycsb_gen->nextKey());
-			} else {
-				const uint64_t k = file_key_start + (rand_.Next64() % file_key_span);
-				snprintf(key, sizeof(key), "%020lu", k);
+				pool = new std::vector<long long>(nkeys);
+				for (int i = 0; i < nkeys; i++)
+					(*pool)[i] = hlsm::YCSBKey_hash(done + i);
+				std::sort(pool->begin(), pool->end());
+				pools.push_back(pool);
 			}
-			DEBUG_INFO(4, "Insert key %s (k = %d)\n", key, i);
-			batch.Put(key, gen.Generate(value_size_));
-
-			done++;
-			bnum++;
-			if (bnum == entries_per_batch_) {
-				bnum = 0;
-				fprintf(stderr, "... almost finished %d ops%30s\r", done, "");
-				DEBUG_MEASURE_RECORD(2, (s = db_->Write(write_options_, &batch)), "RW--Write");
-				fprintf(stderr, "... finished %d ops%30s\r", done, "");
-				batch.Clear();
-				if (!s.ok()) {
-					fprintf(stderr, "put error: %s\n", s.ToString().c_str());
-					exit(1);
-				}
 
-				// write one immutable table, move to next file
-				if (reinterpret_cast<DBImpl*>(db_)->MaybeCompactMemTableToLevel(level) == 1) {
-					clevel_fnum++;
-					if (!FLAGS_ycsb_compatible) {
-						file_key_start += file_key_span;
-						DEBUG_INFO(2, "start: %ld, span: %ld, fnum_max: %d, level: %d, fnum: %d\n",
-												file_key_start, file_key_span, clevel_max_fnum, level, clevel_fnum);
-					}
+			const int64_t file_key_span = FLAGS_write_span / (max_fnum + FLAGS_extra_files_per_level);
+			int f = 0;
+			for (int k = 0; k < nkeys; k += keynum_per_file, f++) {
+				const int n = std::min(keynum_per_file, nkeys - k);
+				if (FLAGS_ycsb_compatible) {
+					partitions.push_back(new GenPartition(level, &gen, pool, k, k + n));
+				} else {
+					partitions.push_back(new GenPartition(level, &gen,
+							FLAGS_write_from + f * file_key_span, file_key_span, n,
+							FLAGS_random_seed + partitions.size()));
 				}
 			}
+			DEBUG_INFO(2, "level %d: %d files, %d keys from #%d\n", level, f, nkeys, done);
+			done += nkeys;
 		}
 
-		// advance the delta level of the last logical level
-		reinterpret_cast<DBImpl*>(db_)->AdvanceHLSMActiveDeltaLevel(level);
+		BulkLoadOptions options;
+		options.threads = FLAGS_threads;
+		const uint64_t start = Env::Default()->NowMicros();
+		Status s;
+		HLSM_MEASURE(hlsm::metrics::kBenchWrite, (s = db_->BulkLoad(options, partitions)));
+		if (!s.ok()) {
+			fprintf(stderr, "bulk load error: %s\n", s.ToString().c_str());
+			exit(1);
+		}
+		fprintf(stdout, "%d keys in %d tables loaded in %.3f seconds\n", done,
+				(int) partitions.size(), (Env::Default()->NowMicros() - start) * 1e-6);
 
+		for (size_t i = 0; i < partitions.size(); i++)
+			delete partitions[i];
+		for (size_t i = 0; i < pools.size(); i++)
+			delete pools[i];
 		return 0;
 	}
 
@@ -267,6 +312,14 @@ int main(int argc, char** argv) {
       FLAGS_write_buffer_size = n;
     } else if (sscanf(argv[i], "--bloom_bits=%d%c", &n, &junk) == 1) {
       FLAGS_bloom_bits = n;
+    } else if (sscanf(argv[i], "--data_block_hash_index=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_data_block_hash_index = n;
+    } else if (sscanf(argv[i], "--partition_index_and_filters=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_partition_index_and_filters = n;
+    } else if (sscanf(argv[i], "--prefix_size=%d%c", &n, &junk) == 1) {
+      FLAGS_prefix_size = n;
     } else if (sscanf(argv[i], "--bloom_bits_use=%d%c", &n, &junk) == 1) {
       hlsm::config::bloom_bits_use = n;
     } else if (sscanf(argv[i], "--open_files=%d%c", &n, &junk) == 1) {
@@ -282,6 +335,8 @@ int main(int argc, char** argv) {
       hlsm::config::secondary_storage_path = argv[i] + 30;
     } else if (sscanf(argv[i], "--file_size=%d%c", &n, &junk) == 1) {
       leveldb::config::kTargetFileSize = n * 1048576; // in MiB
+    } else if (sscanf(argv[i], "--threads=%d%c", &n, &junk) == 1 && n > 0) {
+      FLAGS_threads = n;
     } else if (sscanf(argv[i], "--random_seed=%lf%c", &d, &junk) == 1) {
       FLAGS_random_seed = d;
     } else if (sscanf(argv[i], "--ycsb_compatible=%lf%c", &d, &junk) == 1) {
@@ -292,6 +347,8 @@ int main(int argc, char** argv) {
       leveldb::config::kLevelRatio = n;
     } else if (sscanf(argv[i], "--debug_level=%d%c", &n, &junk) == 1) {
       hlsm::config::debug_level = n;
+    } else if (sscanf(argv[i], "--hlsm_metrics=%d%c", &n, &junk) == 1) {
+      hlsm::config::collect_metrics = n;
     } else if (sscanf(argv[i], "--run_compaction=%d%c", &n, &junk) == 1) {
       hlsm::config::run_compaction = n;
     } else if (sscanf(argv[i], "--extra_files_per_level=%d%c", &n, &junk) == 1) {
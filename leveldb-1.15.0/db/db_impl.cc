@@ -52,6 +52,60 @@ struct DBImpl::Writer {
   explicit Writer(port::Mutex* mu) : cv(mu) { }
 };
 
+// Read-side view of the DB state used by Get().  A SuperVersion pins
+// mem_, the memtables of imm_, the current Version and (in hLSM mode)
+// the current lazy Version.  A new one is installed under mutex_
+// whenever any of them changes, so a reader holding a SuperVersion never
+// needs mutex_ to look them up.
+struct DBImpl::SuperVersion {
+  MemTable* mem;
+  std::vector<MemTable*> imm;  // Oldest first
+  Version* current;
+  Version* current_lazy;
+  volatile int refs;
+
+  void Ref() { __sync_add_and_fetch(&refs, 1); }
+
+  // Returns true if the last reference was dropped.  The caller must
+  // then release the pinned state with mutex_ held.
+  bool Unref() { return __sync_sub_and_fetch(&refs, 1) == 0; }
+};
+
+// Thread-local state of a reader: the SuperVersion it last picked up and
+// the seek stats charged against sv->current that have not been applied
+// yet.  Stats are applied in batches so that Get() stays off mutex_.
+//
+// While Get() reads through the cached SuperVersion, sv is InUse().
+// InstallSuperVersion() takes the SuperVersion of every other slot away
+// (sv becomes NULL), so that an idle thread does not pin obsolete
+// memtables and versions; a slot it finds in use is released by Get()
+// itself when it is done.
+struct DBImpl::ReadSlot {
+  DBImpl* db;
+  SuperVersion* volatile sv;
+  std::vector<Version::GetStats> pending_stats;
+
+  static SuperVersion* InUse() {
+    static char tag;
+    return reinterpret_cast<SuperVersion*>(&tag);
+  }
+
+  // Atomically replace sv by "v" and return the previous value
+  SuperVersion* Swap(SuperVersion* v) {
+    return __sync_lock_test_and_set(&sv, v);
+  }
+};
+
+static const size_t kMaxPendingSeekStats = 64;
+
+// Memtable flushes run on the HIGH pool, next to compactions on the LOW
+// pool.  A LazyVersionEdit snapshots the delta-level metadata when it is
+// created, so in hLSM mode flushes stay on the compaction thread to keep
+// lazy edits from overtaking each other.
+static bool FlushOnHighPool() {
+  return !hlsm::config::mode.ishLSM();
+}
+
 struct DBImpl::CompactionState {
   Compaction* const compaction;
 
@@ -101,6 +155,7 @@ Options SanitizeOptions(const std::string& dbname,
   ClipToRange(&result.max_open_files,    64 + kNumNonTableCacheFiles, 50000);
   ClipToRange(&result.write_buffer_size, 64<<10,                      1<<30);
   ClipToRange(&result.block_size,        1<<10,                       4<<20);
+  ClipToRange(&result.max_immutable_memtables, 1, 16);
   if (result.info_log == NULL) {
     // Open a log file in the same directory as the db
     src.env->CreateDir(dbname);  // In case it does not exist
@@ -129,17 +184,26 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
       db_lock_(NULL),
       shutting_down_(NULL),
       bg_cv_(&mutex_),
-      mem_(new MemTable(internal_comparator_)),
-      imm_(NULL),
+      mem_(new MemTable(internal_comparator_, &options_)),
       logfile_(NULL),
       logfile_number_(0),
       log_(NULL),
       seed_(0),
       tmp_batch_(new WriteBatch),
       bg_compaction_scheduled_(false),
-      manual_compaction_(NULL) {
+      bg_flush_scheduled_(false),
+      manual_compaction_(NULL),
+      level_shrink_pending_(false),
+      tuning_start_micros_(env_->NowMicros()),
+      tuning_seeks_(0),
+      tuning_delta_seeks_(0),
+      tuning_write_bytes_(0),
+      tuning_mirror_bytes_(0),
+      flush_rate_(0) {
   mem_->Ref();
   has_imm_.Release_Store(NULL);
+  super_version_.Release_Store(NULL);
+  pthread_key_create(&read_slot_key_, &DBImpl::DeleteReadSlot);
 
   // Reserve ten files or so for other uses and give the rest to TableCache.
   const int table_cache_size = options_.max_open_files - kNumNonTableCacheFiles;
@@ -153,9 +217,24 @@ DBImpl::~DBImpl() {
   // Wait for background work to finish
   mutex_.Lock();
   shutting_down_.Release_Store(this);  // Any non-NULL value is ok
-  while (bg_compaction_scheduled_ && hlsm::config::run_compaction) {
+  while ((bg_compaction_scheduled_ || bg_flush_scheduled_) &&
+         hlsm::config::run_compaction) {
     bg_cv_.Wait();
   }
+
+  // Drop every reader's cached SuperVersion; threads that outlive us must
+  // not run DeleteReadSlot() against a destroyed DBImpl.
+  pthread_key_delete(read_slot_key_);
+  for (std::set<ReadSlot*>::iterator it = read_slots_.begin();
+       it != read_slots_.end(); ++it) {
+    SuperVersion* cached = (*it)->Swap(NULL);
+    if (cached != NULL) ReleaseSuperVersion(cached);
+    delete *it;
+  }
+  read_slots_.clear();
+  SuperVersion* sv = reinterpret_cast<SuperVersion*>(super_version_.NoBarrier_Load());
+  if (sv != NULL) ReleaseSuperVersion(sv);
+  super_version_.Release_Store(NULL);
   mutex_.Unlock();
 
   if (db_lock_ != NULL) {
@@ -164,17 +243,22 @@ DBImpl::~DBImpl() {
 
   if (hlsm::runtime::use_opq_thread) {
 		uint64_t primary_end_at = Env::Default()->NowMicros();
-		OPQ_ADD_HALT(hlsm::runtime::op_queue);
-		if (hlsm::runtime::opq_helper != NULL) pthread_join(*hlsm::runtime::opq_helper, NULL);
+		hlsm::wait_opq_helper();
 		uint64_t secondary_end_at = Env::Default()->NowMicros();
 		Log(options_.info_log, "MJoin takes %lu ms", (secondary_end_at - primary_end_at)/1000);
   }
 
-  DEBUG_LEVEL_CHECK(1, hlsm::runtime::counters.print());
+  if (hlsm::config::collect_metrics) {
+    std::string report;
+    hlsm::metrics::Report(&report);
+    Log(options_.info_log, "Metrics\n%s", report.c_str());
+  }
 
   delete versions_;
   if (mem_ != NULL) mem_->Unref();
-  if (imm_ != NULL) imm_->Unref();
+  for (size_t i = 0; i < imm_.size(); i++) {
+    imm_[i]->Unref();
+  }
   delete tmp_batch_;
   delete log_;
   delete logfile_;
@@ -437,7 +521,7 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
     WriteBatchInternal::SetContents(&batch, record);
 
     if (mem == NULL) {
-      mem = new MemTable(internal_comparator_);
+      mem = new MemTable(internal_comparator_, &options_);
       mem->Ref();
     }
     status = WriteBatchInternal::InsertInto(&batch, mem);
@@ -454,10 +538,10 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
 
     if (mem->ApproximateMemoryUsage() > options_.write_buffer_size) {
       status = WriteLevel0Table(mem, edit, NULL);
-      DEBUG_INFO(2, "Level 0 Table: %lu\n", hlsm::runtime::table_level.getLatest());
+      DEBUG_INFO(2, "Level 0 Table: %lu\n", hlsm::runtime::placement.latest());
       // if the table is not mirrored, then there may be a table
       //   with the same name on the secondary store left unfinished in last execution
-      hlsm::maybe_delete_secondary_table(env_, hlsm::runtime::table_level.getLatest());
+      hlsm::maybe_delete_secondary_table(env_, hlsm::runtime::placement.latest());
       if (!status.ok()) {
         // Reflect errors immediately so that conditions like full
         // file-systems cause the DB::Open() to fail.
@@ -470,8 +554,8 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
 
   if (status.ok() && mem != NULL) {
     status = WriteLevel0Table(mem, edit, NULL);
-    DEBUG_INFO(2, "Level 0 Table: %lu\n", hlsm::runtime::table_level.getLatest());
-    hlsm::maybe_delete_secondary_table(env_, hlsm::runtime::table_level.getLatest());
+    DEBUG_INFO(2, "Level 0 Table: %lu\n", hlsm::runtime::placement.latest());
+    hlsm::maybe_delete_secondary_table(env_, hlsm::runtime::placement.latest());
     // Reflect errors immediately so that conditions like full
     // file-systems cause the DB::Open() to fail.
   }
@@ -481,22 +565,34 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
   return status;
 }
 
-Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
-                                Version* base) {
+Status DBImpl::WriteLevel0Table(const std::vector<MemTable*>& mems,
+                                VersionEdit* edit, Version* base,
+                                uint64_t* pending_number) {
   mutex_.AssertHeld();
   const uint64_t start_micros = env_->NowMicros();
   FileMetaData meta;
   meta.number = versions_->NewFileNumber();
   pending_outputs_.insert(meta.number);
-  Iterator* iter = mem->NewIterator();
-  Log(options_.info_log, "Level-0 table #%llu: started",
-      (unsigned long long) meta.number);
+  std::vector<Iterator*> list;
+  for (size_t i = 0; i < mems.size(); i++) {
+    list.push_back(mems[i]->NewIterator());
+  }
+  Iterator* iter = NewMergingIterator(&internal_comparator_, &list[0],
+                                      list.size());
+  Log(options_.info_log, "Level-0 table #%llu: started (%d memtables)",
+      (unsigned long long) meta.number, static_cast<int>(mems.size()));
 
   Status s;
   {
     mutex_.Unlock();
+    const uint64_t build_start = env_->NowMicros();
     s = BuildTable(dbname_, env_, options_, table_cache_, iter, &meta);
+    const uint64_t build_micros = env_->NowMicros() - build_start;
     mutex_.Lock();
+    if (s.ok() && meta.file_size > 0 && build_micros > 0) {
+      const double rate = meta.file_size * 1e6 / build_micros;
+      flush_rate_ = (flush_rate_ == 0) ? rate : (flush_rate_ + rate) / 2;
+    }
   }
 
   Log(options_.info_log, "Level-0 table #%llu: %lld bytes %s",
@@ -504,7 +600,11 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
       (unsigned long long) meta.file_size,
       s.ToString().c_str());
   delete iter;
-  pending_outputs_.erase(meta.number);
+  if (pending_number != NULL) {
+    *pending_number = meta.number;
+  } else {
+    pending_outputs_.erase(meta.number);
+  }
 
   if (hlsm::runtime::compaction_throttler != NULL) {
     	// write level-0 table
@@ -536,7 +636,11 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
 
 void DBImpl::CompactMemTable() {
   mutex_.AssertHeld();
-  assert(imm_ != NULL);
+  assert(!imm_.empty());
+
+  // Memtables that fill up while the table is written wait for the next
+  // flush
+  const std::vector<MemTable*> mems(imm_);
 
   // Save the contents of the memtable as a new Table
   VersionEdit &edit = (*NewVersionEdit(versions_));
@@ -546,7 +650,15 @@ void DBImpl::CompactMemTable() {
   CALL_IF_HLSM(current_lazy = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy());
 
   CALL_IF_HLSM(current_lazy->Ref());
-  Status s = WriteLevel0Table(imm_, &edit, base);
+  // A flush on the HIGH pool may race with a compaction that starts
+  // while the table is built, so base may be stale by the time a level
+  // is picked; keep its output at level-0 so that it cannot overlap the
+  // compaction's inputs or outputs.  Keep it in pending_outputs_ until
+  // the edit is installed so that the compaction thread's
+  // DeleteObsoleteFiles() does not remove it.
+  uint64_t number = 0;
+  Status s = WriteLevel0Table(mems, &edit, FlushOnHighPool() ? NULL : base,
+                              &number);
   base->Unref();
   CALL_IF_HLSM(current_lazy->Unref());
 
@@ -559,16 +671,22 @@ void DBImpl::CompactMemTable() {
   // Replace immutable memtable with the generated Table
   if (s.ok()) {
     edit.SetPrevLogNumber(0);
-    edit.SetLogNumber(logfile_number_);  // Earlier logs no longer needed
+    // Earlier logs no longer needed
+    edit.SetLogNumber(imm_logs_[mems.size() - 1]);
 
     s = versions_->LogAndApply(&edit, &mutex_);
   }
+  pending_outputs_.erase(number);
 
   if (s.ok()) {
     // Commit to the new state
-    imm_->Unref();
-    imm_ = NULL;
-    has_imm_.Release_Store(NULL);
+    for (size_t i = 0; i < mems.size(); i++) {
+      mems[i]->Unref();
+    }
+    imm_.erase(imm_.begin(), imm_.begin() + mems.size());
+    imm_logs_.erase(imm_logs_.begin(), imm_logs_.begin() + mems.size());
+    has_imm_.Release_Store(imm_.empty() ? NULL : imm_.back());
+    InstallSuperVersion();
     DeleteObsoleteFiles();
   } else {
     RecordBackgroundError(s);
@@ -636,10 +754,10 @@ Status DBImpl::TEST_CompactMemTable() {
   if (s.ok()) {
     // Wait until the compaction completes
     MutexLock l(&mutex_);
-    while (imm_ != NULL && bg_error_.ok()) {
+    while (!imm_.empty() && bg_error_.ok()) {
       bg_cv_.Wait();
     }
-    if (imm_ != NULL) {
+    if (!imm_.empty()) {
       s = bg_error_;
     }
   }
@@ -656,20 +774,32 @@ void DBImpl::RecordBackgroundError(const Status& s) {
 
 void DBImpl::MaybeScheduleCompaction() {
   mutex_.AssertHeld();
-  if (bg_compaction_scheduled_) {
-    // Already scheduled
-  } else if (shutting_down_.Acquire_Load()) {
+  if (shutting_down_.Acquire_Load()) {
     // DB is being deleted; no more background compactions
+    return;
   } else if (!bg_error_.ok()) {
     // Already got an error; no more changes
-  } else if (imm_ == NULL &&
+    return;
+  }
+
+  if (!imm_.empty() && FlushOnHighPool() && !bg_flush_scheduled_) {
+    bg_flush_scheduled_ = true;
+    if (hlsm::config::run_compaction)
+    	env_->Schedule(&DBImpl::BGFlushWork, this, Env::HIGH);
+  }
+
+  if (bg_compaction_scheduled_) {
+    // Already scheduled
+  } else if ((imm_.empty() || FlushOnHighPool()) &&
              manual_compaction_ == NULL &&
-             !versions_->NeedsCompaction()) {
+             !versions_->NeedsCompaction() &&
+             DeltaMergeLevel() < 0 &&
+             !LevelTuningDue()) {
     // No work to be done
   } else {
     bg_compaction_scheduled_ = true;
     if (hlsm::config::run_compaction)
-    	env_->Schedule(&DBImpl::BGWork, this);
+    	env_->Schedule(&DBImpl::BGWork, this, Env::LOW);
   }
 }
 
@@ -686,6 +816,10 @@ void DBImpl::BackgroundCall() {
     // No more background work after a background error.
   } else {
     BackgroundCompaction();
+    InstallSuperVersion();
+    // Pending compaction bytes may change without a new SuperVersion,
+    // which is all InstallSuperVersion() updates the write rate for
+    UpdateWriteController();
   }
 
   bg_compaction_scheduled_ = false;
@@ -696,14 +830,51 @@ void DBImpl::BackgroundCall() {
   bg_cv_.SignalAll();
 }
 
+void DBImpl::BGFlushWork(void* db) {
+  reinterpret_cast<DBImpl*>(db)->BackgroundFlushCall();
+}
+
+void DBImpl::BackgroundFlushCall() {
+  MutexLock l(&mutex_);
+  assert(bg_flush_scheduled_);
+  if (shutting_down_.Acquire_Load()) {
+    // No more background work when shutting down.
+  } else if (!bg_error_.ok()) {
+    // No more background work after a background error.
+  } else if (!imm_.empty()) {
+    CompactMemTable();
+  }
+
+  bg_flush_scheduled_ = false;
+
+  // The flush may have pushed level-0 over its compaction trigger.
+  MaybeScheduleCompaction();
+  bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
+}
+
 void DBImpl::BackgroundCompaction() {
   mutex_.AssertHeld();
 
-  if (imm_ != NULL) {
+  if (!imm_.empty() && !FlushOnHighPool()) {
     CompactMemTable();
     return;
   }
 
+  if (manual_compaction_ == NULL && MaybeTuneLevels()) {
+    return;
+  }
+
+  // Delta merges only touch the secondary storage; let them go first
+  // unless level-0 is already slowing down writers.
+  if (manual_compaction_ == NULL && DeltaMergeLevel() >= 0 &&
+      versions_->NumLevelFiles(0) < config::kL0_SlowdownWritesTrigger) {
+    Status s = MergeDeltaLevels(DeltaMergeLevel());
+    if (!s.ok()) {
+      RecordBackgroundError(s);
+    }
+    return;
+  }
+
   Compaction* c;
   bool is_manual = (manual_compaction_ != NULL);
   InternalKey manual_end;
@@ -761,12 +932,14 @@ void DBImpl::BackgroundCompaction() {
   } else {
     DEBUG_INFO(1, "DoCompactionWork\n");
     CompactionState* compact = new CompactionState(c);
-    DEBUG_MEASURE_RECORD(1, (status = DoCompactionWork(compact)), "DoCompactionWork");
+    HLSM_MEASURE(hlsm::metrics::kCompaction, (status = DoCompactionWork(compact)));
     if (!status.ok()) {
       RecordBackgroundError(status);
     }
     CleanupCompaction(compact);
     c->ReleaseInputs();
+    // Drop the SuperVersions that still hold the inputs' Version
+    InstallSuperVersion();
     DeleteObsoleteFiles();
   }
   delete c;
@@ -830,7 +1003,7 @@ Status DBImpl::OpenCompactionOutputFile(CompactionState* compact) {
 
   // Make the output file
   std::string fname = TableFileName(dbname_, file_number);
-  hlsm::runtime::table_level.add(file_number, compact->compaction->level()+1);
+  hlsm::runtime::placement.set_level(file_number, compact->compaction->level()+1);
   Status s = env_->NewWritableFile(fname, &compact->outfile);
   if (s.ok()) {
     compact->builder = new TableBuilder(options_, compact->outfile);
@@ -940,8 +1113,7 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
   mutex_.Unlock();
 
   Iterator* input;
-  DEBUG_MEASURE_RECORD(1, (input = versions_->MakeInputIterator(compact->compaction, true)), 
-      "DoCompactionWork--MakeInputIterator");
+  HLSM_MEASURE(hlsm::metrics::kCompactionInput, (input = versions_->MakeInputIterator(compact->compaction, true)));
 
   input->SeekToFirst();
   Status status;
@@ -949,13 +1121,14 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
   std::string current_user_key;
   bool has_current_user_key = false;
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
+  bool stop_before = false;
   for (; input->Valid() && !shutting_down_.Acquire_Load(); ) {
-    // Prioritize immutable compaction work
-    if (has_imm_.NoBarrier_Load() != NULL) {
+    // Prioritize immutable compaction work, unless the HIGH pool does it
+    if (!FlushOnHighPool() && has_imm_.NoBarrier_Load() != NULL) {
       const uint64_t imm_start = env_->NowMicros();
       mutex_.Lock();
-      if (imm_ != NULL) {
-        DEBUG_MEASURE_RECORD(1, (CompactMemTable()), "DoCompactionWork--CompactMemTable");
+      if (!imm_.empty()) {
+        HLSM_MEASURE(hlsm::metrics::kCompactionMemTable, (CompactMemTable()));
         bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
       }
       mutex_.Unlock();
@@ -965,15 +1138,12 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
     Slice key = input->key();
     if (compact->compaction->ShouldStopBefore(key) &&
         compact->builder != NULL) {
-      DEBUG_MEASURE_RECORD(1, (status = FinishCompactionOutputFile(compact, input)), 
-          "DoCompactionWork--FinishCompactionOutputFile");
-      if (!status.ok()) {
-        break;
-      }
+      stop_before = true;
     }
 
     // Handle key/value, add to state, etc.
     bool drop = false;
+    bool new_user_key = true;
     if (!ParseInternalKey(key, &ikey)) {
       // Do not hide error keys
       current_user_key.clear();
@@ -987,6 +1157,8 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
         current_user_key.assign(ikey.user_key.data(), ikey.user_key.size());
         has_current_user_key = true;
         last_sequence_for_key = kMaxSequenceNumber;
+      } else {
+        new_user_key = false;
       }
 
       if (last_sequence_for_key <= compact->smallest_snapshot) {
@@ -1017,6 +1189,20 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
         (int)last_sequence_for_key, (int)compact->smallest_snapshot);
 #endif
 
+    // Close the current output before this key if it is big enough or
+    // overlaps too much of the grandparent level.  Outputs only end
+    // between user keys: a table holding the newer versions of a key
+    // could otherwise move below the table holding its older versions.
+    if (compact->builder != NULL && new_user_key &&
+        (stop_before || compact->builder->FileSize() >=
+                        compact->compaction->MaxOutputFileSize())) {
+      HLSM_MEASURE(hlsm::metrics::kCompactionOutput, (status = FinishCompactionOutputFile(compact, input)));
+      if (!status.ok()) {
+        break;
+      }
+      stop_before = false;
+    }
+
     if (!drop) {
       // Open output file if necessary
       if (compact->builder == NULL) {
@@ -1030,15 +1216,6 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
       }
       compact->current_output()->largest.DecodeFrom(key);
       compact->builder->Add(key, input->value());
-
-      // Close output file if it is big enough
-      if (compact->builder->FileSize() >=
-          compact->compaction->MaxOutputFileSize()) {
-        status = FinishCompactionOutputFile(compact, input);
-        if (!status.ok()) {
-          break;
-        }
-      }
     }
 
     input->Next();
@@ -1083,7 +1260,7 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
   if (hlsm::runtime::compaction_throttler != NULL) {
   	// add read and write bytes
   	hlsm::runtime::compaction_throttler->add(compact->total_bytes * 2);
-  	DEBUG_MEASURE_RECORD(1, (hlsm::runtime::compaction_throttler->throttle()), "DoCompactionWork--Throttle");
+  	HLSM_MEASURE(hlsm::metrics::kCompactionThrottle, (hlsm::runtime::compaction_throttler->throttle()));
   }
 
   return status;
@@ -1094,14 +1271,16 @@ struct IterState {
   port::Mutex* mu;
   Version* version;
   MemTable* mem;
-  MemTable* imm;
+  std::vector<MemTable*> imm;
 };
 
 static void CleanupIteratorState(void* arg1, void* arg2) {
   IterState* state = reinterpret_cast<IterState*>(arg1);
   state->mu->Lock();
   state->mem->Unref();
-  if (state->imm != NULL) state->imm->Unref();
+  for (size_t i = 0; i < state->imm.size(); i++) {
+    state->imm[i]->Unref();
+  }
   state->version->Unref();
   state->mu->Unlock();
   delete state;
@@ -1120,19 +1299,28 @@ Iterator* DBImpl::NewInternalIterator(const ReadOptions& options,
   std::vector<Iterator*> list;
   list.push_back(mem_->NewIterator());
   mem_->Ref();
-  if (imm_ != NULL) {
-    list.push_back(imm_->NewIterator());
-    imm_->Ref();
-  }
-  versions_->current()->AddIterators(options, &list, is_sequential);
+  for (size_t i = 0; i < imm_.size(); i++) {
+    list.push_back(imm_[i]->NewIterator());
+    imm_[i]->Ref();
+  }
+  // Like Get(), short scans in hLSM mode read the lazy version on the
+  // secondary; the merging iterator orders the entries of its NEW and
+  // delta levels by sequence number.  Sequential scans stream from the
+  // primary.
+  Version* v = versions_->current();
+  if (hlsm::config::mode.ishLSM() && !hlsm::read_from_primary(is_sequential)) {
+    v = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy();
+    HLSM_COUNT(hlsm::metrics::kLazyVersionIterators, 1);
+  }
+  v->AddIterators(options, &list, is_sequential);
   Iterator* internal_iter =
       NewMergingIterator(&internal_comparator_, &list[0], list.size());
-  versions_->current()->Ref();
+  v->Ref();
 
   cleanup->mu = &mutex_;
   cleanup->mem = mem_;
   cleanup->imm = imm_;
-  cleanup->version = versions_->current();
+  cleanup->version = v;
   internal_iter->RegisterCleanup(CleanupIteratorState, cleanup, NULL);
 
   *seed = ++seed_;
@@ -1151,63 +1339,209 @@ int64_t DBImpl::TEST_MaxNextLevelOverlappingBytes() {
   return versions_->MaxNextLevelOverlappingBytes();
 }
 
+void DBImpl::UpdateWriteController() {
+  mutex_.AssertHeld();
+  // Without a configured rate, slow down from the speed memtables are
+  // flushed at: writing faster than that only piles up level-0 files
+  uint64_t base_rate =
+      static_cast<uint64_t>(hlsm::config::delayed_write_rate_kb) << 10;
+  if (base_rate == 0) {
+    base_rate = (flush_rate_ > 0) ? static_cast<uint64_t>(flush_rate_)
+                                  : (16 << 20);
+  }
+  write_controller_.Update(
+      versions_->NumLevelFiles(0),
+      config::kL0_SlowdownWritesTrigger, KL0_STOP_WRITE_TRIGGER,
+      versions_->EstimatedPendingCompactionBytes(),
+      static_cast<int64_t>(hlsm::config::soft_pending_compaction_mb) << 20,
+      static_cast<int64_t>(hlsm::config::hard_pending_compaction_mb) << 20,
+      base_rate);
+}
+
+void DBImpl::InstallSuperVersion() {
+  mutex_.AssertHeld();
+  Version* current = versions_->current();
+  Version* current_lazy = NULL;
+  CALL_IF_HLSM(current_lazy = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy());
+
+  SuperVersion* old = reinterpret_cast<SuperVersion*>(super_version_.NoBarrier_Load());
+  if (old != NULL && old->mem == mem_ && old->imm == imm_ &&
+      old->current == current && old->current_lazy == current_lazy) {
+    return;
+  }
+  UpdateWriteController();
+
+  SuperVersion* sv = new SuperVersion;
+  sv->mem = mem_;
+  sv->imm = imm_;
+  sv->current = current;
+  sv->current_lazy = current_lazy;
+  sv->refs = 1;
+  sv->mem->Ref();
+  for (size_t i = 0; i < sv->imm.size(); i++) {
+    sv->imm[i]->Ref();
+  }
+  sv->current->Ref();
+  if (sv->current_lazy != NULL) sv->current_lazy->Ref();
+  super_version_.Release_Store(sv);
+
+  if (old != NULL) ReleaseSuperVersion(old);
+
+  // Take the SuperVersions of idle readers away; they pick up sv on
+  // their next Get()
+  for (std::set<ReadSlot*>::iterator it = read_slots_.begin();
+       it != read_slots_.end(); ++it) {
+    SuperVersion* cached = (*it)->Swap(NULL);
+    if (cached != NULL && cached != ReadSlot::InUse()) {
+      ReleaseReadSlotSuperVersion(*it, cached);
+    }
+  }
+}
+
+void DBImpl::ReleaseSuperVersion(SuperVersion* sv) {
+  mutex_.AssertHeld();
+  if (sv->Unref()) {
+    sv->mem->Unref();
+    for (size_t i = 0; i < sv->imm.size(); i++) {
+      sv->imm[i]->Unref();
+    }
+    sv->current->Unref();
+    if (sv->current_lazy != NULL) sv->current_lazy->Unref();
+    delete sv;
+  }
+}
+
+DBImpl::ReadSlot* DBImpl::GetReadSlot() {
+  ReadSlot* slot = reinterpret_cast<ReadSlot*>(pthread_getspecific(read_slot_key_));
+  if (slot == NULL) {
+    slot = new ReadSlot;
+    slot->db = this;
+    slot->sv = NULL;
+    MutexLock l(&mutex_);
+    read_slots_.insert(slot);
+    pthread_setspecific(read_slot_key_, slot);
+  }
+  return slot;
+}
+
+DBImpl::SuperVersion* DBImpl::AcquireSuperVersion(ReadSlot* slot) {
+  SuperVersion* sv = slot->Swap(ReadSlot::InUse());
+  assert(sv != ReadSlot::InUse());
+  if (sv == NULL || sv != super_version_.Acquire_Load()) {
+    MutexLock l(&mutex_);
+    if (sv != NULL) {
+      ReleaseReadSlotSuperVersion(slot, sv);
+    }
+    sv = reinterpret_cast<SuperVersion*>(super_version_.NoBarrier_Load());
+    sv->Ref();
+  }
+  return sv;
+}
+
+void DBImpl::ReturnSuperVersion(ReadSlot* slot, SuperVersion* sv) {
+  if (!__sync_bool_compare_and_swap(&slot->sv, ReadSlot::InUse(), sv)) {
+    // InstallSuperVersion() took the slot over while we read through sv
+    MutexLock l(&mutex_);
+    ReleaseReadSlotSuperVersion(slot, sv);
+  }
+}
+
+void DBImpl::ReleaseReadSlotSuperVersion(ReadSlot* slot, SuperVersion* sv) {
+  mutex_.AssertHeld();
+  if (FlushSeekStats(slot, sv)) {
+    MaybeScheduleCompaction();
+  }
+  ReleaseSuperVersion(sv);
+}
+
+bool DBImpl::FlushSeekStats(ReadSlot* slot, SuperVersion* sv) {
+  mutex_.AssertHeld();
+  bool need_compaction = false;
+  const bool lazy = hlsm::config::mode.ishLSM() && !hlsm::read_from_primary(false);
+  for (size_t i = 0; i < slot->pending_stats.size(); i++) {
+    if (sv->current->UpdateStats(slot->pending_stats[i])) {
+      need_compaction = true;
+    }
+    if (lazy) {
+      tuning_seeks_++;
+      if (hlsm::is_delta_level_of(slot->pending_stats[i].seek_file_level,
+                                  hlsm::runtime::two_phase_end_level)) {
+        tuning_delta_seeks_++;
+      }
+    }
+  }
+  slot->pending_stats.clear();
+  // Without writes, reads are what bring up the next tuning decision
+  return need_compaction || (lazy && LevelTuningDue());
+}
+
+// Called on exit of a thread that has read from the DB.
+void DBImpl::DeleteReadSlot(void* arg) {
+  ReadSlot* slot = reinterpret_cast<ReadSlot*>(arg);
+  DBImpl* db = slot->db;
+  MutexLock l(&db->mutex_);
+  SuperVersion* sv = slot->Swap(NULL);
+  if (sv != NULL) {
+    db->ReleaseReadSlotSuperVersion(slot, sv);
+  }
+  db->read_slots_.erase(slot);
+  delete slot;
+}
+
 Status DBImpl::Get(const ReadOptions& options,
                    const Slice& key,
                    std::string* value) {
   Status s;
-  MutexLock l(&mutex_);
   SequenceNumber snapshot;
   if (options.snapshot != NULL) {
     snapshot = reinterpret_cast<const SnapshotImpl*>(options.snapshot)->number_;
   } else {
     snapshot = versions_->LastSequence();
   }
+  // The memtable switch that produced any write at or below "snapshot"
+  // was published before the sequence number, so load it afterwards.
+  port::MemoryBarrier();
 
-  MemTable* mem = mem_;
-  MemTable* imm = imm_;
-  Version* current = versions_->current();
-  mem->Ref();
-  if (imm != NULL) imm->Ref();
-  current->Ref();
-
-  Version* current_lazy = NULL;
-  CALL_IF_HLSM(current_lazy = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy());
-  CALL_IF_HLSM(current_lazy->Ref());
+  ReadSlot* slot = GetReadSlot();
+  SuperVersion* sv = AcquireSuperVersion(slot);
 
   bool have_stat_update = false;
   Version::GetStats stats;
 
-  // Unlock while reading from files and memtables
-  {
-    mutex_.Unlock();
-    // First look in the memtable, then in the immutable memtable (if any).
-    LookupKey lkey(key, snapshot);
-    bool found = false;
-    DEBUG_MEASURE_RECORD(1, (found = mem->Get(lkey, value, &s)), "DBImpl::Get--mem->Get");
+  // First look in the memtable, then in the immutable memtables (if any),
+  // newest first.
+  LookupKey lkey(key, snapshot);
+  bool found = false;
+  HLSM_MEASURE(hlsm::metrics::kDBGetMem, (found = sv->mem->Get(lkey, value, &s)));
 
-    if (!found && imm != NULL) { 
-    	DEBUG_MEASURE_RECORD(1, (found = imm->Get(lkey, value, &s)), "DBImpl::Get--imm->Get" );
-    }
+  for (size_t i = sv->imm.size(); !found && i > 0; i--) {
+    HLSM_MEASURE(hlsm::metrics::kDBGetImm, (found = sv->imm[i - 1]->Get(lkey, value, &s)));
+  }
 
-    if (!found) {
-      if (hlsm::read_from_primary(false) || !hlsm::config::mode.ishLSM()) {
-    	  DEBUG_MEASURE_RECORD(1, (s = current->Get(options, lkey, value, &stats)), "DBImpl::Get--Version::Get");
-      } else {
-    	  Version* current_lazy = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy();
-    	  DEBUG_MEASURE_RECORD(1, (s = current_lazy->Get(options, lkey, value, &stats)), "DBImpl::Get--LazyVersion:Get");
-      }
-      have_stat_update = true;
+  if (!found) {
+    if (hlsm::read_from_primary(false) || !hlsm::config::mode.ishLSM()) {
+      HLSM_MEASURE(hlsm::metrics::kDBGetVersion, (s = sv->current->Get(options, lkey, value, &stats)));
+    } else {
+      HLSM_MEASURE(hlsm::metrics::kDBGetLazyVersion, (s = sv->current_lazy->Get(options, lkey, value, &stats)));
     }
-    mutex_.Lock();
+    have_stat_update = true;
+  }
+  if (s.ok()) {
+    hlsm::metrics::Add(hlsm::metrics::kUserReadBytes, key.size() + value->size());
   }
 
-  if (have_stat_update && current->UpdateStats(stats)) {
-    MaybeScheduleCompaction();
+  // Seek stats are charged against sv->current in batches; they are also
+  // flushed whenever the slot gives up sv.
+  if (have_stat_update && stats.seek_file != NULL) {
+    slot->pending_stats.push_back(stats);
+    if (slot->pending_stats.size() >= kMaxPendingSeekStats) {
+      MutexLock l(&mutex_);
+      if (FlushSeekStats(slot, sv)) {
+        MaybeScheduleCompaction();
+      }
+    }
   }
-  mem->Unref();
-  if (imm != NULL) imm->Unref();
-  current->Unref();
-  CALL_IF_HLSM(current_lazy->Unref());
+  ReturnSuperVersion(slot, sv);
 
   return s;
 }
@@ -1221,7 +1555,7 @@ Iterator* DBImpl::NewIterator(const ReadOptions& options, bool is_sequential) {
       (options.snapshot != NULL
        ? reinterpret_cast<const SnapshotImpl*>(options.snapshot)->number_
        : latest_snapshot),
-      seed);
+      seed, options.prefix_same_as_start ? options_.prefix_extractor : NULL);
 }
 
 void DBImpl::RecordReadSample(Slice key) {
@@ -1265,13 +1599,20 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
     return w.status;
   }
 
+  // The group is built first so that a delay charges its bytes
+  Writer* last_writer = &w;
+  WriteBatch* updates = NULL;
+  if (my_batch != NULL) {  // NULL batch is for compactions
+    updates = BuildBatchGroup(&last_writer);
+  }
+
   // May temporarily unlock and wait.
   Status status;
-  DEBUG_MEASURE_RECORD(1, (status = MakeRoomForWrite(my_batch == NULL)), "DBImpl::Write--MakeRoom");
+  HLSM_MEASURE(hlsm::metrics::kDBWriteMakeRoom,
+      (status = MakeRoomForWrite(my_batch == NULL,
+          updates == NULL ? 0 : WriteBatchInternal::ByteSize(updates))));
   uint64_t last_sequence = versions_->LastSequence();
-  Writer* last_writer = &w;
-  if (status.ok() && my_batch != NULL) {  // NULL batch is for compactions
-    WriteBatch* updates = BuildBatchGroup(&last_writer);
+  if (status.ok() && my_batch != NULL) {
     WriteBatchInternal::SetSequence(updates, last_sequence + 1);
     last_sequence += WriteBatchInternal::Count(updates);
 
@@ -1282,6 +1623,7 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
     {
       mutex_.Unlock();
       status = log_->AddRecord(WriteBatchInternal::Contents(updates));
+      hlsm::metrics::Add(hlsm::metrics::kUserWriteBytes, WriteBatchInternal::ByteSize(updates));
       bool sync_error = false;
       if (status.ok() && options.sync) {
         status = logfile_->Sync();
@@ -1290,7 +1632,7 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
         }
       }
       if (status.ok()) {
-        DEBUG_MEASURE_RECORD(1, (status = WriteBatchInternal::InsertInto(updates, mem_)), "DBImpl::Write--Insert");
+        HLSM_MEASURE(hlsm::metrics::kDBWriteInsert, (status = WriteBatchInternal::InsertInto(updates, mem_)));
       }
       mutex_.Lock();
       if (sync_error) {
@@ -1300,10 +1642,9 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
         RecordBackgroundError(status);
       }
     }
-    if (updates == tmp_batch_) tmp_batch_->Clear();
-
     versions_->SetLastSequence(last_sequence);
   }
+  if (updates == tmp_batch_) tmp_batch_->Clear();
 
   while (true) {
     Writer* ready = writers_.front();
@@ -1324,6 +1665,72 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
   return status;
 }
 
+DBImpl::Writer* DBImpl::StopWrites() {
+  mutex_.AssertHeld();
+  Writer* w = new Writer(&mutex_);
+  w->batch = NULL;
+  w->sync = false;
+  w->done = false;
+  writers_.push_back(w);
+  while (w != writers_.front()) {
+    w->cv.Wait();
+  }
+  return w;
+}
+
+void DBImpl::ResumeWrites(Writer* w) {
+  mutex_.AssertHeld();
+  assert(w == writers_.front());
+  writers_.pop_front();
+  if (!writers_.empty()) {
+    writers_.front()->cv.Signal();
+  }
+  delete w;
+}
+
+Status DBImpl::FlushMemTable() {
+  mutex_.AssertHeld();
+  Iterator* iter = mem_->NewIterator();
+  iter->SeekToFirst();
+  const bool empty = !iter->Valid();
+  delete iter;
+
+  Status s;
+  if (!empty) {
+    s = MakeRoomForWrite(true, 0);
+  }
+  while (s.ok() && !imm_.empty()) {
+    if (!bg_error_.ok()) {
+      s = bg_error_;
+    } else {
+      bg_cv_.Wait();
+    }
+  }
+  return s;
+}
+
+Status DBImpl::ReserveSequence(int n, SequenceNumber* last) {
+  MutexLock l(&mutex_);
+  Writer* w = StopWrites();
+
+  Status s = bg_error_;
+  if (s.ok()) {
+    Iterator* iter = mem_->NewIterator();
+    iter->SeekToFirst();
+    if (iter->Valid() || !imm_.empty()) {
+      s = Status::InvalidArgument("memtable is not empty");
+    }
+    delete iter;
+  }
+  if (s.ok()) {
+    *last = versions_->LastSequence() + n;
+    versions_->SetLastSequence(*last);
+  }
+
+  ResumeWrites(w);
+  return s;
+}
+
 // REQUIRES: Writer list must be non-empty
 // REQUIRES: First writer must have a non-NULL batch
 WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer) {
@@ -1375,38 +1782,42 @@ WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer) {
 
 // REQUIRES: mutex_ is held
 // REQUIRES: this thread is currently at the front of the writer queue
-Status DBImpl::MakeRoomForWrite(bool force) {
+Status DBImpl::MakeRoomForWrite(bool force, uint64_t write_bytes) {
   mutex_.AssertHeld();
   assert(!writers_.empty());
   bool allow_delay = !force;
   Status s;
-  DEBUG_INFO(3, "Mem Usage: %lu\tBuffer Size: %lu\time: %p\n",
-  		mem_->ApproximateMemoryUsage(), options_.write_buffer_size, imm_);
+  DEBUG_INFO(3, "Mem Usage: %lu\tBuffer Size: %lu\timm: %lu\n",
+  		mem_->ApproximateMemoryUsage(), options_.write_buffer_size, imm_.size());
   while (true) {
     if (!bg_error_.ok()) {
       // Yield previous error
       s = bg_error_;
       break;
-    } else if (
-        allow_delay &&
-        versions_->NumLevelFiles(0) >= config::kL0_SlowdownWritesTrigger) {
-      // We are getting close to hitting a hard limit on the number of
-      // L0 files.  Rather than delaying a single write by several
-      // seconds when we hit the hard limit, start delaying each
-      // individual write by 1ms to reduce latency variance.  Also,
-      // this delay hands over some CPU to the compaction thread in
-      // case it is sharing the same core as the writer.
-      mutex_.Unlock();
-      env_->SleepForMicroseconds(1000);
+    } else if (allow_delay && write_controller_.IsDelayed()) {
+      // Compactions are falling behind.  Rather than delaying a single
+      // write by several seconds when we hit the hard limit, pace the
+      // writes at the rate picked by write_controller_, charging each
+      // for the bytes about to be written.  The delay also hands
+      // over some CPU to the compaction thread in case it is sharing
+      // the same core as the writer.
+      const uint64_t delay = write_controller_.GetDelay(
+          env_->NowMicros(), write_bytes);
       allow_delay = false;  // Do not delay a single write more than once
-      mutex_.Lock();
+      if (delay > 0) {
+        HLSM_COUNT(hlsm::metrics::kWriteDelayMicros, delay);
+        mutex_.Unlock();
+        env_->SleepForMicroseconds(static_cast<int>(delay));
+        mutex_.Lock();
+      }
     } else if (!force &&
                (mem_->ApproximateMemoryUsage() <= options_.write_buffer_size)) {
       // There is room in current memtable
       break;
-    } else if (imm_ != NULL) {
+    } else if (imm_.size() >=
+               static_cast<size_t>(options_.max_immutable_memtables)) {
       // We have filled up the current memtable, but the previous
-      // one is still being compacted, so we wait.
+      // ones are still being compacted, so we wait.
       Log(options_.info_log, "Current memtable full; waiting...\n");
       bg_cv_.Wait();
     } else if (versions_->NumLevelFiles(0) >= KL0_STOP_WRITE_TRIGGER) {
@@ -1429,10 +1840,12 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       logfile_ = lfile;
       logfile_number_ = new_log_number;
       log_ = new log::Writer(lfile);
-      imm_ = mem_;
-      has_imm_.Release_Store(imm_);
-      mem_ = new MemTable(internal_comparator_);
+      imm_.push_back(mem_);
+      imm_logs_.push_back(new_log_number);
+      has_imm_.Release_Store(mem_);
+      mem_ = new MemTable(internal_comparator_, &options_);
       mem_->Ref();
+      InstallSuperVersion();
       force = false;   // Do not force another compaction if have room
       MaybeScheduleCompaction();
     }
@@ -1443,6 +1856,10 @@ Status DBImpl::MakeRoomForWrite(bool force) {
 bool DBImpl::GetProperty(const Slice& property, std::string* value) {
   value->clear();
 
+  if (property.starts_with("hlsm.")) {
+    return GetHlsmProperty(property, value);
+  }
+
   MutexLock l(&mutex_);
   Slice in = property;
   Slice prefix("leveldb.");
@@ -1534,9 +1951,19 @@ Status DB::Delete(const WriteOptions& opt, const Slice& key) {
   return Write(opt, &batch);
 }
 
+Status DB::BulkLoad(const BulkLoadOptions& options,
+                    const std::vector<BulkLoadPartition*>& partitions) {
+  return Status::NotSupported("BulkLoad");
+}
+
+Status DB::IngestExternalFiles(const std::vector<std::string>& paths) {
+  return Status::NotSupported("IngestExternalFiles");
+}
+
+BulkLoadPartition::~BulkLoadPartition() { }
+
 DB::~DB() {
   if (hlsm::runtime::use_opq_thread) {
-	OPQ_ADD_HALT(hlsm::runtime::op_queue);
 	DEBUG_INFO(1, "DB Released\n");
   }
   hlsm::runtime::cleanup();
@@ -1572,6 +1999,7 @@ Status DB::Open(const Options& options, const std::string& dbname,
       hlsm::runtime::mirror_start_level = -1;
       impl->DeleteObsoleteFiles();
       hlsm::runtime::mirror_start_level = msl; // Delete all tables that are not in MANIFEST, but appear in secondary store
+      impl->InstallSuperVersion();
       impl->MaybeScheduleCompaction();
     }
   }
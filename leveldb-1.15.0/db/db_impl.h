@@ -7,9 +7,12 @@
 
 #include <deque>
 #include <set>
+#include <vector>
+#include <pthread.h>
 #include "db/dbformat.h"
 #include "db/log_writer.h"
 #include "db/snapshot.h"
+#include "db/write_controller.h"
 #include "leveldb/db.h"
 #include "leveldb/env.h"
 #include "port/port.h"
@@ -17,6 +20,7 @@
 
 namespace leveldb {
 
+struct FileMetaData;
 class MemTable;
 class TableCache;
 class Version;
@@ -41,6 +45,9 @@ class DBImpl : public DB {
   virtual bool GetProperty(const Slice& property, std::string* value);
   virtual void GetApproximateSizes(const Range* range, int n, uint64_t* sizes);
   virtual void CompactRange(const Slice* begin, const Slice* end);
+  virtual Status BulkLoad(const BulkLoadOptions& options,
+                          const std::vector<BulkLoadPartition*>& partitions);
+  virtual Status IngestExternalFiles(const std::vector<std::string>& paths);
 
   // Extra methods (for testing) that are not in the public DB interface
 
@@ -59,19 +66,24 @@ class DBImpl : public DB {
   // file at a level >= 1.
   int64_t TEST_MaxNextLevelOverlappingBytes();
 
+  // End two-phase compaction one level later (step > 0) or earlier
+  // (step < 0) as level tuning does, once background work is idle.  An
+  // earlier end waits for the copies of the new end level's tables.
+  // REQUIRES: no other thread writes meanwhile
+  Status TEST_MoveTwoPhaseEndLevel(int step);
+
   // Record a sample of bytes read at the specified internal key.
   // Samples are taken approximately once every config::kReadBytesPeriod
   // bytes.
   void RecordReadSample(Slice key);
 
-  // for db_gen
-  int MaybeCompactMemTableToLevel(int level);
-  int AdvanceHLSMActiveDeltaLevel(int level);
-
  private:
   friend class DB;
   struct CompactionState;
   struct Writer;
+  struct SuperVersion;
+  struct ReadSlot;
+  struct BulkLoadState;
 
   Iterator* NewInternalIterator(const ReadOptions&,
                                 SequenceNumber* latest_snapshot,
@@ -91,8 +103,8 @@ class DBImpl : public DB {
   void BasicDeleteObsoleteFiles();
   void HLSMDeleteObsoleteFiles();
 
-  // Compact the in-memory write buffer to disk.  Switches to a new
-  // log-file/memtable and writes a new descriptor iff successful.
+  // Compact the immutable memtables queued so far to disk, into one
+  // table.  Writes a new descriptor and drops them iff successful.
   // Errors are recorded in bg_error_.
   void CompactMemTable() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
@@ -101,22 +113,97 @@ class DBImpl : public DB {
                         SequenceNumber* max_sequence)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
-  Status WriteLevel0Table(MemTable* mem, VersionEdit* edit, Version* base)
+  // Write the entries of all of "mems" into one table.
+  // If "pending_number" is non-NULL the new table stays in
+  // pending_outputs_ and its number is stored there; the caller must
+  // erase it once the edit has been applied.
+  Status WriteLevel0Table(const std::vector<MemTable*>& mems,
+                          VersionEdit* edit, Version* base,
+                          uint64_t* pending_number = NULL)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  Status WriteLevel0Table(MemTable* mem, VersionEdit* edit, Version* base)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return WriteLevel0Table(std::vector<MemTable*>(1, mem), edit, base);
+  }
 
-  // for db_gen
-  Status WriteLevel0TableToLevel(MemTable* mem, VersionEdit* edit,
-                                  Version* base, int level);
+  // Wait at the head of the write queue, so that no write runs until
+  // ResumeWrites(w) is called with the returned writer.  mutex_ may be
+  // released in between.
+  Writer* StopWrites() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void ResumeWrites(Writer* w) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // With writes stopped, hand a non-empty memtable to the compaction and
+  // wait until it is written to a table
+  Status FlushMemTable() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Take n sequence numbers in the write queue, so that no write gets
+  // them, and store the last one in *last.  Fails unless the memtable is
+  // empty, i.e. unless every entry in the database is older.
+  Status ReserveSequence(int n, SequenceNumber* last);
+
+  // Bulk load (bulk_load.cc): build the table of one partition with every
+  // entry at sequence number seq
+  static void BulkLoadWorker(void* arg);
+  Status BuildBulkTable(BulkLoadPartition* partition, SequenceNumber seq,
+                        FileMetaData* meta);
+  // Add the built tables to the current version(s)
+  Status InstallBulkTables(const std::vector<BulkLoadPartition*>& partitions,
+                           std::vector<FileMetaData>* files)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
-  Status MakeRoomForWrite(bool force /* compact even if there is room? */)
+  // Merge the delta levels of logical level "llevel" on the secondary
+  // storage into one sorted run (hLSM only)
+  Status MergeDeltaLevels(int llevel) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  int DeltaMergeLevel() const;
+
+  // Move the two-phase end level by one if hlsm::config::level_tuning_interval
+  // has passed since the last decision, or finish a pending move.  Returns
+  // true if a new version was installed (hLSM only)
+  bool MaybeTuneLevels() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void ResetLevelTuning() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  // True once the next tuning decision is due; counts as background work
+  // so that tuning does not wait for a compaction to get scheduled
+  bool LevelTuningDue() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Properties starting with "hlsm.", see hlsm_impl.cc
+  bool GetHlsmProperty(const Slice& property, std::string* value);
+
+  // write_bytes: size of the batch group about to be written, charged
+  // to the writer while writes are paced
+  Status MakeRoomForWrite(bool force /* compact even if there is room? */,
+                          uint64_t write_bytes)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   WriteBatch* BuildBatchGroup(Writer** last_writer);
 
   void RecordBackgroundError(const Status& s);
 
+  // Recompute the rate writers are paced at from the current version
+  void UpdateWriteController() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Publish a new SuperVersion if mem_, imm_ or one of the current
+  // versions changed since the last install.  Must be called after every
+  // memtable switch and every LogAndApply() that readers should observe.
+  void InstallSuperVersion() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void ReleaseSuperVersion(SuperVersion* sv) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Per-thread cache of the installed SuperVersion used by Get().
+  // AcquireSuperVersion() returns the SuperVersion to read through, which
+  // must be handed back with ReturnSuperVersion().
+  ReadSlot* GetReadSlot();
+  SuperVersion* AcquireSuperVersion(ReadSlot* slot);
+  void ReturnSuperVersion(ReadSlot* slot, SuperVersion* sv);
+  // Apply the pending seek stats of slot to sv->current and drop sv
+  void ReleaseReadSlotSuperVersion(ReadSlot* slot, SuperVersion* sv)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool FlushSeekStats(ReadSlot* slot, SuperVersion* sv)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  static void DeleteReadSlot(void* arg);
+
   void MaybeScheduleCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   static void BGWork(void* db);
   void BackgroundCall();
+  static void BGFlushWork(void* db);
+  void BackgroundFlushCall();
   void  BackgroundCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   void CleanupCompaction(CompactionState* compact)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
@@ -148,8 +235,12 @@ class DBImpl : public DB {
   port::AtomicPointer shutting_down_;
   port::CondVar bg_cv_;          // Signalled when background work finishes
   MemTable* mem_;
-  MemTable* imm_;                // Memtable being compacted
-  port::AtomicPointer has_imm_;  // So bg thread can detect non-NULL imm_
+  std::vector<MemTable*> imm_;   // Memtables being compacted, oldest first
+  std::vector<uint64_t> imm_logs_;  // Log file started after each of imm_
+  port::AtomicPointer has_imm_;  // So bg thread can detect non-empty imm_
+  port::AtomicPointer super_version_;  // Written under mutex_, read lock-free
+  pthread_key_t read_slot_key_;
+  std::set<ReadSlot*> read_slots_;
   WritableFile* logfile_;
   uint64_t logfile_number_;
   log::Writer* log_;
@@ -168,6 +259,9 @@ class DBImpl : public DB {
   // Has a background compaction been scheduled or is running?
   bool bg_compaction_scheduled_;
 
+  // Has a memtable flush been scheduled on the HIGH pool or is running?
+  bool bg_flush_scheduled_;
+
   // Information for a manual compaction
   struct ManualCompaction {
     int level;
@@ -200,6 +294,21 @@ class DBImpl : public DB {
   };
   CompactionStats stats_[config::kNumLevels];
 
+  // Level tuning state (hLSM).  The counters cover the current interval;
+  // the byte totals are those of stats_ when it started.
+  bool level_shrink_pending_;    // waiting for the new end level's copies
+  uint64_t tuning_start_micros_;
+  uint64_t tuning_seeks_;
+  uint64_t tuning_delta_seeks_;
+  int64_t tuning_write_bytes_;
+  int64_t tuning_mirror_bytes_;
+
+  // Write pacing.  flush_rate_ is a moving average of the bytes per
+  // second level-0 tables are built at; writers are charged for the size
+  // of their batch group.
+  WriteController write_controller_;
+  double flush_rate_;
+
   // No copying allowed
   DBImpl(const DBImpl&);
   void operator=(const DBImpl&);
@@ -9,6 +9,7 @@
 #include "db/dbformat.h"
 #include "leveldb/env.h"
 #include "leveldb/iterator.h"
+#include "leveldb/slice_transform.h"
 #include "port/port.h"
 #include "util/logging.h"
 #include "util/mutexlock.h"
@@ -49,13 +50,15 @@ class DBIter: public Iterator {
   };
 
   DBIter(DBImpl* db, const Comparator* cmp, Iterator* iter, SequenceNumber s,
-         uint32_t seed)
+         uint32_t seed, const SliceTransform* prefix_extractor)
       : db_(db),
         user_comparator_(cmp),
         iter_(iter),
         sequence_(s),
+        prefix_extractor_(prefix_extractor),
         direction_(kForward),
         valid_(false),
+        has_prefix_(false),
         rnd_(seed),
         bytes_counter_(RandomPeriod()) {
   }
@@ -89,6 +92,8 @@ class DBIter: public Iterator {
   void FindNextUserEntry(bool skipping, std::string* skip);
   void FindPrevUserEntry();
   bool ParseKey(ParsedInternalKey* key);
+  void CheckPrefix();
+  bool SwitchesDirection(Direction direction);
 
   inline void SaveKey(const Slice& k, std::string* dst) {
     dst->assign(k.data(), k.size());
@@ -112,12 +117,16 @@ class DBIter: public Iterator {
   const Comparator* const user_comparator_;
   Iterator* const iter_;
   SequenceNumber const sequence_;
+  // Non-NULL in prefix_same_as_start mode
+  const SliceTransform* const prefix_extractor_;
 
   Status status_;
   std::string saved_key_;     // == current key when direction_==kReverse
   std::string saved_value_;   // == current raw value when direction_==kReverse
   Direction direction_;
   bool valid_;
+  bool has_prefix_;           // Only keys with prefix_ are valid
+  std::string prefix_;
 
   Random rnd_;
   ssize_t bytes_counter_;
@@ -143,8 +152,36 @@ inline bool DBIter::ParseKey(ParsedInternalKey* ikey) {
   }
 }
 
+// In prefix mode, children of iter_ skip their tables on Seek() if the
+// tables lack the prefix, so iter_ cannot re-seek them to change direction
+inline bool DBIter::SwitchesDirection(Direction direction) {
+  if (prefix_extractor_ != NULL && direction_ != direction) {
+    status_ = Status::NotSupported(
+        "changing direction in prefix_same_as_start mode");
+    valid_ = false;
+    return true;
+  }
+  return false;
+}
+
+// In prefix mode, end at the first key without the prefix of the target
+inline void DBIter::CheckPrefix() {
+  if (valid_ && has_prefix_) {
+    Slice k = key();
+    if (!prefix_extractor_->InDomain(k) ||
+        prefix_extractor_->Transform(k) != Slice(prefix_)) {
+      valid_ = false;
+      saved_key_.clear();
+      ClearSavedValue();
+    }
+  }
+}
+
 void DBIter::Next() {
   assert(valid_);
+  if (SwitchesDirection(kForward)) {
+    return;
+  }
 
   if (direction_ == kReverse) {  // Switch directions?
     direction_ = kForward;
@@ -168,6 +205,7 @@ void DBIter::Next() {
   }
 
   FindNextUserEntry(true, &saved_key_);
+  CheckPrefix();
 }
 
 void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
@@ -204,6 +242,9 @@ void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
 
 void DBIter::Prev() {
   assert(valid_);
+  if (SwitchesDirection(kReverse)) {
+    return;
+  }
 
   if (direction_ == kForward) {  // Switch directions?
     // iter_ is pointing at the current entry.  Scan backwards until
@@ -274,12 +315,19 @@ void DBIter::FindPrevUserEntry() {
 void DBIter::Seek(const Slice& target) {
   direction_ = kForward;
   ClearSavedValue();
+  has_prefix_ = (prefix_extractor_ != NULL &&
+                 prefix_extractor_->InDomain(target));
+  if (has_prefix_) {
+    Slice prefix = prefix_extractor_->Transform(target);
+    prefix_.assign(prefix.data(), prefix.size());
+  }
   saved_key_.clear();
   AppendInternalKey(
       &saved_key_, ParsedInternalKey(target, sequence_, kValueTypeForSeek));
   iter_->Seek(saved_key_);
   if (iter_->Valid()) {
     FindNextUserEntry(false, &saved_key_ /* temporary storage */);
+    CheckPrefix();
   } else {
     valid_ = false;
   }
@@ -288,6 +336,7 @@ void DBIter::Seek(const Slice& target) {
 void DBIter::SeekToFirst() {
   direction_ = kForward;
   ClearSavedValue();
+  has_prefix_ = false;
   iter_->SeekToFirst();
   if (iter_->Valid()) {
     FindNextUserEntry(false, &saved_key_ /* temporary storage */);
@@ -299,6 +348,7 @@ void DBIter::SeekToFirst() {
 void DBIter::SeekToLast() {
   direction_ = kReverse;
   ClearSavedValue();
+  has_prefix_ = false;
   iter_->SeekToLast();
   FindPrevUserEntry();
 }
@@ -310,8 +360,10 @@ Iterator* NewDBIterator(
     const Comparator* user_key_comparator,
     Iterator* internal_iter,
     SequenceNumber sequence,
-    uint32_t seed) {
-  return new DBIter(db, user_key_comparator, internal_iter, sequence, seed);
+    uint32_t seed,
+    const SliceTransform* prefix_extractor) {
+  return new DBIter(db, user_key_comparator, internal_iter, sequence, seed,
+                    prefix_extractor);
 }
 
 }  // namespace leveldb
@@ -12,16 +12,19 @@
 namespace leveldb {
 
 class DBImpl;
+class SliceTransform;
 
 // Return a new iterator that converts internal keys (yielded by
 // "*internal_iter") that were live at the specified "sequence" number
-// into appropriate user keys.
+// into appropriate user keys.  If "prefix_extractor" is non-NULL, the
+// iterator is in ReadOptions::prefix_same_as_start mode.
 extern Iterator* NewDBIterator(
     DBImpl* db,
     const Comparator* user_key_comparator,
     Iterator* internal_iter,
     SequenceNumber sequence,
-    uint32_t seed);
+    uint32_t seed,
+    const SliceTransform* prefix_extractor = NULL);
 
 }  // namespace leveldb
 
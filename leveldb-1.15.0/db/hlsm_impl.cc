@@ -3,12 +3,14 @@
 #include "leveldb/status.h"
 #include "leveldb/hlsm.h"
 #include "leveldb/table.h"
+#include "leveldb/table_builder.h"
 #include "leveldb/options.h"
 #include "leveldb/env.h"
 
 #include "port/port_posix.h"
 #include "table/filter_block.h"
 #include "table/format.h"
+#include "table/merger.h"
 
 #include "db/memtable.h"
 #include "db/builder.h"
@@ -20,6 +22,8 @@
 #include "db/table_cache.h"
 #include "db/db_impl.h"
 #include "db/filename.h"
+#include "util/block_buffer.h"
+#include "util/mutexlock.h"
 
 
 
@@ -43,11 +47,11 @@ int Version::PreloadMetadata(int max_level, bool update_table_level) {
 		DEBUG_INFO(1, "Level %d:\t", level);
 		for (uint32_t i = 0; i < num_files; i++) {
 			if (update_table_level) {
-				hlsm::runtime::table_level.add(files[i]->number, level);
-				DEBUG_PRINT(1, "%lu[%d]\t", files[i]->number, hlsm::runtime::table_level.get(files[i]->number));
+				hlsm::runtime::placement.set_level(files[i]->number, level);
+				DEBUG_PRINT(1, "%lu[%d]\t", files[i]->number, hlsm::runtime::placement.level(files[i]->number));
 			}
 			DEBUG_INFO(3, "file %lu is in use (%d)\n", files[i]->number,
-					hlsm::runtime::FileNameHash::inuse(files[i]->number));
+					hlsm::runtime::placement.writing_secondary(files[i]->number));
 			Status s = vset_->table_cache_->PreLoadTable(files[i]->number, files[i]->file_size);
 		}
 		DEBUG_PRINT(1, "\n");
@@ -72,14 +76,14 @@ Status BasicVersionSet::MoveLevelDown(Compaction* c, port::Mutex *mutex_) {
     	c->edit()->DeleteFile(level, f->number);
     	c->edit()->AddFile(level + 1, f->number, f->file_size,
     	                       f->smallest, f->largest);
-    	hlsm::runtime::table_level.add(f->number, c->level()+1);
+    	hlsm::runtime::placement.set_level(f->number, c->level()+1);
     	DEBUG_INFO(3, "[%d/%lu] number: %lu\t size: %lu\n", i+1, num_files, f->number, f->file_size);
     }
 
     if (c->level() + 1 == hlsm::runtime::mirror_start_level) // need to copy the content to secondary
     	for(int i = 0; i < num_files; i++) {
     		leveldb::FileMetaData* f = files[i];
-    		OPQ_ADD_COPYFILE(hlsm::runtime::op_queue,
+    		OPQ_ADD_COPYFILE(hlsm::table_queue(f->number),
     			new std::string(leveldb::TableFileName(hlsm::config::primary_storage_path, f->number)), f->number );
     	}
 
@@ -97,9 +101,9 @@ Status BasicVersionSet::MoveFileDown(Compaction* c, port::Mutex *mutex_) {
 	edit->DeleteFile(level, f->number);
 	edit->AddFile(level + 1, f->number, f->file_size,
 			f->smallest, f->largest);
-	hlsm::runtime::table_level.add(f->number, level+1);
+	hlsm::runtime::placement.set_level(f->number, level+1);
 	if (level + 1 == hlsm::runtime::mirror_start_level) { // need to copy the content to secondary
-		OPQ_ADD_COPYFILE(hlsm::runtime::op_queue,
+		OPQ_ADD_COPYFILE(hlsm::table_queue(f->number),
 				new std::string(TableFileName(hlsm::config::primary_storage_path, f->number)), f->number);
 	}
 	leveldb::Status status = this->LogAndApply(c->edit(), mutex_);
@@ -142,14 +146,33 @@ struct Table::Rep {
 
   BlockHandle metaindex_handle;  // Handle to metaindex_block: saved from footer
   Block* index_block;
+
+  bool partitioned_index;
+  bool partitioned_filter;
+  size_t filter_data_size;
+
+  // Filter of the prefixes of options.prefix_extractor, if the table has
+  // one by that extractor and options.filter_policy
+  FilterBlockReader* prefix_filter;
+  const char* prefix_filter_data;
+  size_t prefix_filter_data_size;
 };
 
 RandomAccessFile* Table::PickFileHandler(Table::Rep* rep, bool is_sequential) {
 	assert(rep->primary_ != NULL || rep->secondary_ != NULL);
 	RandomAccessFile* ret = NULL;
 	Env* env = rep->options.env;
+	// a registered copy saves probing the file system on every block read
+	hlsm::TablePlacement placement = hlsm::TablePlacement();
+	bool known = false;
+	if ((hlsm::read_from_primary(is_sequential) ? rep->primary_ : rep->secondary_) == NULL) {
+		const std::string& fname = (rep->primary_ != NULL ? rep->primary_ : rep->secondary_)->GetFileName();
+		known = hlsm::runtime::placement.lookup(hlsm::table_name_to_number(fname), &placement) &&
+				placement.copies_known();
+	}
+
 	if(hlsm::read_from_primary(is_sequential)) {
-		if (rep->primary_ == NULL) {
+		if (rep->primary_ == NULL && (!known || placement.on_primary)) {
 			std::string pname = SECONDARY_TO_PRIMARY_FILE(rep->secondary_->GetFileName());
 			if (env->FileExists(pname)) {
 				Status s = env->NewRandomAccessFile(pname, &(rep->primary_));
@@ -166,9 +189,9 @@ RandomAccessFile* Table::PickFileHandler(Table::Rep* rep, bool is_sequential) {
 		ret = (rep->primary_ != NULL)? rep->primary_ : rep->secondary_;
 	} else {
 		if (hlsm::config::secondary_storage_path != NULL) {
-			if (rep->secondary_ == NULL) {
+			if (rep->secondary_ == NULL && (!known || placement.on_secondary)) {
 				std::string sname = PRIMARY_TO_SECONDARY_FILE(rep->primary_->GetFileName());
-				if (!hlsm::runtime::FileNameHash::inuse(sname) ) {
+				if (!placement.writing_secondary) {
 					DEBUG_INFO(2, "%p, %s\n", rep->primary_, rep->primary_->GetFileName().c_str());
 					if (env->FileExists(sname)) {
 						Status s = env->NewRandomAccessFile(sname, &(rep->secondary_));
@@ -203,10 +226,18 @@ RandomAccessFile* Table::PickFileHandler(bool is_sequential) {
 
 
 int Table::PrefetchTable(leveldb::RandomAccessFile* file, uint64_t size) {
+	// Pull the file into the page cache a chunk at a time through one
+	// pooled buffer instead of allocating the whole file
+	const size_t kChunk = 1 << 20;
 	leveldb::Slice buffer_input;
-	char *buffer_space = (char*)malloc(size);
-	leveldb::Status s = file->Read(0, size, &buffer_input, buffer_space);
-	free(buffer_space);
+	char *buffer_space = NewBlockBuffer(kChunk);
+	for (uint64_t offset = 0; offset < size; offset += kChunk) {
+		size_t n = std::min<uint64_t>(kChunk, size - offset);
+		leveldb::Status s = file->Read(offset, n, &buffer_input, buffer_space);
+		if (!s.ok() || buffer_input.size() < n)
+			break;
+	}
+	DeleteBlockBuffer(buffer_space, kChunk);
 	return 0;
 }
 
@@ -232,8 +263,10 @@ void DBImpl::HLSMDeleteObsoleteFiles() {
   std::set<uint64_t> live = pending_outputs_;
   versions_->AddLiveFiles(&live);
 
-  std::set<uint64_t> lazy_live = hlsm::runtime::moving_tables_;
-  std::set<uint64_t> on_the_fly = hlsm::runtime::moving_tables_;
+  std::set<uint64_t> lazy_live;
+  hlsm::runtime::placement.get_migrating(&lazy_live);
+  std::set<uint64_t> on_the_fly = lazy_live;
+  lazy_live.insert(pending_outputs_.begin(), pending_outputs_.end()); // delta merge outputs
   (reinterpret_cast<LazyVersionSet*>(versions_))->AddLiveLazyFiles(&lazy_live);
 
   std::vector<std::string> filenames;
@@ -288,164 +321,527 @@ void DBImpl::HLSMDeleteObsoleteFiles() {
     }
   }
 
-  env_->GetChildren(std::string(hlsm::config::secondary_storage_path), &filenames); // Ignoring errors on purpose
-  for (size_t i = 0; i < filenames.size(); i++) {
-    if (ParseFileName(filenames[i], &number, &type)) {
-      bool keep = true;
-      switch (type) {
-        case kTableFile:
-          keep = (lazy_live.find(number) != lazy_live.end());
-          break;
-      }
+  for (size_t p = 0; p < hlsm::runtime::secondary_paths.size(); p++) {
+    const std::string& spath = hlsm::runtime::secondary_paths[p];
+    env_->GetChildren(spath, &filenames); // Ignoring errors on purpose
+    for (size_t i = 0; i < filenames.size(); i++) {
+      if (ParseFileName(filenames[i], &number, &type)) {
+        bool keep = true;
+        switch (type) {
+          case kTableFile:
+          case kTempFile: // table migration in progress
+            keep = (lazy_live.find(number) != lazy_live.end());
+            break;
+        }
 
-      if (!keep) {
-        if (type == kTableFile && live.find(number) == live.end()) { // also not mirrored
-          table_cache_->Evict(number);
+        if (!keep) {
+          if (type == kTempFile ||
+              (type == kTableFile && live.find(number) == live.end())) { // also not mirrored
+            if (type == kTableFile) table_cache_->Evict(number);
 
-          Log(options_.info_log, "Delete on Secondary type=%d #%lld\n",
-        		  int(type), static_cast<unsigned long long>(number));
-          env_->DeleteFile(std::string(hlsm::config::secondary_storage_path) + "/" + filenames[i]);
+            Log(options_.info_log, "Delete on Secondary type=%d #%lld\n",
+              int(type), static_cast<unsigned long long>(number));
+            env_->DeleteFile(spath + "/" + filenames[i]);
+          }
         }
       }
     }
   }
 }
 
-Status DBImpl::WriteLevel0TableToLevel(MemTable* mem, VersionEdit* edit,
-                                Version* base, int level) {
+/*
+ * Delta merge: combine the delta levels filled since the last roll forward
+ * 	of a logical level into one sorted run on the secondary storage
+ *
+ * 	R(clear+1) ... R(active-1) --> R(active-1)
+ *
+ * The run replaces the merged levels through a LazyVersionEdit, so lookups
+ * 	on the lazy version probe one delta level instead of many. Entries
+ * 	shadowed by a newer entry of the same key below the oldest snapshot are
+ * 	dropped; deletion markers are kept since older delta generations and
+ * 	deeper lazy levels may still hold the key.
+ */
+Status DBImpl::MergeDeltaLevels(int llevel) {
   mutex_.AssertHeld();
   const uint64_t start_micros = env_->NowMicros();
-  FileMetaData meta;
-  meta.number = versions_->NewFileNumber();
-  pending_outputs_.insert(meta.number);
-  Iterator* iter = mem->NewIterator();
-  Log(options_.info_log, "Level-0 table #%llu: started written to level %d",
-      (unsigned long long) meta.number, level);
-  DEBUG_INFO(3, "Write to level %d [start]\n", level);
-
-  Status s;
-  {
-    mutex_.Unlock();
-    s = BuildTable(dbname_, env_, options_, table_cache_, iter, &meta);
-    mutex_.Lock();
-  }
-
-  DEBUG_INFO(3, "Write to level %d [table built]\n", level);
-
-  Log(options_.info_log, "Level-0 table #%llu: %lld bytes %s",
-      (unsigned long long) meta.number,
-      (unsigned long long) meta.file_size,
-      s.ToString().c_str());
-  delete iter;
-  pending_outputs_.erase(meta.number);
-
-
-  // Note that if file_size is zero, the file has been deleted and
-  // should not be added to the manifest.
-  if (s.ok() && meta.file_size > 0) {
-    const Slice min_user_key = meta.smallest.user_key();
-    const Slice max_user_key = meta.largest.user_key();
-    edit->AddFile(level, meta.number, meta.file_size,
-                  meta.smallest, meta.largest);
-    CALL_IF_HLSM(reinterpret_cast<LazyVersionEdit*>(edit)
-    	->AddLazyFileByRawLevel(level, meta.number, meta.file_size, meta.smallest, meta.largest,
-    			reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy() ));
+  LazyVersionSet* lvset = reinterpret_cast<LazyVersionSet*>(versions_);
+  Version* lv = lvset->current_lazy();
+  lv->Ref();
+
+  hlsm::delta_meta_t* meta = lvset->GetDeltaLevelOffsets();
+  const uint32_t clear = meta[llevel].clear;
+  std::vector<std::pair<int, FileMetaData*> > inputs;
+  int target;
+  lvset->GetDeltaMergeInputs(llevel, &inputs, &target);
+  assert(!inputs.empty());
+
+  ReadOptions ropts;
+  ropts.verify_checksums = options_.paranoid_checks;
+  ropts.fill_cache = false;
+  std::vector<Iterator*> list;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    const FileMetaData* f = inputs[i].second;
+    list.push_back(table_cache_->NewIterator(ropts, f->number, f->file_size,
+                                             NULL, false));
   }
+  Iterator* input = NewMergingIterator(&internal_comparator_, &list[0], list.size());
 
-  CompactionStats stats;
-  stats.micros = env_->NowMicros() - start_micros;
-  stats.bytes_written = meta.file_size;
-  stats_[level].Add(stats);
-  return s;
-}
+  const SequenceNumber smallest_snapshot = snapshots_.empty() ?
+      versions_->LastSequence() : snapshots_.oldest()->number_;
+  Log(options_.info_log, "Merging %d delta level files of level %d into level %d",
+      int(inputs.size()), llevel, target);
 
-int DBImpl::MaybeCompactMemTableToLevel(int level) {
-	if (imm_ == NULL)
-	  	return 0;
-	mutex_.AssertHeld();
-	mutex_.Lock();
+  std::vector<FileMetaData> outputs;
+  WritableFile* outfile = NULL;
+  TableBuilder* builder = NULL;
+  Status s;
 
-  // Save the contents of the memtable as a new Table
-  VersionEdit &edit = (*NewVersionEdit(versions_));
-  Version* base = versions_->current();
-  base->Ref();
-  Version* current_lazy = NULL;
-  CALL_IF_HLSM(current_lazy = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy());
+  mutex_.Unlock();
+  ParsedInternalKey ikey;
+  std::string current_user_key;
+  bool has_current_user_key = false;
+  SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
+  for (input->SeekToFirst(); input->Valid() && s.ok() && !shutting_down_.Acquire_Load(); input->Next()) {
+    Slice key = input->key();
+    bool new_user_key = true;
+    bool drop = false;
+    if (!ParseInternalKey(key, &ikey)) {
+      // Do not hide error keys
+      current_user_key.clear();
+      has_current_user_key = false;
+      last_sequence_for_key = kMaxSequenceNumber;
+    } else {
+      if (has_current_user_key &&
+          user_comparator()->Compare(ikey.user_key, Slice(current_user_key)) == 0) {
+        new_user_key = false;
+      } else {
+        current_user_key.assign(ikey.user_key.data(), ikey.user_key.size());
+        has_current_user_key = true;
+        last_sequence_for_key = kMaxSequenceNumber;
+      }
+      if (last_sequence_for_key <= smallest_snapshot) {
+        drop = true; // Hidden by a newer entry for same user key
+      }
+      last_sequence_for_key = ikey.sequence;
+    }
+    if (drop) {
+      continue;
+    }
 
-  CALL_IF_HLSM(current_lazy->Ref());
-  Status s = WriteLevel0TableToLevel(imm_, &edit, base, level);
-  base->Unref();
-  CALL_IF_HLSM(current_lazy->Unref());
+    // Close the current output at a user key boundary once it is full
+    if (builder != NULL && new_user_key &&
+        builder->FileSize() >= static_cast<uint64_t>(config::kTargetFileSize)) {
+      s = builder->Finish();
+      outputs.back().file_size = builder->FileSize();
+      delete builder;
+      builder = NULL;
+      if (s.ok()) s = outfile->Sync();
+      if (s.ok()) s = outfile->Close();
+      delete outfile;
+      outfile = NULL;
+    }
 
-  DEBUG_INFO(1, "To level %d\n", level);
+    if (builder == NULL && s.ok()) {
+      FileMetaData out;
+      mutex_.Lock();
+      out.number = versions_->NewFileNumber();
+      pending_outputs_.insert(out.number);
+      mutex_.Unlock();
+      outputs.push_back(out);
+      s = env_->NewWritableFile(hlsm::secondary_table_file(out.number), &outfile);
+      if (!s.ok()) {
+        break;
+      }
+      builder = new TableBuilder(options_, outfile);
+      outputs.back().smallest.DecodeFrom(key);
+    }
+    outputs.back().largest.DecodeFrom(key);
+    builder->Add(key, input->value());
+  }
 
   if (s.ok() && shutting_down_.Acquire_Load()) {
-    s = Status::IOError("Deleting DB during memtable compaction");
+    s = Status::IOError("Deleting DB during delta merge");
   }
-
-  // Replace immutable memtable with the generated Table
   if (s.ok()) {
-    edit.SetPrevLogNumber(0);
-    edit.SetLogNumber(logfile_number_);  // Earlier logs no longer needed
+    s = input->status();
+  }
+  if (builder != NULL) {
+    if (s.ok()) {
+      s = builder->Finish();
+      outputs.back().file_size = builder->FileSize();
+    } else {
+      builder->Abandon();
+    }
+    delete builder;
+    if (s.ok()) s = outfile->Sync();
+    if (s.ok()) s = outfile->Close();
+  }
+  delete outfile;
+  delete input;
+  mutex_.Lock();
+
+  // Only the background thread rolls delta levels forward, but make sure
+  //	the merged generation is still the one we read
+  const bool stale = (meta[llevel].clear != clear);
+  if (s.ok() && !stale) {
+    LazyVersionEdit* edit = reinterpret_cast<LazyVersionEdit*>(NewVersionEdit(versions_));
+    for (size_t i = 0; i < inputs.size(); i++) {
+      edit->DeleteLazyFile(inputs[i].first, inputs[i].second->number);
+    }
+    for (size_t i = 0; i < outputs.size(); i++) {
+      const FileMetaData& out = outputs[i];
+      edit->AddLazyFile(target, out.number, out.file_size, out.smallest, out.largest);
+    }
+    s = versions_->LogAndApply(edit, &mutex_);
+    delete edit;
+  }
 
-    s = versions_->LogAndApply(&edit, &mutex_);
+  for (size_t i = 0; i < outputs.size(); i++) {
+    pending_outputs_.erase(outputs[i].number);
   }
+  lv->Unref();
 
-  delete &edit;
-  if (s.ok()) {
-    // Commit to the new state
-    imm_->Unref();
-    imm_ = NULL;
-    has_imm_.Release_Store(NULL);
-    DeleteObsoleteFiles();
-
-    // delete leftover kv-pairs to avoid key range overlapping
-    mem_->Unref();
-    mem_ = new MemTable(internal_comparator_);
-    mem_->Ref();
-    mutex_.Unlock();
-    return 1;
+  if (s.ok() && !stale) {
+    InstallSuperVersion();
+    for (size_t i = 0; i < outputs.size(); i++) {
+      HLSM_COUNT(hlsm::metrics::kDeltaMergeBytes, outputs[i].file_size);
+    }
+    Log(options_.info_log, "Merged delta levels of level %d into %d files: %lld micros",
+        llevel, int(outputs.size()),
+        static_cast<long long>(env_->NowMicros() - start_micros));
   } else {
-    RecordBackgroundError(s);
+    for (size_t i = 0; i < outputs.size(); i++) {
+      env_->DeleteFile(hlsm::secondary_table_file(outputs[i].number));
+    }
   }
+  DeleteObsoleteFiles();
+  return s;
+}
 
-  mutex_.Unlock();
-  return 0;
+int DBImpl::DeltaMergeLevel() const {
+  if (!hlsm::config::mode.ishLSM())
+    return -1;
+  return reinterpret_cast<LazyVersionSet*>(versions_)->DeltaMergeLevel();
 }
 
-int DBImpl::AdvanceHLSMActiveDeltaLevel(int level) {
-	if(!hlsm::config::mode.ishLSM())
-			return 0;
+/*
+ * Level tuning: move the end of two-phase compaction by one logical level
+ * 	at a time, as decided by hlsm::tune_two_phase_end_level()
+ *
+ * 	later:   the mirrored copies of the next level become its deltas, in
+ * 	         the same edit
+ * 	earlier: the tables of the new end level are mirrored from now on and
+ * 	         the existing ones copied to the secondary; once all copies are
+ * 	         there, one edit swaps the deltas of the old end level for the
+ * 	         mirrored copies
+ */
+void DBImpl::ResetLevelTuning() {
+  mutex_.AssertHeld();
+  tuning_start_micros_ = env_->NowMicros();
+  tuning_seeks_ = 0;
+  tuning_delta_seeks_ = 0;
+  tuning_write_bytes_ = 0;
+  tuning_mirror_bytes_ = 0;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    tuning_write_bytes_ += stats_[level].bytes_written;
+    if (level >= hlsm::runtime::mirror_start_level) {
+      tuning_mirror_bytes_ += stats_[level].bytes_written;
+    }
+  }
+}
 
-	mutex_.AssertHeld();
-	mutex_.Lock();
+bool DBImpl::LevelTuningDue() {
+  mutex_.AssertHeld();
+  if (!hlsm::config::mode.ishLSM() || hlsm::config::level_tuning_interval <= 0 ||
+      level_shrink_pending_) {
+    return false;
+  }
+  return env_->NowMicros() >= tuning_start_micros_ +
+      static_cast<uint64_t>(hlsm::config::level_tuning_interval) * 1000000;
+}
 
-  VersionEdit* edit = NewVersionEdit(versions_);
-  Version* base = versions_->current();
-  base->Ref();
-  Version* current_lazy = NULL;
-  current_lazy = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy();
+bool DBImpl::MaybeTuneLevels() {
+  mutex_.AssertHeld();
+  if (!hlsm::config::mode.ishLSM() || hlsm::config::level_tuning_interval <= 0) {
+    return false;
+  }
+  LazyVersionSet* lvset = reinterpret_cast<LazyVersionSet*>(versions_);
+  const int level = hlsm::runtime::two_phase_end_level;
+  Status s;
 
-  current_lazy->Ref();
+  if (!level_shrink_pending_) {
+    if (!LevelTuningDue()) {
+      return false;
+    }
+    hlsm::LevelTuning t;
+    lvset->GetLevelTuning(&t);
+    t.capacity = (hlsm::config::secondary_capacity_mb > 0) ?
+        static_cast<uint64_t>(hlsm::config::secondary_capacity_mb) * 1048576 :
+        t.used + hlsm::secondary_free_bytes();
+    t.seeks = tuning_seeks_;
+    t.delta_seeks = tuning_delta_seeks_;
+    int64_t write_bytes = 0, mirror_bytes = 0;
+    for (int l = 0; l < config::kNumLevels; l++) {
+      write_bytes += stats_[l].bytes_written;
+      if (l >= hlsm::runtime::mirror_start_level) {
+        mirror_bytes += stats_[l].bytes_written;
+      }
+    }
+    t.write_bytes = write_bytes - tuning_write_bytes_;
+    t.mirror_bytes = mirror_bytes - tuning_mirror_bytes_;
+
+    const int step = hlsm::tune_two_phase_end_level(t);
+    Log(options_.info_log, "Level tuning at level %d: %llu of %llu bytes on the "
+        "secondary, %lld to gain, %llu/%llu delta seeks, %llu/%llu mirrored bytes: %d",
+        level, (unsigned long long) t.used, (unsigned long long) t.capacity,
+        (long long) t.shrink_gain,
+        (unsigned long long) t.delta_seeks, (unsigned long long) t.seeks,
+        (unsigned long long) t.mirror_bytes, (unsigned long long) t.write_bytes,
+        step);
+    ResetLevelTuning();
+    if (step == 0) {
+      return false;
+    } else if (step > 0) {
+      s = lvset->ExtendTwoPhase(&mutex_);
+    } else {
+      // New tables of the future end level go to the secondary right away
+      hlsm::runtime::mirror_start_level = 2 * (level - 1);
+      level_shrink_pending_ = true;
+    }
+  }
+
+  if (level_shrink_pending_) {
+    if (!lvset->CopyMirrorLevels()) {
+      return false;
+    }
+    s = lvset->ShrinkTwoPhase(&mutex_);
+    level_shrink_pending_ = false;
+  }
 
-  int ok = reinterpret_cast<LazyVersionEdit*>(edit)->AdvanceActiveDeltaLevelByRawLevel(level);
-  base->Unref();
-  current_lazy->Unref();
+  Log(options_.info_log, "Two-phase compaction ends at level %d instead of %d: %s",
+      hlsm::runtime::two_phase_end_level, level, s.ToString().c_str());
+  if (!s.ok()) {
+    hlsm::runtime::mirror_start_level = 2 * hlsm::runtime::two_phase_end_level;
+    RecordBackgroundError(s);
+    return false;
+  }
+  ResetLevelTuning();
+  DeleteObsoleteFiles();
+  return true;
+}
 
-  DEBUG_INFO(1, "Advance delta level of level %d\n", level);
+Status DBImpl::TEST_MoveTwoPhaseEndLevel(int step) {
+  MutexLock l(&mutex_);
+  LazyVersionSet* lvset = reinterpret_cast<LazyVersionSet*>(versions_);
+  if (step < 0) {
+    hlsm::runtime::mirror_start_level = 2 * (hlsm::runtime::two_phase_end_level - 1);
+  }
+  Status s;
+  while (true) {
+    // Only one thread may be in LogAndApply()
+    while ((bg_compaction_scheduled_ || bg_flush_scheduled_) && bg_error_.ok()) {
+      bg_cv_.Wait();
+    }
+    if (!bg_error_.ok()) {
+      s = bg_error_;
+      break;
+    }
+    if (step > 0) {
+      s = lvset->ExtendTwoPhase(&mutex_);
+      break;
+    }
+    if (lvset->CopyMirrorLevels()) {
+      s = lvset->ShrinkTwoPhase(&mutex_);
+      break;
+    }
+    mutex_.Unlock();
+    env_->SleepForMicroseconds(1000);
+    mutex_.Lock();
+  }
+  if (!s.ok()) {
+    hlsm::runtime::mirror_start_level = 2 * hlsm::runtime::two_phase_end_level;
+    return s;
+  }
+  InstallSuperVersion();
+  DeleteObsoleteFiles();
+  return s;
+}
 
+/*
+ * Properties
+ *
+ * hlsm.metrics      counters and latencies of hlsm_metrics.h
+ * hlsm.io-stats     I/O per device and level, and the amplification
+ * hlsm.lazy-levels  lazy levels of the current lazy version (hLSM only)
+ * hlsm.queue-stats  operations queued for the helpers and pending migrations
+ * hlsm.delayed-write-rate  bytes per second writers are paced at, 0 if none
+ */
+static void AppendLatency(const hlsm::metrics::Stats& stats, std::string* out) {
+  char buf[40];
+  if (stats.count == 0) {
+    snprintf(buf, sizeof(buf), " %17s", "-");
+  } else {
+    snprintf(buf, sizeof(buf), " %8.1f/%8.1f", hlsm::metrics::Percentile(stats, 50),
+             hlsm::metrics::Percentile(stats, 99));
+  }
+  out->append(buf);
+}
 
-  // Replace immutable memtable with the generated Table
-  if (ok) {
-    edit->SetPrevLogNumber(0);
-    edit->SetLogNumber(logfile_number_);  // Earlier logs no longer needed
+bool DBImpl::GetHlsmProperty(const Slice& property, std::string* value) {
+  using namespace hlsm::metrics;
+  char buf[200];
+
+  if (property == Slice("hlsm.metrics")) {
+    Report(value);
+    return true;
+
+  } else if (property == Slice("hlsm.io-stats")) {
+    IoStats* io = new IoStats;
+    GetIo(io);
+    uint64_t device_bytes[kMaxDevices][kNumIoOps];
+    uint64_t total[kNumIoOps] = { 0, 0, 0 };
+    bool used[kMaxDevices];
+    int devices = 0;
+    for (int d = 0; d < kMaxDevices; d++) {
+      used[d] = false;
+      for (int op = 0; op < kNumIoOps; op++) {
+        uint64_t ops = 0;
+        device_bytes[d][op] = 0;
+        for (int l = 0; l < kNumIoLevels; l++) {
+          ops += io->ops[d][l][op];
+          device_bytes[d][op] += io->bytes[d][l][op];
+        }
+        total[op] += device_bytes[d][op];
+        used[d] = used[d] || ops > 0;
+      }
+      if (used[d]) devices = d + 1;
+    }
 
-    versions_->LogAndApply(edit, &mutex_);
+    value->append("Device                          Ops(read/write/sync)  Read(MB) Write(MB)"
+                  "  Read p50/p99(us)  Write p50/p99(us)   Sync p50/p99(us)\n"
+                  "------------------------------------------------------------------"
+                  "---------------------------------------------------------\n");
+    for (int d = 0; d < devices; d++) {
+      std::string name;
+      if (d == 0) {
+        name = hlsm::config::primary_storage_path != NULL ?
+            hlsm::config::primary_storage_path : dbname_;
+      } else if (d - 1 < static_cast<int>(hlsm::runtime::secondary_paths.size())) {
+        name = hlsm::runtime::secondary_paths[d - 1];
+      }
+      uint64_t ops[kNumIoOps] = { 0, 0, 0 };
+      for (int l = 0; l < kNumIoLevels; l++) {
+        for (int op = 0; op < kNumIoOps; op++) {
+          ops[op] += io->ops[d][l][op];
+        }
+      }
+      snprintf(buf, sizeof(buf), "%d %-24.24s %9llu/%9llu/%6llu %9.1f %9.1f",
+               d, name.c_str(), (unsigned long long) ops[kIoRead],
+               (unsigned long long) ops[kIoWrite], (unsigned long long) ops[kIoSync],
+               device_bytes[d][kIoRead] / 1048576.0, device_bytes[d][kIoWrite] / 1048576.0);
+      value->append(buf);
+      for (int op = 0; op < kNumIoOps; op++) {
+        AppendLatency(io->latency[d][op], value);
+      }
+      value->append("\n");
+    }
+
+    // Read and written MB per level, a pair of columns per device
+    value->append("\nLevel    ");
+    for (int d = 0; d < devices; d++) {
+      snprintf(buf, sizeof(buf), "   Read(MB)@%d  Write(MB)@%d", d, d);
+      value->append(buf);
+    }
+    value->append("\n");
+    for (int l = 0; l < kNumIoLevels; l++) {
+      bool any = false;
+      for (int d = 0; d < devices; d++) {
+        for (int op = 0; op < kNumIoOps; op++) {
+          any = any || io->ops[d][l][op] > 0;
+        }
+      }
+      if (!any) continue;
+      if (l == kLogIoLevel) {
+        snprintf(buf, sizeof(buf), "%-9s", "log");
+      } else if (l == kMetaIoLevel) {
+        snprintf(buf, sizeof(buf), "%-9s", "other");
+      } else if (l == kUnleveledIoLevel) {
+        snprintf(buf, sizeof(buf), "%-9s", "unleveled");
+      } else if (hlsm::config::mode.ishLSM()) {
+        snprintf(buf, sizeof(buf), "L%-2d(LL%d)", l, hlsm::get_logical_level(l));
+      } else {
+        snprintf(buf, sizeof(buf), "L%-8d", l);
+      }
+      value->append(buf);
+      for (int d = 0; d < devices; d++) {
+        snprintf(buf, sizeof(buf), " %12.1f %12.1f", io->bytes[d][l][kIoRead] / 1048576.0,
+                 io->bytes[d][l][kIoWrite] / 1048576.0);
+        value->append(buf);
+      }
+      value->append("\n");
+    }
+
+    // Bytes moved by the devices per byte the user read or wrote
+    Stats user_read, user_write;
+    hlsm::metrics::Get(kUserReadBytes, &user_read);
+    hlsm::metrics::Get(kUserWriteBytes, &user_write);
+    snprintf(buf, sizeof(buf), "\nUser: read %.1f MB, written %.1f MB\n",
+             user_read.sum / 1048576.0, user_write.sum / 1048576.0);
+    value->append(buf);
+    snprintf(buf, sizeof(buf), "Write amplification: %.2f",
+             user_write.sum > 0 ? double(total[kIoWrite]) / user_write.sum : 0.0);
+    value->append(buf);
+    for (int d = 0; d < devices && user_write.sum > 0; d++) {
+      snprintf(buf, sizeof(buf), "%s%d: %.2f", d == 0 ? " (" : ", ", d,
+               double(device_bytes[d][kIoWrite]) / user_write.sum);
+      value->append(buf);
+    }
+    value->append(user_write.sum > 0 && devices > 0 ? ")\n" : "\n");
+    snprintf(buf, sizeof(buf), "Read amplification: %.2f\n",
+             user_read.sum > 0 ? double(total[kIoRead]) / user_read.sum : 0.0);
+    value->append(buf);
+    delete io;
+    return true;
+
+  } else if (property == Slice("hlsm.lazy-levels")) {
+    if (!hlsm::config::mode.ishLSM()) {
+      return false;
+    }
+    MutexLock l(&mutex_);
+    reinterpret_cast<LazyVersionSet*>(versions_)->LazyLevelSummary(value);
+    return true;
+
+  } else if (property == Slice("hlsm.queue-stats")) {
+    if (hlsm::runtime::op_queue != NULL) {
+      snprintf(buf, sizeof(buf), "op_queue: %lu, hop_queue: %lu\n",
+               (unsigned long) OPQ_GET_LENGTH(hlsm::runtime::op_queue),
+               (unsigned long) OPQ_GET_LENGTH(hlsm::runtime::hop_queue));
+      value->append(buf);
+    }
+    for (size_t i = 0; i < hlsm::runtime::device_queues.size(); i++) {
+      snprintf(buf, sizeof(buf), "%s: %lu\n",
+               i < hlsm::runtime::secondary_paths.size() ?
+                   hlsm::runtime::secondary_paths[i].c_str() : "?",
+               (unsigned long) OPQ_GET_LENGTH(hlsm::runtime::device_queues[i]));
+      value->append(buf);
+    }
+    std::set<uint64_t> migrating;
+    hlsm::runtime::placement.get_migrating(&migrating);
+    snprintf(buf, sizeof(buf), "migrations: %d, %.1f MB to copy\n",
+             int(migrating.size()),
+             hlsm::runtime::placement.migration_pending_bytes() / 1048576.0);
+    value->append(buf);
+    return true;
+
+  } else if (property == Slice("hlsm.delayed-write-rate")) {
+    MutexLock l(&mutex_);
+    snprintf(buf, sizeof(buf), "%llu",
+             (unsigned long long) write_controller_.delayed_write_rate());
+    value->append(buf);
+    return true;
   }
 
-  delete edit;
-  mutex_.Unlock();
-  return 0;
+  return false;
 }
 
 } // namespace leveldb
@@ -530,7 +926,10 @@ int init(leveldb::Env* env_) {
 		meta_on_primary = false;
 		log_on_primary = false;
 		use_opq_thread = true;
-		two_phase_end_level = 6; // cursor (logical) level; level starts at 0
+		// cursor (logical) level; level starts at 0. LazyVersionSet::Recover()
+		//	replaces it with the level recorded in the MANIFEST
+		two_phase_end_level = std::max(1, std::min(hlsm::config::two_phase_end_level,
+				kMaxTwoPhaseEndLevel));
 		mirror_start_level = two_phase_end_level * 2; // physical level on primary storage
 		leveldb::config::kMaxMemCompactLevel = 0; // do not write memtable to levels other than 0
 		if (hlsm::config::secondary_storage_path == NULL) {
@@ -542,8 +941,12 @@ int init(leveldb::Env* env_) {
 		exit(0);
 	}
 
-	if (use_opq_thread)
+	hlsm::init_secondary_paths();
+	if (use_opq_thread) {
 		hlsm::init_opq_helpler();
+		if (secondary_paths.size() > 1) // a helper per device, and one for op_queue
+			env_->SetBackgroundThreads(secondary_paths.size() + 1, leveldb::Env::IO);
+	}
 
 	runtime::kMinBytesPerSeek = 1; //config::kMinKBPerSeek * 1024;
 
@@ -570,54 +973,6 @@ bool DeltaLevelMeta::is_valid_detla_meta() {
 		   active <= hlsm::runtime::delta_level_num;
 }
 
-int TableLevel::get(uint64_t key){
-	mutex_.Lock();
-	int value;
-	if (mapping_.find(key) == mapping_.end())
-		value = -1;
-	else
-		value = mapping_.find(key)->second;
-	mutex_.Unlock();
-	return value;
-}
-
-uint64_t TableLevel::getLatest() {
-	return latest;
-}
-
-int TableLevel::add(uint64_t key, int raw_level){
-	DEBUG_INFO(3, "level: %d\tfile number: %lu\n", raw_level, key);
-	mutex_.Lock();
-	mapping_[key] = raw_level;
-	latest = key;
-	mutex_.Unlock();
-	return 0;
-}
-
-int TableLevel::remove(uint64_t key){
-	mutex_.Lock();
-	DEBUG_INFO(2, "file number: %lu\n", key);
-	mapping_.erase(key);
-	mutex_.Unlock();
-	return 0;
-}
-
-bool TableLevel::withinMirroredLevel(uint64_t key){
-	int level = get(key);
-	if (level == -1) return false;
-	DEBUG_INFO(2, "file number: %lu\tlevel: %d\n", key, level);
-	return (level >= runtime::mirror_start_level ||
-		level <= runtime::top_mirror_end_level); // <=1 for hLSM-tree 2-phase compaction
-}
-
-bool TableLevel::withinPureMirroredLevel(uint64_t key){
-	int level = get(key);
-	if (level == -1) return false;
-	DEBUG_INFO(2, "file number: %lu\tlevel: %d\n", key, level);
-	return (level >= runtime::mirror_start_level ||
-			level <= runtime::top_pure_mirror_end_level); // delete obsolete level 0 file on secondary
-}
-
 /*
  * hlsm_impl.h
  */
@@ -625,7 +980,7 @@ bool TableLevel::withinPureMirroredLevel(uint64_t key){
 int delete_secondary_table(leveldb::Env* const env, uint64_t number) {
 	if (hlsm::config::secondary_storage_path == NULL)
 		return 0;
-	std::string fname = leveldb::TableFileName(hlsm::config::secondary_storage_path, number);
+	std::string fname = hlsm::secondary_table_file(number);
 	if (env->FileExists(fname))
 		env->DeleteFile(fname);
 	return 0;
@@ -634,10 +989,10 @@ int delete_secondary_table(leveldb::Env* const env, uint64_t number) {
 // proper = true implies getting the proper file
 std::string get_table_path(uint64_t number, bool is_seq, bool proper) {
 	bool from_primary = read_from_primary(is_seq);
-	if ( (from_primary && proper) || (!from_primary && !proper) || hlsm::runtime::FileNameHash::inuse(number))
+	if ( (from_primary && proper) || (!from_primary && !proper) || hlsm::runtime::placement.writing_secondary(number))
 		return leveldb::TableFileName(hlsm::config::primary_storage_path, number);
 	else
-		return leveldb::TableFileName(hlsm::config::secondary_storage_path, number);
+		return hlsm::secondary_table_file(number);
 }
 
 
@@ -44,7 +44,7 @@ int preload_metadata(leveldb::VersionSet*);
 
 namespace cursor {
 
-inline double calculate_compaction_score(int level, std::vector<leveldb::FileMetaData*> files[]) {
+inline double calculate_compaction_score(int level, const leveldb::LevelFiles files[]) {
 	assert(level > 0);
 	double score = 0;
 	if (files[level].size() == 0)
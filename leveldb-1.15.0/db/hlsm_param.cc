@@ -23,6 +23,9 @@ int kMinKBPerSeek = 16;
 int kMaxLevel = -1;
 int MmapLimit = 1024;
 int kL0_StopWritesTrigger = 0;
+int delayed_write_rate_kb = 0;
+int soft_pending_compaction_mb = 1024;
+int hard_pending_compaction_mb = 4096;
 
 const char *primary_storage_path = NULL;
 const char *secondary_storage_path = NULL;
@@ -31,6 +34,7 @@ bool secondary_use_buffer_file = true;
 bool lazy_sync_on_secondary = false;
 bool run_compaction = true;
 bool iterator_prefetch = false;
+int max_readahead_kb = 256;
 bool raw_prefetch = false;
 bool append_by_opq = false;
 bool use_mmap_file = false;
@@ -39,21 +43,34 @@ double restrict_L0_score = 0;
 
 int debug_level = 0;
 char* debug_file = NULL;
+bool collect_metrics = false;
 
 int bloom_bits_use = -1;
+
+int delta_merge_trigger = 8;
+int delta_merge_overlap_trigger = 4;
+
+int migration_chunk_size = 1048576;
+
+int two_phase_end_level = 6;
+int level_tuning_interval = 0;
+int secondary_capacity_mb = 0;
+double secondary_high_watermark = 0.9;
+double secondary_low_watermark = 0.6;
 } //config
 
 namespace runtime {
 leveldb::Env* env_ = NULL;
 
-pthread_t *opq_helper = NULL;
 opq op_queue = NULL;
 opq hop_queue = NULL;
+std::vector<std::string> secondary_paths;
+std::vector<opq> device_queues;
 
 FILE *debug_fd = stderr;
 leveldb::port::Mutex debug_mutex_;
-hlsm::NamedCounter counters;
 hlsm::Throttler *compaction_throttler = NULL;
+hlsm::Throttler *migration_throttler = NULL;
 
 bool delete_primary_only = false;
 
@@ -74,9 +91,7 @@ int kMinBytesPerSeek = 16384;
 
 int two_phase_end_level = 0;
 
-TableLevel table_level;
-uint32_t FileNameHash::hash[] = {0};
-std::set<uint64_t> moving_tables_;
+PlacementRegistry placement;
 
 } // runtime
 
@@ -1,9 +1,155 @@
+#include <algorithm>
+#include <math.h>
+#include <map>
+#include <vector>
+#include "util/logging.h"
+#include "util/mutexlock.h"
 #include "util/testharness.h"
+#include "util/random.h"
+#include "util/testutil.h"
+#include "db/db_impl.h"
+#include "db/filename.h"
+#include "db/hlsm_impl.h"
+#include "db/dbformat.h"
 #include "db/lazy_version_edit.h"
+#include "db/lazy_version_set.h"
+#include "db/log_reader.h"
+#include "db/table_cache.h"
+#include "db/version_set.h"
+#include "leveldb/bulk_load.h"
+#include "leveldb/cache.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/hlsm.h"
+#include "leveldb/table_builder.h"
+#include "table/format.h"
 
 using namespace leveldb;
 namespace hlsm {
 
+/*
+ * hLSM mode
+ */
+
+// Databases opened in its lifetime run in hLSM mode at dbname, with a
+// secondary directory next to it.  DB::Open() sets the runtime flags of
+// the mode and Default mode does not reset all of them, so they are
+// restored on the way out.
+class HlsmMode {
+ public:
+  explicit HlsmMode(const std::string& dbname)
+      : primary_(dbname), secondary_(dbname + "_secondary"),
+        mode_(config::mode),
+        primary_path_(config::primary_storage_path),
+        secondary_path_(config::secondary_storage_path),
+        secondary_paths_(runtime::secondary_paths),
+        full_mirror_(runtime::full_mirror),
+        mirror_start_level_(runtime::mirror_start_level),
+        top_mirror_end_level_(runtime::top_mirror_end_level),
+        top_pure_mirror_end_level_(runtime::top_pure_mirror_end_level),
+        use_cursor_compaction_(runtime::use_cursor_compaction),
+        seqential_read_from_primary_(runtime::seqential_read_from_primary),
+        random_read_from_primary_(runtime::random_read_from_primary),
+        meta_on_primary_(runtime::meta_on_primary),
+        log_on_primary_(runtime::log_on_primary),
+        use_opq_thread_(runtime::use_opq_thread),
+        two_phase_end_level_(runtime::two_phase_end_level),
+        max_mem_compact_level_(leveldb::config::kMaxMemCompactLevel),
+        config_two_phase_end_level_(config::two_phase_end_level),
+        l0_size_(leveldb::config::kL0_Size),
+        level_ratio_(leveldb::config::kLevelRatio),
+        target_file_size_(leveldb::config::kTargetFileSize),
+        delta_merge_trigger_(config::delta_merge_trigger),
+        delta_merge_overlap_trigger_(config::delta_merge_overlap_trigger) {
+    config::mode = DBMode(hLSM);
+    config::primary_storage_path = primary_.c_str();
+    config::secondary_storage_path = secondary_.c_str();
+    runtime::secondary_paths.clear();
+    Destroy();
+    Env::Default()->CreateDir(secondary_);
+  }
+
+  ~HlsmMode() {
+    Destroy();
+    config::mode = mode_;
+    config::primary_storage_path = primary_path_;
+    runtime::secondary_paths = secondary_paths_;
+    config::secondary_storage_path = secondary_paths_.empty() ?
+        secondary_path_ : runtime::secondary_paths[0].c_str();
+    runtime::full_mirror = full_mirror_;
+    runtime::mirror_start_level = mirror_start_level_;
+    runtime::top_mirror_end_level = top_mirror_end_level_;
+    runtime::top_pure_mirror_end_level = top_pure_mirror_end_level_;
+    runtime::use_cursor_compaction = use_cursor_compaction_;
+    runtime::seqential_read_from_primary = seqential_read_from_primary_;
+    runtime::random_read_from_primary = random_read_from_primary_;
+    runtime::meta_on_primary = meta_on_primary_;
+    runtime::log_on_primary = log_on_primary_;
+    runtime::use_opq_thread = use_opq_thread_;
+    runtime::two_phase_end_level = two_phase_end_level_;
+    leveldb::config::kMaxMemCompactLevel = max_mem_compact_level_;
+    config::two_phase_end_level = config_two_phase_end_level_;
+    leveldb::config::kL0_Size = l0_size_;
+    leveldb::config::kLevelRatio = level_ratio_;
+    leveldb::config::kTargetFileSize = target_file_size_;
+    config::delta_merge_trigger = delta_merge_trigger_;
+    config::delta_merge_overlap_trigger = delta_merge_overlap_trigger_;
+  }
+
+  // Levels of 1MB, 4MB, ... in tables of 32KB, so that a few MB of writes
+  // reach the delta levels; two-phase compaction ends at logical level
+  // end_level
+  void UseSmallLevels(int end_level) {
+    leveldb::config::kL0_Size = 1;
+    leveldb::config::kLevelRatio = 4;
+    leveldb::config::kTargetFileSize = 32 << 10;
+    config::two_phase_end_level = end_level;
+  }
+
+  // Remove the database from both directories
+  void Destroy() {
+    DestroyDB(primary_, Options());
+    Env* env = Env::Default();
+    std::vector<std::string> children;
+    env->GetChildren(secondary_, &children);
+    for (size_t i = 0; i < children.size(); i++) {
+      env->DeleteFile(secondary_ + "/" + children[i]);
+    }
+  }
+
+ private:
+  const std::string primary_, secondary_;
+  const DBMode mode_;
+  const char* primary_path_;
+  const char* secondary_path_;
+  const std::vector<std::string> secondary_paths_;
+  const bool full_mirror_;
+  const int mirror_start_level_;
+  const int top_mirror_end_level_;
+  const int top_pure_mirror_end_level_;
+  const bool use_cursor_compaction_;
+  const bool seqential_read_from_primary_;
+  const bool random_read_from_primary_;
+  const bool meta_on_primary_;
+  const bool log_on_primary_;
+  const bool use_opq_thread_;
+  const int two_phase_end_level_;
+  const int max_mem_compact_level_;
+  const int config_two_phase_end_level_;
+  const int l0_size_;
+  const int level_ratio_;
+  const int target_file_size_;
+  const int delta_merge_trigger_;
+  const int delta_merge_overlap_trigger_;
+};
+
+static std::string BulkKey(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return buf;
+}
+
 /*
  * LazyVersionEdit
  */
@@ -42,6 +188,8 @@ TEST(VersionEditTest, EncodeDecode) {
   edit.SetNextFile(kBig + 200);
   edit.SetLastSequence(kBig + 1000);
   TestEncodeDecode(edit);
+  edit.SetTwoPhaseEndLevel(3);
+  TestEncodeDecode(edit);
 }
 
 
@@ -49,6 +197,1541 @@ TEST(VersionEditTest, EncodeDecode) {
  * LazyVersionSet
  */
 
+// The VersionSet of hlsm::config::mode over a new database at dbname, for
+// edits of made-up tables.  config::primary_storage_path must be dbname.
+class VersionSetHarness {
+ public:
+  explicit VersionSetHarness(const std::string& dbname)
+      : dbname_(dbname), icmp_(BytewiseComparator()) {
+    options_.create_if_missing = true;
+    DestroyDB(dbname_, options_);
+    DB* db;
+    ASSERT_OK(DB::Open(options_, dbname_, &db));
+    delete db;
+    options_.comparator = &icmp_;
+    table_cache_ = new TableCache(dbname_, &options_, 100);
+    vset_ = NewVersionSet(dbname_, &options_, table_cache_, &icmp_);
+    ASSERT_OK(vset_->Recover());
+  }
+
+  ~VersionSetHarness() {
+    delete vset_;
+    delete table_cache_;
+    options_.comparator = BytewiseComparator();
+    DestroyDB(dbname_, options_);
+  }
+
+  VersionSet* vset() { return vset_; }
+  port::Mutex* mu() { return &mu_; }
+
+  // Recover a new VersionSet from the MANIFEST; its first edit writes a
+  // new MANIFEST that starts with a snapshot
+  void Reopen() {
+    delete vset_;
+    vset_ = NewVersionSet(dbname_, &options_, table_cache_, &icmp_);
+    ASSERT_OK(vset_->Recover());
+  }
+
+  VersionEdit* NewEdit() { return NewVersionEdit(vset_); }
+
+  // Add a table of "size" bytes holding user keys [smallest, largest]
+  uint64_t AddFile(VersionEdit* edit, int level, uint64_t size,
+                   const std::string& smallest, const std::string& largest) {
+    const uint64_t number = vset_->NewFileNumber();
+    edit->AddFile(level, number, size, InternalKey(smallest, 100, kTypeValue),
+                  InternalKey(largest, 100, kTypeValue));
+    return number;
+  }
+
+  // Apply and delete *edit
+  Status Apply(VersionEdit* edit) {
+    MutexLock l(&mu_);
+    Status s = vset_->LogAndApply(edit, &mu_);
+    delete edit;
+    return s;
+  }
+
+ private:
+  const std::string dbname_;
+  const InternalKeyComparator icmp_;
+  Options options_;
+  port::Mutex mu_;
+  TableCache* table_cache_;
+  VersionSet* vset_;
+};
+
+
+class LazyVersionSetTest { };
+
+TEST(LazyVersionSetTest, SharedLevelFiles) {
+  const std::string dbname = test::TmpDir() + "/hlsm_level_files";
+  config::primary_storage_path = dbname.c_str();
+  {
+    VersionSetHarness h(dbname);
+    VersionEdit* edit = h.NewEdit();
+    h.AddFile(edit, 2, 1000, "a", "b");
+    h.AddFile(edit, 3, 1000, "a", "b");
+    ASSERT_OK(h.Apply(edit));
+    Version* v1 = h.vset()->current();
+    v1->Ref();
+
+    // Only the level an edit touches gets its own list
+    edit = h.NewEdit();
+    h.AddFile(edit, 3, 1000, "c", "d");
+    ASSERT_OK(h.Apply(edit));
+    Version* v2 = h.vset()->current();
+    v2->Ref();
+    ASSERT_TRUE(v1->TEST_LevelFiles(2).SharedWith(v2->TEST_LevelFiles(2)));
+    ASSERT_TRUE(!v1->TEST_LevelFiles(3).SharedWith(v2->TEST_LevelFiles(3)));
+    ASSERT_EQ(1, v1->NumFiles(3));
+    ASSERT_EQ(2, v2->NumFiles(3));
+
+    // Deleting from a shared list leaves the older Version alone
+    edit = h.NewEdit();
+    edit->DeleteFile(2, v1->TEST_LevelFiles(2)[0]->number);
+    ASSERT_OK(h.Apply(edit));
+    Version* v3 = h.vset()->current();
+    ASSERT_EQ(1, v1->NumFiles(2));
+    ASSERT_EQ(0, v3->NumFiles(2));
+    ASSERT_TRUE(v2->TEST_LevelFiles(3).SharedWith(v3->TEST_LevelFiles(3)));
+    v1->Unref();
+    ASSERT_EQ(1, v2->NumFiles(2));
+    ASSERT_EQ(2, v3->NumFiles(3));
+    v2->Unref();
+  }
+  config::primary_storage_path = NULL;
+}
+
+TEST(LazyVersionSetTest, ChunkedSnapshot) {
+  const std::string dbname = test::TmpDir() + "/hlsm_chunked_snapshot";
+  HlsmMode mode(dbname);
+  VersionSetHarness h(dbname);
+
+  // Enough lazy files for several snapshot records
+  const int kFiles = 2500;
+  LazyVersionEdit* edit = reinterpret_cast<LazyVersionEdit*>(h.NewEdit());
+  for (int i = 0; i < kFiles; i++) {
+    const uint64_t number = h.vset()->NewFileNumber();
+    const int level = (i % 2 == 0) ? 1 : get_pure_mirror_level(14);
+    edit->AddLazyFile(level, number, 1000,
+                      InternalKey(BulkKey(2 * i), 100, kTypeValue),
+                      InternalKey(BulkKey(2 * i + 1), 100, kTypeValue));
+  }
+  h.AddFile(edit, 1, 1000, "a", "b");
+  edit->AdvanceActiveDeltaLevel(1);
+  ASSERT_OK(h.Apply(edit));
+  LazyVersionSet* vset = reinterpret_cast<LazyVersionSet*>(h.vset());
+  const std::string files = vset->current()->DebugString();
+  const std::string lazy_files = vset->current_lazy()->DebugString();
+  std::string summary;
+  vset->LazyLevelSummary(&summary);
+
+  // The new MANIFEST holds the snapshot in several records
+  h.Reopen();
+  ASSERT_OK(h.Apply(h.NewEdit()));
+  std::string current;
+  ASSERT_OK(ReadFileToString(Env::Default(), CurrentFileName(dbname),
+                             &current));
+  current.resize(current.size() - 1);
+  SequentialFile* file;
+  ASSERT_OK(Env::Default()->NewSequentialFile(dbname + "/" + current, &file));
+  {
+    log::Reader reader(file, NULL, true, 0);
+    Slice record;
+    std::string scratch;
+    int records = 0;
+    while (reader.ReadRecord(&record, &scratch)) records++;
+    ASSERT_EQ(1 + (kFiles + 1023) / 1024 + 1, records);
+  }
+  delete file;
+
+  // and recovers to the same state
+  h.Reopen();
+  vset = reinterpret_cast<LazyVersionSet*>(h.vset());
+  ASSERT_EQ(files, vset->current()->DebugString());
+  ASSERT_EQ(lazy_files, vset->current_lazy()->DebugString());
+  std::string recovered;
+  vset->LazyLevelSummary(&recovered);
+  ASSERT_EQ(summary, recovered);
+  ASSERT_EQ(kFiles / 2, vset->current_lazy()->NumFiles(1));
+}
+
+
+/*
+ * Table migration
+ */
+
+class MigrationTest { };
+
+TEST(MigrationTest, CopyInChunks) {
+  Env* env = Env::Default();
+  std::string dir;
+  ASSERT_OK(env->GetTestDirectory(&dir));
+  const std::string src = dir + "/migration_src";
+  const std::string dst = dir + "/migration_dst";
+  const uint64_t fnum = 7;
+
+  Random rnd(301);
+  std::string data;
+  test::RandomString(&rnd, 3 * 4096 + 100, &data);
+  ASSERT_OK(WriteStringToFile(env, data, src));
+
+  const int saved_chunk = config::migration_chunk_size;
+  config::migration_chunk_size = 4096;
+  runtime::placement.begin_migration(fnum);
+  ASSERT_OK(migrate_table(src, dst, fnum));
+  config::migration_chunk_size = saved_chunk;
+
+  // The table is tracked until the helper is done with it
+  std::set<uint64_t> moving;
+  runtime::placement.get_migrating(&moving);
+  ASSERT_EQ(1, moving.count(fnum));
+  ASSERT_EQ(0, runtime::placement.migration_pending_bytes());
+  runtime::placement.end_migration(fnum, true);
+  moving.clear();
+  runtime::placement.get_migrating(&moving);
+  ASSERT_TRUE(moving.empty());
+  TablePlacement p;
+  ASSERT_TRUE(runtime::placement.lookup(fnum, &p));
+  ASSERT_TRUE(p.on_secondary);
+
+  std::string copied;
+  ASSERT_OK(ReadFileToString(env, dst, &copied));
+  ASSERT_TRUE(copied == data);
+
+  // A missing source leaves no partial copy behind
+  ASSERT_OK(env->DeleteFile(dst));
+  ASSERT_TRUE(!migrate_table(src + ".missing", dst, fnum).ok());
+  ASSERT_TRUE(!env->FileExists(dst));
+  ASSERT_OK(env->DeleteFile(src));
+}
+
+/*
+ * Placement registry
+ */
+
+class PlacementTest { };
+
+TEST(PlacementTest, LevelsAndCopies) {
+  PlacementRegistry reg;
+  TablePlacement p;
+  ASSERT_TRUE(!reg.lookup(5, &p));
+  ASSERT_EQ(-1, reg.level(5));
+
+  reg.set_level(5, 2);
+  ASSERT_EQ(2, reg.level(5));
+  ASSERT_EQ(5, reg.latest());
+  ASSERT_TRUE(reg.lookup(5, &p));
+  ASSERT_TRUE(!p.copies_known());
+
+  reg.add_copy(5, PlacementRegistry::kPrimary);
+  reg.add_copy(5, PlacementRegistry::kSecondary);
+  reg.begin_secondary_write(5);
+  ASSERT_TRUE(reg.writing_secondary(5));
+  reg.end_secondary_write(5);
+  ASSERT_TRUE(!reg.writing_secondary(5));
+  ASSERT_TRUE(reg.lookup(5, &p));
+  ASSERT_TRUE(p.on_primary && p.on_secondary);
+
+  // The entry goes away with the last copy
+  reg.drop_copy(5, PlacementRegistry::kPrimary);
+  ASSERT_EQ(2, reg.level(5));
+  reg.drop_copy(5, PlacementRegistry::kSecondary);
+  ASSERT_TRUE(!reg.lookup(5, &p));
+
+  // but not while it is being migrated
+  reg.set_level(6, 3);
+  reg.begin_migration(6);
+  reg.remove(6);
+  ASSERT_TRUE(reg.lookup(6, &p));
+  reg.end_migration(6, false);
+  ASSERT_TRUE(!reg.lookup(6, &p));
+
+  reg.set_level(7, 1);
+  reg.begin_migration(7);
+  reg.end_migration(7, true);
+  ASSERT_TRUE(reg.lookup(7, &p));
+  ASSERT_TRUE(p.on_secondary && !p.on_primary);
+  ASSERT_EQ(1, p.level);
+}
+
+TEST(PlacementTest, Growth) {
+  PlacementRegistry reg;
+  const int N = 10000;
+  for (int i = 1; i <= N; i++) {
+    reg.set_level(i, i % 7);
+  }
+  for (int i = 1; i <= N; i += 2) {
+    reg.remove(i);
+  }
+  for (int i = 1; i <= N; i++) {
+    ASSERT_EQ((i % 2) ? -1 : i % 7, reg.level(i));
+  }
+  for (int i = 2; i <= N; i += 2) {
+    reg.remove(i);
+  }
+  reg.set_level(N + 1, 1);
+  ASSERT_EQ(1, reg.level(N + 1));
+  ASSERT_EQ(-1, reg.level(N));
+}
+
+namespace {
+struct ReaderState {
+  PlacementRegistry* reg;
+  port::AtomicPointer stop;
+  port::AtomicPointer done;
+  bool failed;
+};
+
+static void PlacementReader(void* arg) {
+  ReaderState* state = reinterpret_cast<ReaderState*>(arg);
+  while (state->stop.Acquire_Load() == NULL) {
+    // Table 1 is never touched by the writer
+    if (state->reg->level(1) != 4) {
+      state->failed = true;
+    }
+  }
+  state->done.Release_Store(state);
+}
+}  // namespace
+
+TEST(PlacementTest, ConcurrentReader) {
+  PlacementRegistry reg;
+  reg.set_level(1, 4);
+  ReaderState state;
+  state.reg = &reg;
+  state.stop.Release_Store(NULL);
+  state.done.Release_Store(NULL);
+  state.failed = false;
+  Env::Default()->StartThread(PlacementReader, &state);
+
+  // Grow and shrink the table under the reader
+  for (int round = 0; round < 5; round++) {
+    for (int i = 2; i < 5000; i++) {
+      reg.set_level(i, 0);
+    }
+    for (int i = 2; i < 5000; i++) {
+      reg.remove(i);
+    }
+  }
+  state.stop.Release_Store(&state);
+  while (state.done.Acquire_Load() == NULL) {
+    Env::Default()->SleepForMicroseconds(1000);
+  }
+  ASSERT_TRUE(!state.failed);
+}
+
+TEST(PlacementTest, SecondaryStripes) {
+  Env* env = Env::Default();
+  std::string dir;
+  ASSERT_OK(env->GetTestDirectory(&dir));
+  const std::string a = dir + "/stripe_a", b = dir + "/stripe_b";
+  env->CreateDir(a);
+  env->CreateDir(b);
+  const std::string list = a + "," + b;
+  config::secondary_storage_path = list.c_str();
+  init_secondary_paths();
+  ASSERT_EQ(2, runtime::secondary_paths.size());
+  ASSERT_EQ(a, std::string(config::secondary_storage_path));
+  init_secondary_paths();
+  ASSERT_EQ(2, runtime::secondary_paths.size());
+
+  // Other files stay on the first path
+  ASSERT_EQ(a + "/MANIFEST-000002", secondary_file("/db/MANIFEST-000002"));
+  ASSERT_TRUE(is_secondary_file(b + "/000009.ldb"));
+  ASSERT_TRUE(!is_secondary_file("/db/000009.ldb"));
+  ASSERT_TRUE(!is_secondary_file(b + "0/000009.ldb"));
+  ASSERT_EQ(2, io_device(b + "/000009.ldb"));
+  ASSERT_EQ(0, io_device(b + "0/000009.ldb"));
+
+  // A table found on a path is kept there
+  ASSERT_OK(WriteStringToFile(env, "x", TableFileName(b, 900001)));
+  ASSERT_EQ(1, secondary_stripe(900001));
+  ASSERT_EQ(TableFileName(b, 900001), secondary_file("/db/900001.ldb"));
+  ASSERT_OK(env->DeleteFile(TableFileName(b, 900001)));
+
+  // Listings take in the other files of every path
+  ASSERT_OK(WriteStringToFile(env, "x", TempFileName(b, 900002)));
+  std::vector<std::string> children;
+  ASSERT_OK(env->GetChildren(dir, &children));
+  ASSERT_EQ(1, std::count(children.begin(), children.end(), "900002.dbtmp"));
+  ASSERT_OK(env->GetChildren(b, &children));
+  ASSERT_EQ(1, std::count(children.begin(), children.end(), "900002.dbtmp"));
+  ASSERT_OK(env->DeleteFile(TempFileName(b, 900002)));
+
+  // New tables spread over both paths and keep their choice
+  int count[2] = { 0, 0 };
+  for (uint64_t fnum = 900100; fnum < 900110; fnum++) {
+    const int stripe = secondary_stripe(fnum);
+    ASSERT_TRUE(stripe == 0 || stripe == 1);
+    ASSERT_EQ(stripe, secondary_stripe(fnum));
+    count[stripe]++;
+    runtime::placement.remove(fnum);
+  }
+  ASSERT_TRUE(count[0] > 0 && count[1] > 0);
+  runtime::placement.remove(900001);
+
+  config::secondary_storage_path = NULL;
+  init_secondary_paths();
+  ASSERT_TRUE(runtime::secondary_paths.empty());
+  env->DeleteDir(a);
+  env->DeleteDir(b);
+}
+
+/*
+ * Level tuning
+ */
+
+class LevelTuningTest { };
+
+TEST(LevelTuningTest, Policy) {
+  LevelTuning t;
+  t.level = 4;
+  t.capacity = 1000;
+  t.used = 500;
+  t.shrink_gain = 100;
+  t.extend_cost = 50;
+  ASSERT_EQ(0, tune_two_phase_end_level(t));
+
+  // Over the high watermark, unless ending earlier frees nothing
+  t.used = 950;
+  ASSERT_EQ(-1, tune_two_phase_end_level(t));
+  t.shrink_gain = -10;
+  ASSERT_EQ(0, tune_two_phase_end_level(t));
+  t.shrink_gain = 100;
+  t.level = 1;
+  ASSERT_EQ(0, tune_two_phase_end_level(t));
+  t.level = 4;
+
+  // Lookups stuck in the deltas of the end level
+  t.used = 500;
+  t.seeks = 100;
+  t.delta_seeks = 80;
+  ASSERT_EQ(-1, tune_two_phase_end_level(t));
+
+  // Mirrored writes, with room for the deltas of one more level
+  t.delta_seeks = 10;
+  t.write_bytes = 1000;
+  t.mirror_bytes = 600;
+  ASSERT_EQ(1, tune_two_phase_end_level(t));
+  t.extend_cost = 200;
+  ASSERT_EQ(0, tune_two_phase_end_level(t));
+  t.extend_cost = 50;
+  t.level = runtime::kMaxTwoPhaseEndLevel;
+  ASSERT_EQ(0, tune_two_phase_end_level(t));
+}
+
+/*
+ * Metrics
+ */
+
+class MetricsTest { };
+
+static void* MetricsWriter(void* arg) {
+  const uint64_t ticks = *reinterpret_cast<uint64_t*>(arg);
+  for (int i = 0; i < 1000; i++) {
+    metrics::Record(metrics::kDBGetMem, ticks);
+  }
+  metrics::Add(metrics::kMigratedBytes, 4096);
+  return NULL;
+}
+
+TEST(MetricsTest, Aggregate) {
+  metrics::Reset();
+
+  // Slots of exited threads are kept
+  pthread_t threads[4];
+  uint64_t ticks[4] = { 1, 100, 1000, 1 << 20 };
+  for (int i = 0; i < 4; i++) {
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, MetricsWriter, &ticks[i]));
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  metrics::Record(metrics::kDBGetMem, 0);
+
+  metrics::Stats stats;
+  metrics::Get(metrics::kDBGetMem, &stats);
+  ASSERT_EQ(4001, stats.count);
+  ASSERT_EQ(1000 * (1 + 100 + 1000 + (1 << 20)), stats.sum);
+  ASSERT_EQ(1001, stats.buckets[0]);
+  ASSERT_EQ(1000, stats.buckets[20]);
+  ASSERT_TRUE(metrics::Percentile(stats, 50) < metrics::Percentile(stats, 99));
+  metrics::Get(metrics::kMigratedBytes, &stats);
+  ASSERT_EQ(4, stats.count);
+  ASSERT_EQ(4 * 4096, stats.sum);
+
+  std::string report;
+  metrics::Report(&report);
+  ASSERT_TRUE(report.find("DBImpl::Get--mem->Get") != std::string::npos);
+  ASSERT_TRUE(report.find("Migration--bytes") != std::string::npos);
+  ASSERT_TRUE(report.find("DoCompactionWork") == std::string::npos);
+
+  metrics::Reset();
+  metrics::Get(metrics::kDBGetMem, &stats);
+  ASSERT_EQ(0, stats.count);
+
+  // Sites only time their work while collection is on
+  const bool saved = config::collect_metrics;
+  int calls = 0;
+  config::collect_metrics = false;
+  HLSM_MEASURE(metrics::kDBGetImm, calls++);
+  metrics::Get(metrics::kDBGetImm, &stats);
+  ASSERT_EQ(0, stats.count);
+  config::collect_metrics = true;
+  HLSM_MEASURE(metrics::kDBGetImm, calls++);
+  metrics::Get(metrics::kDBGetImm, &stats);
+  ASSERT_EQ(1, stats.count);
+  ASSERT_EQ(2, calls);
+  config::collect_metrics = saved;
+  metrics::Reset();
+}
+
+TEST(MetricsTest, IoStats) {
+  metrics::Reset();
+  const bool saved = config::collect_metrics;
+  config::collect_metrics = true;
+  metrics::RecordIo(0, 3, metrics::kIoRead, 4096, metrics::IoStart());
+  metrics::RecordIo(1, 3, metrics::kIoWrite, 100, metrics::IoStart());
+  metrics::RecordIo(1, 3, metrics::kIoWrite, 200, 0);	// not timed
+  metrics::RecordIo(1, -1, metrics::kIoRead, 10, 0);
+  metrics::RecordIo(100, metrics::kLogIoLevel, metrics::kIoSync, 0, 0);
+  config::collect_metrics = saved;
+
+  metrics::IoStats* io = new metrics::IoStats;
+  metrics::GetIo(io);
+  ASSERT_EQ(1, io->ops[0][3][metrics::kIoRead]);
+  ASSERT_EQ(4096, io->bytes[0][3][metrics::kIoRead]);
+  ASSERT_EQ(2, io->ops[1][3][metrics::kIoWrite]);
+  ASSERT_EQ(300, io->bytes[1][3][metrics::kIoWrite]);
+  ASSERT_EQ(1, io->latency[1][metrics::kIoWrite].count);
+  ASSERT_EQ(10, io->bytes[1][metrics::kUnleveledIoLevel][metrics::kIoRead]);
+  ASSERT_EQ(1, io->ops[metrics::kMaxDevices - 1][metrics::kLogIoLevel][metrics::kIoSync]);
+  delete io;
+  metrics::Reset();
+}
+
+/*
+ * YCSB key choosers
+ */
+
+class YCSBTest { };
+
+TEST(YCSBTest, Distributions) {
+  const int kItems = 1000;
+  const int kDraws = 100000;
+  std::vector<int> hits(kItems, 0);
+
+  ZipfianGenerator zipfian(0, kItems - 1, 301);
+  for (int i = 0; i < kDraws; i++) {
+    const long long v = zipfian.next();
+    ASSERT_TRUE(v >= 0 && v < kItems);
+    hits[v]++;
+  }
+  // item 0 is drawn with probability 1/zeta(kItems)
+  const double p0 = 1 / ZipfianGenerator::zeta(0, kItems, ZipfianGenerator::kZipfianConstant, 0);
+  ASSERT_TRUE(fabs(hits[0] / (double)kDraws - p0) < 0.01) << hits[0];
+  ASSERT_GT(hits[0], hits[1]);
+  ASSERT_GT(hits[1], hits[kItems / 2]);
+  for (int i = 0; i < kDraws; i++) {	// a grown range
+    const long long v = zipfian.next(2 * kItems);
+    ASSERT_TRUE(v >= 0 && v < 2 * kItems);
+  }
+
+  ScrambledZipfianGenerator scrambled(100, 100 + kItems - 1, 301);
+  for (int i = 0; i < kDraws; i++) {
+    const long long v = scrambled.next();
+    ASSERT_TRUE(v >= 100 && v < 100 + kItems);
+  }
+
+  volatile long long last = kItems - 1;
+  SkewedLatestGenerator latest(&last, 301);
+  int newest = 0;
+  for (int i = 0; i < kDraws; i++) {
+    const long long v = latest.next();
+    ASSERT_TRUE(v >= 0 && v <= last);
+    if (v == last) newest++;
+  }
+  ASSERT_TRUE(fabs(newest / (double)kDraws - p0) < 0.01) << newest;
+  last = 2 * kItems - 1;
+  for (int i = 0; i < kDraws; i++) {
+    const long long v = latest.next();
+    ASSERT_TRUE(v >= 0 && v <= last);
+  }
+
+  HotspotGenerator hotspot(0, kItems - 1, 301, 0.2, 0.8);
+  int hot = 0;
+  for (int i = 0; i < kDraws; i++) {
+    const long long v = hotspot.next();
+    ASSERT_TRUE(v >= 0 && v < kItems);
+    if (v < kItems / 5) hot++;
+  }
+  ASSERT_TRUE(fabs(hot / (double)kDraws - 0.8) < 0.01) << hot;
+}
+
+TEST(YCSBTest, AcknowledgedCounter) {
+  AcknowledgedCounter inserts(10);
+  ASSERT_EQ(9, *inserts.last());
+  ASSERT_EQ(10, inserts.next());
+  ASSERT_EQ(11, inserts.next());
+  ASSERT_EQ(12, inserts.next());
+  ASSERT_EQ(13, inserts.next());
+  // the newest item waits for the older inserts to finish
+  inserts.acknowledge(11);
+  inserts.acknowledge(13);
+  ASSERT_EQ(9, *inserts.last());
+  inserts.acknowledge(10);
+  ASSERT_EQ(11, *inserts.last());
+  inserts.acknowledge(12);
+  ASSERT_EQ(13, *inserts.last());
+
+  inserts.reset(0);
+  ASSERT_EQ(-1, *inserts.last());
+  ASSERT_EQ(0, inserts.next());
+  inserts.acknowledge(0);
+  ASSERT_EQ(0, *inserts.last());
+}
+
+/*
+ * Bulk load
+ */
+
+class BulkLoadTest { };
+
+namespace {
+class VectorPartition : public BulkLoadPartition {
+ public:
+  VectorPartition(int level, int from, int to, const std::string& value)
+      : level_(level), value_(value), next_(0) {
+    for (int i = from; i < to; i++) keys_.push_back(BulkKey(i));
+  }
+  VectorPartition(int level, const std::vector<std::string>& keys)
+      : level_(level), keys_(keys), value_("v"), next_(0) { }
+  virtual int level() const { return level_; }
+  virtual bool Next(Slice* key, Slice* value) {
+    if (next_ >= keys_.size()) return false;
+    *key = keys_[next_++];
+    *value = value_;
+    return true;
+  }
+ private:
+  int level_;
+  std::vector<std::string> keys_;
+  std::string value_;
+  size_t next_;
+};
+
+std::string Get(DB* db, int i) {
+  std::string value;
+  Status s = db->Get(ReadOptions(), BulkKey(i), &value);
+  return s.ok() ? value : s.IsNotFound() ? "NOT_FOUND" : s.ToString();
+}
+
+// Numbers of the tables in dbname, in increasing order
+static std::vector<uint64_t> TableFiles(const std::string& dbname) {
+  std::vector<std::string> children;
+  Env::Default()->GetChildren(dbname, &children);
+  std::vector<uint64_t> tables;
+  uint64_t number;
+  FileType type;
+  for (size_t i = 0; i < children.size(); i++) {
+    if (ParseFileName(children[i], &number, &type) && type == kTableFile) {
+      tables.push_back(number);
+    }
+  }
+  std::sort(tables.begin(), tables.end());
+  return tables;
+}
+
+Status Load(DB* db, BulkLoadPartition* p) {
+  std::vector<BulkLoadPartition*> partitions(1, p);
+  return db->BulkLoad(BulkLoadOptions(), partitions);
+}
+}  // namespace
+
+TEST(BulkLoadTest, LevelsAndChecks) {
+  const std::string dbname = test::TmpDir() + "/hlsm_bulk_load";
+  Options options;
+  options.create_if_missing = true;
+  DestroyDB(dbname, options);
+  config::primary_storage_path = dbname.c_str();
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+
+  VectorPartition upper0(1, 0, 50, "new"), upper1(1, 50, 100, "new");
+  VectorPartition lower0(2, 0, 100, "old"), lower1(2, 100, 200, "old");
+  std::vector<BulkLoadPartition*> partitions;
+  partitions.push_back(&lower1);
+  partitions.push_back(&upper0);
+  partitions.push_back(&lower0);
+  partitions.push_back(&upper1);
+  BulkLoadOptions bulk;
+  bulk.threads = 3;
+  ASSERT_OK(db->BulkLoad(bulk, partitions));
+  std::string files;
+  ASSERT_TRUE(db->GetProperty("leveldb.num-files-at-level1", &files));
+  ASSERT_EQ("2", files);
+  ASSERT_TRUE(db->GetProperty("leveldb.num-files-at-level2", &files));
+  ASSERT_EQ("2", files);
+  ASSERT_EQ("new", Get(db, 10));
+  ASSERT_EQ("new", Get(db, 99));
+  ASSERT_EQ("old", Get(db, 100));
+  ASSERT_EQ("NOT_FOUND", Get(db, 200));
+
+  // Later writes shadow the loaded values, also after a reopen
+  ASSERT_OK(db->Put(WriteOptions(), BulkKey(150), "put"));
+  delete db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  ASSERT_EQ("new", Get(db, 0));
+  ASSERT_EQ("put", Get(db, 150));
+  ASSERT_EQ("old", Get(db, 199));
+
+  // Nothing is loaded while the memtable has entries
+  ASSERT_OK(db->Put(WriteOptions(), BulkKey(250), "put"));
+  VectorPartition more(3, 300, 310, "more");
+  ASSERT_TRUE(!Load(db, &more).ok());
+  db->CompactRange(NULL, NULL);
+  ASSERT_OK(Load(db, &more));
+  ASSERT_EQ("more", Get(db, 305));
+
+  // Overlapping partitions, overlap with the database, unsorted keys
+  VectorPartition a(4, 400, 410, "a"), b(4, 405, 420, "b");
+  partitions.clear();
+  partitions.push_back(&a);
+  partitions.push_back(&b);
+  ASSERT_TRUE(!db->BulkLoad(bulk, partitions).ok());
+  VectorPartition shadowed(6, 190, 210, "c");
+  ASSERT_TRUE(!Load(db, &shadowed).ok());
+  std::vector<std::string> unsorted;
+  unsorted.push_back(BulkKey(502));
+  unsorted.push_back(BulkKey(501));
+  VectorPartition bad(5, unsorted);
+  ASSERT_TRUE(!Load(db, &bad).ok());
+  ASSERT_EQ("NOT_FOUND", Get(db, 405));
+  ASSERT_EQ("old", Get(db, 190));
+  ASSERT_EQ("NOT_FOUND", Get(db, 501));
+
+  delete db;
+  DestroyDB(dbname, options);
+  config::primary_storage_path = NULL;
+}
+
+TEST(BulkLoadTest, LazyLevels) {
+  const std::string dbname = test::TmpDir() + "/hlsm_bulk_load_lazy";
+  HlsmMode mode(dbname);
+  Options options;
+  options.create_if_missing = true;
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+
+  // Tables of the top mirrored, two-phase and pure mirror levels
+  const int levels[] = { 1, 2, 3, 4, 5, 2 * (runtime::two_phase_end_level + 1) };
+  const int kLevels = sizeof(levels) / sizeof(levels[0]);
+  std::vector<VectorPartition*> owned;
+  std::vector<BulkLoadPartition*> partitions;
+  for (int j = 0; j < kLevels; j++) {
+    for (int k = 0; k < 3; k++) {
+      const int from = 1000 * (j + 1) + 100 * k;
+      owned.push_back(new VectorPartition(levels[j], from, from + 50,
+                                          NumberToString(levels[j])));
+      partitions.push_back(owned.back());
+    }
+  }
+  BulkLoadOptions bulk;
+  bulk.threads = 3;
+  ASSERT_OK(db->BulkLoad(bulk, partitions));
+  std::string lazy;
+  ASSERT_TRUE(db->GetProperty("hlsm.lazy-levels", &lazy));
+  for (int j = 0; j < kLevels; j++) {
+    for (int k = 0; k < 3; k++) {
+      ASSERT_EQ(NumberToString(levels[j]), Get(db, 1000 * (j + 1) + 100 * k + 49));
+    }
+  }
+  ASSERT_EQ("NOT_FOUND", Get(db, 1050));
+
+  // A level that takes more delta levels than the ring holds is refused
+  // and its tables are not kept
+  const int per_delta = max_fnum_in_level(1);
+  const std::vector<uint64_t> tables = TableFiles(dbname);
+  for (size_t i = 0; i < owned.size(); i++) delete owned[i];
+  owned.clear();
+  partitions.clear();
+  for (int i = 0; i < (runtime::delta_level_num + 1) * per_delta; i++) {
+    owned.push_back(new VectorPartition(3, 100000 + 2 * i, 100000 + 2 * i + 1,
+                                        "ring"));
+    partitions.push_back(owned.back());
+  }
+  Status s = db->BulkLoad(bulk, partitions);
+  ASSERT_TRUE(s.ToString().find("delta levels") != std::string::npos)
+      << s.ToString();
+  ASSERT_EQ("NOT_FOUND", Get(db, 100000));
+  ASSERT_TRUE(tables == TableFiles(dbname));
+  for (uint64_t n = tables.back() + 1; n <= tables.back() + 2 * owned.size(); n++) {
+    ASSERT_EQ(-1, runtime::placement.level(n));
+  }
+  for (size_t i = 0; i < owned.size(); i++) delete owned[i];
+  owned.clear();
+
+  // The lazy levels are recovered from the MANIFEST
+  delete db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  std::string recovered;
+  ASSERT_TRUE(db->GetProperty("hlsm.lazy-levels", &recovered));
+  ASSERT_EQ(lazy, recovered);
+  for (int j = 0; j < kLevels; j++) {
+    ASSERT_EQ(NumberToString(levels[j]), Get(db, 1000 * (j + 1) + 1));
+  }
+  delete db;
+}
+
+/*
+ * External table ingestion
+ */
+
+class IngestTest { };
+
+namespace {
+Status WriteExternal(const std::string& fname, int from, int to,
+                     const std::string& value) {
+  WritableFile* file;
+  Status s = Env::Default()->NewWritableFile(fname, &file);
+  if (!s.ok()) return s;
+  ExternalTableBuilder builder(Options(), file);
+  for (int i = from; s.ok() && i < to; i++) {
+    s = builder.Add(BulkKey(i), value);
+  }
+  if (s.ok()) {
+    s = builder.Finish();
+  } else {
+    builder.Abandon();
+  }
+  if (s.ok()) s = file->Close();
+  delete file;
+  return s;
+}
+
+std::string Get(DB* db, const Snapshot* snapshot, int i) {
+  ReadOptions options;
+  options.snapshot = snapshot;
+  std::string value;
+  Status s = db->Get(options, BulkKey(i), &value);
+  return s.ok() ? value : s.IsNotFound() ? "NOT_FOUND" : s.ToString();
+}
+}  // namespace
+
+TEST(IngestTest, SequenceAndLevels) {
+  const std::string dbname = test::TmpDir() + "/hlsm_ingest";
+  const std::string ext = test::TmpDir() + "/hlsm_ingest_ext";
+  Options options;
+  options.create_if_missing = true;
+  DestroyDB(dbname, options);
+  config::primary_storage_path = dbname.c_str();
+  Env::Default()->CreateDir(ext);
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+
+  VectorPartition old(2, 0, 100, "old");
+  ASSERT_OK(Load(db, &old));
+  ASSERT_OK(db->Put(WriteOptions(), BulkKey(50), "put"));
+  const Snapshot* before = db->GetSnapshot();
+
+  // Keys 50 to 59 overlap the database, 300 to 309 do not
+  std::vector<std::string> paths;
+  paths.push_back(ext + "/b.ldb");
+  paths.push_back(ext + "/a.ldb");
+  ASSERT_OK(WriteExternal(paths[0], 300, 310, "ext"));
+  ASSERT_OK(WriteExternal(paths[1], 50, 60, "ext"));
+  ASSERT_OK(db->IngestExternalFiles(paths));
+  ASSERT_EQ("ext", Get(db, 50));
+  ASSERT_EQ("ext", Get(db, 59));
+  ASSERT_EQ("old", Get(db, 60));
+  ASSERT_EQ("ext", Get(db, 305));
+  ASSERT_EQ("put", Get(db, before, 50));
+  ASSERT_EQ("old", Get(db, before, 55));
+  ASSERT_EQ("NOT_FOUND", Get(db, before, 305));
+  db->ReleaseSnapshot(before);
+  std::string files;
+  ASSERT_TRUE(db->GetProperty("leveldb.num-files-at-level2", &files));
+  ASSERT_EQ("2", files);
+
+  Iterator* iter = db->NewIterator(ReadOptions());
+  iter->Seek(BulkKey(55));
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ(BulkKey(55), iter->key().ToString());
+  ASSERT_EQ("ext", iter->value().ToString());
+  int count = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) count++;
+  ASSERT_EQ(110, count);
+  delete iter;
+
+  // Later writes shadow the tables, also after a reopen and a compaction
+  ASSERT_OK(db->Put(WriteOptions(), BulkKey(51), "put"));
+  delete db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  ASSERT_EQ("put", Get(db, 51));
+  ASSERT_EQ("ext", Get(db, 52));
+  db->CompactRange(NULL, NULL);
+  ASSERT_EQ("put", Get(db, 51));
+  ASSERT_EQ("ext", Get(db, 52));
+  ASSERT_EQ("ext", Get(db, 309));
+  ASSERT_EQ("old", Get(db, 99));
+
+  // Overlapping tables, foreign names
+  paths.clear();
+  paths.push_back(ext + "/c.ldb");
+  paths.push_back(ext + "/d.ldb");
+  ASSERT_OK(WriteExternal(paths[0], 400, 410, "c"));
+  ASSERT_OK(WriteExternal(paths[1], 405, 420, "d"));
+  ASSERT_TRUE(!db->IngestExternalFiles(paths).ok());
+  paths.resize(1);
+  paths[0] = ext + "/e.sst";
+  ASSERT_OK(WriteExternal(paths[0], 500, 510, "e"));
+  ASSERT_TRUE(!db->IngestExternalFiles(paths).ok());
+  ASSERT_EQ("NOT_FOUND", Get(db, 405));
+  ASSERT_EQ("NOT_FOUND", Get(db, 505));
+
+  // A table of user keys, which are not internal keys
+  paths[0] = ext + "/f.ldb";
+  WritableFile* file;
+  ASSERT_OK(Env::Default()->NewWritableFile(paths[0], &file));
+  TableBuilder builder(Options(), file);
+  builder.Add("a", "f");
+  builder.Add("b", "f");
+  ASSERT_OK(builder.Finish());
+  ASSERT_OK(file->Close());
+  delete file;
+  ASSERT_TRUE(db->IngestExternalFiles(paths).IsCorruption());
+
+  delete db;
+  DestroyDB(dbname, options);
+  std::vector<std::string> children;
+  Env::Default()->GetChildren(ext, &children);
+  for (size_t i = 0; i < children.size(); i++) {
+    Env::Default()->DeleteFile(ext + "/" + children[i]);
+  }
+  Env::Default()->DeleteDir(ext);
+  config::primary_storage_path = NULL;
+}
+
+/*
+ * Queued immutable memtables
+ */
+
+class ImmutableMemTablesTest { };
+
+static void CheckModel(DB* db, const std::map<int, std::string>& model,
+                       int keys) {
+  for (int i = 0; i < keys; i++) {
+    std::map<int, std::string>::const_iterator it = model.find(i);
+    ASSERT_EQ(it == model.end() ? "NOT_FOUND" : it->second, Get(db, i));
+  }
+  Iterator* iter = db->NewIterator(ReadOptions());
+  std::map<int, std::string>::const_iterator it = model.begin();
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next(), ++it) {
+    ASSERT_TRUE(it != model.end());
+    ASSERT_EQ(BulkKey(it->first), iter->key().ToString());
+    ASSERT_EQ(it->second, iter->value().ToString());
+  }
+  ASSERT_TRUE(it == model.end());
+  delete iter;
+}
+
+TEST(ImmutableMemTablesTest, ReadsAndRecovery) {
+  const std::string dbname = test::TmpDir() + "/hlsm_imm";
+  Options options;
+  options.create_if_missing = true;
+  options.write_buffer_size = 64 << 10;
+  options.max_immutable_memtables = 4;
+  DestroyDB(dbname, options);
+  config::primary_storage_path = dbname.c_str();
+
+  // Without background work, full memtables queue up instead of stalling
+  const bool saved = config::run_compaction;
+  config::run_compaction = false;
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  std::map<int, std::string> model, old_model;
+  const Snapshot* snapshot = NULL;
+  Random rnd(301);
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 600; i++) {
+      if (rnd.OneIn(7)) {
+        ASSERT_OK(db->Delete(WriteOptions(), BulkKey(i)));
+        model.erase(i);
+      } else {
+        std::string value;
+        test::RandomString(&rnd, 100, &value);
+        ASSERT_OK(db->Put(WriteOptions(), BulkKey(i), value));
+        model[i] = value;
+      }
+    }
+    if (round == 0) {
+      snapshot = db->GetSnapshot();
+      old_model = model;
+    }
+  }
+  std::string files;
+  ASSERT_TRUE(db->GetProperty("leveldb.num-files-at-level0", &files));
+  ASSERT_EQ("0", files);
+  CheckModel(db, model, 600);
+  for (int i = 0; i < 600; i++) {
+    std::map<int, std::string>::const_iterator it = old_model.find(i);
+    ASSERT_EQ(it == old_model.end() ? "NOT_FOUND" : it->second,
+              Get(db, snapshot, i));
+  }
+  db->ReleaseSnapshot(snapshot);
+  delete db;
+
+  // The logs of all queued memtables are replayed
+  config::run_compaction = saved;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  CheckModel(db, model, 600);
+
+  // Flushes of several memtables at once
+  for (int n = 0; n < 20000; n++) {
+    const int i = rnd.Uniform(2000);
+    std::string value;
+    test::RandomString(&rnd, 100, &value);
+    ASSERT_OK(db->Put(WriteOptions(), BulkKey(i), value));
+    model[i] = value;
+  }
+  CheckModel(db, model, 2000);
+  db->CompactRange(NULL, NULL);
+  CheckModel(db, model, 2000);
+
+  delete db;
+  DestroyDB(dbname, options);
+  config::primary_storage_path = NULL;
+}
+
+/*
+ * Iterators over the lazy version
+ */
+
+class LazyIteratorTest { };
+
+namespace {
+// Up to n entries of iter from its position on, in the given direction
+std::string Scan(Iterator* iter, int n, bool forward) {
+  std::string result;
+  for (int i = 0; i < n && iter->Valid(); i++) {
+    result += iter->key().ToString() + "=" + iter->value().ToString() + " ";
+    if (forward) {
+      iter->Next();
+    } else {
+      iter->Prev();
+    }
+  }
+  return result;
+}
+
+// What Scan() returns for the entries of model from key i on
+std::string ScanModel(const std::map<int, std::string>& model, int i, int n,
+                      bool forward) {
+  std::string result;
+  std::map<int, std::string>::const_iterator it = model.lower_bound(i);
+  if (!forward) {
+    if (it == model.end() || it->first != i) {
+      if (it == model.begin()) return result;
+      --it;
+    }
+    for (int j = 0; j < n; j++) {
+      result += BulkKey(it->first) + "=" + it->second + " ";
+      if (it == model.begin()) break;
+      --it;
+    }
+    return result;
+  }
+  for (int j = 0; j < n && it != model.end(); j++, ++it) {
+    result += BulkKey(it->first) + "=" + it->second + " ";
+  }
+  return result;
+}
+
+// Position iter at the first entry at or after key, or if !forward at
+// the last one at or before key
+void SeekTo(Iterator* iter, const std::string& key, bool forward) {
+  iter->Seek(key);
+  if (forward) return;
+  if (!iter->Valid()) {
+    iter->SeekToLast();
+  } else if (iter->key() != key) {
+    iter->Prev();
+  }
+}
+
+// Check full and short scans in both directions, from the lazy version
+// and from the primary, against model
+void CheckScans(DB* db, const Snapshot* snapshot,
+                const std::map<int, std::string>& model, int keys) {
+  ReadOptions options;
+  options.snapshot = snapshot;
+  Iterator* lazy = db->NewIterator(options);
+  Iterator* primary = db->NewIterator(options, true);
+  const std::string all = ScanModel(model, 0, keys, true);
+  lazy->SeekToFirst();
+  ASSERT_EQ(all, Scan(lazy, keys, true));
+  primary->SeekToFirst();
+  ASSERT_EQ(all, Scan(primary, keys, true));
+  const std::string all_reverse = ScanModel(model, keys, keys, false);
+  lazy->SeekToLast();
+  ASSERT_EQ(all_reverse, Scan(lazy, keys, false));
+
+  Random rnd(17);
+  for (int n = 0; n < 200; n++) {
+    const int i = rnd.Uniform(keys);
+    const bool forward = rnd.OneIn(2);
+    const std::string expected = ScanModel(model, i, 20, forward);
+    SeekTo(lazy, BulkKey(i), forward);
+    SeekTo(primary, BulkKey(i), forward);
+    ASSERT_EQ(expected, Scan(lazy, 20, forward));
+    ASSERT_EQ(expected, Scan(primary, 20, forward));
+  }
+  ASSERT_OK(lazy->status());
+  ASSERT_OK(primary->status());
+  delete lazy;
+  delete primary;
+
+  for (int i = 0; i < keys; i++) {
+    std::map<int, std::string>::const_iterator it = model.find(i);
+    ASSERT_EQ(it == model.end() ? "NOT_FOUND" : it->second,
+              Get(db, snapshot, i));
+  }
+}
+}  // namespace
+
+TEST(LazyIteratorTest, MatchesPrimary) {
+  const std::string dbname = test::TmpDir() + "/hlsm_lazy_iter";
+  HlsmMode mode(dbname);
+  mode.UseSmallLevels(2);
+  Options options;
+  options.create_if_missing = true;
+  options.write_buffer_size = 64 << 10;
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+
+  // Overwrites and deletes spread over the NEW and delta levels
+  const int kKeys = 20000;
+  std::map<int, std::string> model, old_model;
+  const Snapshot* snapshot = NULL;
+  Random rnd(301);
+  for (int n = 0; n < 100000; n++) {
+    const int i = rnd.Uniform(kKeys);
+    if (rnd.OneIn(10)) {
+      ASSERT_OK(db->Delete(WriteOptions(), BulkKey(i)));
+      model.erase(i);
+    } else {
+      std::string value;
+      test::RandomString(&rnd, 100, &value);
+      ASSERT_OK(db->Put(WriteOptions(), BulkKey(i), value));
+      model[i] = value;
+    }
+    if (n == 50000) {
+      snapshot = db->GetSnapshot();
+      old_model = model;
+    }
+  }
+  std::string lazy;
+  ASSERT_TRUE(db->GetProperty("hlsm.lazy-levels", &lazy));
+  ASSERT_TRUE(lazy.find(" new") != std::string::npos) << lazy;
+  ASSERT_TRUE(lazy.find("LL1 delta") != std::string::npos) << lazy;
+  ASSERT_TRUE(lazy.find("LL2 delta") != std::string::npos) << lazy;
+
+  const bool saved = config::collect_metrics;
+  config::collect_metrics = true;
+  metrics::Reset();
+  CheckScans(db, NULL, model, kKeys);
+  CheckScans(db, snapshot, old_model, kKeys);
+  metrics::Stats stats;
+  metrics::Get(metrics::kLazyVersionIterators, &stats);
+  ASSERT_EQ(2, stats.sum);
+  config::collect_metrics = saved;
+  metrics::Reset();
+
+  db->ReleaseSnapshot(snapshot);
+  delete db;
+}
+
+/*
+ * Delta merge
+ */
+
+class DeltaMergeTest { };
+
+namespace {
+// Add a table holding user keys [smallest, largest] to the active delta
+// level of llevel, then move the active delta level on
+void AddDelta(VersionSetHarness* h, int llevel, const std::string& smallest,
+              const std::string& largest) {
+  LazyVersionEdit* edit = reinterpret_cast<LazyVersionEdit*>(h->NewEdit());
+  LazyVersionSet* vset = reinterpret_cast<LazyVersionSet*>(h->vset());
+  edit->AddLazyFile(get_active_delta_level(vset->GetDeltaLevelOffsets(), llevel),
+                    h->vset()->NewFileNumber(), 1000,
+                    InternalKey(smallest, 100, kTypeValue),
+                    InternalKey(largest, 100, kTypeValue));
+  edit->AdvanceActiveDeltaLevel(llevel);
+  ASSERT_OK(h->Apply(edit));
+}
+}  // namespace
+
+TEST(DeltaMergeTest, Inputs) {
+  const std::string dbname = test::TmpDir() + "/hlsm_delta_merge_inputs";
+  HlsmMode mode(dbname);
+  config::delta_merge_trigger = 3;
+  config::delta_merge_overlap_trigger = 0;
+  VersionSetHarness h(dbname);
+  LazyVersionSet* vset = reinterpret_cast<LazyVersionSet*>(h.vset());
+  const int width = runtime::delta_level_num + 1;
+
+  // Two filled delta levels are below the trigger
+  AddDelta(&h, 1, "a", "c");
+  AddDelta(&h, 1, "b", "d");
+  ASSERT_EQ(-1, vset->DeltaMergeLevel());
+
+  // The third reaches it; the active delta level is not an input
+  AddDelta(&h, 1, "x", "z");
+  ASSERT_EQ(1, vset->DeltaMergeLevel());
+  LazyVersionEdit* edit = reinterpret_cast<LazyVersionEdit*>(h.NewEdit());
+  edit->AddLazyFile(get_active_delta_level(vset->GetDeltaLevelOffsets(), 1),
+                    h.vset()->NewFileNumber(), 1000,
+                    InternalKey("e", 100, kTypeValue),
+                    InternalKey("f", 100, kTypeValue));
+  ASSERT_OK(h.Apply(edit));
+  std::vector<std::pair<int, FileMetaData*> > inputs;
+  int target;
+  vset->GetDeltaMergeInputs(1, &inputs, &target);
+  ASSERT_EQ(3, inputs.size());
+  ASSERT_EQ(width, inputs[0].first);
+  ASSERT_EQ(width - 1, inputs[1].first);
+  ASSERT_EQ(width - 2, inputs[2].first);
+  ASSERT_EQ("a", inputs[0].second->smallest.user_key().ToString());
+  ASSERT_EQ("x", inputs[2].second->smallest.user_key().ToString());
+  ASSERT_EQ(width - 2, target);  // The newest of them
+
+  // The logical level with the higher score goes first
+  for (int i = 0; i < 4; i++) {
+    AddDelta(&h, 2, "a", "b");
+  }
+  ASSERT_EQ(2, vset->DeltaMergeLevel());
+  inputs.clear();
+  vset->GetDeltaMergeInputs(2, &inputs, &target);
+  ASSERT_EQ(4, inputs.size());
+  ASSERT_EQ(2 * width + 1 - 4, target);
+
+  // Overlap alone: a lookup of "b" probes two delta levels of level 1
+  // and four of level 2
+  config::delta_merge_trigger = 0;
+  config::delta_merge_overlap_trigger = 5;
+  ASSERT_OK(h.Apply(h.NewEdit()));
+  ASSERT_EQ(-1, vset->DeltaMergeLevel());
+  config::delta_merge_overlap_trigger = 2;
+  ASSERT_OK(h.Apply(h.NewEdit()));
+  ASSERT_EQ(2, vset->DeltaMergeLevel());
+  for (int i = 0; i < 4; i++) {
+    AddDelta(&h, 1, "b", "c");
+  }
+  ASSERT_EQ(1, vset->DeltaMergeLevel());
+}
+
+TEST(DeltaMergeTest, NewerVersionsWin) {
+  const std::string dbname = test::TmpDir() + "/hlsm_delta_merge";
+  HlsmMode mode(dbname);
+  mode.UseSmallLevels(2);
+  config::delta_merge_trigger = 2;
+  config::delta_merge_overlap_trigger = 2;
+  const bool saved = config::collect_metrics;
+  config::collect_metrics = true;
+  metrics::Reset();
+  Options options;
+  options.create_if_missing = true;
+  options.write_buffer_size = 64 << 10;
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+
+  // Rounds of overwrites of the same keys leave versions of a key in
+  // several delta levels; a snapshot holds the first round
+  const int kKeys = 10000;
+  std::map<int, std::string> model, old_model;
+  const Snapshot* snapshot = NULL;
+  Random rnd(302);
+  for (int round = 0; round < 8; round++) {
+    for (int n = 0; n < kKeys; n++) {
+      const int i = rnd.Uniform(kKeys);
+      if (round > 0 && rnd.OneIn(10)) {
+        ASSERT_OK(db->Delete(WriteOptions(), BulkKey(i)));
+        model.erase(i);
+      } else {
+        std::string value;
+        test::RandomString(&rnd, 100, &value);
+        ASSERT_OK(db->Put(WriteOptions(), BulkKey(i), value));
+        model[i] = value;
+      }
+    }
+    if (round == 0) {
+      snapshot = db->GetSnapshot();
+      old_model = model;
+    }
+  }
+  metrics::Stats stats;
+  metrics::Get(metrics::kDeltaMergeBytes, &stats);
+  ASSERT_GT(stats.sum, 0);
+
+  CheckScans(db, NULL, model, kKeys);
+  CheckScans(db, snapshot, old_model, kKeys);
+  db->ReleaseSnapshot(snapshot);
+
+  // The merged delta levels survive recovery
+  delete db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  CheckScans(db, NULL, model, kKeys);
+  delete db;
+  config::collect_metrics = saved;
+  metrics::Reset();
+}
+
+/*
+ * Two-phase end level
+ */
+
+class TwoPhaseEndLevelTest { };
+
+namespace {
+// n random overwrites and deletes of kKeys keys, recorded in *model
+void Churn(DB* db, Random* rnd, int keys, int n,
+           std::map<int, std::string>* model) {
+  for (int j = 0; j < n; j++) {
+    const int i = rnd->Uniform(keys);
+    if (rnd->OneIn(10)) {
+      ASSERT_OK(db->Delete(WriteOptions(), BulkKey(i)));
+      model->erase(i);
+    } else {
+      std::string value;
+      test::RandomString(rnd, 100, &value);
+      ASSERT_OK(db->Put(WriteOptions(), BulkKey(i), value));
+      (*model)[i] = value;
+    }
+  }
+}
+
+// Offsets of the oldest delta level still in use and of the active one
+// in the delta level ring of llevel
+void DeltaRing(DB* db, int llevel, unsigned int* start, unsigned int* active) {
+  std::string lazy;
+  ASSERT_TRUE(db->GetProperty("hlsm.lazy-levels", &lazy));
+  char prefix[20];
+  snprintf(prefix, sizeof(prefix), "LL%d deltas:", llevel);
+  const size_t pos = lazy.find(prefix);
+  ASSERT_TRUE(pos != std::string::npos) << lazy;
+  unsigned int clear;
+  ASSERT_EQ(3, sscanf(lazy.c_str() + pos + strlen(prefix),
+                      " start %u, clear %u, active %u", start, &clear, active))
+      << lazy;
+}
+
+// Move the two-phase end level by step and check that it took
+void MoveEndLevel(DB* db, int step, int expected) {
+  ASSERT_OK(reinterpret_cast<DBImpl*>(db)->TEST_MoveTwoPhaseEndLevel(step));
+  ASSERT_EQ(expected, runtime::two_phase_end_level);
+  ASSERT_EQ(2 * expected, runtime::mirror_start_level);
+  std::string lazy;
+  ASSERT_TRUE(db->GetProperty("hlsm.lazy-levels", &lazy));
+  char buf[40];
+  snprintf(buf, sizeof(buf), "Two-phase end level: %d,", expected);
+  ASSERT_TRUE(lazy.find(buf) != std::string::npos) << lazy;
+}
+}  // namespace
+
+TEST(TwoPhaseEndLevelTest, WrappedDeltaRing) {
+  const std::string dbname = test::TmpDir() + "/hlsm_delta_ring";
+  HlsmMode mode(dbname);
+  mode.UseSmallLevels(1);
+  Options options;
+  options.create_if_missing = true;
+  options.write_buffer_size = 64 << 10;
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+
+  // Every move of level 2 rolls the deltas of the end level forward, so
+  // its ring wraps after a few rounds; lookups still probe it newest first
+  const int kKeys = 20000;
+  std::map<int, std::string> model;
+  Random rnd(304);
+  bool wrapped = false;
+  for (int round = 0; round < 10 && !wrapped; round++) {
+    Churn(db, &rnd, kKeys, 30000, &model);
+    unsigned int start, active;
+    DeltaRing(db, 1, &start, &active);
+    wrapped = (active < start);
+    CheckScans(db, NULL, model, kKeys);
+  }
+  ASSERT_TRUE(wrapped);
+  delete db;
+}
+
+TEST(TwoPhaseEndLevelTest, ShrinkAndExtend) {
+  const std::string dbname = test::TmpDir() + "/hlsm_end_level";
+  HlsmMode mode(dbname);
+  mode.UseSmallLevels(2);
+  Options options;
+  options.create_if_missing = true;
+  options.write_buffer_size = 64 << 10;
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+
+  const int kKeys = 20000;
+  std::map<int, std::string> model;
+  Random rnd(303);
+  Churn(db, &rnd, kKeys, 100000, &model);
+  const Snapshot* snapshot = db->GetSnapshot();
+  const std::map<int, std::string> old_model = model;
+
+  // The mirrored copies of level 3 become its deltas
+  MoveEndLevel(db, 1, 3);
+  CheckScans(db, NULL, model, kKeys);
+  CheckScans(db, snapshot, old_model, kKeys);
+  Churn(db, &rnd, kKeys, 30000, &model);
+  CheckScans(db, NULL, model, kKeys);
+
+  // and give way to mirrored copies again, down to level 1
+  MoveEndLevel(db, -1, 2);
+  CheckScans(db, NULL, model, kKeys);
+  CheckScans(db, snapshot, old_model, kKeys);
+  MoveEndLevel(db, -1, 1);
+  CheckScans(db, NULL, model, kKeys);
+  CheckScans(db, snapshot, old_model, kKeys);
+  Churn(db, &rnd, kKeys, 30000, &model);
+  CheckScans(db, NULL, model, kKeys);
+  db->ReleaseSnapshot(snapshot);
+
+  // The end level is recovered from the MANIFEST
+  delete db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  ASSERT_EQ(1, runtime::two_phase_end_level);
+  CheckScans(db, NULL, model, kKeys);
+  delete db;
+}
+
+/*
+ * SuperVersion
+ */
+
+class SuperVersionTest { };
+
+namespace {
+struct IdleReaderState {
+  DB* db;
+  std::string expected;
+  port::AtomicPointer step;   // set by the test to move the reader on
+  port::AtomicPointer ack;    // set by the reader when it is idle again
+  port::AtomicPointer stop;
+  port::AtomicPointer done;
+  bool failed;
+};
+
+static void Wait(port::AtomicPointer* p) {
+  while (p->Acquire_Load() == NULL) {
+    Env::Default()->SleepForMicroseconds(1000);
+  }
+}
+
+static void IdleReader(void* arg) {
+  IdleReaderState* state = reinterpret_cast<IdleReaderState*>(arg);
+  if (Get(state->db, 0) != state->expected) state->failed = true;
+  state->ack.Release_Store(state);
+  Wait(&state->step);
+  if (Get(state->db, 0) != state->expected) state->failed = true;
+  state->ack.Release_Store(state);
+  Wait(&state->stop);
+  state->done.Release_Store(state);
+}
+}  // namespace
+
+TEST(SuperVersionTest, IdleReaderReleases) {
+  const std::string dbname = test::TmpDir() + "/hlsm_idle_reader";
+  Options options;
+  options.create_if_missing = true;
+  DestroyDB(dbname, options);
+  config::primary_storage_path = dbname.c_str();
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_OK(db->Put(WriteOptions(), BulkKey(i), "v1"));
+  }
+  db->CompactRange(NULL, NULL);
+  const std::vector<uint64_t> old_tables = TableFiles(dbname);
+  ASSERT_TRUE(!old_tables.empty());
+
+  // The reader picks up the current SuperVersion and goes idle
+  IdleReaderState state;
+  state.db = db;
+  state.expected = "v1";
+  state.step.Release_Store(NULL);
+  state.ack.Release_Store(NULL);
+  state.stop.Release_Store(NULL);
+  state.done.Release_Store(NULL);
+  state.failed = false;
+  Env::Default()->StartThread(IdleReader, &state);
+  Wait(&state.ack);
+
+  // Compact the reader's tables away
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_OK(db->Put(WriteOptions(), BulkKey(i), "v2"));
+  }
+  db->CompactRange(NULL, NULL);
+  const std::vector<uint64_t> new_tables = TableFiles(dbname);
+  for (size_t i = 0; i < old_tables.size(); i++) {
+    ASSERT_TRUE(std::find(new_tables.begin(), new_tables.end(),
+                          old_tables[i]) == new_tables.end());
+  }
+
+  // The reader moves on to the new state
+  state.expected = "v2";
+  state.ack.Release_Store(NULL);
+  state.step.Release_Store(&state);
+  Wait(&state.ack);
+  ASSERT_TRUE(!state.failed);
+
+  // Let the reader exit only once its slot is gone with the DB
+  delete db;
+  state.stop.Release_Store(&state);
+  Wait(&state.done);
+  DestroyDB(dbname, options);
+  config::primary_storage_path = NULL;
+}
+
+/*
+ * Pending compaction bytes
+ */
+
+class PendingCompactionTest { };
+
+TEST(PendingCompactionTest, Estimate) {
+  const std::string dbname = test::TmpDir() + "/hlsm_pending_bytes";
+  config::primary_storage_path = dbname.c_str();
+  {
+    VersionSetHarness h(dbname);
+    const int64_t kHuge = 1LL << 40;
+    VersionEdit* edit = h.NewEdit();
+    h.AddFile(edit, 2, kHuge, "a", "b");
+    h.AddFile(edit, 3, 1000, "c", "d");
+    ASSERT_OK(h.Apply(edit));
+    ASSERT_GT(h.vset()->EstimatedPendingCompactionBytes(), kHuge / 2);
+
+    // Levels from kMaxLevel on are never compacted
+    const int saved_max_level = config::kMaxLevel;
+    config::kMaxLevel = 2;
+    ASSERT_EQ(0, h.vset()->EstimatedPendingCompactionBytes());
+    config::kMaxLevel = saved_max_level;
+
+    // Nor is LX.R while LX.L holds files, under cursor compaction
+    const bool saved_cursor = runtime::use_cursor_compaction;
+    runtime::use_cursor_compaction = true;
+    ASSERT_EQ(0, h.vset()->EstimatedPendingCompactionBytes());
+    runtime::use_cursor_compaction = saved_cursor;
+  }
+  config::primary_storage_path = NULL;
+}
+
 }  // namespace hlsm
 
 int main(int argc, char** argv) {
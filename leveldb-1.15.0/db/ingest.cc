@@ -0,0 +1,386 @@
+#include <algorithm>
+
+#include "leveldb/bulk_load.h"
+#include "leveldb/env.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/hlsm.h"
+#include "leveldb/table.h"
+#include "leveldb/table_builder.h"
+#include "db/db_impl.h"
+#include "db/dbformat.h"
+#include "db/filename.h"
+#include "db/lazy_version_edit.h"
+#include "db/lazy_version_set.h"
+#include "db/table_cache.h"
+#include "db/version_set.h"
+#include "util/mutexlock.h"
+
+/*
+ * External table ingestion
+ *
+ * ExternalTableBuilder writes a table like any other, with internal keys
+ * 	at sequence number 0.  IngestExternalFiles() links the table into the
+ * 	database unchanged and records a global sequence number for it in the
+ * 	MANIFEST; the table cache shows the keys with that number.  So a
+ * 	compaction that reads the table writes the real sequence numbers.
+ *
+ * 	validate --> stop writes, flush the memtable, take a sequence number
+ * 		--> link or copy --> one edit --> resume writes
+ *
+ * As with BulkLoad(), hLSM keeps a copy of every table on the secondary for
+ * 	the lazy levels; it is made in the background like the copy of a
+ * 	table moved to a mirrored level.
+ */
+
+namespace leveldb {
+
+struct ExternalTableBuilder::Rep {
+  InternalKeyComparator icmp;
+  InternalFilterPolicy* ipolicy;
+  Options options;
+  TableBuilder* builder;
+  std::string last_key;
+  std::string key;
+  bool closed;
+
+  Rep(const Options& opt)
+      : icmp(opt.comparator),
+        ipolicy(opt.filter_policy == NULL ? NULL
+                : new InternalFilterPolicy(opt.filter_policy)),
+        options(opt),
+        builder(NULL),
+        closed(false) {
+    options.comparator = &icmp;
+    options.filter_policy = ipolicy;
+  }
+  ~Rep() {
+    delete builder;
+    delete ipolicy;
+  }
+};
+
+ExternalTableBuilder::ExternalTableBuilder(const Options& options,
+                                           WritableFile* file)
+    : rep_(new Rep(options)) {
+  rep_->builder = new TableBuilder(rep_->options, file);
+}
+
+ExternalTableBuilder::~ExternalTableBuilder() {
+  assert(rep_->closed);
+  delete rep_;
+}
+
+Status ExternalTableBuilder::Add(const Slice& key, const Slice& value) {
+  Rep* r = rep_;
+  assert(!r->closed);
+  if (r->builder->NumEntries() > 0 &&
+      r->icmp.user_comparator()->Compare(key, r->last_key) <= 0) {
+    return Status::InvalidArgument("external table keys out of order", key);
+  }
+  r->last_key.assign(key.data(), key.size());
+  r->key.clear();
+  AppendInternalKey(&r->key, ParsedInternalKey(key, 0, kTypeValue));
+  r->builder->Add(r->key, value);
+  return r->builder->status();
+}
+
+Status ExternalTableBuilder::Finish() {
+  assert(!rep_->closed);
+  rep_->closed = true;
+  return rep_->builder->Finish();
+}
+
+void ExternalTableBuilder::Abandon() {
+  assert(!rep_->closed);
+  rep_->closed = true;
+  rep_->builder->Abandon();
+}
+
+uint64_t ExternalTableBuilder::NumEntries() const {
+  return rep_->builder->NumEntries();
+}
+
+uint64_t ExternalTableBuilder::FileSize() const {
+  return rep_->builder->FileSize();
+}
+
+namespace {
+
+struct IngestedTable {
+  std::string path;
+  FileMetaData meta;  // number and keys set once placed
+  int level;
+};
+
+struct BySmallestKey {
+  const InternalKeyComparator* icmp;
+  bool operator()(const IngestedTable& a, const IngestedTable& b) const {
+    return icmp->Compare(a.meta.smallest, b.meta.smallest) < 0;
+  }
+};
+
+// Parse the key at iter, which must be valid, into *parsed and *key
+Status ParseBoundaryKey(Iterator* iter, const std::string& path,
+                        ParsedInternalKey* parsed, InternalKey* key) {
+  if (!ParseInternalKey(iter->key(), parsed)) {
+    return Status::Corruption("bad key in external table", path);
+  }
+  key->DecodeFrom(iter->key());
+  return Status::OK();
+}
+
+// Store the size and the first and last keys of the table at path in
+// *meta.  Only these two keys are checked for sequence number 0, which
+// ExternalTableBuilder gives every key; checking the others would read
+// the whole table.
+Status ReadExternalTable(Env* env, const Options& options,
+                         const std::string& path, FileMetaData* meta) {
+  Status s = env->GetFileSize(path, &meta->file_size);
+  RandomAccessFile* file = NULL;
+  if (s.ok()) {
+    s = env->NewRandomAccessFile(path, &file);
+  }
+  Table* table = NULL;
+  if (s.ok()) {
+    s = Table::Open(options, file, meta->file_size, &table);
+  }
+  if (s.ok()) {
+    Iterator* iter = table->NewIterator(ReadOptions());
+    ParsedInternalKey first, last;
+    iter->SeekToFirst();
+    if (iter->Valid()) {
+      s = ParseBoundaryKey(iter, path, &first, &meta->smallest);
+      if (s.ok()) {
+        iter->SeekToLast();
+      }
+      if (s.ok() && iter->Valid()) {
+        s = ParseBoundaryKey(iter, path, &last, &meta->largest);
+      }
+    }
+    if (s.ok()) {
+      s = iter->status();
+    }
+    if (s.ok() && !iter->Valid()) {
+      s = Status::InvalidArgument("empty or unreadable external table", path);
+    } else if (s.ok() && (first.sequence != 0 || last.sequence != 0)) {
+      s = Status::InvalidArgument("not written by ExternalTableBuilder", path);
+    }
+    delete iter;
+  }
+  delete table;
+  delete file;
+  return s;
+}
+
+// Copy src to the table file fname
+Status CopyExternalTable(Env* env, const std::string& src,
+                         const std::string& fname) {
+  SequentialFile* in;
+  Status s = env->NewSequentialFile(src, &in);
+  if (!s.ok()) {
+    return s;
+  }
+  WritableFile* out;
+  s = env->NewWritableFile(fname, &out);
+  if (!s.ok()) {
+    delete in;
+    return s;
+  }
+  const size_t kBufferSize = 1 << 20;
+  char* buffer = new char[kBufferSize];
+  while (s.ok()) {
+    Slice chunk;
+    s = in->Read(kBufferSize, &chunk, buffer);
+    if (!s.ok() || chunk.empty()) {
+      break;
+    }
+    s = out->Append(chunk);
+  }
+  delete[] buffer;
+  delete in;
+  if (s.ok()) s = out->Sync();
+  if (s.ok()) s = out->Close();
+  delete out;
+  return s;
+}
+
+// Deepest level of v for a table whose entries are newer than all of v:
+// above the first level overlapping [smallest, largest], and not below
+// the deepest level holding tables.  Under cursor compaction tables enter
+// a logical level through LX.R, like compaction outputs do.
+int PickIngestLevel(Version* v, const Slice& smallest, const Slice& largest) {
+  int bottom = 0;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    if (v->NumFiles(level) > 0) bottom = level;
+  }
+  int level = 0;
+  if (!v->OverlapInLevel(0, &smallest, &largest)) {
+    while (level < bottom &&
+           !v->OverlapInLevel(level + 1, &smallest, &largest)) {
+      level++;
+    }
+  }
+  if (hlsm::runtime::use_cursor_compaction && level % 2 == 1) {
+    level--;
+  }
+  return level;
+}
+
+// Whether table "number" needs a copy on the secondary at the level it is
+// registered with in the placement registry; hLSM needs one for the lazy
+// levels whatever the level
+bool IsMirroredIngest(uint64_t number) {
+  if (hlsm::config::secondary_storage_path == NULL) {
+    return false;
+  }
+  return hlsm::config::mode.ishLSM() || hlsm::is_mirrored_write(number);
+}
+
+}  // namespace
+
+Status DBImpl::IngestExternalFiles(const std::vector<std::string>& paths) {
+  std::vector<IngestedTable> tables(paths.size());
+  Status s;
+  for (size_t i = 0; s.ok() && i < paths.size(); i++) {
+    tables[i].path = paths[i];
+    if (!FILE_HAS_SUFFIX(paths[i], ".ldb")) {
+      return Status::InvalidArgument("external table not named *.ldb",
+                                     paths[i]);
+    }
+    s = ReadExternalTable(env_, options_, paths[i], &tables[i].meta);
+  }
+  if (!s.ok() || tables.empty()) {
+    return s;
+  }
+  BySmallestKey cmp;
+  cmp.icmp = &internal_comparator_;
+  std::sort(tables.begin(), tables.end(), cmp);
+  for (size_t i = 1; i < tables.size(); i++) {
+    if (user_comparator()->Compare(tables[i-1].meta.largest.user_key(),
+                                   tables[i].meta.smallest.user_key()) >= 0) {
+      return Status::InvalidArgument("external tables overlap",
+                                     tables[i].path);
+    }
+  }
+
+  // Every entry of the database is older than the tables from here on, so
+  // that their level is decided by overlaps alone, and their file numbers
+  // are larger than those of the level-0 tables
+  MutexLock l(&mutex_);
+  Writer* w = StopWrites();
+  s = FlushMemTable();
+  SequenceNumber seq = 0;
+  if (s.ok()) {
+    seq = versions_->LastSequence() + 1;
+    versions_->SetLastSequence(seq);
+  }
+  Version* base = versions_->current();
+  for (size_t i = 0; s.ok() && i < tables.size(); i++) {
+    IngestedTable* t = &tables[i];
+    t->meta.number = versions_->NewFileNumber();
+    pending_outputs_.insert(t->meta.number);
+    const Slice smallest = t->meta.smallest.user_key();
+    const Slice largest = t->meta.largest.user_key();
+    t->level = PickIngestLevel(base, smallest, largest);
+  }
+
+  // on_both: written to both devices by the Env, as in FullMirror mode
+  std::vector<bool> mirrored(tables.size(), false);
+  std::vector<bool> on_both(tables.size(), false);
+  if (s.ok()) {
+    mutex_.Unlock();
+    for (size_t i = 0; s.ok() && i < tables.size(); i++) {
+      const IngestedTable& t = tables[i];
+      const std::string fname = TableFileName(dbname_, t.meta.number);
+      if (env_->LinkFile(t.path, fname).ok()) {
+        hlsm::runtime::placement.add_copy(t.meta.number,
+                                          hlsm::PlacementRegistry::kPrimary);
+      } else {
+        on_both[i] = hlsm::is_mirrored_write(fname);
+        s = CopyExternalTable(env_, t.path, fname);
+      }
+      hlsm::runtime::placement.set_level(t.meta.number, t.level);
+      mirrored[i] = IsMirroredIngest(t.meta.number);
+    }
+    mutex_.Lock();
+  }
+
+  // Compactions may have written tables across the key range of one in
+  // the meantime; they only hold older entries, so the level is picked
+  // again, as long as the copies stay right for it
+  VersionEdit* edit = NewVersionEdit(versions_);
+  base = versions_->current();
+  Version* current_lazy = NULL;
+  CALL_IF_HLSM(current_lazy = reinterpret_cast<LazyVersionSet*>(versions_)->current_lazy());
+  for (size_t i = 0; s.ok() && i < tables.size(); i++) {
+    IngestedTable* t = &tables[i];
+    const Slice smallest = t->meta.smallest.user_key();
+    const Slice largest = t->meta.largest.user_key();
+    const int level = PickIngestLevel(base, smallest, largest);
+    hlsm::runtime::placement.set_level(t->meta.number, level);
+    if (IsMirroredIngest(t->meta.number) != mirrored[i]) {
+      s = Status::IOError("level of external table changed, retry",
+                          t->path);
+      break;
+    }
+    t->level = level;
+
+    t->meta.smallest = InternalKey(smallest, seq, kTypeValue);
+    t->meta.largest = InternalKey(largest, seq, kTypeValue);
+
+    const FileMetaData& f = t->meta;
+    edit->AddFile(level, f.number, f.file_size, f.smallest, f.largest);
+    edit->SetGlobalSequence(f.number, seq);
+    bool placed = true;
+    CALL_IF_HLSM(placed = reinterpret_cast<LazyVersionEdit*>(edit)
+        ->AddLazyFileByRawLevel(level, f.number, f.file_size, f.smallest,
+            f.largest, current_lazy));
+    if (!placed) {
+      s = Status::IOError("no free delta level for external table, retry",
+                          t->path);
+    }
+  }
+  for (size_t i = 0; s.ok() && i < tables.size(); i++) {
+    bool placed = true;
+    CALL_IF_HLSM(placed = reinterpret_cast<LazyVersionEdit*>(edit)
+        ->CloseActiveDeltaLevelByRawLevel(tables[i].level));
+    if (!placed) {
+      s = Status::IOError("no free delta level for external table, retry",
+                          tables[i].path);
+    }
+  }
+  if (s.ok()) {
+    s = versions_->LogAndApply(edit, &mutex_);
+  }
+  delete edit;
+
+  if (s.ok()) {
+    InstallSuperVersion();
+    for (size_t i = 0; i < tables.size(); i++) {
+      const IngestedTable& t = tables[i];
+      if (mirrored[i] && !on_both[i]) {
+        OPQ_ADD_COPYFILE(hlsm::table_queue(t.meta.number),
+            new std::string(TableFileName(hlsm::config::primary_storage_path,
+                                          t.meta.number)), t.meta.number);
+      }
+      CompactionStats stats;
+      stats.bytes_written = t.meta.file_size;
+      stats_[t.level].Add(stats);
+    }
+    Log(options_.info_log, "Ingested %d tables at sequence %llu",
+        int(tables.size()), static_cast<unsigned long long>(seq));
+  }
+  ResumeWrites(w);
+
+  for (size_t i = 0; i < tables.size(); i++) {
+    pending_outputs_.erase(tables[i].meta.number);
+  }
+  if (!s.ok()) {
+    DeleteObsoleteFiles();  // the linked or copied tables
+  } else {
+    MaybeScheduleCompaction();
+  }
+  return s;
+}
+
+}  // namespace leveldb
@@ -26,7 +26,9 @@ enum Tag {
   kPrevLogNumber        = 9,
   kDeletedLazyFile		= 10,
   kNewLazyFile          = 11,
-  kDeltaLevelOffset		= 12
+  kDeltaLevelOffset		= 12,
+  kTwoPhaseEndLevel		= 13,
+  kGlobalSequence       = 14
 };
 
 LazyVersionEdit::LazyVersionEdit() {Clear();}
@@ -46,8 +48,11 @@ void LazyVersionEdit::Clear() {
   has_prev_log_number_ = false;
   has_next_file_number_ = false;
   has_last_sequence_ = false;
+  has_two_phase_end_level_ = false;
+  two_phase_end_level_ = 0;
   deleted_files_.clear();
   new_files_.clear();
+  global_seqs_.clear();
   deleted_files_lazy_.clear();
   new_files_lazy_.clear();
 }
@@ -80,6 +85,11 @@ void LazyVersionEdit::EncodeTo(std::string* dst) const {
     PutLengthPrefixedSlice(dst, compact_pointers_[i].second.Encode());
   }
 
+  if (has_two_phase_end_level_) {
+    PutVarint32(dst, kTwoPhaseEndLevel);
+    PutVarint32(dst, two_phase_end_level_);
+  }
+
   for (size_t i = 0; i < hlsm::runtime::kLogicalLevels; i++) {
     PutVarint32(dst, kDeltaLevelOffset);
     PutVarint32(dst, i);  // level
@@ -114,6 +124,12 @@ void LazyVersionEdit::EncodeTo(std::string* dst) const {
     PutLengthPrefixedSlice(dst, f.largest.Encode());
   }
 
+  for (size_t i = 0; i < global_seqs_.size(); i++) {
+    PutVarint32(dst, kGlobalSequence);
+    PutVarint64(dst, global_seqs_[i].first);   // file number
+    PutVarint64(dst, global_seqs_[i].second);  // sequence number
+  }
+
   for (size_t i = 0; i < new_files_lazy_.size(); i++) {
     const FileMetaData& f = new_files_lazy_[i].second;
     PutVarint32(dst, kNewLazyFile);
@@ -167,6 +183,7 @@ Status LazyVersionEdit::DecodeFrom(const Slice& src) {
   // Temporary storage for parsing
   int level;
   uint64_t number;
+  SequenceNumber seq;
   FileMetaData f;
   Slice str;
   InternalKey key;
@@ -198,6 +215,16 @@ Status LazyVersionEdit::DecodeFrom(const Slice& src) {
         }
         break;
 
+      case kTwoPhaseEndLevel:
+        if (GetVarint32(&input, &start) &&
+            start >= 1 && start <= hlsm::runtime::kMaxTwoPhaseEndLevel) {
+          two_phase_end_level_ = start;
+          has_two_phase_end_level_ = true;
+        } else {
+          msg = "two-phase end level";
+        }
+        break;
+
       case kLogNumber:
         if (GetVarint64(&input, &log_number_)) {
           has_log_number_ = true;
@@ -269,6 +296,15 @@ Status LazyVersionEdit::DecodeFrom(const Slice& src) {
         }
         break;
 
+      case kGlobalSequence:
+        if (GetVarint64(&input, &number) &&
+            GetVarint64(&input, &seq)) {
+          global_seqs_.push_back(std::make_pair(number, seq));
+        } else {
+          msg = "global sequence number";
+        }
+        break;
+
       case kNewLazyFile:
         if (GetLazyLevel(&input, &level) &&
             GetVarint64(&input, &f.number) &&
@@ -321,6 +357,10 @@ std::string LazyVersionEdit::DebugString() const {
     r.append("\n  LastSeq: ");
     AppendNumberTo(&r, last_sequence_);
   }
+  if (has_two_phase_end_level_) {
+    r.append("\n  TwoPhaseEndLevel: ");
+    AppendNumberTo(&r, two_phase_end_level_);
+  }
   for (size_t i = 0; i < compact_pointers_.size(); i++) {
     r.append("\n  CompactPointer: ");
     AppendNumberTo(&r, compact_pointers_[i].first);
@@ -358,6 +398,12 @@ std::string LazyVersionEdit::DebugString() const {
     r.append(" .. ");
     r.append(f.largest.DebugString());
   }
+  for (size_t i = 0; i < global_seqs_.size(); i++) {
+    r.append("\n  GlobalSequence: ");
+    AppendNumberTo(&r, global_seqs_[i].first);
+    r.append(" ");
+    AppendNumberTo(&r, global_seqs_[i].second);
+  }
   r.append("\n}\n");
   return r;
 }
@@ -404,7 +450,7 @@ int LazyVersionEdit::UpdateLazyLevels(int level, VersionSet* v, Compaction* cons
 		for (int i = 0; i < c->num_input_files(0); i++) {
 		  FileMetaData *f = c->input(0,i);
 		  std::string *copy_from = new std::string(TableFileName(hlsm::config::primary_storage_path, f->number));
-		  OPQ_ADD_COPYFILE(hlsm::runtime::op_queue, copy_from, f->number);
+		  OPQ_ADD_COPYFILE(hlsm::table_queue(f->number), copy_from, f->number);
 		  // add f to X.NEW
 		  AddLazyFile(hlsm::get_hlsm_new_level(level),
 				  f->number, f->file_size, f->smallest, f->largest);
@@ -447,7 +493,7 @@ int LazyVersionEdit::UpdateLazyLevels(int level, VersionSet* v, Compaction* cons
 	  return 0;
  }
 
-void LazyVersionEdit::AddLazyFileByRawLevel(int raw_level, uint64_t file,
+bool LazyVersionEdit::AddLazyFileByRawLevel(int raw_level, uint64_t file,
 		uint64_t file_size,
 		const InternalKey& smallest,
 		const InternalKey& largest,
@@ -466,7 +512,9 @@ void LazyVersionEdit::AddLazyFileByRawLevel(int raw_level, uint64_t file,
 
 			// check if current delta level is full (its size equals the size of the new level above)
 			//	raw_level >= 2 due to llevel > 0
-			if (hlsm::max_fnum_in_level(raw_level - 2) - 1 <= lv->NumFiles(dlevel) ) {
+			if (hlsm::max_fnum_in_level(raw_level - 2) <= lv->NumFiles(dlevel) + NumNewLazyFiles(dlevel)) {
+				if (!CanAdvanceActiveDeltaLevel(llevel))
+					return false;
 				AdvanceActiveDeltaLevel(llevel);
 			}
 
@@ -475,6 +523,27 @@ void LazyVersionEdit::AddLazyFileByRawLevel(int raw_level, uint64_t file,
 		AddLazyFile(hlsm::get_pure_mirror_level(raw_level),
 				file, file_size, smallest, largest);
 	}
+	return true;
+}
+
+bool LazyVersionEdit::CloseActiveDeltaLevelByRawLevel(int raw_level) {
+	int llevel = hlsm::get_logical_level(raw_level);
+	if (llevel > 0 && llevel <= hlsm::runtime::two_phase_end_level &&
+			NumNewLazyFiles(hlsm::get_active_delta_level(delta_meta_, llevel)) > 0) {
+		if (!CanAdvanceActiveDeltaLevel(llevel))
+			return false;
+		AdvanceActiveDeltaLevel(llevel);
+	}
+	return true;
+}
+
+int LazyVersionEdit::NumNewLazyFiles(int level) const {
+	int n = 0;
+	for (size_t i = 0; i < new_files_lazy_.size(); i++) {
+		if (new_files_lazy_[i].first == level)
+			n++;
+	}
+	return n;
 }
 
 }  // namespace leveldb
@@ -32,10 +32,22 @@ class LazyVersionEdit: public leveldb::VersionEdit {
     DEBUG_INFO(3,"size: %lu fnum: %lu\tlevel: %d\tfp: %p\n", file_size, file, level, &f);
   }
 
-  void AddLazyFileByRawLevel(int raw_level, uint64_t file,
+  // Place a table of raw level raw_level in the lazy levels; a delta
+  //	level that fills up with the files of lv and this edit is closed.
+  //	Returns false if it cannot be closed because every other delta
+  //	level of the logical level is in use; the edit must then be dropped
+  bool AddLazyFileByRawLevel(int raw_level, uint64_t file,
                uint64_t file_size, const InternalKey& smallest,
                const InternalKey& largest, Version *lv);
 
+  // Close the active delta level of the logical level of raw_level, if
+  //	this edit added files to it, so that later files start a new one.
+  //	Returns false as AddLazyFileByRawLevel() does
+  bool CloseActiveDeltaLevelByRawLevel(int raw_level);
+
+  // Files this edit adds to lazy level "level"
+  int NumNewLazyFiles(int level) const;
+
   // Delete the specified "file" from the specified "level".
   void DeleteLazyFile(int level, uint64_t file) {
 	deleted_files_lazy_.insert(std::make_pair(level, file));
@@ -56,6 +68,13 @@ class LazyVersionEdit: public leveldb::VersionEdit {
 
   void SetDeltaLevels(VersionSet* v);
 
+  // Logical level where two-phase compaction ends; LazyVersionSet stamps
+  // the current one on edits that do not move it
+  void SetTwoPhaseEndLevel(int level) {
+	  has_two_phase_end_level_ = true;
+	  two_phase_end_level_ = level;
+  }
+
   struct Output {
     uint64_t number;
     uint64_t file_size;
@@ -63,19 +82,20 @@ class LazyVersionEdit: public leveldb::VersionEdit {
   };
   int UpdateLazyLevels(int, VersionSet*, Compaction* const, std::vector<Output> &);
 
+  // The active delta level of llevel may move on without wrapping onto
+  //	the oldest delta level still in use (start + 1)
+  inline bool CanAdvanceActiveDeltaLevel(int llevel) const {
+	  const uint32_t n = hlsm::runtime::delta_level_num;
+	  return delta_meta_[llevel].active % n != delta_meta_[llevel].start % n;
+  }
+
   inline void AdvanceActiveDeltaLevel(int llevel) {
-	  assert(delta_meta_[llevel].active != delta_meta_[llevel].start);
+	  assert(CanAdvanceActiveDeltaLevel(llevel));
 	  delta_meta_[llevel].active++;
 	  if (delta_meta_[llevel].active > hlsm::runtime::delta_level_num)
 		  delta_meta_[llevel].active = 1;
   }
 
-  int AdvanceActiveDeltaLevelByRawLevel(int raw_level) {
-  	int llevel = hlsm::get_logical_level(raw_level);
-  	AdvanceActiveDeltaLevel(llevel);
-  	return 1;
-  }
-
   inline void RollForwardDeltaLevels(int llevel) {
   	  delta_meta_[llevel].start = delta_meta_[llevel].clear;
   	  delta_meta_[llevel].clear = delta_meta_[llevel].active;
@@ -94,6 +114,8 @@ class LazyVersionEdit: public leveldb::VersionEdit {
   DeletedFileSet deleted_files_lazy_;
   std::vector< std::pair<int, FileMetaData> > new_files_lazy_;
   hlsm::delta_meta_t delta_meta_[hlsm::runtime::kLogicalLevels];
+  bool has_two_phase_end_level_;
+  int two_phase_end_level_;
 };
 
 }  // namespace leveldb
@@ -1,5 +1,7 @@
 #include <algorithm>
 #include <stdio.h>
+#include <map>
+#include <set>
 #include <bits/algorithmfwd.h>
 
 #include "db/version_set.h"
@@ -36,7 +38,7 @@ class LazyVersionSet::Builder {
   typedef std::set<FileMetaData*, BySmallestKey> FileSet;
   struct LevelState {
     std::set<uint64_t> deleted_files;
-    FileSet* added_files;
+    FileSet* added_files;  // NULL until the first file is added
   };
 
   LazyVersionSet* vset_;
@@ -53,19 +55,31 @@ class LazyVersionSet::Builder {
         lazy_base_(lazy_base) {
     base_->Ref();
     lazy_base_->Ref();
-    BySmallestKey cmp;
-    cmp.internal_comparator = &vset_->icmp_;
     for (int level = 0; level < leveldb::config::kNumLevels; level++) {
-      levels_[level].added_files = new FileSet(cmp);
+      levels_[level].added_files = NULL;
     }
     for (int level = 0; level < hlsm::runtime::kNumLazyLevels; level++) {
-      lazy_levels_[level].added_files = new FileSet(cmp);
+      lazy_levels_[level].added_files = NULL;
+    }
+  }
+
+  // Most edits touch a handful of the lazy levels, so the per-level sets
+  // are only created on demand.
+  FileSet* AddedFiles(LevelState* state) {
+    if (state->added_files == NULL) {
+      BySmallestKey cmp;
+      cmp.internal_comparator = &vset_->icmp_;
+      state->added_files = new FileSet(cmp);
     }
+    return state->added_files;
   }
 
   inline static void FreeLevels(LevelState *levels, int num) {
 	  for (int level = 0; level < num; level++) {
 		  const FileSet* added = levels[level].added_files;
+		  if (added == NULL) {
+			  continue;
+		  }
 		  std::vector<FileMetaData*> to_unref;
 		  to_unref.reserve(added->size());
 		  for (FileSet::const_iterator it = added->begin();
@@ -151,7 +165,7 @@ class LazyVersionSet::Builder {
       if (f->allowed_seeks < 100) f->allowed_seeks = 100;
 
       levels_[level].deleted_files.erase(f->number);
-      levels_[level].added_files->insert(f);
+      AddedFiles(&levels_[level])->insert(f);
     }
 
     for (size_t i = 0; i < edit->new_files_lazy_.size(); i++) {
@@ -162,7 +176,7 @@ class LazyVersionSet::Builder {
       f->allowed_seeks = 1000000;
 
       lazy_levels_[level].deleted_files.erase(f->number);
-      lazy_levels_[level].added_files->insert(f);
+      AddedFiles(&lazy_levels_[level])->insert(f);
     }
   }
 
@@ -170,7 +184,7 @@ class LazyVersionSet::Builder {
     if (levels[level].deleted_files.count(f->number) > 0) {
       // File is deleted: do nothing
     } else {
-      std::vector<FileMetaData*>* files = &v->files_[level];
+      std::vector<FileMetaData*>* files = v->files_[level].mutable_files();
       if (level > 0 && !files->empty()) {
         // Must not overlap
       	DEBUG_INFO(3, "Versions: %p, level: %d, file: %lu\n", v, level, f->number);
@@ -187,13 +201,22 @@ class LazyVersionSet::Builder {
     BySmallestKey cmp;
     cmp.internal_comparator = &vset_->icmp_;
     for (int level = 0; level < kLevel; level++) {
+      const FileSet* added = levels[level].added_files;
+      if (added == NULL && levels[level].deleted_files.empty()) {
+        // Level untouched by the edits: share the base list
+        v->files_[level].ShareFrom(base->files_[level]);
+        continue;
+      }
+      if (added == NULL) {
+        added = AddedFiles(&levels[level]);
+      }
+
       // Merge the set of added files with the set of pre-existing files.
       // Drop any deleted files.  Store the result in *v.
       const std::vector<FileMetaData*>& base_files = base->files_[level];
       std::vector<FileMetaData*>::const_iterator base_iter = base_files.begin();
       std::vector<FileMetaData*>::const_iterator base_end = base_files.end();
-      const FileSet* added = levels[level].added_files;
-      v->files_[level].reserve(base_files.size() + added->size());
+      v->files_[level].mutable_files()->reserve(base_files.size() + added->size());
       for (FileSet::const_iterator added_iter = added->begin();
            added_iter != added->end();
            ++added_iter) {
@@ -246,7 +269,8 @@ LazyVersionSet::LazyVersionSet(const std::string& dbname,
                        const InternalKeyComparator* cmp)
     :VersionSet(dbname, options, table_cache, cmp),
      dummy_lazy_versions_(this, hlsm::runtime::kNumLazyLevels),
-     current_lazy_(NULL) {
+     current_lazy_(NULL),
+     delta_merge_level_(-1) {
   AppendVersion(new Version(this), new Version(this, hlsm::runtime::kNumLazyLevels) );
   DEBUG_INFO(1, "cmp = %p (icmp = %p), %s (%s)\n",
 		  cmp, icmp_.user_comparator(), cmp->Name(), icmp_.Name());
@@ -294,6 +318,7 @@ void LazyVersionSet::AppendVersion(Version* v, Version* lv) {
 }
 
 Status LazyVersionSet::LogAndApply(VersionEdit* edit, port::Mutex* mu) {
+  BeginLogAndApply(mu);
   if (edit->has_log_number_) {
     assert(edit->log_number_ >= log_number_);
     assert(edit->log_number_ < next_file_number_);
@@ -307,12 +332,16 @@ Status LazyVersionSet::LogAndApply(VersionEdit* edit, port::Mutex* mu) {
 
   edit->SetNextFile(next_file_number_);
   edit->SetLastSequence(last_sequence_);
+  LazyVersionEdit* lazy_edit = reinterpret_cast<LazyVersionEdit*>(edit);
+  if (!lazy_edit->has_two_phase_end_level_) {
+    lazy_edit->SetTwoPhaseEndLevel(hlsm::runtime::two_phase_end_level);
+  }
 
   Version* v = new Version(this);
   Version* lv = new Version(this, hlsm::runtime::kNumLazyLevels);
   {
 	Builder builder(this, current_, current_lazy_);
-    builder.Apply(reinterpret_cast<LazyVersionEdit*>(edit) );
+    builder.Apply(lazy_edit);
     builder.SaveTo(v, lv);
   }
   Finalize(v); // calculate scores for each level
@@ -362,7 +391,11 @@ Status LazyVersionSet::LogAndApply(VersionEdit* edit, port::Mutex* mu) {
 
   // Install the new version
   if (s.ok()) {
+    ApplyGlobalSequences(*edit);
+    SetLookupOrder(lv, lazy_edit->two_phase_end_level_);
     AppendVersion(v, lv);
+    InstallTwoPhaseEndLevel(lazy_edit->two_phase_end_level_);
+    FinalizeDeltaMerge();
     log_number_ = edit->log_number_;
     prev_log_number_ = edit->prev_log_number_;
   } else {
@@ -378,11 +411,17 @@ Status LazyVersionSet::LogAndApply(VersionEdit* edit, port::Mutex* mu) {
 
   DEBUG_LEVEL_CHECK_NOLOCK(1, PrintVersionSet());
 
+  EndLogAndApply();
   return s;
 }
 
+// Upper bound on the lazy files saved per snapshot record
+static const size_t kSnapshotFilesPerRecord = 1024;
+
 Status LazyVersionSet::WriteSnapshot(log::Writer* log) {
-  // TODO: Break up into multiple records to reduce memory usage on recovery?
+  // The lazy levels are saved in records of bounded size after the
+  // regular levels, skipping empty levels.  Every record carries the
+  // delta level offsets since Builder::Apply installs them per edit.
 
   // Save metadata
   LazyVersionEdit edit;
@@ -399,6 +438,7 @@ Status LazyVersionSet::WriteSnapshot(log::Writer* log) {
 
   // Save delta level offsets
   edit.SetDeltaLevels(delta_meta_);
+  edit.SetTwoPhaseEndLevel(hlsm::runtime::two_phase_end_level);
 
   // Save files
   for (int level = 0; level < leveldb::config::kNumLevels; level++) {
@@ -408,18 +448,39 @@ Status LazyVersionSet::WriteSnapshot(log::Writer* log) {
       edit.AddFile(level, f->number, f->file_size, f->smallest, f->largest);
     }
   }
+  std::set<uint64_t> live;
+  AddLiveFiles(&live);
+  AddLiveLazyFiles(&live);
+  SaveGlobalSequences(live, &edit);
 
-  for (int level = 0; level < hlsm::runtime::kNumLazyLevels; level++) {
+  std::string record;
+  edit.EncodeTo(&record);
+  Status s = log->AddRecord(record);
+
+  LazyVersionEdit lazy_edit;
+  size_t pending = 0;
+  for (int level = 0; s.ok() && level < hlsm::runtime::kNumLazyLevels; level++) {
     const std::vector<FileMetaData*>& files = current_lazy_->files_[level];
-    for (size_t i = 0; i < files.size(); i++) {
+    for (size_t i = 0; s.ok() && i < files.size(); i++) {
       const FileMetaData* f = files[i];
-      edit.AddLazyFile(level, f->number, f->file_size, f->smallest, f->largest);
+      lazy_edit.AddLazyFile(level, f->number, f->file_size, f->smallest, f->largest);
+      if (++pending == kSnapshotFilesPerRecord) {
+        lazy_edit.SetDeltaLevels(delta_meta_);
+        record.clear();
+        lazy_edit.EncodeTo(&record);
+        s = log->AddRecord(record);
+        lazy_edit.Clear();
+        pending = 0;
+      }
     }
   }
-
-  std::string record;
-  edit.EncodeTo(&record);
-  return log->AddRecord(record);
+  if (s.ok() && pending > 0) {
+    lazy_edit.SetDeltaLevels(delta_meta_);
+    record.clear();
+    lazy_edit.EncodeTo(&record);
+    s = log->AddRecord(record);
+  }
+  return s;
 }
 
 
@@ -457,6 +518,7 @@ Status LazyVersionSet::Recover() {
   uint64_t last_sequence = 0;
   uint64_t log_number = 0;
   uint64_t prev_log_number = 0;
+  int two_phase_end_level = -1;
   Builder builder(this, current_, current_lazy_);
 
   {
@@ -479,6 +541,7 @@ Status LazyVersionSet::Recover() {
 
       if (s.ok()) {
         builder.Apply(&edit);
+        ApplyGlobalSequences(edit);
       }
 
       if (edit.has_log_number_) {
@@ -500,6 +563,10 @@ Status LazyVersionSet::Recover() {
         last_sequence = edit.last_sequence_;
         have_last_sequence = true;
       }
+
+      if (edit.has_two_phase_end_level_) {
+        two_phase_end_level = edit.two_phase_end_level_;
+      }
     }
   }
   delete file;
@@ -528,7 +595,13 @@ Status LazyVersionSet::Recover() {
     builder.SaveTo(v, lv);
     // Install recovered version
     Finalize(v);
+    SetLookupOrder(lv, two_phase_end_level > 0 ? two_phase_end_level
+                                               : hlsm::runtime::two_phase_end_level);
     AppendVersion(v, lv);
+    if (two_phase_end_level > 0) { // written before the level could move
+      InstallTwoPhaseEndLevel(two_phase_end_level);
+    }
+    FinalizeDeltaMerge();
     manifest_file_number_ = next_file;
     next_file_number_ = next_file + 1;
     last_sequence_ = last_sequence;
@@ -539,11 +612,306 @@ Status LazyVersionSet::Recover() {
   return s;
 }
 
+void LazyVersionSet::FinalizeDeltaMerge() {
+  const Comparator* ucmp = icmp_.user_comparator();
+  double best_score = 0;
+  delta_merge_level_ = -1;
+
+  for (int llevel = 1; llevel <= hlsm::runtime::two_phase_end_level; llevel++) {
+    std::vector<uint32_t> dlevels = hlsm::get_mergeable_delta_levels(delta_meta_, llevel);
+    std::vector<const FileMetaData*> first, last;
+    for (size_t i = 0; i < dlevels.size(); i++) {
+      const LevelFiles& files = current_lazy_->files_[dlevels[i]];
+      if (!files.empty()) {
+        first.push_back(files[0]);
+        last.push_back(files[files.size() - 1]);
+      }
+    }
+    if (first.size() < 2) {
+      continue;
+    }
+
+    // Deepest stack of delta levels a single lookup may have to probe
+    int depth = 0;
+    for (size_t i = 0; i < first.size(); i++) {
+      const Slice start = first[i]->smallest.user_key();
+      int covered = 0;
+      for (size_t j = 0; j < first.size(); j++) {
+        if (ucmp->Compare(first[j]->smallest.user_key(), start) <= 0 &&
+            ucmp->Compare(last[j]->largest.user_key(), start) >= 0) {
+          covered++;
+        }
+      }
+      depth = std::max(depth, covered);
+    }
+
+    double score = 0;
+    if (hlsm::config::delta_merge_trigger > 0) {
+      score = first.size() / static_cast<double>(hlsm::config::delta_merge_trigger);
+    }
+    if (hlsm::config::delta_merge_overlap_trigger > 0) {
+      score = std::max(score,
+          depth / static_cast<double>(hlsm::config::delta_merge_overlap_trigger));
+    }
+    DEBUG_INFO(2, "llevel: %d, delta levels: %lu, depth: %d, score: %.3f\n",
+        llevel, first.size(), depth, score);
+    if (score >= 1 && score > best_score) {
+      best_score = score;
+      delta_merge_level_ = llevel;
+    }
+  }
+}
+
+void LazyVersionSet::SetLookupOrder(Version* lv, int end) {
+  const int width = hlsm::runtime::delta_level_num + 1;
+  std::vector<int>& order = lv->lookup_order_;
+  order.clear();
+  order.push_back(0);
+  order.push_back(1);
+  for (int llevel = 1; llevel <= end; llevel++) {
+    uint32_t delta = delta_meta_[llevel].active;
+    for (int i = 0; i < hlsm::runtime::delta_level_num; i++) {
+      order.push_back(llevel * width + 1 - delta);
+      delta = (delta > 1) ? delta - 1 : hlsm::runtime::delta_level_num;
+    }
+    order.push_back(llevel * width + 1); // X.NEW, or the first pure mirror
+  }
+  for (int level = end * width + 2; level < hlsm::runtime::kNumLazyLevels; level++) {
+    order.push_back(level);
+  }
+  assert(order.size() == static_cast<size_t>(hlsm::runtime::kNumLazyLevels));
+}
+
+void LazyVersionSet::InstallTwoPhaseEndLevel(int level) {
+  if (level != hlsm::runtime::two_phase_end_level) {
+    hlsm::runtime::two_phase_end_level = level;
+    hlsm::runtime::mirror_start_level = level * 2;
+  }
+}
+
+void LazyVersionSet::LazyLevelSummary(std::string* out) {
+  const int end = hlsm::runtime::two_phase_end_level;
+  const int width = hlsm::runtime::delta_level_num + 1;
+  const int first_mirror = end * width + 1;
+  char buf[200];
+  snprintf(buf, sizeof(buf), "Two-phase end level: %d, mirror start level: %d\n"
+           " Lazy  Files  Size(MB)  Level\n"
+           "-----------------------------------------------\n",
+           end, hlsm::runtime::mirror_start_level);
+  out->append(buf);
+  for (int level = 0; level < hlsm::runtime::kNumLazyLevels; level++) {
+    const std::vector<FileMetaData*>& files = current_lazy_->files_[level];
+    if (files.empty()) {
+      continue;
+    }
+    char role[64];
+    if (level < 2) {
+      snprintf(role, sizeof(role), "mirror of L%d", level);
+    } else if (level >= first_mirror) {
+      snprintf(role, sizeof(role), "mirror of L%d", level - first_mirror + 2 * (end + 1));
+    } else if (level % width == 1) {
+      snprintf(role, sizeof(role), "LL%d new", level / width);
+    } else {
+      const int llevel = (level - 2) / width + 1;
+      const int delta = llevel * width + 1 - level;
+      snprintf(role, sizeof(role), "LL%d delta %d%s", llevel, delta,
+               (uint32_t) delta == delta_meta_[llevel].active ? " (active)" : "");
+    }
+    snprintf(buf, sizeof(buf), "%5d %6d %9.1f  %s\n", level, int(files.size()),
+             hlsm::TotalFileSize(files) / 1048576.0, role);
+    out->append(buf);
+  }
+  for (int llevel = 1; llevel <= end; llevel++) {
+    snprintf(buf, sizeof(buf), "LL%d deltas: start %u, clear %u, active %u, "
+             "%d mergeable\n", llevel, delta_meta_[llevel].start,
+             delta_meta_[llevel].clear, delta_meta_[llevel].active,
+             int(hlsm::get_mergeable_delta_levels(delta_meta_, llevel).size()));
+    out->append(buf);
+  }
+}
+
+void LazyVersionSet::GetLevelTuning(hlsm::LevelTuning* t) {
+  const int end = hlsm::runtime::two_phase_end_level;
+  // Lazy levels from the NEW sub-level above the end level on go away
+  //	when two-phase compaction ends one level earlier
+  const int first_dropped = (end - 1) * (hlsm::runtime::delta_level_num + 1) + 1;
+  std::set<uint64_t> lazy, kept;
+  std::map<uint64_t, uint64_t> dropped;
+  t->level = end;
+  t->used = 0;
+
+  for (int level = 0; level < hlsm::runtime::kNumLazyLevels; level++) {
+    const std::vector<FileMetaData*>& files = current_lazy_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      const FileMetaData* f = files[i];
+      if (lazy.insert(f->number).second) {
+        t->used += f->file_size;
+      }
+      if (level >= first_dropped) {
+        dropped[f->number] = f->file_size;
+      } else {
+        kept.insert(f->number);
+      }
+    }
+  }
+
+  uint64_t to_copy = 0;
+  t->extend_cost = 0;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    const bool mirrored = level >= 2 * end ||
+        level <= hlsm::runtime::top_mirror_end_level;
+    const std::vector<FileMetaData*>& files = current_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      const FileMetaData* f = files[i];
+      const bool on_secondary = mirrored || lazy.count(f->number) > 0;
+      if (mirrored && lazy.count(f->number) == 0) {
+        t->used += f->file_size;
+      }
+      if (mirrored) {
+        kept.insert(f->number);
+      } else if (level >= 2 * end - 2 && !on_secondary) {
+        to_copy += f->file_size;
+      }
+      if (level == 2 * end + 2 || level == 2 * end + 3) {
+        t->extend_cost += f->file_size;
+      }
+    }
+  }
+
+  uint64_t freed = 0;
+  for (std::map<uint64_t, uint64_t>::const_iterator it = dropped.begin();
+       it != dropped.end(); ++it) {
+    if (kept.count(it->first) == 0) {
+      freed += it->second;
+    }
+  }
+  t->shrink_gain = static_cast<int64_t>(freed) - static_cast<int64_t>(to_copy);
+}
+
+bool LazyVersionSet::CopyMirrorLevels() {
+  bool ready = true;
+  const int end = hlsm::runtime::two_phase_end_level;
+  for (int level = std::max(hlsm::runtime::mirror_start_level, 0);
+       level < 2 * end + 2 && level < config::kNumLevels; level++) {
+    const std::vector<FileMetaData*>& files = current_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      const uint64_t number = files[i]->number;
+      hlsm::TablePlacement p;
+      if (hlsm::runtime::placement.lookup(number, &p) &&
+          (p.migrations > 0 || p.writing_secondary)) {
+        ready = false; // a copy is on its way
+      } else if (!env_->FileExists(hlsm::secondary_table_file(number))) {
+        OPQ_ADD_COPYFILE(hlsm::table_queue(number),
+            new std::string(TableFileName(hlsm::config::primary_storage_path, number)),
+            number);
+        ready = false;
+      }
+    }
+  }
+  return ready;
+}
+
+/*
+ *	end: the new two-phase end level, X = end + 1
+ *	drop X-1.NEW, the deltas of X and the pure mirrored levels
+ *	add X.R, X.L, ... to the pure mirrored levels below end
+ *	reset the delta level meta from X on
+ */
+Status LazyVersionSet::ShrinkTwoPhase(port::Mutex* mu) {
+  const int end = hlsm::runtime::two_phase_end_level - 1;
+  assert(end >= 1);
+  LazyVersionEdit edit;
+  edit.SetDeltaLevels(delta_meta_);
+
+  const int first_dropped = end * (hlsm::runtime::delta_level_num + 1) + 1;
+  for (int level = first_dropped; level < hlsm::runtime::kNumLazyLevels; level++) {
+    const std::vector<FileMetaData*>& files = current_lazy_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      edit.DeleteLazyFile(level, files[i]->number);
+    }
+  }
+  for (int level = 2 * end + 2; level < config::kNumLevels; level++) {
+    const std::vector<FileMetaData*>& files = current_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      const FileMetaData* f = files[i];
+      edit.AddLazyFile(hlsm::get_pure_mirror_level(level, end),
+          f->number, f->file_size, f->smallest, f->largest);
+    }
+  }
+  for (int llevel = end + 1; llevel < hlsm::runtime::kLogicalLevels; llevel++) {
+    edit.delta_meta_[llevel] = hlsm::delta_meta_t();
+  }
+  edit.SetTwoPhaseEndLevel(end);
+
+  return LogAndApply(&edit, mu);
+}
+
+/*
+ *	end: the new two-phase end level
+ *	drop the pure mirrored levels
+ *	end.R -> end.R2, end.L -> end.R1: two delta levels ready to be merged
+ *	add the levels below end to the pure mirrored levels
+ */
+Status LazyVersionSet::ExtendTwoPhase(port::Mutex* mu) {
+  const int end = hlsm::runtime::two_phase_end_level + 1;
+  assert(end <= hlsm::runtime::kMaxTwoPhaseEndLevel);
+  LazyVersionEdit edit;
+  edit.SetDeltaLevels(delta_meta_);
+
+  const int first_dropped = (end - 1) * (hlsm::runtime::delta_level_num + 1) + 1;
+  for (int level = first_dropped; level < hlsm::runtime::kNumLazyLevels; level++) {
+    const std::vector<FileMetaData*>& files = current_lazy_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      edit.DeleteLazyFile(level, files[i]->number);
+    }
+  }
+  for (int llevel = end; llevel < hlsm::runtime::kLogicalLevels; llevel++) {
+    edit.delta_meta_[llevel] = hlsm::delta_meta_t();
+  }
+  // Lookups probe the newer X.R before X.L
+  edit.delta_meta_[end].set_delta_meta(0, 0, 3);
+  for (int level = 2 * end; level < config::kNumLevels; level++) {
+    int lazy_level;
+    if (level == 2 * end) {
+      lazy_level = end * (hlsm::runtime::delta_level_num + 1) + 1 - 2;
+    } else if (level == 2 * end + 1) {
+      lazy_level = end * (hlsm::runtime::delta_level_num + 1) + 1 - 1;
+    } else {
+      lazy_level = hlsm::get_pure_mirror_level(level, end);
+    }
+    const std::vector<FileMetaData*>& files = current_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      const FileMetaData* f = files[i];
+      edit.AddLazyFile(lazy_level, f->number, f->file_size, f->smallest, f->largest);
+    }
+  }
+  edit.SetTwoPhaseEndLevel(end);
+
+  return LogAndApply(&edit, mu);
+}
+
+void LazyVersionSet::GetDeltaMergeInputs(int llevel,
+    std::vector<std::pair<int, FileMetaData*> >* inputs, int* target) {
+  std::vector<uint32_t> dlevels = hlsm::get_mergeable_delta_levels(delta_meta_, llevel);
+  assert(!dlevels.empty());
+  *target = dlevels.back(); // newest merged delta level
+  for (size_t i = 0; i < dlevels.size(); i++) {
+    const LevelFiles& files = current_lazy_->files_[dlevels[i]];
+    for (size_t j = 0; j < files.size(); j++) {
+      inputs->push_back(std::make_pair(static_cast<int>(dlevels[i]), files[j]));
+    }
+  }
+}
+
 void LazyVersionSet::AddLiveLazyFiles(std::set<uint64_t>* live) {
   for (Version* v = dummy_lazy_versions_.next_;
        v != &dummy_lazy_versions_;
        v = v->next_) {
     for (int level = 0; level < hlsm::runtime::kNumLazyLevels; level++) {
+      if (v->prev_ != &dummy_lazy_versions_ &&
+          v->files_[level].SharedWith(v->prev_->files_[level])) {
+        continue;  // Already added with the previous version
+      }
       const std::vector<FileMetaData*>& files = v->files_[level];
       for (size_t i = 0; i < files.size(); i++) {
         live->insert(files[i]->number);
@@ -563,7 +931,7 @@ Status LazyVersionSet::MoveFileDown(Compaction* c, port::Mutex *mutex_) {
 	edit->DeleteFile(level, f->number);
 	edit->AddFile(level + 1, f->number, f->file_size,
 			f->smallest, f->largest);
-	hlsm::runtime::table_level.add(f->number, level+1);
+	hlsm::runtime::placement.set_level(f->number, level+1);
 	if (level + 1 == hlsm::runtime::mirror_start_level) { // need to copy the content to secondary
 
 	}
@@ -589,13 +957,13 @@ Status LazyVersionSet::MoveFileDown(Compaction* c, port::Mutex *mutex_) {
 				f->number, f->file_size, f->smallest, f->largest);
 
 	} else if (llevel > 0 && llevel < hlsm::runtime::two_phase_end_level) {
-		OPQ_ADD_COPYFILE(hlsm::runtime::op_queue,
+		OPQ_ADD_COPYFILE(hlsm::table_queue(f->number),
 					new std::string(TableFileName(hlsm::config::primary_storage_path, f->number)), f->number);
 		edit->AddLazyFile(hlsm::get_hlsm_new_level(level),
 			f->number, f->file_size, f->smallest, f->largest);
 
 	} else if (llevel == hlsm::runtime::two_phase_end_level) {
-		OPQ_ADD_COPYFILE(hlsm::runtime::op_queue,
+		OPQ_ADD_COPYFILE(hlsm::table_queue(f->number),
 			new std::string(TableFileName(hlsm::config::primary_storage_path, f->number)), f->number);
 		// (X+1).R level since last 2-phase level has no new sub-level
 		int rlevel = hlsm::get_hlsm_new_level(level);
@@ -630,14 +998,14 @@ Status LazyVersionSet::MoveLevelDown(Compaction* c, port::Mutex *mutex_){
     	c->edit()->DeleteFile(level, f->number);
     	c->edit()->AddFile(level + 1, f->number, f->file_size,
     			f->smallest, f->largest);
-    	hlsm::runtime::table_level.add(f->number, c->level()+1);
+    	hlsm::runtime::placement.set_level(f->number, c->level()+1);
     	DEBUG_INFO(3, "[%d/%lu] number: %lu\t size: %lu\n", i+1, num_files, f->number, f->file_size);
     }
 
     if (c->level() + 1 == hlsm::runtime::mirror_start_level) {// need to copy the content to secondary
     	for(int i = 0; i < num_files; i++) {
     		leveldb::FileMetaData* f = files[i];
-    		OPQ_ADD_COPYFILE(hlsm::runtime::op_queue,
+    		OPQ_ADD_COPYFILE(hlsm::table_queue(f->number),
     			new std::string(leveldb::TableFileName(hlsm::config::primary_storage_path, f->number)), f->number);
     	}
     }
@@ -31,7 +31,42 @@ public:
 	bool isLazyLevelNonEmpty(int level) {return current_lazy_->NumFiles(level) > 0;}
 	void PrintVersionSet();
 
+	// Logical level whose delta levels should be merged next, or -1 if
+	// none exceeds hlsm::config::delta_merge_trigger or
+	// delta_merge_overlap_trigger.  Updated whenever a version is installed.
+	int DeltaMergeLevel() const { return delta_merge_level_; }
+
+	// Files in the mergeable delta levels of logical level "llevel" of the
+	// current lazy version, paired with their lazy level.  *target is set to
+	// the delta level that receives the merged run.
+	void GetDeltaMergeInputs(int llevel,
+			std::vector<std::pair<int, FileMetaData*> >* inputs, int* target);
+
+	// Space on the secondary and the cost of moving the two-phase end
+	// level by one, for hlsm::tune_two_phase_end_level()
+	void GetLevelTuning(hlsm::LevelTuning* t);
+
+	// One line per non-empty lazy level of the current lazy version, naming
+	// the role of the level, then the delta level offsets of each logical
+	// level ("hlsm.lazy-levels")
+	void LazyLevelSummary(std::string* out);
+
+	// Queue copies of the primary tables from mirror_start_level down to the
+	// level below the two-phase end level that have none on the secondary.
+	// Returns true once every one of them has a complete copy there.
+	bool CopyMirrorLevels();
+
+	// End two-phase compaction one level earlier: the deltas of the end level
+	// give way to mirrored copies of its tables.  The tables of the new end
+	// level must be on the secondary (see CopyMirrorLevels()).
+	Status ShrinkTwoPhase(port::Mutex* mu) EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+	// End two-phase compaction one level later: the mirrored copies of the
+	// next level become its first two delta levels.
+	Status ExtendTwoPhase(port::Mutex* mu) EXCLUSIVE_LOCKS_REQUIRED(mu);
+
 private:
+ class Builder;
  friend class Compaction;
  friend class Version;
  friend class Builder;
@@ -41,11 +76,23 @@ private:
 
  void AppendVersion(Version* v, Version* lv);
 
+ // Pick delta_merge_level_ from current_lazy_
+ void FinalizeDeltaMerge();
+
+ // Make "level" the two-phase end level of the running instance
+ void InstallTwoPhaseEndLevel(int level);
+
+ // Probe the delta levels of each logical level of "lv" from the active
+ //	one back around the ring, so that a wrapped ring is still read newest
+ //	first; two-phase compaction ends at "end"
+ void SetLookupOrder(Version* lv, int end);
+
 
  Version dummy_lazy_versions_;
  Version* current_lazy_;
 
  hlsm::delta_meta_t delta_meta_[hlsm::runtime::kLogicalLevels]; // new level - offset returns the current(active) delta level
+ int delta_merge_level_;
 
  // No copying allowed
  LazyVersionSet(const LazyVersionSet&);
@@ -8,7 +8,7 @@
 #include <string>
 #include "leveldb/db.h"
 #include "db/dbformat.h"
-#include "db/skiplist.h"
+#include "db/memtable_rep.h"
 #include "util/arena.h"
 
 namespace leveldb {
@@ -21,7 +21,11 @@ class MemTable {
  public:
   // MemTables are reference counted.  The initial reference count
   // is zero and the caller must call Ref() at least once.
-  explicit MemTable(const InternalKeyComparator& comparator);
+  //
+  // The entries are held as options->memtable_rep says, or in a skip
+  // list if options is NULL.
+  explicit MemTable(const InternalKeyComparator& comparator,
+                    const Options* options = NULL);
 
   // Increase reference count.
   void Ref() { ++refs_; }
@@ -66,20 +70,12 @@ class MemTable {
  private:
   ~MemTable();  // Private since only Unref() should be used to delete it
 
-  struct KeyComparator {
-    const InternalKeyComparator comparator;
-    explicit KeyComparator(const InternalKeyComparator& c) : comparator(c) { }
-    int operator()(const char* a, const char* b) const;
-  };
-  friend class MemTableIterator;
-  friend class MemTableBackwardIterator;
-
-  typedef SkipList<const char*, KeyComparator> Table;
+  typedef MemTableRep::KeyComparator KeyComparator;
 
   KeyComparator comparator_;
   int refs_;
   Arena arena_;
-  Table table_;
+  MemTableRep* table_;
 
   // No copying allowed
   MemTable(const MemTable&);
@@ -0,0 +1,252 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/memtable_rep.h"
+
+#include <algorithm>
+#include <new>
+#include <vector>
+#include "db/skiplist.h"
+#include "leveldb/options.h"
+#include "port/port.h"
+#include "util/arena.h"
+#include "util/coding.h"
+#include "util/hash.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+static Slice GetLengthPrefixedSlice(const char* data) {
+  uint32_t len;
+  const char* p = data;
+  p = GetVarint32Ptr(p, p + 5, &len);  // +5: we assume "p" is not corrupted
+  return Slice(p, len);
+}
+
+int MemTableRep::KeyComparator::operator()(const char* aptr, const char* bptr)
+    const {
+  // Internal keys are encoded as length-prefixed strings.
+  Slice a = GetLengthPrefixedSlice(aptr);
+  Slice b = GetLengthPrefixedSlice(bptr);
+  return comparator.Compare(a, b);
+}
+
+namespace {
+
+// Entries kept sorted on insert, in a skip list
+class SkipListRep : public MemTableRep {
+ public:
+  SkipListRep(const KeyComparator& cmp, Arena* arena) : table_(cmp, arena) { }
+
+  virtual void Insert(const char* entry) { table_.Insert(entry); }
+
+  virtual const char* Lookup(const char* key) const {
+    Table::Iterator iter(&table_);
+    iter.Seek(key);
+    return iter.Valid() ? iter.key() : NULL;
+  }
+
+  virtual MemTableRep::Iterator* NewIterator() const {
+    return new Iter(&table_);
+  }
+
+ private:
+  typedef SkipList<const char*, KeyComparator> Table;
+
+  class Iter : public MemTableRep::Iterator {
+   public:
+    explicit Iter(const Table* table) : iter_(table) { }
+    virtual bool Valid() const { return iter_.Valid(); }
+    virtual const char* key() const { return iter_.key(); }
+    virtual void Next() { iter_.Next(); }
+    virtual void Prev() { iter_.Prev(); }
+    virtual void Seek(const char* target) { iter_.Seek(target); }
+    virtual void SeekToFirst() { iter_.SeekToFirst(); }
+    virtual void SeekToLast() { iter_.SeekToLast(); }
+
+   private:
+    Table::Iterator iter_;
+  };
+
+  Table table_;
+};
+
+// Iterator over a copy of the entries of an unordered representation,
+// sorted when the iterator is created
+class SortedIterator : public MemTableRep::Iterator {
+ public:
+  SortedIterator(const MemTableRep::KeyComparator& cmp,
+                 std::vector<const char*>* entries)
+      : compare_(cmp) {
+    entries_.swap(*entries);
+    std::sort(entries_.begin(), entries_.end(), Less(&compare_));
+    pos_ = entries_.size();
+  }
+
+  virtual bool Valid() const { return pos_ < entries_.size(); }
+  virtual const char* key() const {
+    assert(Valid());
+    return entries_[pos_];
+  }
+  virtual void Next() {
+    assert(Valid());
+    pos_++;
+  }
+  virtual void Prev() {
+    assert(Valid());
+    pos_ = (pos_ == 0) ? entries_.size() : pos_ - 1;
+  }
+  virtual void Seek(const char* target) {
+    pos_ = std::lower_bound(entries_.begin(), entries_.end(), target,
+                            Less(&compare_)) - entries_.begin();
+  }
+  virtual void SeekToFirst() { pos_ = 0; }
+  virtual void SeekToLast() {
+    pos_ = entries_.empty() ? 0 : entries_.size() - 1;
+  }
+
+ private:
+  struct Less {
+    const MemTableRep::KeyComparator* cmp;
+    explicit Less(const MemTableRep::KeyComparator* c) : cmp(c) { }
+    bool operator()(const char* a, const char* b) const {
+      return (*cmp)(a, b) < 0;
+    }
+  };
+
+  const MemTableRep::KeyComparator compare_;
+  std::vector<const char*> entries_;
+  size_t pos_;  // entries_.size() when not valid
+};
+
+// Entries hashed by user key into buckets, each a linked list sorted by
+// internal key.  Nodes are published with release-stores, as in SkipList,
+// so that lookups need no locking.
+class HashLinkListRep : public MemTableRep {
+ public:
+  HashLinkListRep(const KeyComparator& cmp, Arena* arena, size_t buckets)
+      : compare_(cmp),
+        arena_(arena),
+        bucket_count_(std::max<size_t>(buckets, 1)),
+        buckets_(new port::AtomicPointer[bucket_count_]) {
+    for (size_t i = 0; i < bucket_count_; i++) {
+      buckets_[i].NoBarrier_Store(NULL);
+    }
+  }
+
+  virtual ~HashLinkListRep() { delete[] buckets_; }
+
+  virtual void Insert(const char* entry) {
+    port::AtomicPointer* link = Bucket(entry);
+    Node* x = reinterpret_cast<Node*>(link->NoBarrier_Load());
+    while (x != NULL && compare_(x->entry, entry) < 0) {
+      link = &x->next;
+      x = reinterpret_cast<Node*>(link->NoBarrier_Load());
+    }
+    char* mem = arena_->AllocateAligned(sizeof(Node));
+    Node* n = new (mem) Node;
+    n->entry = entry;
+    n->next.NoBarrier_Store(x);
+    link->Release_Store(n);
+  }
+
+  virtual const char* Lookup(const char* key) const {
+    Node* x = reinterpret_cast<Node*>(Bucket(key)->Acquire_Load());
+    while (x != NULL && compare_(x->entry, key) < 0) {
+      x = reinterpret_cast<Node*>(x->next.Acquire_Load());
+    }
+    return (x == NULL) ? NULL : x->entry;
+  }
+
+  virtual MemTableRep::Iterator* NewIterator() const {
+    std::vector<const char*> entries;
+    for (size_t i = 0; i < bucket_count_; i++) {
+      Node* x = reinterpret_cast<Node*>(buckets_[i].Acquire_Load());
+      while (x != NULL) {
+        entries.push_back(x->entry);
+        x = reinterpret_cast<Node*>(x->next.Acquire_Load());
+      }
+    }
+    return new SortedIterator(compare_, &entries);
+  }
+
+ private:
+  struct Node {
+    const char* entry;
+    port::AtomicPointer next;
+  };
+
+  port::AtomicPointer* Bucket(const char* entry) const {
+    Slice user_key = ExtractUserKey(GetLengthPrefixedSlice(entry));
+    return &buckets_[Hash(user_key.data(), user_key.size(), 0) % bucket_count_];
+  }
+
+  const KeyComparator compare_;
+  Arena* const arena_;
+  const size_t bucket_count_;
+  // Not counted in the memory usage: the flush of a memtable is due
+  // to the entries it holds, whatever its bucket count
+  port::AtomicPointer* const buckets_;
+};
+
+// Entries appended to an array, for bulk loads: lookups scan the whole
+// array
+class VectorRep : public MemTableRep {
+ public:
+  explicit VectorRep(const KeyComparator& cmp) : compare_(cmp) { }
+
+  virtual void Insert(const char* entry) {
+    MutexLock l(&mu_);
+    entries_.push_back(entry);
+  }
+
+  virtual const char* Lookup(const char* key) const {
+    MutexLock l(&mu_);
+    const char* result = NULL;
+    for (size_t i = 0; i < entries_.size(); i++) {
+      const char* e = entries_[i];
+      if (compare_(e, key) >= 0 &&
+          (result == NULL || compare_(e, result) < 0)) {
+        result = e;
+      }
+    }
+    return result;
+  }
+
+  virtual MemTableRep::Iterator* NewIterator() const {
+    std::vector<const char*> entries;
+    {
+      MutexLock l(&mu_);
+      entries = entries_;
+    }
+    return new SortedIterator(compare_, &entries);
+  }
+
+  virtual size_t ApproximateMemoryUsage() const {
+    MutexLock l(&mu_);
+    return entries_.capacity() * sizeof(const char*);
+  }
+
+ private:
+  const KeyComparator compare_;
+  mutable port::Mutex mu_;
+  std::vector<const char*> entries_;
+};
+
+}  // namespace
+
+MemTableRep* NewMemTableRep(const Options* options,
+                            const MemTableRep::KeyComparator& cmp,
+                            Arena* arena) {
+  switch (options == NULL ? kSkipListRep : options->memtable_rep) {
+    case kHashLinkListRep:
+      return new HashLinkListRep(cmp, arena, options->memtable_hash_buckets);
+    case kVectorRep:
+      return new VectorRep(cmp);
+    default:
+      return new SkipListRep(cmp, arena);
+  }
+}
+
+}  // namespace leveldb
@@ -0,0 +1,71 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A MemTableRep holds the entries of a MemTable, each a pointer to the
+// length-prefixed internal key and value the MemTable allocated in its
+// arena.  As with SkipList, Insert() requires external synchronization,
+// while lookups and iterators may run concurrently with it.
+
+#ifndef STORAGE_LEVELDB_DB_MEMTABLE_REP_H_
+#define STORAGE_LEVELDB_DB_MEMTABLE_REP_H_
+
+#include <stddef.h>
+#include "db/dbformat.h"
+
+namespace leveldb {
+
+class Arena;
+struct Options;
+
+class MemTableRep {
+ public:
+  // Orders entries by their length-prefixed internal keys
+  struct KeyComparator {
+    const InternalKeyComparator comparator;
+    explicit KeyComparator(const InternalKeyComparator& c) : comparator(c) { }
+    int operator()(const char* a, const char* b) const;
+  };
+
+  // Iteration over the entries of a MemTableRep, in the order of
+  // KeyComparator.  The interface is that of SkipList::Iterator.
+  class Iterator {
+   public:
+    virtual ~Iterator() { }
+    virtual bool Valid() const = 0;
+    virtual const char* key() const = 0;
+    virtual void Next() = 0;
+    virtual void Prev() = 0;
+    virtual void Seek(const char* target) = 0;
+    virtual void SeekToFirst() = 0;
+    virtual void SeekToLast() = 0;
+  };
+
+  virtual ~MemTableRep() { }
+
+  // Insert entry into the representation.
+  // REQUIRES: nothing that compares equal to entry is currently in it.
+  virtual void Insert(const char* entry) = 0;
+
+  // Return the first entry at or after the length-prefixed internal key
+  // "key" if it has the user key of "key".  Otherwise, return NULL or an
+  // entry with another user key.
+  virtual const char* Lookup(const char* key) const = 0;
+
+  // Return a new iterator over the entries.  Entries inserted after the
+  // call may or may not be seen by the iterator.
+  virtual Iterator* NewIterator() const = 0;
+
+  // Bytes of memory in use outside the arena
+  virtual size_t ApproximateMemoryUsage() const { return 0; }
+};
+
+// Return a new representation of the kind options->memtable_rep (a
+// skip list if options is NULL) that allocates its nodes in *arena.
+extern MemTableRep* NewMemTableRep(const Options* options,
+                                   const MemTableRep::KeyComparator& cmp,
+                                   Arena* arena);
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_MEMTABLE_REP_H_
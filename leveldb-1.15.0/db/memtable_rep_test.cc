@@ -0,0 +1,161 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/memtable.h"
+
+#include <map>
+#include "db/dbformat.h"
+#include "leveldb/comparator.h"
+#include "leveldb/db.h"
+#include "leveldb/hlsm_param.h"
+#include "util/random.h"
+#include "util/testharness.h"
+#include "util/testutil.h"
+
+namespace leveldb {
+
+static std::string Key(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return buf;
+}
+
+static std::string Get(DB* db, int i) {
+  std::string value;
+  Status s = db->Get(ReadOptions(), Key(i), &value);
+  return s.ok() ? value : s.IsNotFound() ? "NOT_FOUND" : s.ToString();
+}
+
+class MemTableRepTest { };
+
+static std::string MemGet(MemTable* mem, int i, SequenceNumber seq) {
+  std::string value;
+  Status s;
+  if (!mem->Get(LookupKey(Key(i), seq), &value, &s)) {
+    return "MISSING";
+  }
+  return s.ok() ? value : "NOT_FOUND";
+}
+
+static std::string Contents(Iterator* iter, bool reverse) {
+  std::string result;
+  if (reverse) {
+    for (iter->SeekToLast(); iter->Valid(); iter->Prev()) {
+      result += iter->key().ToString() + "=" + iter->value().ToString() + ",";
+    }
+  } else {
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      result += iter->key().ToString() + "=" + iter->value().ToString() + ",";
+    }
+  }
+  return result;
+}
+
+TEST(MemTableRepTest, MatchesSkipList) {
+  InternalKeyComparator cmp(BytewiseComparator());
+  const MemTableRepType reps[] = { kHashLinkListRep, kVectorRep };
+  for (int r = 0; r < 2; r++) {
+    Options options;
+    options.memtable_rep = reps[r];
+    options.memtable_hash_buckets = 64;  // Chains of several keys
+    MemTable* expected = new MemTable(cmp);
+    MemTable* mem = new MemTable(cmp, &options);
+    expected->Ref();
+    mem->Ref();
+    Random rnd(301);
+    for (SequenceNumber seq = 1; seq <= 2000; seq++) {
+      const std::string key = Key(rnd.Uniform(500));
+      const ValueType type = rnd.OneIn(5) ? kTypeDeletion : kTypeValue;
+      char value[20];
+      snprintf(value, sizeof(value), "v%d", static_cast<int>(seq));
+      expected->Add(seq, type, key, value);
+      mem->Add(seq, type, key, value);
+    }
+    for (int i = 0; i < 510; i++) {
+      for (SequenceNumber seq = 0; seq <= 2000; seq += 250) {
+        ASSERT_EQ(MemGet(expected, i, seq), MemGet(mem, i, seq));
+      }
+    }
+
+    Iterator* e = expected->NewIterator();
+    Iterator* m = mem->NewIterator();
+    ASSERT_EQ(Contents(e, false), Contents(m, false));
+    ASSERT_EQ(Contents(e, true), Contents(m, true));
+    for (int i = 0; i < 510; i += 7) {
+      const std::string target = InternalKey(Key(i), 1000,
+                                             kValueTypeForSeek).Encode().ToString();
+      e->Seek(target);
+      m->Seek(target);
+      ASSERT_EQ(e->Valid(), m->Valid());
+      if (e->Valid()) {
+        ASSERT_EQ(e->key().ToString(), m->key().ToString());
+        e->Prev();
+        m->Prev();
+        ASSERT_EQ(e->Valid(), m->Valid());
+      }
+    }
+    delete e;
+    delete m;
+    expected->Unref();
+    mem->Unref();
+  }
+}
+
+TEST(MemTableRepTest, FlushAndRecover) {
+  const std::string dbname = test::TmpDir() + "/memtable_rep_test";
+  const MemTableRepType reps[] = { kHashLinkListRep, kVectorRep };
+  for (int r = 0; r < 2; r++) {
+    Options options;
+    options.create_if_missing = true;
+    options.write_buffer_size = 64 << 10;
+    options.memtable_rep = reps[r];
+    DestroyDB(dbname, options);
+    hlsm::config::primary_storage_path = dbname.c_str();
+    DB* db;
+    ASSERT_OK(DB::Open(options, dbname, &db));
+
+    std::map<int, std::string> model;
+    Random rnd(301);
+    for (int n = 0; n < 5000; n++) {
+      const int i = rnd.Uniform(1000);
+      if (rnd.OneIn(5)) {
+        ASSERT_OK(db->Delete(WriteOptions(), Key(i)));
+        model.erase(i);
+      } else {
+        std::string value;
+        test::RandomString(&rnd, 100, &value);
+        ASSERT_OK(db->Put(WriteOptions(), Key(i), value));
+        model[i] = value;
+      }
+    }
+
+    // Once from the memtables and tables, once more after replaying the log
+    for (int pass = 0; pass < 2; pass++) {
+      for (int i = 0; i < 1000; i++) {
+        ASSERT_EQ(model.count(i) ? model[i] : "NOT_FOUND", Get(db, i));
+      }
+      Iterator* iter = db->NewIterator(ReadOptions());
+      std::map<int, std::string>::const_iterator it = model.begin();
+      for (iter->SeekToFirst(); iter->Valid(); iter->Next(), ++it) {
+        ASSERT_TRUE(it != model.end());
+        ASSERT_EQ(Key(it->first), iter->key().ToString());
+        ASSERT_EQ(it->second, iter->value().ToString());
+      }
+      ASSERT_TRUE(it == model.end());
+      delete iter;
+
+      delete db;
+      ASSERT_OK(DB::Open(options, dbname, &db));
+    }
+    delete db;
+    DestroyDB(dbname, options);
+    hlsm::config::primary_storage_path = NULL;
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
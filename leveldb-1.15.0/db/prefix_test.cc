@@ -0,0 +1,132 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/db.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/hlsm_metrics.h"
+#include "leveldb/hlsm_param.h"
+#include "leveldb/slice_transform.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static std::string PrefixKey(int prefix, int i) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "p%03d-%04d", prefix, i);
+  return std::string(buf);
+}
+
+class PrefixTest {
+ public:
+  std::string dbname_;
+  const FilterPolicy* policy_;
+  Options options_;
+  DB* db_;
+
+  PrefixTest() : policy_(NewBloomFilterPolicy(10)), db_(NULL) {
+    dbname_ = test::TmpDir() + "/prefix_test";
+    hlsm::config::primary_storage_path = dbname_.c_str();
+    options_.create_if_missing = true;
+    options_.filter_policy = policy_;
+    DestroyDB(dbname_, options_);
+  }
+
+  ~PrefixTest() {
+    delete db_;
+    DestroyDB(dbname_, options_);
+    delete policy_;
+    hlsm::config::primary_storage_path = NULL;
+  }
+
+  void Reopen() {
+    delete db_;
+    db_ = NULL;
+    ASSERT_OK(DB::Open(options_, dbname_, &db_));
+  }
+
+  // Keys an iterator with "options" finds from PrefixKey(prefix, 0)
+  int CountPrefix(const ReadOptions& options, int prefix) {
+    Iterator* iter = db_->NewIterator(options);
+    int count = 0;
+    for (iter->Seek(PrefixKey(prefix, 0)); iter->Valid(); iter->Next()) {
+      count++;
+    }
+    delete iter;
+    return count;
+  }
+};
+
+TEST(PrefixTest, SeekSkipsTables) {
+  const SliceTransform* prefix4 = NewFixedPrefixTransform(4);
+  options_.prefix_extractor = prefix4;
+  Reopen();
+  for (int p = 0; p < 200; p += 2) {
+    for (int i = 0; i < 20; i++) {
+      ASSERT_OK(db_->Put(WriteOptions(), PrefixKey(p, i), "v"));
+    }
+  }
+  db_->CompactRange(NULL, NULL);
+
+  ReadOptions prefix_mode;
+  prefix_mode.prefix_same_as_start = true;
+  prefix_mode.fill_cache = false;
+  ReadOptions total_order;
+  total_order.fill_cache = false;
+  const bool saved = hlsm::config::collect_metrics;
+  hlsm::config::collect_metrics = true;
+  hlsm::metrics::Stats reads;
+  uint64_t block_reads[2];
+  for (int mode = 0; mode < 2; mode++) {
+    hlsm::metrics::Reset();
+    for (int p = 1; p < 200; p += 2) {
+      if (mode == 0) {
+        ASSERT_EQ(0, CountPrefix(prefix_mode, p));
+      } else {
+        Iterator* iter = db_->NewIterator(total_order);
+        iter->Seek(PrefixKey(p, 0));
+        ASSERT_TRUE(p == 199 || iter->Valid());
+        delete iter;
+      }
+    }
+    hlsm::metrics::Get(hlsm::metrics::kTableReadBlock, &reads);
+    block_reads[mode] = reads.count;
+  }
+  hlsm::config::collect_metrics = saved;
+  hlsm::metrics::Reset();
+  ASSERT_GE(block_reads[1], 99);
+  ASSERT_LT(block_reads[0] * 10, block_reads[1]);
+
+  for (int p = 0; p < 200; p += 2) {
+    ASSERT_EQ(20, CountPrefix(prefix_mode, p));
+  }
+
+  // Keys without a prefix seek as usual; the direction cannot change
+  Iterator* iter = db_->NewIterator(prefix_mode);
+  iter->Seek("p");
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ(PrefixKey(0, 0), iter->key().ToString());
+  iter->Seek(PrefixKey(10, 5));
+  ASSERT_EQ(PrefixKey(10, 5), iter->key().ToString());
+  iter->Prev();
+  ASSERT_TRUE(!iter->Valid());
+  ASSERT_TRUE(!iter->status().ok());
+  delete iter;
+
+  // Filters of another extractor are not used
+  const SliceTransform* prefix3 = NewFixedPrefixTransform(3);
+  options_.prefix_extractor = prefix3;
+  Reopen();
+  ASSERT_EQ(20 * 5, CountPrefix(prefix_mode, 10));
+
+  delete db_;
+  db_ = NULL;
+  delete prefix3;
+  delete prefix4;
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/db.h"
+#include "leveldb/hlsm_metrics.h"
+#include "leveldb/hlsm_param.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static std::string Key(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return buf;
+}
+
+class ReadaheadTest {
+ public:
+  std::string dbname_;
+  Options options_;
+  DB* db_;
+  bool saved_prefetch_;
+
+  ReadaheadTest() : db_(NULL) {
+    dbname_ = test::TmpDir() + "/readahead_test";
+    hlsm::config::primary_storage_path = dbname_.c_str();
+    saved_prefetch_ = hlsm::config::iterator_prefetch;
+    hlsm::config::iterator_prefetch = true;
+    options_.create_if_missing = true;
+    options_.block_size = 1024;
+    options_.compression = kNoCompression;
+    DestroyDB(dbname_, options_);
+    ASSERT_OK(DB::Open(options_, dbname_, &db_));
+  }
+
+  ~ReadaheadTest() {
+    delete db_;
+    DestroyDB(dbname_, options_);
+    hlsm::config::iterator_prefetch = saved_prefetch_;
+    hlsm::config::primary_storage_path = NULL;
+  }
+
+  std::string Get(int i) {
+    std::string value;
+    Status s = db_->Get(ReadOptions(), Key(i), &value);
+    return s.ok() ? value : s.IsNotFound() ? "NOT_FOUND" : s.ToString();
+  }
+};
+
+TEST(ReadaheadTest, LongScansOnly) {
+  for (int i = 0; i < 5000; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), std::string(200, 'v')));
+  }
+  db_->CompactRange(NULL, NULL);
+
+  const bool saved = hlsm::config::collect_metrics;
+  hlsm::config::collect_metrics = true;
+  hlsm::metrics::Stats readahead, reads[2];
+  for (int pass = 0; pass < 2; pass++) {
+    hlsm::metrics::Reset();
+    Iterator* iter = db_->NewIterator(ReadOptions());
+    int count = 0;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      count++;
+    }
+    ASSERT_EQ(5000, count);
+    delete iter;
+    hlsm::metrics::Get(hlsm::metrics::kReadaheadBytes, &readahead);
+    hlsm::metrics::Get(hlsm::metrics::kTableReadBlock, &reads[pass]);
+    // The windows double, so a few cover the tables
+    ASSERT_GT(readahead.sum, 5000 * 200 / 2);
+    ASSERT_LT(readahead.count, reads[pass].count / 4);
+  }
+  // The blocks of the scan were not cached
+  ASSERT_GT(reads[1].count, reads[0].count * 3 / 4);
+
+  // Short scans and point lookups do not read ahead
+  hlsm::metrics::Reset();
+  Iterator* iter = db_->NewIterator(ReadOptions());
+  for (int i = 0; i < 5000; i += 500) {
+    iter->Seek(Key(i));
+    for (int j = 0; j < 3 && iter->Valid(); j++) {
+      ASSERT_EQ(Key(i + j), iter->key().ToString());
+      iter->Next();
+    }
+    ASSERT_EQ(std::string(200, 'v'), Get(i));
+  }
+  delete iter;
+  hlsm::metrics::Get(hlsm::metrics::kReadaheadBytes, &readahead);
+  ASSERT_EQ(0, readahead.count);
+  hlsm::config::collect_metrics = saved;
+  hlsm::metrics::Reset();
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -0,0 +1,126 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/db.h"
+#include "leveldb/cache.h"
+#include "leveldb/hlsm_metrics.h"
+#include "leveldb/hlsm_param.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static std::string Key(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return buf;
+}
+
+class RowCacheTest {
+ public:
+  std::string dbname_;
+  Options options_;
+  DB* db_;
+
+  RowCacheTest() : db_(NULL) {
+    dbname_ = test::TmpDir() + "/row_cache_test";
+    hlsm::config::primary_storage_path = dbname_.c_str();
+    options_.create_if_missing = true;
+    options_.row_cache = NewLRUCache(1 << 20);
+    DestroyDB(dbname_, options_);
+    Reopen();
+  }
+
+  ~RowCacheTest() {
+    delete db_;
+    DestroyDB(dbname_, options_);
+    delete options_.row_cache;
+    hlsm::config::primary_storage_path = NULL;
+  }
+
+  void Reopen() {
+    delete db_;
+    db_ = NULL;
+    ASSERT_OK(DB::Open(options_, dbname_, &db_));
+  }
+
+  void DestroyAndReopen() {
+    delete db_;
+    db_ = NULL;
+    DestroyDB(dbname_, options_);
+    Reopen();
+  }
+
+  std::string Get(int i, const Snapshot* snapshot = NULL) {
+    ReadOptions options;
+    options.snapshot = snapshot;
+    std::string value;
+    Status s = db_->Get(options, Key(i), &value);
+    return s.ok() ? value : s.IsNotFound() ? "NOT_FOUND" : s.ToString();
+  }
+};
+
+TEST(RowCacheTest, HitsAndVisibility) {
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), "old"));
+  }
+  db_->CompactRange(NULL, NULL);
+
+  const bool saved = hlsm::config::collect_metrics;
+  hlsm::config::collect_metrics = true;
+  hlsm::metrics::Reset();
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < 1000; i++) {
+      ASSERT_EQ("old", Get(i));
+    }
+  }
+  hlsm::metrics::Stats hits, misses;
+  hlsm::metrics::Get(hlsm::metrics::kRowCacheHit, &hits);
+  hlsm::metrics::Get(hlsm::metrics::kRowCacheMiss, &misses);
+  ASSERT_GE(hits.sum, 1000);
+  ASSERT_GE(misses.sum, 1000);
+
+  // Rows of new tables are cached apart, and snapshots see their own
+  const Snapshot* snapshot = db_->GetSnapshot();
+  for (int i = 0; i < 200; i++) {
+    ASSERT_EQ("old", Get(i, snapshot));
+  }
+  for (int i = 0; i < 100; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), "new"));
+    ASSERT_OK(db_->Delete(WriteOptions(), Key(i + 100)));
+  }
+  db_->CompactRange(NULL, NULL);
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < 300; i++) {
+      ASSERT_EQ(i < 100 ? "new" : i < 200 ? "NOT_FOUND" : "old", Get(i));
+      ASSERT_EQ("old", Get(i, snapshot));
+    }
+  }
+  db_->ReleaseSnapshot(snapshot);
+  hlsm::config::collect_metrics = saved;
+  hlsm::metrics::Reset();
+}
+
+TEST(RowCacheTest, SharedCache) {
+  // A DB recreated at the same path reuses the file numbers of the
+  // first one, whose rows are still in the cache
+  for (int round = 0; round < 2; round++) {
+    const std::string value = (round == 0) ? "first" : "second";
+    DestroyAndReopen();
+    for (int i = 0; i < 100; i++) {
+      ASSERT_OK(db_->Put(WriteOptions(), Key(i), value));
+    }
+    db_->CompactRange(NULL, NULL);
+    for (int pass = 0; pass < 2; pass++) {
+      for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(value, Get(i));
+      }
+    }
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -9,12 +9,14 @@
 #include "leveldb/table.h"
 #include "leveldb/hlsm.h"
 #include "util/coding.h"
+#include "util/mutexlock.h"
 
 namespace leveldb {
 
 struct TableAndFile {
   RandomAccessFile* file;
   Table* table;
+  SequenceNumber global_seq;  // 0 unless the table was ingested
 };
 
 static void DeleteEntry(const Slice& key, void* value) {
@@ -30,13 +32,117 @@ static void UnrefEntry(void* arg1, void* arg2) {
   cache->Release(h);
 }
 
+// Replace the sequence number of internal key "key" by "seq"
+static void SetSequence(const Slice& key, SequenceNumber seq,
+                        std::string* result) {
+  result->clear();
+  ParsedInternalKey parsed;
+  if (ParseInternalKey(key, &parsed)) {
+    parsed.sequence = seq;
+    AppendInternalKey(result, parsed);
+  } else {
+    result->assign(key.data(), key.size());
+  }
+}
+
+namespace {
+
+// Iterator over an ingested table that shows its keys with the global
+// sequence number of the table
+class GlobalSequenceIterator : public Iterator {
+ public:
+  GlobalSequenceIterator(Iterator* iter, SequenceNumber seq,
+                         const Comparator* icmp)
+      : iter_(iter), seq_(seq), icmp_(icmp) { }
+  virtual ~GlobalSequenceIterator() { delete iter_; }
+
+  virtual bool Valid() const { return iter_->Valid(); }
+  virtual void SeekToFirst() { iter_->SeekToFirst(); Update(); }
+  virtual void SeekToLast() { iter_->SeekToLast(); Update(); }
+  virtual void Seek(const Slice& target) {
+    // The stored key (u, 0) follows every target (u, s), but (u, seq_)
+    // precedes targets with s < seq_
+    iter_->Seek(target);
+    Update();
+    if (Valid() && icmp_->Compare(key_, target) < 0) {
+      Next();
+    }
+  }
+  virtual void Next() { iter_->Next(); Update(); }
+  virtual void Prev() { iter_->Prev(); Update(); }
+  virtual Slice key() const { return key_; }
+  virtual Slice value() const { return iter_->value(); }
+  virtual Status status() const { return iter_->status(); }
+
+ private:
+  void Update() {
+    if (iter_->Valid()) {
+      SetSequence(iter_->key(), seq_, &key_);
+    }
+  }
+
+  Iterator* const iter_;
+  const SequenceNumber seq_;
+  const Comparator* const icmp_;
+  std::string key_;
+};
+
+// Passes the entries of an ingested table found by Table::InternalGet()
+// on with the global sequence number, unless the lookup key is older
+struct GlobalSequenceSaver {
+  void* arg;
+  void (*saver)(void*, const Slice&, const Slice&);
+  SequenceNumber seq;
+  const Comparator* icmp;
+  Slice target;
+};
+
+static void SaveGlobalSequence(void* arg, const Slice& k, const Slice& v) {
+  GlobalSequenceSaver* s = reinterpret_cast<GlobalSequenceSaver*>(arg);
+  std::string key;
+  SetSequence(k, s->seq, &key);
+  if (s->icmp->Compare(key, s->target) >= 0) {
+    (*s->saver)(s->arg, key, v);
+  }
+}
+
+// Remembers the entry of the lookup user key passed on by
+// Table::InternalGet(), for the row cache
+struct RowSaver {
+  void* arg;
+  void (*saver)(void*, const Slice&, const Slice&);
+  Slice user_key;
+  bool found;
+  std::string row;  // varint32 key length, key, value
+};
+
+static void SaveRow(void* arg, const Slice& k, const Slice& v) {
+  RowSaver* r = reinterpret_cast<RowSaver*>(arg);
+  if (k.size() >= 8 && ExtractUserKey(k) == r->user_key) {
+    r->found = true;
+    r->row.clear();
+    PutVarint32(&r->row, k.size());
+    r->row.append(k.data(), k.size());
+    r->row.append(v.data(), v.size());
+  }
+  (*r->saver)(r->arg, k, v);
+}
+
+static void DeleteRow(const Slice& key, void* value) {
+  delete reinterpret_cast<std::string*>(value);
+}
+
+}  // namespace
+
 TableCache::TableCache(const std::string& dbname,
                        const Options* options,
                        int entries)
     : env_(options->env),
       dbname_(dbname),
       options_(options),
-      cache_(NewLRUCache(entries)) {
+      cache_(NewLRUCache(entries)),
+      row_cache_id_(options->row_cache != NULL ? options->row_cache->NewId()
+                                               : 0) {
 }
 
 TableCache::~TableCache() {
@@ -90,6 +196,7 @@ Status TableCache::FindTable(uint64_t file_number, uint64_t file_size,
       TableAndFile* tf = new TableAndFile;
       tf->file = file;
       tf->table = table;
+      tf->global_seq = GlobalSequence(file_number);
       *handle = cache_->Insert(key, tf, 1, &DeleteEntry);
       assert(*handle != NULL);
     }
@@ -112,26 +219,13 @@ Iterator* TableCache::NewIterator(const ReadOptions& options,
     return NewErrorIterator(s);
   }
 
-  Table* table;
-  table = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
-  DEBUG_INFO(2, "is_sequential = %d, iter_prefetch = %d, raw_prefetch = %d\n",
-		  is_sequential, hlsm::config::iterator_prefetch, hlsm::config::raw_prefetch);
-  if (hlsm::runtime::use_opq_thread && hlsm::config::iterator_prefetch && is_sequential) {
-  	  Cache::Handle* phandle = NULL;
-  	  Status s = FindTable(file_number, file_size, &phandle, is_sequential);
-
-	  DEBUG_INFO(2, "Prefetch fnum: %lu, size: %lu\n", file_number, file_size);
-	  ReadOptions* opq_options = (ReadOptions*) malloc(sizeof(ReadOptions));
-	  opq_options->snapshot = options.snapshot;
-	  opq_options->verify_checksums = false;
-	  opq_options->fill_cache = true;
-	  Iterator* piter = table->NewIterator(*opq_options, is_sequential);
-  	  piter->RegisterCleanup(&UnrefEntry, cache_, phandle);
-
-	  OPQ_ADD_ITR_PREFETCH(hlsm::runtime::hop_queue, piter, opq_options);
-	  DEBUG_INFO(2, "ITR_PREFETCH op added\n");
-
-  } else if (hlsm::runtime::use_opq_thread && hlsm::config::raw_prefetch && is_sequential) {
+  TableAndFile* tf = reinterpret_cast<TableAndFile*>(cache_->Value(handle));
+  Table* table = tf->table;
+  DEBUG_INFO(2, "is_sequential = %d, raw_prefetch = %d\n",
+		  is_sequential, hlsm::config::raw_prefetch);
+  // With hlsm::config::iterator_prefetch, the table iterator reads ahead
+  // by itself once it sees a sequential scan
+  if (hlsm::runtime::use_opq_thread && hlsm::config::raw_prefetch && is_sequential) {
 	  OPQ_ADD_RAW_PREFETCH(hlsm::runtime::hop_queue,
 			  table->PickFileHandler(is_sequential), file_size);
 	  DEBUG_INFO(2, "RAW_PREFETCH op added\n");
@@ -139,6 +233,10 @@ Iterator* TableCache::NewIterator(const ReadOptions& options,
 
   Iterator* result = table->NewIterator(options, is_sequential);
   result->RegisterCleanup(&UnrefEntry, cache_, handle);
+  if (tf->global_seq != 0) {
+    result = new GlobalSequenceIterator(result, tf->global_seq,
+                                        options_->comparator);
+  }
 
   if (tableptr != NULL) {
     *tableptr = table;
@@ -152,21 +250,98 @@ Status TableCache::Get(const ReadOptions& options,
                        const Slice& k,
                        void* arg,
                        void (*saver)(void*, const Slice&, const Slice&)) {
+  // Rows are keyed by table cache and table, then by the snapshot (none
+  // reads the newest entry, whatever the sequence of the lookup), then by
+  // user key
+  Cache* const row_cache = options_->row_cache;
+  std::string row_key;
+  RowSaver rs;
+  if (row_cache != NULL && k.size() >= 8) {
+    PutFixed64(&row_key, row_cache_id_);
+    PutFixed64(&row_key, file_number);
+    PutFixed64(&row_key, options.snapshot == NULL ? kMaxSequenceNumber
+               : DecodeFixed64(k.data() + k.size() - 8) >> 8);
+    Slice user_key = ExtractUserKey(k);
+    row_key.append(user_key.data(), user_key.size());
+    Cache::Handle* h = row_cache->Lookup(row_key);
+    if (h != NULL) {
+      HLSM_COUNT(hlsm::metrics::kRowCacheHit, 1);
+      Slice row(*reinterpret_cast<std::string*>(row_cache->Value(h)));
+      uint32_t key_length;
+      GetVarint32(&row, &key_length);
+      (*saver)(arg, Slice(row.data(), key_length),
+               Slice(row.data() + key_length, row.size() - key_length));
+      row_cache->Release(h);
+      return Status::OK();
+    }
+    HLSM_COUNT(hlsm::metrics::kRowCacheMiss, 1);
+    rs.arg = arg;
+    rs.saver = saver;
+    rs.user_key = user_key;
+    rs.found = false;
+    arg = &rs;
+    saver = &SaveRow;
+  }
+
   Cache::Handle* handle = NULL;
   Status s;
-  DEBUG_MEASURE_RECORD(1, (s = FindTable(file_number, file_size, &handle)), "Get--FindTable");
+  HLSM_MEASURE(hlsm::metrics::kTableCacheFind, (s = FindTable(file_number, file_size, &handle)));
   if (s.ok()) {
-    Table* t = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
-    DEBUG_MEASURE_RECORD(1, (s = t->InternalGet(options, k, arg, saver, false)), "TableCache::Get--InternatGet");
+    TableAndFile* tf = reinterpret_cast<TableAndFile*>(cache_->Value(handle));
+    Table* t = tf->table;
+    GlobalSequenceSaver gs;
+    if (tf->global_seq != 0) {
+      gs.arg = arg;
+      gs.saver = saver;
+      gs.seq = tf->global_seq;
+      gs.icmp = options_->comparator;
+      gs.target = k;
+      arg = &gs;
+      saver = &SaveGlobalSequence;
+    }
+    HLSM_MEASURE(hlsm::metrics::kTableCacheGet, (s = t->InternalGet(options, k, arg, saver, false)));
     cache_->Release(handle);
   }
+  if (s.ok() && !row_key.empty() && rs.found) {
+    std::string* row = new std::string;
+    row->swap(rs.row);
+    row_cache->Release(row_cache->Insert(row_key, row,
+                                         row_key.size() + row->size(),
+                                         &DeleteRow));
+  }
   return s;
 }
 
+bool TableCache::PrefixMayMatch(uint64_t file_number, uint64_t file_size,
+                                const Slice& k) {
+  Cache::Handle* handle = NULL;
+  if (!FindTable(file_number, file_size, &handle).ok()) {
+    return true;
+  }
+  Table* t = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
+  const bool match = t->PrefixMayMatch(k);
+  cache_->Release(handle);
+  return match;
+}
+
 void TableCache::Evict(uint64_t file_number) {
   char buf[sizeof(file_number)];
   EncodeFixed64(buf, file_number);
   cache_->Erase(Slice(buf, sizeof(buf)));
+  MutexLock l(&mutex_);
+  global_seqs_.erase(file_number);
+}
+
+void TableCache::SetGlobalSequence(uint64_t file_number, SequenceNumber seq) {
+  MutexLock l(&mutex_);
+  global_seqs_[file_number] = seq;
+}
+
+SequenceNumber TableCache::GlobalSequence(uint64_t file_number) {
+  MutexLock l(&mutex_);
+  std::map<uint64_t, SequenceNumber>::const_iterator it =
+      global_seqs_.find(file_number);
+  return (it == global_seqs_.end()) ? 0 : it->second;
 }
 
 }  // namespace leveldb
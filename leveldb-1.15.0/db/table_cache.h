@@ -7,6 +7,7 @@
 #ifndef STORAGE_LEVELDB_DB_TABLE_CACHE_H_
 #define STORAGE_LEVELDB_DB_TABLE_CACHE_H_
 
+#include <map>
 #include <string>
 #include <stdint.h>
 #include "db/dbformat.h"
@@ -45,15 +46,34 @@ class TableCache {
              void* arg,
              void (*handle_result)(void*, const Slice&, const Slice&));
 
-  // Evict any entry for the specified file number
+  // Whether the specified file may hold keys with the prefix of internal
+  // key "k", by its prefix filter.  True if the file cannot be opened.
+  bool PrefixMayMatch(uint64_t file_number, uint64_t file_size,
+                      const Slice& k);
+
+  // Evict any entry for the specified file number, and forget its global
+  // sequence number
   void Evict(uint64_t file_number);
   Status PreLoadTable(uint64_t file_number, uint64_t file_size);
 
+  // The keys of an ingested table are stored with sequence number 0;
+  // iterators and Get() show them with the global sequence number of the
+  // table instead.  Set before the table is first opened.
+  void SetGlobalSequence(uint64_t file_number, SequenceNumber seq);
+  // 0 if the keys of the table carry their own sequence numbers
+  SequenceNumber GlobalSequence(uint64_t file_number);
+
  private:
   Env* const env_;
   const std::string dbname_;
   const Options* options_;
   Cache* cache_;
+  // Prefix of the keys of this table cache in options_->row_cache, which
+  // may be shared with other DBs whose file numbers collide with ours
+  const uint64_t row_cache_id_;
+
+  port::Mutex mutex_;
+  std::map<uint64_t, SequenceNumber> global_seqs_;  // guarded by mutex_
 
   Status FindTable(uint64_t file_number, uint64_t file_size, Cache::Handle**, bool is_sequential = false);
 };
@@ -20,7 +20,9 @@ enum Tag {
   kDeletedFile          = 6,
   kNewFile              = 7,
   // 8 was used for large value refs
-  kPrevLogNumber        = 9
+  kPrevLogNumber        = 9,
+  // 10 to 13 are used by LazyVersionEdit
+  kGlobalSequence       = 14
 };
 
 
@@ -39,6 +41,7 @@ void BasicVersionEdit::Clear() {
   has_last_sequence_ = false;
   deleted_files_.clear();
   new_files_.clear();
+  global_seqs_.clear();
 }
 
 void BasicVersionEdit::EncodeTo(std::string* dst) const {
@@ -86,6 +89,12 @@ void BasicVersionEdit::EncodeTo(std::string* dst) const {
     PutLengthPrefixedSlice(dst, f.smallest.Encode());
     PutLengthPrefixedSlice(dst, f.largest.Encode());
   }
+
+  for (size_t i = 0; i < global_seqs_.size(); i++) {
+    PutVarint32(dst, kGlobalSequence);
+    PutVarint64(dst, global_seqs_[i].first);   // file number
+    PutVarint64(dst, global_seqs_[i].second);  // sequence number
+  }
 }
 
 static bool GetInternalKey(Slice* input, InternalKey* dst) {
@@ -118,6 +127,7 @@ Status BasicVersionEdit::DecodeFrom(const Slice& src) {
   // Temporary storage for parsing
   int level;
   uint64_t number;
+  SequenceNumber seq;
   FileMetaData f;
   Slice str;
   InternalKey key;
@@ -195,6 +205,15 @@ Status BasicVersionEdit::DecodeFrom(const Slice& src) {
         }
         break;
 
+      case kGlobalSequence:
+        if (GetVarint64(&input, &number) &&
+            GetVarint64(&input, &seq)) {
+          global_seqs_.push_back(std::make_pair(number, seq));
+        } else {
+          msg = "global sequence number";
+        }
+        break;
+
       default:
         msg = "unknown tag";
         break;
@@ -262,6 +281,12 @@ std::string BasicVersionEdit::DebugString() const {
     r.append(" .. ");
     r.append(f.largest.DebugString());
   }
+  for (size_t i = 0; i < global_seqs_.size(); i++) {
+    r.append("\n  GlobalSequence: ");
+    AppendNumberTo(&r, global_seqs_[i].first);
+    r.append(" ");
+    AppendNumberTo(&r, global_seqs_[i].second);
+  }
   r.append("\n}\n");
   return r;
 }
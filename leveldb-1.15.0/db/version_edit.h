@@ -76,6 +76,12 @@ class VersionEdit {
     deleted_files_.insert(std::make_pair(level, file));
   }
 
+  // The keys of ingested table "file" are stored with sequence number 0
+  // and read with sequence number "seq" (see TableCache)
+  void SetGlobalSequence(uint64_t file, SequenceNumber seq) {
+    global_seqs_.push_back(std::make_pair(file, seq));
+  }
+
   virtual void EncodeTo(std::string* dst) const = 0;
   virtual Status DecodeFrom(const Slice& src) = 0;
 
@@ -102,6 +108,7 @@ protected:
   std::vector< std::pair<int, InternalKey> > compact_pointers_;
   DeletedFileSet deleted_files_;
   std::vector< std::pair<int, FileMetaData> > new_files_;
+  std::vector< std::pair<uint64_t, SequenceNumber> > global_seqs_;
 };
 
 class BasicVersionEdit: public VersionEdit {
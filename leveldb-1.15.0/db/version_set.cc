@@ -78,17 +78,53 @@ Version::~Version() {
   next_->prev_ = prev_;
 
   // Drop references to files
-  for (int level = 0; level < level_num_; level++) {
-    for (size_t i = 0; i < files_[level].size(); i++) {
-      FileMetaData* f = files_[level][i];
+  delete[] files_;
+}
+
+const std::vector<FileMetaData*> LevelFiles::empty_;
+
+void LevelFiles::Unref() {
+  if (rep_ == NULL) {
+    return;
+  }
+  assert(rep_->refs > 0);
+  if (--rep_->refs == 0) {
+    for (size_t i = 0; i < rep_->files.size(); i++) {
+      FileMetaData* f = rep_->files[i];
       assert(f->refs > 0);
       f->refs--;
       if (f->refs <= 0) {
         delete f;
       }
     }
+    delete rep_;
   }
-  delete[] files_;
+  rep_ = NULL;
+}
+
+void LevelFiles::ShareFrom(const LevelFiles& other) {
+  if (other.rep_ != NULL) {
+    other.rep_->refs++;
+  }
+  Unref();
+  rep_ = other.rep_;
+}
+
+std::vector<FileMetaData*>* LevelFiles::mutable_files() {
+  if (rep_ == NULL) {
+    rep_ = new Rep;
+    rep_->refs = 1;
+  } else if (rep_->refs > 1) {
+    Rep* copy = new Rep;
+    copy->refs = 1;
+    copy->files = rep_->files;
+    for (size_t i = 0; i < copy->files.size(); i++) {
+      copy->files[i]->refs++;
+    }
+    Unref();
+    rep_ = copy;
+  }
+  return &rep_->files;
 }
 
 int FindFile(const InternalKeyComparator& icmp,
@@ -232,11 +268,23 @@ static Iterator* GetFileIterator(void* arg,
   }
 }
 
+// Whether the file may hold keys with the prefix of target.  The files of
+// a level do not overlap, so if the first one with keys >= target has
+// none with its prefix, no later file has any.
+static bool FileMayMatch(void* arg, const Slice& file_value,
+                         const Slice& target) {
+  TableCache* cache = reinterpret_cast<TableCache*>(arg);
+  return file_value.size() != 16 ||
+         cache->PrefixMayMatch(DecodeFixed64(file_value.data()),
+                               DecodeFixed64(file_value.data() + 8), target);
+}
+
 Iterator* Version::NewConcatenatingIterator(const ReadOptions& options,
                                             int level, bool is_sequential) const {
   return NewTwoLevelIterator(
-      new LevelFileNumIterator(vset_->icmp_, &files_[level]),
-      &GetFileIterator, vset_->table_cache_, options, is_sequential);
+      new LevelFileNumIterator(vset_->icmp_, &files_[level].files()),
+      &GetFileIterator, &FileMayMatch, NULL, vset_->table_cache_, options,
+      is_sequential);
 }
 
 void Version::AddIterators(const ReadOptions& options,
@@ -356,7 +404,8 @@ Status Version::Get(const ReadOptions& options,
   // in an smaller level, later levels are irrelevant.
   std::vector<FileMetaData*> tmp;
   FileMetaData* tmp2;
-  for (int level = 0; level < level_num_; level++) {
+  for (int i = 0; i < level_num_; i++) {
+    const int level = lookup_order_.empty() ? i : lookup_order_[i];
     size_t num_files = files_[level].size();
     if (num_files == 0) continue;
 
@@ -414,8 +463,7 @@ Status Version::Get(const ReadOptions& options,
       saver.user_key = user_key;
       saver.value = value;
       DEBUG_INFO(3, "before table_cache_->Get()\n");
-      DEBUG_MEASURE_RECORD(2, (s = vset_->table_cache_->Get(options, f->number, f->file_size, ikey, &saver, SaveValue)),
-      		"Version::Get--TableCache::Get");
+      HLSM_MEASURE(hlsm::metrics::kVersionTableGet, (s = vset_->table_cache_->Get(options, f->number, f->file_size, ikey, &saver, SaveValue)));
       DEBUG_INFO(3, "after table_cache_->Get()\n");
 
       if (!s.ok()) {
@@ -726,13 +774,19 @@ class BasicVersionSet::Builder {
     BySmallestKey cmp;
     cmp.internal_comparator = &vset_->icmp_;
     for (int level = 0; level < config::kNumLevels; level++) {
+      const FileSet* added = levels_[level].added_files;
+      if (added->empty() && levels_[level].deleted_files.empty()) {
+        // Level untouched by the edits: share the base list
+        v->files_[level].ShareFrom(base_->files_[level]);
+        continue;
+      }
+
       // Merge the set of added files with the set of pre-existing files.
       // Drop any deleted files.  Store the result in *v.
       const std::vector<FileMetaData*>& base_files = base_->files_[level];
       std::vector<FileMetaData*>::const_iterator base_iter = base_files.begin();
       std::vector<FileMetaData*>::const_iterator base_end = base_files.end();
-      const FileSet* added = levels_[level].added_files;
-      v->files_[level].reserve(base_files.size() + added->size());
+      v->files_[level].mutable_files()->reserve(base_files.size() + added->size());
       for (FileSet::const_iterator added_iter = added->begin();
            added_iter != added->end();
            ++added_iter) {
@@ -774,7 +828,7 @@ class BasicVersionSet::Builder {
     if (levels_[level].deleted_files.count(f->number) > 0) {
       // File is deleted: do nothing
     } else {
-      std::vector<FileMetaData*>* files = &v->files_[level];
+      std::vector<FileMetaData*>* files = v->files_[level].mutable_files();
       if (level > 0 && !files->empty()) {
         // Must not overlap
       	DEBUG_INFO(4, "largest = %s, smallest = %s\n",
@@ -805,7 +859,9 @@ VersionSet::VersionSet(const std::string& dbname,
       descriptor_file_(NULL),
       descriptor_log_(NULL),
       dummy_versions_(this),
-      current_(NULL) { }
+      current_(NULL),
+      manifest_writer_active_(false),
+      manifest_writer_cv_(NULL) { }
 
 BasicVersionSet::BasicVersionSet(const std::string& dbname,
                        const Options* options,
@@ -842,7 +898,24 @@ void VersionSet::AppendVersion(Version* v) {
   v->next_->prev_ = v;
 }
 
+void VersionSet::BeginLogAndApply(port::Mutex* mu) {
+  mu->AssertHeld();
+  if (manifest_writer_cv_ == NULL) {
+    manifest_writer_cv_ = new port::CondVar(mu);
+  }
+  while (manifest_writer_active_) {
+    manifest_writer_cv_->Wait();
+  }
+  manifest_writer_active_ = true;
+}
+
+void VersionSet::EndLogAndApply() {
+  manifest_writer_active_ = false;
+  manifest_writer_cv_->SignalAll();
+}
+
 Status BasicVersionSet::LogAndApply(VersionEdit* edit, port::Mutex* mu) {
+  BeginLogAndApply(mu);
   if (edit->has_log_number_) {
     assert(edit->log_number_ >= log_number_);
     assert(edit->log_number_ < next_file_number_);
@@ -910,6 +983,7 @@ Status BasicVersionSet::LogAndApply(VersionEdit* edit, port::Mutex* mu) {
 
   // Install the new version
   if (s.ok()) {
+    ApplyGlobalSequences(*edit);
     AppendVersion(v);
     log_number_ = edit->log_number_;
     prev_log_number_ = edit->prev_log_number_;
@@ -925,6 +999,7 @@ Status BasicVersionSet::LogAndApply(VersionEdit* edit, port::Mutex* mu) {
   }
 
   DEBUG_LEVEL_CHECK_NOLOCK(1, PrintVersionSet());
+  EndLogAndApply();
   return s;
 }
 
@@ -984,6 +1059,7 @@ Status BasicVersionSet::Recover() {
 
       if (s.ok()) {
         builder.Apply(&edit);
+        ApplyGlobalSequences(edit);
       }
 
       if (edit.has_log_number_) {
@@ -1049,46 +1125,50 @@ void VersionSet::MarkFileNumberUsed(uint64_t number) {
   }
 }
 
+double VersionSet::CompactionScore(const Version* v, int level) {
+  double score;
+  if (level == 0) {
+    // We treat level-0 specially by bounding the number of files
+    // instead of number of bytes for two reasons:
+    //
+    // (1) With larger write-buffer sizes, it is nice not to do too
+    // many level-0 compactions.
+    //
+    // (2) The files in level-0 are merged on every read and
+    // therefore we wish to avoid too many files when the individual
+    // file size is small (perhaps because of a small write-buffer
+    // setting, or very high compression ratios, or lots of
+    // overwrites/deletions).
+    score = hlsm::cursor::calculate_level0_compaction_score(v->files_[level].size(), v->files_[level+1].size());
+    if (hlsm::config::restrict_L0_score > 0) {
+    	score = (score > hlsm::config::restrict_L0_score) ?
+    			hlsm::config::restrict_L0_score : score;
+    }
+    DEBUG_INFO((score>0 ? 1:100), "level %d, score = %.3f, #f = %lu, bytes = %lu\n", 
+    		level, score, v->files_[level].size(), TotalFileSize(v->files_[level]));
+  } else {
+    // Compute the ratio of current size to size limit.
+    if (hlsm::runtime::use_cursor_compaction) {
+  	  score = hlsm::cursor::calculate_compaction_score(level, v->files_);
+    } else {
+  	  const uint64_t level_bytes = TotalFileSize(v->files_[level]);
+  	  score = static_cast<double>(level_bytes) / MaxBytesForLevel(level);
+	  // do not compact the level that exceeds the kMaxLevel
+  	  if (hlsm::config::kMaxLevel > 0 && level >= hlsm::config::kMaxLevel) score = 0;
+  	  DEBUG_INFO((score>0 ? 1:100), "level %d, score = %.3f, bytes = %lu, max_bytes = %.3f, #f=%lu\n", 
+  	  		level, score, level_bytes, MaxBytesForLevel(level), v->files_[level].size());
+    }
+  }
+  return score;
+}
+
 void VersionSet::Finalize(Version* v) {
   // Precomputed best level for next compaction
   int best_level = -1;
   double best_score = -1;
 
   for (int level = 0; level < config::kNumLevels-1; level++) {
-    double score;
-    if (level == 0) {
-      // We treat level-0 specially by bounding the number of files
-      // instead of number of bytes for two reasons:
-      //
-      // (1) With larger write-buffer sizes, it is nice not to do too
-      // many level-0 compactions.
-      //
-      // (2) The files in level-0 are merged on every read and
-      // therefore we wish to avoid too many files when the individual
-      // file size is small (perhaps because of a small write-buffer
-      // setting, or very high compression ratios, or lots of
-      // overwrites/deletions).
-      score = hlsm::cursor::calculate_level0_compaction_score(v->files_[level].size(), v->files_[level+1].size());
-      if (hlsm::config::restrict_L0_score > 0) {
-      	score = (score > hlsm::config::restrict_L0_score) ?
-      			hlsm::config::restrict_L0_score : score;
-      }
-      DEBUG_INFO((score>0 ? 1:100), "level %d, score = %.3f, #f = %lu, bytes = %lu\n", 
-      		level, score, v->files_[level].size(), TotalFileSize(v->files_[level]));
-    } else {
-      // Compute the ratio of current size to size limit.
-      if (hlsm::runtime::use_cursor_compaction) {
-    	  score = hlsm::cursor::calculate_compaction_score(level, v->files_);
-      } else {
-    	  const uint64_t level_bytes = TotalFileSize(v->files_[level]);
-    	  score = static_cast<double>(level_bytes) / MaxBytesForLevel(level);
-	  // do not compact the level that exceeds the kMaxLevel
-    	  if (hlsm::config::kMaxLevel > 0 && level >= hlsm::config::kMaxLevel) score = 0;
-    	  DEBUG_INFO((score>0 ? 1:100), "level %d, score = %.3f, bytes = %lu, max_bytes = %.3f, #f=%lu\n", 
-    	  		level, score, level_bytes, MaxBytesForLevel(level), v->files_[level].size());
-      }
-    }
-
+    const double score = CompactionScore(v, level);
     if (score > best_score) {
       best_level = level;
       best_score = score;
@@ -1123,12 +1203,33 @@ Status BasicVersionSet::WriteSnapshot(log::Writer* log) {
       edit.AddFile(level, f->number, f->file_size, f->smallest, f->largest);
     }
   }
+  std::set<uint64_t> live;
+  AddLiveFiles(&live);
+  SaveGlobalSequences(live, &edit);
 
   std::string record;
   edit.EncodeTo(&record);
   return log->AddRecord(record);
 }
 
+void VersionSet::ApplyGlobalSequences(const VersionEdit& edit) {
+  for (size_t i = 0; i < edit.global_seqs_.size(); i++) {
+    table_cache_->SetGlobalSequence(edit.global_seqs_[i].first,
+                                    edit.global_seqs_[i].second);
+  }
+}
+
+void VersionSet::SaveGlobalSequences(const std::set<uint64_t>& live,
+                                     VersionEdit* edit) {
+  for (std::set<uint64_t>::const_iterator it = live.begin();
+       it != live.end(); ++it) {
+    const SequenceNumber seq = table_cache_->GlobalSequence(*it);
+    if (seq != 0) {
+      edit->SetGlobalSequence(*it, seq);
+    }
+  }
+}
+
 int VersionSet::NumLevelFiles(int level) const {
   assert(level >= 0);
   assert(level < config::kNumLevels);
@@ -1188,6 +1289,10 @@ void VersionSet::AddLiveFiles(std::set<uint64_t>* live) {
        v != &dummy_versions_;
        v = v->next_) {
     for (int level = 0; level < config::kNumLevels; level++) {
+      if (v->prev_ != &dummy_versions_ &&
+          v->files_[level].SharedWith(v->prev_->files_[level])) {
+        continue;  // Already added with the previous version
+      }
       const std::vector<FileMetaData*>& files = v->files_[level];
       for (size_t i = 0; i < files.size(); i++) {
         live->insert(files[i]->number);
@@ -1202,6 +1307,26 @@ int64_t VersionSet::NumLevelBytes(int level) const {
   return TotalFileSize(current_->files_[level]);
 }
 
+int64_t VersionSet::EstimatedPendingCompactionBytes() const {
+  int64_t result = 0;
+  if (current_->files_[0].size() >=
+      static_cast<size_t>(config::kL0_CompactionTrigger) &&
+      CompactionScore(current_, 0) > 0) {
+    result += TotalFileSize(current_->files_[0]);
+  }
+  for (int level = 1; level < config::kNumLevels - 1; level++) {
+    if (CompactionScore(current_, level) <= 0) {
+      continue;
+    }
+    const int64_t excess = TotalFileSize(current_->files_[level]) -
+        static_cast<int64_t>(MaxBytesForLevel(level));
+    if (excess > 0) {
+      result += excess;
+    }
+  }
+  return result;
+}
+
 int64_t VersionSet::MaxNextLevelOverlappingBytes() {
   int64_t result = 0;
   std::vector<FileMetaData*> overlaps;
@@ -57,6 +57,51 @@ extern bool SomeFileOverlapsRange(
     const Slice* smallest_user_key,
     const Slice* largest_user_key);
 
+// The files of one level of a Version.  Versions produced by the same
+// LogAndApply share the list of every level the edit did not touch; the
+// list is copied only when a builder modifies it.  The list holds one
+// reference on each of its files.
+class LevelFiles {
+ public:
+  LevelFiles() : rep_(NULL) { }
+  ~LevelFiles() { Unref(); }
+
+  size_t size() const { return files().size(); }
+  bool empty() const { return files().empty(); }
+  FileMetaData* const& operator[](size_t i) const { return files()[i]; }
+
+  const std::vector<FileMetaData*>& files() const {
+    return (rep_ != NULL) ? rep_->files : empty_;
+  }
+  operator const std::vector<FileMetaData*>&() const { return files(); }
+
+  // Drop the current contents and share the list of *other.
+  void ShareFrom(const LevelFiles& other);
+
+  // Return a list private to this level that may be modified.  Files
+  // pushed into it must carry a reference for the list.
+  std::vector<FileMetaData*>* mutable_files();
+
+  bool SharedWith(const LevelFiles& other) const {
+    return rep_ != NULL && rep_ == other.rep_;
+  }
+
+ private:
+  struct Rep {
+    int refs;
+    std::vector<FileMetaData*> files;
+  };
+
+  void Unref();
+
+  static const std::vector<FileMetaData*> empty_;
+  Rep* rep_;
+
+  // No copying allowed
+  LevelFiles(const LevelFiles&);
+  void operator=(const LevelFiles&);
+};
+
 class Version {
  public:
   Version() {} // for the sake of compiler only
@@ -114,6 +159,9 @@ class Version {
 
   int NumFiles(int level) const { return files_[level].size(); }
 
+  // For tests: the file list of "level"
+  const LevelFiles& TEST_LevelFiles(int level) const { return files_[level]; }
+
   // Return a human readable string that describes this version's contents.
   std::string DebugString() const;
 
@@ -144,8 +192,12 @@ class Version {
   int refs_;                    // Number of live refs to this version
   int level_num_;
 
+  // Levels in the order Get() probes them, newest data first; empty when
+  // that is the order of the levels (see LazyVersionSet::SetLookupOrder())
+  std::vector<int> lookup_order_;
+
   // List of files per level
-  std::vector<FileMetaData*> *files_;
+  LevelFiles* files_;
 
   // Next file to compact based on seek stats.
   FileMetaData* file_to_compact_;
@@ -164,7 +216,7 @@ class Version {
         compaction_score_(-1),
         compaction_level_(-1),
         level_num_(level) {
-	  files_ = new std::vector<FileMetaData*>[level];
+	  files_ = new LevelFiles[level];
   }
 
   ~Version();
@@ -180,13 +232,13 @@ class VersionSet {
 		  const Options* options,
 	      TableCache* table_cache,
 	      const InternalKeyComparator*);
-  virtual ~VersionSet() {};
+  virtual ~VersionSet() { delete manifest_writer_cv_; }
 
   // Apply *edit to the current version to form a new descriptor that
   // is both saved to persistent state and installed as the new
   // current version.  Will release *mu while actually writing to the file.
   // REQUIRES: *mu is held on entry.
-  // REQUIRES: no other thread concurrently calls LogAndApply()
+  // Concurrent callers (memtable flushes and compactions) are serialized.
   virtual Status LogAndApply(VersionEdit* edit, port::Mutex* mu)
       EXCLUSIVE_LOCKS_REQUIRED(mu) = 0;
 
@@ -217,6 +269,15 @@ class VersionSet {
   // Return the combined file size of all files at the specified level.
   int64_t NumLevelBytes(int level) const;
 
+  // Return an estimate of the bytes compactions must rewrite before every
+  // level is back within its size limit: all of level-0 once it reaches
+  // its compaction trigger, and the excess of the levels below.  Levels
+  // Finalize() gives a score of 0, such as those from
+  // hlsm::config::kMaxLevel on or the right half of a cursor level whose
+  // left half is not empty, are left out: they are not compacted, so
+  // their excess is no debt.
+  int64_t EstimatedPendingCompactionBytes() const;
+
   // Return the last sequence number.
   uint64_t LastSequence() const { return last_sequence_; }
 
@@ -291,6 +352,10 @@ protected:
 
   void Finalize(Version* v);
 
+  // Compaction score of "level" in v: compaction is needed from 1 on and
+  // never happens at 0
+  static double CompactionScore(const Version* v, int level);
+
   void GetRange(const std::vector<FileMetaData*>& inputs,
                 InternalKey* smallest,
                 InternalKey* largest);
@@ -305,8 +370,18 @@ protected:
   // Save current contents to *log
   virtual Status WriteSnapshot(log::Writer* log) = 0;
 
+  // Global sequence numbers of ingested tables: hand those of an edit to
+  // the table cache, and save those of the tables in "live" with a snapshot
+  void ApplyGlobalSequences(const VersionEdit& edit);
+  void SaveGlobalSequences(const std::set<uint64_t>& live, VersionEdit* edit);
+
   void AppendVersion(Version* v);
 
+  // Bracket the body of LogAndApply() so that only one edit at a time
+  // builds on current_ and writes the MANIFEST.
+  void BeginLogAndApply(port::Mutex* mu) EXCLUSIVE_LOCKS_REQUIRED(mu);
+  void EndLogAndApply();
+
   Env* const env_;
   const std::string dbname_;
   const Options* const options_;
@@ -324,6 +399,11 @@ protected:
   Version dummy_versions_;  // Head of circular doubly-linked list of versions.
   Version* current_;        // == dummy_versions_.prev_
 
+  // Set while a LogAndApply() is in progress; waiters block on the cv,
+  // which is created on first use since *mu is only known then.
+  bool manifest_writer_active_;
+  port::CondVar* manifest_writer_cv_;
+
   // Per-level key at which the next compaction at that level should start.
   // Either an empty string, or a valid InternalKey.
   std::string compact_pointer_[config::kNumLevels];
@@ -0,0 +1,54 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/write_controller.h"
+
+#include <algorithm>
+
+namespace leveldb {
+
+const uint64_t WriteController::kMinWriteRate;
+const uint64_t WriteController::kMaxBurstMicros;
+
+void WriteController::Update(int l0_files, int slowdown_trigger,
+                             int stop_trigger, int64_t pending_bytes,
+                             int64_t soft_pending_bytes,
+                             int64_t hard_pending_bytes, uint64_t base_rate) {
+  // How far the DB is between running freely (0) and stopping writes (1)
+  double pressure = 0;
+  if (l0_files >= slowdown_trigger) {
+    pressure = (l0_files - slowdown_trigger + 1) /
+        static_cast<double>(std::max(stop_trigger - slowdown_trigger + 1, 1));
+  }
+  if (soft_pending_bytes > 0 && pending_bytes >= soft_pending_bytes) {
+    const int64_t range = std::max<int64_t>(
+        hard_pending_bytes - soft_pending_bytes, 1);
+    pressure = std::max(pressure,
+        (pending_bytes - soft_pending_bytes + 1) / static_cast<double>(range));
+  }
+
+  if (pressure <= 0) {
+    rate_ = 0;
+    return;
+  }
+  const uint64_t rate = static_cast<uint64_t>(
+      base_rate * (1 - std::min(pressure, 1.0)));
+  if (rate_ == 0) {
+    next_ = 0;  // Start a new run of delays with a full burst
+  }
+  rate_ = std::max(rate, kMinWriteRate);
+}
+
+uint64_t WriteController::GetDelay(uint64_t now, uint64_t bytes) {
+  if (rate_ == 0) {
+    return 0;
+  }
+  if (next_ + kMaxBurstMicros < now) {
+    next_ = now - kMaxBurstMicros;
+  }
+  next_ += bytes * 1000000 / rate_;
+  return (next_ > now) ? next_ - now : 0;
+}
+
+}  // namespace leveldb
@@ -0,0 +1,54 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// WriteController paces writers while compactions fall behind.  Instead
+// of a fixed sleep per write at the level-0 slowdown trigger, it picks a
+// target ingest rate from the level-0 file count, the estimated pending
+// compaction bytes and the flush speed, and delays each write in
+// proportion to its size.
+//
+// Requires external synchronization (DBImpl::mutex_).
+
+#ifndef STORAGE_LEVELDB_DB_WRITE_CONTROLLER_H_
+#define STORAGE_LEVELDB_DB_WRITE_CONTROLLER_H_
+
+#include <stdint.h>
+
+namespace leveldb {
+
+class WriteController {
+ public:
+  // Rate below which writers are never slowed down, in bytes per second
+  static const uint64_t kMinWriteRate = 16 << 10;
+
+  // Credit an idle writer may bank, in micros of writing at the rate
+  static const uint64_t kMaxBurstMicros = 1000;
+
+  WriteController() : rate_(0), next_(0) { }
+
+  // Pick the rate for the given state of the DB: no delay below both
+  // the level-0 slowdown trigger and soft_pending_bytes, then a rate
+  // that falls from base_rate towards kMinWriteRate as the level-0 files
+  // approach stop_trigger, or the pending bytes hard_pending_bytes.
+  void Update(int l0_files, int slowdown_trigger, int stop_trigger,
+              int64_t pending_bytes, int64_t soft_pending_bytes,
+              int64_t hard_pending_bytes, uint64_t base_rate);
+
+  // Bytes per second writers are paced at, or 0 if they are not delayed
+  uint64_t delayed_write_rate() const { return rate_; }
+  bool IsDelayed() const { return rate_ > 0; }
+
+  // Return the micros a write of "bytes" bytes issued at "now" has to
+  // wait.  Writes take turns on a virtual clock that advances by
+  // bytes / rate per write, so that the delays add up to the rate.
+  uint64_t GetDelay(uint64_t now, uint64_t bytes);
+
+ private:
+  uint64_t rate_;
+  uint64_t next_;  // Micros at which the next write may start
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_WRITE_CONTROLLER_H_
@@ -0,0 +1,131 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/write_controller.h"
+
+#include "db/db_impl.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/hlsm_param.h"
+#include "port/port.h"
+#include "util/mutexlock.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class WriteControllerTest { };
+
+TEST(WriteControllerTest, RateAndDelays) {
+  const uint64_t kBase = 1 << 20;
+  WriteController wc;
+  wc.Update(7, 8, 12, 0, 1 << 20, 4 << 20, kBase);
+  ASSERT_TRUE(!wc.IsDelayed());
+  ASSERT_EQ(0, wc.GetDelay(1000000, 1 << 20));
+
+  // The rate falls with every level-0 file from the slowdown trigger on
+  uint64_t last = kBase;
+  for (int files = 8; files <= 12; files++) {
+    wc.Update(files, 8, 12, 0, 1 << 20, 4 << 20, kBase);
+    ASSERT_TRUE(wc.IsDelayed());
+    ASSERT_LT(wc.delayed_write_rate(), last);
+    ASSERT_GE(wc.delayed_write_rate(), WriteController::kMinWriteRate);
+    last = wc.delayed_write_rate();
+  }
+  ASSERT_EQ(WriteController::kMinWriteRate, last);
+
+  // Pending compaction bytes slow down writes below the trigger too
+  wc.Update(0, 8, 12, 2 << 20, 1 << 20, 4 << 20, kBase);
+  ASSERT_TRUE(wc.IsDelayed());
+  ASSERT_LT(wc.delayed_write_rate(), kBase);
+  wc.Update(0, 8, 12, 8 << 20, 1 << 20, 4 << 20, kBase);
+  ASSERT_EQ(WriteController::kMinWriteRate, wc.delayed_write_rate());
+  wc.Update(0, 8, 12, 0, 1 << 20, 4 << 20, kBase);
+  ASSERT_TRUE(!wc.IsDelayed());
+
+  // At 1MB/s a byte takes a micro; an idle writer banks kMaxBurstMicros
+  wc.Update(8, 8, 9, 0, 0, 0, 2000000);
+  ASSERT_EQ(1000000, wc.delayed_write_rate());
+  const uint64_t now = 10000000;
+  ASSERT_EQ(0, wc.GetDelay(now, 1000));
+  ASSERT_EQ(1000, wc.GetDelay(now, 1000));
+  ASSERT_EQ(500, wc.GetDelay(now + 1000, 500));
+  ASSERT_EQ(0, wc.GetDelay(now + 1000000, 1000));
+}
+
+TEST(WriteControllerTest, Property) {
+  const std::string dbname = test::TmpDir() + "/write_controller_test";
+  Options options;
+  options.create_if_missing = true;
+  DestroyDB(dbname, options);
+  hlsm::config::primary_storage_path = dbname.c_str();
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  ASSERT_OK(db->Put(WriteOptions(), "k", "v"));
+  std::string rate;
+  ASSERT_TRUE(db->GetProperty("hlsm.delayed-write-rate", &rate));
+  ASSERT_EQ("0", rate);
+  delete db;
+  DestroyDB(dbname, options);
+  hlsm::config::primary_storage_path = NULL;
+}
+
+namespace {
+// Occupies the single LOW pool thread, holding back compactions
+struct Blocker {
+  port::Mutex mu;
+  port::CondVar cv;
+  bool released;
+  Blocker() : cv(&mu), released(false) { }
+};
+
+void BlockUntilReleased(void* arg) {
+  Blocker* b = reinterpret_cast<Blocker*>(arg);
+  MutexLock l(&b->mu);
+  while (!b->released) b->cv.Wait();
+}
+}  // namespace
+
+TEST(WriteControllerTest, ChargesOwnBatch) {
+  const std::string dbname = test::TmpDir() + "/write_controller_charge";
+  Options options;
+  options.create_if_missing = true;
+  DestroyDB(dbname, options);
+  hlsm::config::primary_storage_path = dbname.c_str();
+  const int saved_rate = hlsm::config::delayed_write_rate_kb;
+  hlsm::config::delayed_write_rate_kb = 1024;
+  Blocker blocker;
+  Env::Default()->Schedule(&BlockUntilReleased, &blocker, Env::LOW);
+
+  // Flushes still run, so level-0 reaches the slowdown trigger
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  for (int i = 0; i < config::kL0_SlowdownWritesTrigger; i++) {
+    ASSERT_OK(db->Put(WriteOptions(), "a", "v"));
+    ASSERT_OK(reinterpret_cast<DBImpl*>(db)->TEST_CompactMemTable());
+  }
+  std::string rate;
+  ASSERT_TRUE(db->GetProperty("hlsm.delayed-write-rate", &rate));
+  ASSERT_NE("0", rate);
+
+  // A large write after small ones waits for its own bytes, about 300ms
+  const uint64_t start = Env::Default()->NowMicros();
+  ASSERT_OK(db->Put(WriteOptions(), "b", std::string(256 << 10, 'x')));
+  ASSERT_GT(Env::Default()->NowMicros() - start, 200000);
+
+  {
+    MutexLock l(&blocker.mu);
+    blocker.released = true;
+    blocker.cv.SignalAll();
+  }
+  delete db;
+  DestroyDB(dbname, options);
+  hlsm::config::delayed_write_rate_kb = saved_rate;
+  hlsm::config::primary_storage_path = NULL;
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -0,0 +1,74 @@
+#ifndef STORAGE_LEVELDB_INCLUDE_BULK_LOAD_H_
+#define STORAGE_LEVELDB_INCLUDE_BULK_LOAD_H_
+
+#include <stdint.h>
+#include "leveldb/options.h"
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+
+namespace leveldb {
+
+class WritableFile;
+
+// The entries of one table loaded by DB::BulkLoad().  Partitions of the
+// same level must cover disjoint key ranges.
+class BulkLoadPartition {
+ public:
+  virtual ~BulkLoadPartition();
+
+  // Level the table is added to
+  virtual int level() const = 0;
+
+  // Store the next entry in *key and *value and return true, or return
+  // false after the last one.  Keys must be in increasing order.  The
+  // slices stay valid until the next call.  Called from one loader thread
+  // at a time.
+  virtual bool Next(Slice* key, Slice* value) = 0;
+
+  // Error that ended the entries early, if any
+  virtual Status status() const { return Status::OK(); }
+};
+
+struct BulkLoadOptions {
+  // Number of tables built at the same time
+  // Default: 4
+  int threads;
+
+  BulkLoadOptions() : threads(4) { }
+};
+
+// Writes a table for DB::IngestExternalFiles() into a file.  The options
+// must have the comparator and filter policy of the database.
+class ExternalTableBuilder {
+ public:
+  // The caller closes and deletes *file after Finish() or Abandon()
+  ExternalTableBuilder(const Options& options, WritableFile* file);
+
+  // REQUIRES: Finish() or Abandon() has been called
+  ~ExternalTableBuilder();
+
+  // Add an entry.  Fails with InvalidArgument unless key is after all
+  // keys added before.
+  Status Add(const Slice& key, const Slice& value);
+
+  // Write the rest of the table
+  Status Finish();
+
+  // Leave the file incomplete
+  void Abandon();
+
+  uint64_t NumEntries() const;
+  uint64_t FileSize() const;
+
+ private:
+  struct Rep;
+  Rep* rep_;
+
+  // No copying allowed
+  ExternalTableBuilder(const ExternalTableBuilder&);
+  void operator=(const ExternalTableBuilder&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_INCLUDE_BULK_LOAD_H_
@@ -7,6 +7,8 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <vector>
+#include "leveldb/bulk_load.h"
 #include "leveldb/iterator.h"
 #include "leveldb/options.h"
 
@@ -89,6 +91,9 @@ class DB {
   //
   // Caller should delete the iterator when it is no longer needed.
   // The returned iterator should be deleted before this db is deleted.
+  //
+  // Set is_sequential for long scans.  In hLSM mode, other iterators read
+  // the copies on the secondary storage, as Get() does.
   virtual Iterator* NewIterator(const ReadOptions& options, bool is_sequential=false) = 0;
 
   // Return a handle to the current DB state.  Iterators created with
@@ -140,6 +145,31 @@ class DB {
   //    db->CompactRange(NULL, NULL);
   virtual void CompactRange(const Slice* begin, const Slice* end) = 0;
 
+  // Build a table from each partition, with options.threads tables built
+  // at the same time, and add all of them to their levels in one version
+  // edit.  The entries bypass the log and the memtable.  Each level gets
+  // one sequence number, newer than what the database holds and newer
+  // for upper levels.  Fails with InvalidArgument, adding nothing, if the
+  // memtable holds entries, if partitions of a level overlap, or if a
+  // table overlaps a file at or above its level.
+  //
+  // The default implementation returns NotSupported.
+  virtual Status BulkLoad(const BulkLoadOptions& options,
+                          const std::vector<BulkLoadPartition*>& partitions);
+
+  // Add the tables written by ExternalTableBuilder at "paths" without
+  // rewriting them.  Their names have to end in ".ldb", like those of the
+  // tables of the database, which the Env never relocates.  The files are hard-linked into the database if
+  // possible, or else copied.  All their entries get one sequence number,
+  // newer than what the database holds, and each table goes to the
+  // deepest level it does not overlap, counting only the levels that hold
+  // tables; with cursor compaction the LX.R part of a logical level.
+  // Writes wait while the tables are linked or copied.  Fails, adding
+  // nothing, if the tables overlap each other.
+  //
+  // The default implementation returns NotSupported.
+  virtual Status IngestExternalFiles(const std::vector<std::string>& paths);
+
  private:
   // No copying allowed
   DB(const DB&);
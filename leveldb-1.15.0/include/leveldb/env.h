@@ -94,6 +94,12 @@ class Env {
   virtual Status RenameFile(const std::string& src,
                             const std::string& target) = 0;
 
+  // Create target as a hard link to src.  Fails, e.g. across file
+  // systems, where a copy has to be made instead.
+  virtual Status LinkFile(const std::string& src, const std::string& target) {
+    return Status::NotSupported("LinkFile", src);
+  }
+
   // Lock the specified file.  Used to prevent concurrent access to
   // the same db by multiple processes.  On failure, stores NULL in
   // *lock and returns non-OK.
@@ -125,6 +131,37 @@ class Env {
       void (*function)(void* arg),
       void* arg) = 0;
 
+  // Background work is spread over thread pools of different priorities:
+  // HIGH runs memtable flushes, LOW runs compactions and IO runs the
+  // mirror/copy work queued by the hLSM helper.  Each pool starts with a
+  // single thread.
+  enum Priority { LOW, HIGH, IO, TOTAL };
+
+  // Like Schedule(), but run "(*function)(arg)" in the pool of priority
+  // "pri".  The default implementation ignores "pri".
+  virtual void Schedule(void (*function)(void* arg), void* arg,
+                        Priority pri) {
+    Schedule(function, arg);
+  }
+
+  // Resize the pool of priority "pri" to "num" threads.  Surplus threads
+  // exit once they become idle.
+  virtual void SetBackgroundThreads(int num, Priority pri) { }
+
+  // Restrict the threads of pool "pri" to the given CPUs.  An empty
+  // "cpus" removes the restriction.
+  virtual void SetBackgroundThreadsAffinity(const std::vector<int>& cpus,
+                                            Priority pri) { }
+
+  // Set the I/O scheduling class and level (see ioprio_set(2)) used by
+  // the threads of pool "pri".  A negative "io_class" restores the
+  // default.
+  virtual void SetBackgroundThreadsIOPriority(int io_class, int io_level,
+                                              Priority pri) { }
+
+  // Return the number of work items waiting in the pool of priority "pri".
+  virtual int GetThreadPoolQueueLen(Priority pri) { return 0; }
+
   // Start a new thread, invoking "function(arg)" within the new thread.
   // When "function(arg)" returns, the thread will be destroyed.
   virtual void StartThread(void (*function)(void* arg), void* arg) = 0;
@@ -200,6 +237,11 @@ class RandomAccessFile {
   virtual Status Read(uint64_t offset, size_t n, Slice* result,
                       char* scratch) const = 0;
 
+  // Hint that the "n" bytes from "offset" will be read soon, so that they
+  // may be read into the page cache in the background.  Does nothing by
+  // default.
+  virtual void Readahead(uint64_t offset, size_t n) const { }
+
   std::string GetFileName() {return filename_;}
 
  protected:
@@ -308,6 +350,9 @@ class EnvWrapper : public Env {
   Status RenameFile(const std::string& s, const std::string& t) {
     return target_->RenameFile(s, t);
   }
+  Status LinkFile(const std::string& s, const std::string& t) {
+    return target_->LinkFile(s, t);
+  }
   Status LockFile(const std::string& f, FileLock** l) {
     return target_->LockFile(f, l);
   }
@@ -315,6 +360,23 @@ class EnvWrapper : public Env {
   void Schedule(void (*f)(void*), void* a) {
     return target_->Schedule(f, a);
   }
+  void Schedule(void (*f)(void*), void* a, Priority pri) {
+    return target_->Schedule(f, a, pri);
+  }
+  void SetBackgroundThreads(int num, Priority pri) {
+    target_->SetBackgroundThreads(num, pri);
+  }
+  void SetBackgroundThreadsAffinity(const std::vector<int>& cpus,
+                                    Priority pri) {
+    target_->SetBackgroundThreadsAffinity(cpus, pri);
+  }
+  void SetBackgroundThreadsIOPriority(int io_class, int io_level,
+                                      Priority pri) {
+    target_->SetBackgroundThreadsIOPriority(io_class, io_level, pri);
+  }
+  int GetThreadPoolQueueLen(Priority pri) {
+    return target_->GetThreadPoolQueueLen(pri);
+  }
   void StartThread(void (*f)(void*), void* a) {
     return target_->StartThread(f, a);
   }
@@ -10,6 +10,7 @@
 #include "db/version_set.h"
 
 #include "leveldb/hlsm_debug.h"
+#include "leveldb/hlsm_metrics.h"
 #include "leveldb/hlsm_types.h"
 #include "leveldb/hlsm_func.h"
 #include "leveldb/hlsm_param.h"
@@ -9,7 +9,7 @@
 
 #define FILE_HAS_SUFFIX(fname_, str_) ((fname_.find(str_) != std::string::npos))
 #define HAS_SUBSTR(str_, sstr_) ((str_.find(sstr_) != std::string::npos))
-#define PRIMARY_TO_SECONDARY_FILE(fname_) (( std::string(hlsm::config::secondary_storage_path) + fname_.substr(fname_.find_last_of("/")) ))
+#define PRIMARY_TO_SECONDARY_FILE(fname_) (( hlsm::secondary_file(fname_) ))
 #define SECONDARY_TO_PRIMARY_FILE(fname_) (( std::string(hlsm::config::primary_storage_path) + fname_.substr(fname_.find_last_of("/")) ))
 
 #define CALL_IF_HLSM(do_) do { if(hlsm::config::mode.ishLSM()) { DEBUG_INFO(3, "call if hlsm\n"); do_;} } while(0)
@@ -24,9 +24,29 @@
 namespace hlsm {
 
 inline static int table_name_to_number(const std::string& fname) {
-	size_t n = fname.find("ldb");
 	size_t m = fname.find_last_of("/");
-	return std::atoi(fname.substr(m+1, n-1).c_str());
+	return std::atoi(fname.substr(m+1).c_str()); // stops at ".ldb"
+}
+
+/*
+ * Secondary paths, within hlsm_util.cc
+ */
+// Split config::secondary_storage_path into runtime::secondary_paths; the
+//	first path keeps the logs and metadata and stays the configured one
+void init_secondary_paths();
+// Secondary path of table fnum.  A table keeps the path it was first given;
+//	one not seen before is looked up on every path, or else placed on the
+//	path with the most free space per queued operation
+int secondary_stripe(uint64_t fnum);
+std::string secondary_table_file(uint64_t fnum);
+// Counterpart of a primary file on the secondary
+std::string secondary_file(const std::string& fname);
+bool is_secondary_file(const std::string& fname);
+// Device of a file for metrics::RecordIo(): 0 for the primary, k for
+//	secondary path k-1
+int io_device(const std::string& fname);
+inline int secondary_io_device(uint64_t fnum) {
+	return 1 + secondary_stripe(fnum);
 }
 
 inline bool is_primary_file(const std::string& fname) {
@@ -39,15 +59,13 @@ inline static bool do_prefetch (int is_sequential) {
 	return (is_sequential == 1);
 }
 
+// pure: only levels whose secondary copy goes away with the primary one
 inline static bool is_mirrored_write(uint64_t num, bool pure = false) {
-	if (pure) {
-		if (hlsm::runtime::table_level.withinPureMirroredLevel(num))
-			return true;
-	} else {
-		if (hlsm::runtime::table_level.withinMirroredLevel(num))
-			return true;
-	}
-	return false;
+	int level = hlsm::runtime::placement.level(num);
+	if (level == -1) return false;
+	return (level >= hlsm::runtime::mirror_start_level ||
+			level <= (pure ? hlsm::runtime::top_pure_mirror_end_level
+					: hlsm::runtime::top_mirror_end_level)); // <=1 for hLSM-tree 2-phase compaction
 }
 
 inline static bool is_mirrored_write(const std::string& fname, bool pure = false) {
@@ -60,7 +78,7 @@ inline static bool is_mirrored_write(const std::string& fname, bool pure = false
 			size_t m = fname.find_last_of("/");
 			int number = std::atoi(fname.substr(m+1, n-1).c_str());
 			DEBUG_INFO(2, "%s\t%d\n", fname.substr(m+1, n-1).c_str(), number);
-			// requires that table_level is updated before this call
+			// requires that the level is registered before this call
 			return is_mirrored_write(number, pure);
 		}
 	}
@@ -145,6 +163,23 @@ inline int get_hlsm_new_level(int original_level) {
  *  Within hlsm_util.cc
  */
 int init_opq_helpler();
+// Make sure helper h is draining its queues on the Env's IO pool: helper 0
+//	serves op_queue/hop_queue, helper k the queue of secondary path k-1
+void schedule_opq_helper(int h);
+// Block until all queues are drained and the helpers have returned
+void wait_opq_helper();
+// Queue for I/O on the secondary copy of table fnum
+opq table_queue(uint64_t fnum);
+// Copy table fnum from src to dst in steps of config::migration_chunk_size,
+//	reporting the progress to runtime::placement and staying within the
+//	budget of runtime::migration_throttler; dst is synced before returning
+leveldb::Status migrate_table(const std::string& src, const std::string& dst,
+		uint64_t fnum);
+// Free bytes on all secondary paths
+uint64_t secondary_free_bytes();
+// Step for the two-phase end level: -1 to end two-phase compaction one
+//	level earlier, +1 to end it one level later, 0 to keep it
+int tune_two_phase_end_level(const LevelTuning& t);
 
 /*
  * DeltaLevelMeta
@@ -154,13 +189,24 @@ inline uint32_t get_active_delta_level(delta_meta_t meta[], int llevel) {
 	return llevel * (hlsm::runtime::delta_level_num + 1) + 1 - meta[llevel].active;
 }
 
-inline int get_pure_mirror_level(int level) {
-	int lnum = hlsm::runtime::two_phase_end_level + 1;
+// Lazy level of raw level "level" when two-phase compaction ends at end_level
+inline int get_pure_mirror_level(int level, int end_level) {
+	int lnum = end_level + 1;
 	assert(level >= 2 * lnum);
-	return get_hlsm_new_level(2 * lnum - 1)
+	return end_level * (hlsm::runtime::delta_level_num + 1) + 1
 			+ level - 2 * lnum;
 }
 
+inline int get_pure_mirror_level(int level) {
+	return get_pure_mirror_level(level, hlsm::runtime::two_phase_end_level);
+}
+
+// Lazy level "dlevel" is one of the delta levels of logical level llevel
+inline bool is_delta_level_of(int dlevel, int llevel) {
+	return dlevel >= (llevel - 1) * (hlsm::runtime::delta_level_num + 1) + 2
+			&& dlevel <= llevel * (hlsm::runtime::delta_level_num + 1);
+}
+
 inline std::vector<uint32_t> get_obsolete_delta_levels(delta_meta_t meta[], int llevel) {
 	std::vector<uint32_t> levels;
 	uint32_t start = meta[llevel].start;
@@ -177,6 +223,21 @@ inline std::vector<uint32_t> get_obsolete_delta_levels(delta_meta_t meta[], int
 	return levels;
 }
 
+// delta levels filled since the last roll forward, oldest first; the
+//	active delta level is excluded since it still receives files
+inline std::vector<uint32_t> get_mergeable_delta_levels(delta_meta_t meta[], int llevel) {
+	std::vector<uint32_t> levels;
+	uint32_t cur = meta[llevel].clear;
+	for (int i = 0; i < hlsm::runtime::delta_level_num; i++) { // levels: clear+1, _2, ..., active-1
+		cur = cur + 1;
+		if (cur > hlsm::runtime::delta_level_num) cur = 1;
+		if (cur == meta[llevel].active) break;
+		levels.push_back(llevel * (hlsm::runtime::delta_level_num + 1) + 1 - cur);
+	}
+
+	return levels;
+}
+
 /*
  * Bloom Filter
  */
@@ -0,0 +1,151 @@
+#ifndef HLSM_METRICS_H
+#define HLSM_METRICS_H
+
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+/*
+ * Counters and latency histograms registered at compile time
+ *
+ * Samples go to a slot of the calling thread, so recording takes no lock
+ *	and shares no cache line with other threads; slots are summed up when
+ *	the metrics are read.  Latencies are kept in ticks of the time stamp
+ *	counter and converted to microseconds on read.  With
+ *	hlsm::config::collect_metrics unset, a site costs one branch.
+ */
+
+namespace hlsm {
+namespace config {
+extern bool collect_metrics;
+} // config
+
+namespace metrics {
+
+enum Kind { kLatency, kCounter };
+
+//	X(id, kind, name)
+#define HLSM_METRICS(X) \
+	X(kDBGetMem,           kLatency, "DBImpl::Get--mem->Get") \
+	X(kDBGetImm,           kLatency, "DBImpl::Get--imm->Get") \
+	X(kDBGetVersion,       kLatency, "DBImpl::Get--Version::Get") \
+	X(kDBGetLazyVersion,   kLatency, "DBImpl::Get--LazyVersion::Get") \
+	X(kDBWriteMakeRoom,    kLatency, "DBImpl::Write--MakeRoom") \
+	X(kDBWriteInsert,      kLatency, "DBImpl::Write--Insert") \
+	X(kVersionTableGet,    kLatency, "Version::Get--TableCache::Get") \
+	X(kTableCacheFind,     kLatency, "TableCache::Get--FindTable") \
+	X(kTableCacheGet,      kLatency, "TableCache::Get--InternalGet") \
+	X(kTableBlockReader,   kLatency, "InternalGet--BlockReader") \
+	X(kTableReadBlock,     kLatency, "BlockReader--ReadBlock") \
+	X(kCompaction,         kLatency, "DoCompactionWork") \
+	X(kCompactionInput,    kLatency, "DoCompactionWork--MakeInputIterator") \
+	X(kCompactionMemTable, kLatency, "DoCompactionWork--CompactMemTable") \
+	X(kCompactionOutput,   kLatency, "DoCompactionWork--FinishCompactionOutputFile") \
+	X(kCompactionThrottle, kLatency, "DoCompactionWork--Throttle") \
+	X(kSecondaryClone,     kLatency, "Append--clone") \
+	X(kSecondaryAppend,    kLatency, "Append--sfp_->Append") \
+	X(kBenchGet,           kLatency, "RW--Get") \
+	X(kBenchWrite,         kLatency, "RW--Write") \
+	X(kMigratedBytes,      kCounter, "Migration--bytes") \
+	X(kDeltaMergeBytes,    kCounter, "DeltaMerge--bytes") \
+	X(kUserReadBytes,      kCounter, "User--read-bytes") \
+	X(kUserWriteBytes,     kCounter, "User--write-bytes") \
+	X(kBlockBufferAllocBytes, kCounter, "BlockBuffer--allocated-bytes") \
+	X(kRowCacheHit,        kCounter, "TableCache::Get--row-cache-hit") \
+	X(kRowCacheMiss,       kCounter, "TableCache::Get--row-cache-miss") \
+	X(kReadaheadBytes,     kCounter, "TwoLevelIterator--readahead-bytes") \
+	X(kLazyVersionIterators, kCounter, "DBImpl::NewIterator--lazy-version") \
+	X(kWriteDelayMicros,   kCounter, "DBImpl::Write--delay-micros")
+
+enum Metric {
+#define HLSM_METRIC_ID(id, kind, name) id,
+	HLSM_METRICS(HLSM_METRIC_ID)
+#undef HLSM_METRIC_ID
+	kNumMetrics
+};
+
+// Bucket b holds samples of [2^b, 2^(b+1)) ticks; the last one everything above
+static const int kNumBuckets = 48;
+
+struct Stats {
+	uint64_t count;		// samples
+	uint64_t sum;		// ticks for latencies, the added values for counters
+	uint64_t buckets[kNumBuckets];
+};
+
+inline uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return (static_cast<uint64_t>(hi) << 32) | lo;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+const char* Name(Metric m);
+Kind KindOf(Metric m);
+
+// Writers
+void Record(Metric m, uint64_t ticks);	// one latency sample
+void Add(Metric m, uint64_t n);		// add n to a counter
+
+// Readers; samples recorded concurrently may or may not be included
+void Get(Metric m, Stats* stats);
+double TicksPerMicro();
+double Percentile(const Stats& stats, double p);	// in microseconds
+void Report(std::string* out);	// one line per metric with samples
+void Reset();
+
+/*
+ * I/O per device and level
+ *
+ * Bytes and operations are counted whether or not metrics are collected,
+ *	latencies only when they are.  Device 0 is the primary, device k the
+ *	secondary path k-1.  The user bytes above are counted the same way, as
+ *	the base of the amplification.
+ */
+enum IoOp { kIoRead, kIoWrite, kIoSync, kNumIoOps };
+
+static const int kMaxDevices = 9;	// further secondary paths share the last one
+static const int kLogIoLevel = 16;	// after the raw levels (leveldb::config::kNumLevels)
+static const int kMetaIoLevel = 17;	// MANIFEST, CURRENT and other files
+static const int kUnleveledIoLevel = 18;	// tables in no raw level, e.g. lazy ones only
+static const int kNumIoLevels = 19;
+
+struct IoStats {
+	uint64_t ops[kMaxDevices][kNumIoLevels][kNumIoOps];
+	uint64_t bytes[kMaxDevices][kNumIoLevels][kNumIoOps];
+	Stats latency[kMaxDevices][kNumIoOps];	// in ticks
+};
+
+// Start of an operation for RecordIo(); 0 unless latencies are kept
+inline uint64_t IoStart() {
+	return config::collect_metrics ? Now() : 0;
+}
+
+void RecordIo(int device, int level, IoOp op, uint64_t bytes, uint64_t start);
+void GetIo(IoStats* stats);
+
+} // metrics
+} // hlsm
+
+#define HLSM_MEASURE(_metric, _do) do { \
+		if (hlsm::config::collect_metrics) { \
+			const uint64_t _start = hlsm::metrics::Now(); \
+			_do; \
+			hlsm::metrics::Record(_metric, hlsm::metrics::Now() - _start); \
+		} else { \
+			_do; \
+		} \
+	} while(0)
+
+#define HLSM_COUNT(_metric, _n) do { \
+		if (hlsm::config::collect_metrics) { \
+			hlsm::metrics::Add(_metric, _n); \
+		} \
+	} while(0)
+
+#endif  //HLSM_METRICS_H
@@ -4,6 +4,8 @@
 #include "leveldb/hlsm_types.h"
 #include "db/dbformat.h"
 #include <set>
+#include <string>
+#include <vector>
 
 /************************** Constants *****************************/
 #define BLKSIZE 4096
@@ -29,14 +31,22 @@ extern int kMinKBPerSeek;
 extern int kMaxLevel;
 extern int MmapLimit;
 extern int kL0_StopWritesTrigger;
+// pace of writers once level-0 reaches its slowdown trigger, in KB/s
+//	(0: the measured flush speed); it falls as level-0 nears the stop trigger
+extern int delayed_write_rate_kb;
+// pending compaction bytes from which writers are slowed down, and at
+//	which they reach the lowest pace (see leveldb::WriteController)
+extern int soft_pending_compaction_mb;
+extern int hard_pending_compaction_mb;
 
 extern const char *primary_storage_path;	// primary path holds all the .ldb files
-extern const char *secondary_storage_path;
+extern const char *secondary_storage_path;	// comma-separated to stripe tables over devices
 extern bool direct_write_on_secondary;
 extern bool secondary_use_buffer_file;
 extern bool lazy_sync_on_secondary;
 extern bool run_compaction;
-extern bool iterator_prefetch;
+extern bool iterator_prefetch;	// adaptive readahead of table scans
+extern int max_readahead_kb;	// cap of the readahead window
 extern bool raw_prefetch;
 extern bool append_by_opq;
 extern bool use_mmap_file;
@@ -45,21 +55,40 @@ extern double restrict_L0_score; // to reserve a good shape
 
 extern int debug_level;	// default value 0 is; info whose level is smaller or equal to debug_level will be displayed
 extern char* debug_file;// where to dump the debug info
+extern bool collect_metrics; // record the counters and latencies of hlsm_metrics.h
 
 extern int bloom_bits_use; // allow user to probe less bits in bloom filter
+
+// merge the delta levels of a logical level on the secondary once this many
+//	of them hold files, or once a lookup may probe this many of them (0: off)
+extern int delta_merge_trigger;
+extern int delta_merge_overlap_trigger;
+
+extern int migration_chunk_size; // bytes copied per step when a table moves to the secondary
+
+// hLSM: logical level where two-phase compaction ends for a new db; an
+//	existing db keeps the level recorded in its MANIFEST
+extern int two_phase_end_level;
+// move the two-phase end level by one when this many seconds of background
+//	work have passed since the last decision (0: off)
+extern int level_tuning_interval;
+extern int secondary_capacity_mb; // 0: the db's bytes on the secondary plus the free space there
+extern double secondary_high_watermark; // end two-phase compaction earlier above this share
+extern double secondary_low_watermark; // end it later only below this share
 } // config
 
 namespace runtime {
 extern leveldb::Env* env_;
 
-extern pthread_t *opq_helper;
 extern opq op_queue;
 extern opq hop_queue; // for high priority operations
+extern std::vector<std::string> secondary_paths; // the first one also holds logs and metadata
+extern std::vector<opq> device_queues; // one per secondary path if there are several
 
 extern FILE *debug_fd;	// initialized using hlsm::config::debug_file (default: stderr)
 extern leveldb::port::Mutex debug_mutex_;
-extern hlsm::NamedCounter counters;
 extern hlsm::Throttler *compaction_throttler;
+extern hlsm::Throttler *migration_throttler; // bandwidth budget of table migration
 
 // used only by DeleteFile in env_posix.cc with single thread
 extern bool delete_primary_only;
@@ -91,9 +120,9 @@ static const int delta_level_num = 24; // choose a large level_num to handle ove
 static const int kLogicalLevels = leveldb::config::kNumLevels / 2;
 static const int kNumLazyLevels = 2 + (delta_level_num + 1) * (kLogicalLevels - 2) + delta_level_num + 2 + 4; // +4 for safety
 extern int two_phase_end_level;
+static const int kMaxTwoPhaseEndLevel = kLogicalLevels - 2;
 
-extern TableLevel table_level;
-extern std::set<uint64_t> moving_tables_; // tables move from primary to secondary during 2-phase compaction in hlsm-tree
+extern PlacementRegistry placement; // level, copies and moves of every table
 } // runtime
 
 } // hlsm
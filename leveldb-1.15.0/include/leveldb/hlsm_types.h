@@ -4,14 +4,16 @@
 #include <sys/queue.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <map>
+#include <set>
 #include <string>
-#include <tr1/unordered_map>
 
 #include "util/hash.h"
 #include "leveldb/env.h"
 #include "leveldb/slice.h"
 #include "leveldb/status.h"
 #include "leveldb/hlsm_debug.h"
+#include "leveldb/hlsm_metrics.h"
 
 namespace leveldb{
 extern std::string TableFileName(const std::string& dbname, uint64_t number);
@@ -23,6 +25,22 @@ namespace config {
 extern const char *secondary_storage_path;
 }
 
+/*
+ * Device and level that the I/O of an open file is charged to; tables are
+ *	charged to their level at the time of the I/O
+ */
+class IoAccount {
+public:
+	explicit IoAccount(const std::string& fname);	// name after relocate_file()
+	IoAccount(int device, uint64_t fnum);
+	void record(metrics::IoOp op, uint64_t bytes, uint64_t start) const;
+
+private:
+	int device_;
+	uint64_t fnum_;	// table number, 0 for other files
+	int level_;	// level of other files
+};
+
 class FullMirror_PosixWritableFile : public leveldb::WritableFile {
 private:
  std::string filename_;
@@ -55,6 +73,7 @@ class PosixBufferFile : public leveldb::WritableFile {
 	char* limit_;           // Limit of the mapped region
 	char* dst_;             // Where to write next  (in range [base_,limit_])
 	uint64_t file_offset_;  // Offset of base_ in file
+	uint64_t number_;       // Table number, picks the device queue
 
  public:
   PosixBufferFile(const std::string& fname, FILE* f);
@@ -73,8 +92,8 @@ class PosixBufferFile : public leveldb::WritableFile {
 //1. Status Append(const Slice& data)
 //2. Status Sync()
 //3. Status Close()
-typedef enum { MAppend = 1, MAppendOnly, MSync, MClose, MDelete, MHalt, MBufSync, MBufClose,
-	MTruncate, MCopyFile, MCopyDeletedFile, MIterPrefetch, MRawPrefetch, MDeleteStrBuffer} mio_op_t;
+typedef enum { MAppend = 1, MAppendOnly, MSync, MClose, MDelete, MBufSync, MBufClose,
+	MTruncate, MCopyFile, MCopyDeletedFile, MRawPrefetch, MDeleteStrBuffer} mio_op_t;
 
 typedef struct {
 	mio_op_t type;
@@ -98,9 +117,8 @@ typedef struct {
 	pthread_mutex_t mutex;
 	TAILQ_HEAD(tailhead, entry_) head;
 	size_t length;
+	int helper;	// helper draining the queue; 0 for op_queue and hop_queue
 
-	pthread_cond_t noop; //no operation
-	pthread_mutex_t cond_m;
 } *opq, opq_s;
 
 #define OPQ_MALLOC	(opq) malloc(sizeof(opq_s))
@@ -109,43 +127,23 @@ typedef struct {
 
 #define OPQ_INIT(q_) 	do {		\
 		pthread_mutex_init(&(q_->mutex), NULL);	\
-		pthread_mutex_init(&(q_->cond_m), NULL);\
-		pthread_cond_init(&(q_->noop), NULL);	\
 		TAILQ_INIT(&(q_->head));	\
 		q_->length = 0;	\
+		q_->helper = 0;	\
 	} while(0)
 
 #define OPQ_GET_LENGTH(q_)	((q_->length))
 
-#define OPQ_WAIT(q_) do { \
-		pthread_mutex_lock(&(q_->cond_m) );	\
-		pthread_cond_wait(&(q_->noop), &(q_->cond_m) ); 	\
-		pthread_mutex_unlock(&(q_->cond_m) );\
-	} while(0)
-
-#define OPQ_WAKEUP(q_) do { \
-		pthread_mutex_lock(&(q_->cond_m) );	\
-		pthread_cond_signal(&(q_->noop) ); \
-		pthread_mutex_unlock(&(q_->cond_m) );\
-	} while(0)
-
 #define OPQ_ADD(q_, op_)	do {	\
 		struct entry_ *e_;\
+		opq aq_ = (q_);	\
 		e_ = (struct entry_ *) malloc(sizeof(struct entry_));	\
 		e_->op = op_;	\
-		pthread_mutex_lock(&(q_->mutex) );	\
-		TAILQ_INSERT_TAIL(&(q_->head), e_, entries_);	\
-		q_->length++;	\
-		pthread_mutex_unlock(&(q_->mutex) );\
-		OPQ_WAKEUP(q_);	\
-	} while(0)
-
-#define OPQ_ADD_ITR_PREFETCH(q_, it_, opt_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MIterPrefetch;\
-		op_->ptr1 = it_;	\
-		op_->ptr2 = opt_;	\
-		OPQ_ADD(q_, op_);	\
+		pthread_mutex_lock(&(aq_->mutex) );	\
+		TAILQ_INSERT_TAIL(&(aq_->head), e_, entries_);	\
+		aq_->length++;	\
+		pthread_mutex_unlock(&(aq_->mutex) );\
+		hlsm::schedule_opq_helper(aq_->helper);	\
 	} while(0)
 
 #define OPQ_ADD_RAW_PREFETCH(q_, file_, size_)	do{	\
@@ -171,13 +169,14 @@ typedef struct {
 		OPQ_ADD(q_, op_);	\
 	} while(0)
 
-#define OPQ_ADD_BUF_SYNC(q_, buf_, size_, fd_, off_)	do{	\
+#define OPQ_ADD_BUF_SYNC(q_, buf_, size_, fd_, off_, fnum_)	do{	\
 		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
 		op_->type = MBufSync;\
 		op_->ptr1 = buf_;	\
 		op_->size = size_;\
 		op_->fd = fd_;		\
 		op_->offset = off_;	\
+		op_->lu_int = fnum_;	\
 		OPQ_ADD(q_, op_);	\
 	} while(0)
 
@@ -210,12 +209,6 @@ typedef struct {
 		OPQ_ADD(q_, op_);		\
 	} while(0)
 
-#define OPQ_ADD_HALT(q_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MHalt;		\
-		OPQ_ADD(q_, op_);		\
-	} while(0)
-
 #define OPQ_ADD_APPEND(q_, mfp_, slice_)do{	\
 		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
 		op_->type = MAppend;	\
@@ -238,7 +231,7 @@ typedef struct {
 		op_->type = MCopyFile;		\
 		op_->ptr1 = (void*)fname_;	\
 		op_->offset = fnum;		\
-		hlsm::runtime::moving_tables_.insert(f->number); \
+		hlsm::runtime::placement.begin_migration(fnum); \
 		OPQ_ADD(q_, op_);		\
 	} while(0)
 
@@ -253,15 +246,6 @@ typedef struct {
 		free(e_);		\
 	} while(0)
 
-#define INIT_HELPER_AND_QUEUE(helper_, queue_)	\
-	do { \
-		if (helper_ == NULL) {  \
-			helper_ = (pthread_t *) malloc(sizeof(pthread_t));   \
-			queue_ = OPQ_MALLOC;\
-			OPQ_INIT(queue_);   \
-			pthread_create(helper_, NULL,  &hlsm::opq_helper, queue_);	\
-		}\
-	} while (0)
 
 
 /************************** Configuration Related *****************************/
@@ -331,63 +315,94 @@ private:
 };
 
 /*
- * Map File Number to Level
+ * Where the copies of each table live
  */
-class TableLevel {
-public:
-	TableLevel() {};
-	int add(uint64_t, int);
-	int get(uint64_t);
-	uint64_t getLatest();
-	int remove(uint64_t);
-	bool withinMirroredLevel(uint64_t);
-	bool withinPureMirroredLevel(uint64_t);
-private:
-	std::tr1::unordered_map<uint64_t, int> mapping_;
-	uint64_t latest;
-	leveldb::port::Mutex mutex_;
+struct TablePlacement {
+	int level;		// raw level, -1 if not known
+	bool on_primary;	// a copy was written to / kept on the primary
+	bool on_secondary;	// a complete copy exists on the secondary
+	bool writing_secondary;	// the mirrored copy is still being written
+	int migrations;		// pending copies from the primary to the secondary
+	uint64_t copied;	// progress of the current migration
+	uint64_t size;		// 0 until the migration starts
+	int stripe;		// secondary path holding the table, -1 if not chosen
+
+	// Without a known copy, the caller has to look at the file system
+	bool copies_known() const { return on_primary || on_secondary; }
 };
 
-namespace runtime {
 /*
- * Check if a file is currently written to secondary storage
+ * Placement of tables keyed by file number, replacing per-purpose maps.
+ *
+ * Compaction, the secondary writer and the migration helper update it under
+ *	a mutex; lookups from the read path take no lock.  Slots live in an
+ *	open-addressing table and are read under a per-slot sequence count.  A
+ *	full table is replaced by a larger one, and the old one is freed once
+ *	readers of the previous epoch are gone.
  */
-class FileNameHash {
-#define HSIZE 4096
-private:
-	static uint32_t hash[HSIZE];
-
+class PlacementRegistry {
 public:
-	static int add(const std::string filename) {
-		DEBUG_INFO(3,"HashAdd %s\n", filename.c_str());
-		uint32_t h = leveldb::Hash(filename.c_str(), filename.length(), 1);
-		hash[h%HSIZE]++;
-		return 0;
-	}
-
-	static int drop(const std::string filename) {
-		DEBUG_INFO(3,"HashDrop %s\n", filename.c_str());
-		uint32_t h = leveldb::Hash(filename.c_str(), filename.length(), 1);
-		hash[h%HSIZE]--;
-
-		return 0;
-	}
+	enum Device { kPrimary, kSecondary };
+
+	PlacementRegistry();
+	~PlacementRegistry();
+
+	// Readers
+	bool lookup(uint64_t fnum, TablePlacement* p) const;
+	int level(uint64_t fnum) const;
+	bool writing_secondary(uint64_t fnum) const;
+	uint64_t latest() const { return latest_; }	// last table given a level
+	void get_migrating(std::set<uint64_t>* fnums) const;	// insert into *fnums
+	uint64_t migration_pending_bytes() const;
+	int stripe(uint64_t fnum) const;	// -1 if not chosen
+
+	// Writers
+	void set_level(uint64_t fnum, int level);
+	void remove(uint64_t fnum);
+	void add_copy(uint64_t fnum, Device d);
+	void drop_copy(uint64_t fnum, Device d);	// forgets the table with its last copy
+	void begin_secondary_write(uint64_t fnum);
+	void end_secondary_write(uint64_t fnum);
+	void begin_migration(uint64_t fnum);
+	void update_migration(uint64_t fnum, uint64_t copied, uint64_t size);
+	void end_migration(uint64_t fnum, bool ok);
+	// Keep the first stripe given to fnum and return it
+	int assign_stripe(uint64_t fnum, int stripe);
 
-	static int inuse(const std::string filename) {
-		uint32_t h = leveldb::Hash(filename.c_str(), filename.length(), 1);
-		return (hash[h%HSIZE]>0);
-	}
-
-	static int inuse(uint64_t fnum) {
-		if (hlsm::config::secondary_storage_path == NULL) return 0;
-		return inuse(leveldb::TableFileName(hlsm::config::secondary_storage_path, fnum));
-	}
-
-#undef HSIZE
+private:
+	struct Slot {
+		volatile uint32_t seq;	// odd while the slot is written
+		uint64_t fnum;		// 0: never used
+		bool removed;
+		TablePlacement p;
+	};
+
+	struct Table {
+		size_t mask;
+		size_t used;		// slots holding a number, removed or not
+		Slot* slots;
+	};
+
+	static void read_slot(const Slot* slot, Slot* copy);
+	static void write_slot(Slot* slot, uint64_t fnum, bool removed, const TablePlacement& p);
+	const Table* begin_read(int* epoch) const;
+	void end_read(int epoch) const;
+
+	// Slot of fnum, or NULL; with create set, a new slot is set up for it
+	Slot* find(uint64_t fnum, bool create);
+	void resize(size_t capacity);
+
+	leveldb::port::Mutex mutex_;	// serializes writers
+	leveldb::port::AtomicPointer table_;
+	mutable volatile int readers_[2];	// readers per epoch
+	volatile int epoch_;
+	volatile uint64_t latest_;
+
+	// No copying allowed
+	PlacementRegistry(const PlacementRegistry&);
+	void operator=(const PlacementRegistry&);
 };
 
-} // runtime
-
 struct DeltaLevelMeta{
 	uint32_t start; // start + 1 is the first delta level in use
 	uint32_t clear; // clear until this level
@@ -411,70 +426,24 @@ struct DeltaLevelMeta{
 
 typedef struct DeltaLevelMeta delta_meta_t;
 
-class NamedCounter {
-
-struct cc {
-	int occurance;
-	int value;
-};
-
-public:
-	NamedCounter() {};
-	inline int add_nolock(std::string name, int delta) {
-		if (mapping_.count(name) > 0) {
-			mapping_[name].value += delta;
-			mapping_[name].occurance ++;
-		} else {
-			mapping_[name].value = delta;
-			mapping_[name].occurance = 1;
-		}
-
-		return 0;
-	}
-
-	inline int add_nolock(const char *name, int delta) {
-		add_nolock(std::string(name), delta);
-	}
-
-	inline int add(std::string name, int delta) {
-		mutex_.Lock();
-		add_nolock(name, delta);
-		mutex_.Unlock();
-	}
-
-	inline int add(const char* name, int delta) {
-		add(std::string(name), delta);
-	}
-
-
-	inline int get(std::string name) {
-		mutex_.Lock();
-		int value;
-		if (mapping_.find(name) == mapping_.end())
-			value = -1;
-		else
-			value = mapping_.find(name)->second.value;
-		mutex_.Unlock();
-		return value;
-	}
-
-	void print() {
-		mutex_.Lock();
-		std::tr1::unordered_map<std::string, struct cc>::iterator map_it;
-		fprintf(runtime::debug_fd, "Print all Named Counters\n");
-		for (map_it = mapping_.begin(); map_it != mapping_.end(); map_it++) {
-			fprintf(runtime::debug_fd, "Counter %s: %d / %d\n", map_it->first.c_str(),
-					map_it->second.value, map_it->second.occurance);
-		}
-		mutex_.Unlock();
-	}
-
-private:
-	std::tr1::unordered_map<std::string, struct cc> mapping_;
-	leveldb::port::Mutex mutex_;
+/*
+ * What the two-phase end level is tuned on, gathered over one interval
+ */
+struct LevelTuning {
+	int level;		// current two-phase end level
+	uint64_t capacity;	// bytes the db may take on the secondary
+	uint64_t used;		// bytes of the db on the secondary
+	int64_t shrink_gain;	// bytes freed on the secondary by ending one level earlier
+	uint64_t extend_cost;	// bytes the deltas of the next level may come to hold
+	uint64_t seeks;		// lazy lookups that probed more than one table
+	uint64_t delta_seeks;	// ... starting in a delta level of the end level
+	uint64_t write_bytes;	// bytes flushed and compacted
+	uint64_t mirror_bytes;	// ... into the levels mirrored below the end level
+
+	LevelTuning(): level(0), capacity(0), used(0), shrink_gain(0), extend_cost(0),
+			seeks(0), delta_seeks(0), write_bytes(0), mirror_bytes(0) {}
 };
 
-
 class Throttler{
 private:
 	uint64_t speed_limit;
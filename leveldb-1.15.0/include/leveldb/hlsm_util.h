@@ -1,8 +1,11 @@
 #ifndef HLSM_UTIL_H
 #define HLSM_UTIL_H
 
+#include <stdint.h>
 #include <time.h>
 #include <stdlib.h>
+#include <set>
+#include "port/port.h"
 
 namespace hlsm {
 
@@ -21,27 +24,129 @@ static inline long long YCSBKey_hash(long long val)
   	return llabs(hashval);
 }
 
-class YCSBKeyGenerator{
-private:
-	long long *keypool;
-	int index;
-	int max;
-
-public:
-	YCSBKeyGenerator(int startnum, int filenum, int keysize):index(0) {
-		keypool = new long long[keysize*filenum];
-		for(long long i=0;i<keysize*filenum;i++)
-		{
-			keypool[i] = YCSBKey_hash(i + startnum);
-		}
-		sort(keypool,0,keysize*filenum);
+/*
+ * Key choosers of the YCSB core workloads, after com.yahoo.ycsb.generator
+ *
+ * Each draws item numbers from its own xorshift64* stream, so a generator
+ *	belongs to one thread.  None keeps a key pool: memory is O(1), and
+ *	ZipfianGenerator sums zeta(n) once on construction.
+ */
+class YCSBRandom {
+public:
+	explicit YCSBRandom(uint64_t seed): state_(seed != 0 ? seed : 0x9E3779B97F4A7C15ULL) {}
+	uint64_t next64() {
+		state_ ^= state_ >> 12;
+		state_ ^= state_ << 25;
+		state_ ^= state_ >> 27;
+		return state_ * 0x2545F4914F6CDD1DULL;
 	}
-	~YCSBKeyGenerator() {
-		delete keypool;
+	double nextDouble() {	// in [0, 1)
+		return (next64() >> 11) * (1.0 / 9007199254740992.0);
 	}
-	void sort(long long *num, int top, int bottom);
-	int partition(long long *array, int top, int bottom);
-	long long nextKey();
+private:
+	uint64_t state_;
+};
+
+class YCSBGenerator {
+public:
+	explicit YCSBGenerator(uint64_t seed): rand_(seed) {}
+	virtual ~YCSBGenerator() {}
+	virtual long long next() = 0;
+protected:
+	YCSBRandom rand_;
+};
+
+// Every item in [min, max] equally likely
+class UniformGenerator: public YCSBGenerator {
+public:
+	UniformGenerator(long long min, long long max, uint64_t seed):
+		YCSBGenerator(seed), min_(min), items_(max - min + 1) {}
+	long long next() { return min_ + rand_.next64() % items_; }
+private:
+	long long min_;
+	long long items_;
+};
+
+// Item min+i drawn with probability proportional to 1/(i+1)^theta
+class ZipfianGenerator: public YCSBGenerator {
+public:
+	static const double kZipfianConstant;
+
+	// zetan: zeta(max-min+1), if known, saves summing it up
+	ZipfianGenerator(long long min, long long max, uint64_t seed,
+			double theta = kZipfianConstant, double zetan = 0);
+	long long next() { return next(items_); }
+	// Draw from the first items items; growing the range extends zeta(n)
+	long long next(long long items);
+
+	static double zeta(long long from, long long to, double theta, double sum);
+private:
+	void setItems(long long items);
+
+	long long min_;
+	long long items_;
+	double theta_;
+	double alpha_;
+	double zeta2theta_;
+	double zetan_;
+	double eta_;
+	long long count_for_zeta_;	// zetan_ = zeta(count_for_zeta_)
+};
+
+// Zipfian popularity with the popular items spread over [min, max] by an FNV hash
+class ScrambledZipfianGenerator: public YCSBGenerator {
+public:
+	ScrambledZipfianGenerator(long long min, long long max, uint64_t seed);
+	long long next();
+private:
+	static const long long kItemCount;	// items of the underlying zipfian
+	static const double kZetan;		// zeta(kItemCount) for kZipfianConstant
+
+	long long min_;
+	long long items_;
+	ZipfianGenerator zipfian_;
+};
+
+// The most recently inserted items are the most popular; *last is the newest
+class SkewedLatestGenerator: public YCSBGenerator {
+public:
+	SkewedLatestGenerator(const volatile long long* last, uint64_t seed);
+	long long next();
+private:
+	const volatile long long* last_;
+	ZipfianGenerator zipfian_;
+};
+
+// Items of inserts, after AcknowledgedCounterGenerator: next() hands them
+//	out in order, and *last() is the newest item up to which every insert
+//	has been acknowledged, so that readers never draw an item whose insert
+//	has not finished while a later one has.  Thread-safe.
+class AcknowledgedCounter {
+public:
+	explicit AcknowledgedCounter(long long start = 0) { reset(start); }
+	// Hand out items from start on; none acknowledged
+	void reset(long long start);
+	long long next() { return __sync_fetch_and_add(&next_, 1); }
+	void acknowledge(long long item);
+	const volatile long long* last() const { return &last_; }
+private:
+	leveldb::port::Mutex mutex_;
+	volatile long long next_;
+	volatile long long last_;
+	std::set<long long> acked_;	// acknowledged items above last_ + 1
+};
+
+// hot_op_fraction of the draws go to the first hot_set_fraction of [min, max]
+class HotspotGenerator: public YCSBGenerator {
+public:
+	HotspotGenerator(long long min, long long max, uint64_t seed,
+			double hot_set_fraction = 0.2, double hot_op_fraction = 0.8);
+	long long next();
+private:
+	long long min_;
+	long long hot_items_;
+	long long cold_items_;
+	double hot_op_fraction_;
 };
 
 } // hlsm
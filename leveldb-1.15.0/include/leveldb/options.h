@@ -14,6 +14,7 @@ class Comparator;
 class Env;
 class FilterPolicy;
 class Logger;
+class SliceTransform;
 class Snapshot;
 
 // DB contents are stored in a set of blocks, each of which holds a
@@ -27,6 +28,13 @@ enum CompressionType {
   kSnappyCompression = 0x1
 };
 
+// Structure of the memtable (see Options::memtable_rep)
+enum MemTableRepType {
+  kSkipListRep      = 0x0,
+  kHashLinkListRep  = 0x1,
+  kVectorRep        = 0x2
+};
+
 // Options to control the behavior of a database (passed to DB::Open)
 struct Options {
   // -------------------
@@ -74,14 +82,41 @@ struct Options {
   // on disk) before converting to a sorted on-disk file.
   //
   // Larger values increase performance, especially during bulk loads.
-  // Up to two write buffers may be held in memory at the same time,
-  // so you may wish to adjust this parameter to control memory usage.
+  // Up to max_immutable_memtables + 1 write buffers may be held in memory
+  // at the same time, so you may wish to adjust this parameter to control
+  // memory usage.
   // Also, a larger write buffer will result in a longer recovery time
   // the next time the database is opened.
   //
   // Default: 4MB
   size_t write_buffer_size;
 
+  // Number of full write buffers that may wait for their flush to a
+  // level-0 table while writes go on into a new one.  Writes stall only
+  // when this many are waiting.  A flush writes all the write buffers
+  // waiting when it starts into one table.
+  //
+  // Default: 1
+  int max_immutable_memtables;
+
+  // How the memtable holds its entries.  kSkipListRep keeps them sorted
+  // as they are inserted.  kHashLinkListRep hashes user keys into
+  // memtable_hash_buckets short sorted lists, so that inserts and point
+  // lookups take constant time.  kVectorRep appends entries to an array,
+  // and point lookups scan all of it, which suits bulk loads that do not
+  // read back.  Both sort all entries when the memtable is flushed, and
+  // whenever an iterator is created over it.  kHashLinkListRep requires a
+  // comparator that only finds identical keys equal.
+  //
+  // Default: kSkipListRep
+  MemTableRepType memtable_rep;
+
+  // Number of buckets of a kHashLinkListRep memtable.  The buckets take
+  // 8 bytes each on top of write_buffer_size.
+  //
+  // Default: 32768
+  size_t memtable_hash_buckets;
+
   // Number of open files that can be used by the DB.  You may need to
   // increase this if your database has a large working set (budget
   // one open file per 2MB of working set).
@@ -97,6 +132,16 @@ struct Options {
   // Default: NULL
   Cache* block_cache;
 
+  // If non-NULL, use the specified cache for rows: the entry a point
+  // lookup found for a user key in a table, keyed by the table file
+  // number (and the snapshot, if any).  A hit skips the table cache, the
+  // index, the filter and the data block of that table.  Tables never
+  // change, so compactions and lazy level updates leave entries valid;
+  // entries of deleted tables age out.  Like block_cache, it may be
+  // shared by several DBs.
+  // Default: NULL
+  Cache* row_cache;
+
   // Approximate size of user data packed per block.  Note that the
   // block size specified here corresponds to uncompressed data.  The
   // actual size of the unit read from disk may be smaller if
@@ -112,6 +157,26 @@ struct Options {
   // Default: 16
   int block_restart_interval;
 
+  // If true, each data block of a table carries a hash index from user
+  // keys (the keys without their last 8 bytes, the sequence number and
+  // type of an internal key) to restart intervals.  Point lookups then
+  // skip the binary search over the restart points, or miss the block
+  // right away.  Blocks with more than 253 restart points, or written
+  // without the index, are searched as usual; older releases cannot read
+  // blocks that have it.
+  //
+  // Default: false
+  bool data_block_hash_index;
+
+  // If true, the index of a table is split into partitions of about
+  // block_size bytes, and so is the filter (one per index partition).  A
+  // small top-level index locates them, and they are read and cached like
+  // data blocks, so that large tables need not keep whole index and
+  // filter blocks in memory.  Older releases cannot read such tables.
+  //
+  // Default: false
+  bool partition_index_and_filters;
+
   // Compress blocks using the specified compression algorithm.  This
   // parameter can be changed dynamically.
   //
@@ -135,6 +200,13 @@ struct Options {
   // Default: NULL
   const FilterPolicy* filter_policy;
 
+  // If non-NULL and filter_policy is set, new tables also get a filter
+  // of the prefixes of their keys, by which iterators in
+  // ReadOptions::prefix_same_as_start mode skip tables.
+  //
+  // Default: NULL
+  const SliceTransform* prefix_extractor;
+
   // Create an Options object with default values for all fields.
   Options();
 };
@@ -158,10 +230,20 @@ struct ReadOptions {
   // Default: NULL
   const Snapshot* snapshot;
 
+  // If true, an iterator only returns the keys with the prefix (by
+  // Options::prefix_extractor) of its Seek() target, and Seek() skips
+  // the tables whose prefix filter does not have it.  The iterator must
+  // keep its direction: Prev() after Seek() or SeekToFirst(), and Next()
+  // after SeekToLast(), fail with NotSupported.  Targets without a
+  // prefix seek and iterate as usual.
+  // Default: false
+  bool prefix_same_as_start;
+
   ReadOptions()
       : verify_checksums(false),
         fill_cache(true),
-        snapshot(NULL) {
+        snapshot(NULL),
+        prefix_same_as_start(false) {
   }
 };
 
@@ -0,0 +1,45 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A SliceTransform maps keys to their prefix.  With a filter policy, a
+// database configured with one (Options::prefix_extractor) also writes a
+// filter of the prefixes in each table, so that iterators in
+// ReadOptions::prefix_same_as_start mode skip tables without the prefix
+// of the Seek() target.
+
+#ifndef STORAGE_LEVELDB_INCLUDE_SLICE_TRANSFORM_H_
+#define STORAGE_LEVELDB_INCLUDE_SLICE_TRANSFORM_H_
+
+#include <stddef.h>
+
+namespace leveldb {
+
+class Slice;
+
+class SliceTransform {
+ public:
+  virtual ~SliceTransform();
+
+  // Return the name of this transform.  Tables record the name with
+  // their prefix filter, and the filter is only used while the
+  // transform of the database has the same name.  So if the prefixes
+  // change, so must the name.
+  virtual const char* Name() const = 0;
+
+  // Whether key has a prefix.  The keys with a given prefix must form a
+  // contiguous range of the comparator order that holds the prefix
+  // itself.
+  virtual bool InDomain(const Slice& key) const = 0;
+
+  // Return the prefix of key, which is InDomain()
+  virtual Slice Transform(const Slice& key) const = 0;
+};
+
+// Return a transform whose prefix is the first prefix_len bytes of a key.
+// Shorter keys have no prefix.
+extern const SliceTransform* NewFixedPrefixTransform(size_t prefix_len);
+
+}
+
+#endif  // STORAGE_LEVELDB_INCLUDE_SLICE_TRANSFORM_H_
@@ -12,7 +12,9 @@ namespace leveldb {
 
 class Block;
 class BlockHandle;
+class FilterBlockReader;
 class Footer;
+struct ReadaheadState;
 struct Options;
 class RandomAccessFile;
 struct ReadOptions;
@@ -30,7 +32,9 @@ class Table {
   // If successful, returns ok and sets "*table" to the newly opened
   // table.  The client should delete "*table" when no longer needed.
   // If there was an error while initializing the table, sets "*table"
-  // to NULL and returns a non-ok status.  Does not take ownership of
+  // to NULL and returns a non-ok status.  An unreadable metaindex block
+  // is such an error, since it records whether the index is partitioned;
+  // an unreadable filter is not.  Does not take ownership of
   // "*source", but the client must ensure that "source" remains live
   // for the duration of the returned table's lifetime.
   //
@@ -63,6 +67,9 @@ class Table {
 
   explicit Table(Rep* rep) { rep_ = rep; }
   static Iterator* BlockReader(void*, const ReadOptions&, const Slice&, bool is_sequential = false);
+  // BlockReader() for a point lookup of *get_key if get_key != NULL
+  static Iterator* ReadBlockIterator(void*, const ReadOptions&, const Slice&,
+                                     bool is_sequential, const Slice* get_key);
 
   // Calls (*handle_result)(arg, ...) with the entry found after a call
   // to Seek(key).  May not make such a call if filter policy says
@@ -74,8 +81,18 @@ class Table {
       void (*handle_result)(void* arg, const Slice& k, const Slice& v), bool is_sequential = false);
 
 
-  void ReadMeta(const Footer& footer);
+  Status ReadMeta(const Footer& footer);
   void ReadFilter(const Slice& filter_handle_value);
+  FilterBlockReader* ReadFilterBlock(const Slice& filter_handle_value,
+                                     const char** data, size_t* data_size);
+  bool PrefixMayMatch(const Slice& key) const;
+  static bool PrefixFilter(void*, const Slice& index_value,
+                           const Slice& target);
+  static void Readahead(void*, const Slice& index_value, bool is_sequential,
+                        ReadaheadState* state);
+  Iterator* NewIndexIterator(const ReadOptions&, bool is_sequential) const;
+  bool PartitionMayMatch(const ReadOptions&, const Slice& top_index_value,
+                         const Slice& key, bool is_sequential);
   static RandomAccessFile* PickFileHandler(Table::Rep* , bool is_sequential = false);
   RandomAccessFile* PickFileHandler(bool is_sequential = false);
 
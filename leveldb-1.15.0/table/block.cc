@@ -10,39 +10,64 @@
 #include <algorithm>
 #include "leveldb/comparator.h"
 #include "table/format.h"
+#include "util/block_buffer.h"
 #include "util/coding.h"
 #include "util/logging.h"
 
 namespace leveldb {
 
 inline uint32_t Block::NumRestarts() const {
-  assert(size_ >= sizeof(uint32_t));
-  return DecodeFixed32(data_ + size_ - sizeof(uint32_t));
+  return num_restarts_;
 }
 
 Block::Block(const BlockContents& contents)
     : data_(contents.data.data()),
       size_(contents.data.size()),
-      owned_(contents.heap_allocated) {
+      num_restarts_(0),
+      buckets_(NULL),
+      num_buckets_(0),
+      owned_(contents.heap_allocated),
+      buffer_size_(contents.buffer_size) {
   if (size_ < sizeof(uint32_t)) {
     size_ = 0;  // Error marker
   } else {
-    size_t max_restarts_allowed = (size_-sizeof(uint32_t)) / sizeof(uint32_t);
-    if (NumRestarts() > max_restarts_allowed) {
+    num_restarts_ = DecodeFixed32(data_ + size_ - sizeof(uint32_t));
+    size_t trailer = sizeof(uint32_t);
+    if (num_restarts_ & kBlockHashIndexFlag) {
+      num_restarts_ &= ~kBlockHashIndexFlag;
+      trailer += sizeof(uint32_t);
+      if (size_ < trailer) {
+        size_ = 0;
+        return;
+      }
+      num_buckets_ = DecodeFixed32(data_ + size_ - trailer);
+      trailer += num_buckets_;
+      if (num_buckets_ == 0 || size_ < trailer) {
+        size_ = 0;
+        return;
+      }
+      buckets_ = reinterpret_cast<const uint8_t*>(data_ + size_ - trailer);
+    }
+    size_t max_restarts_allowed = (size_ - trailer) / sizeof(uint32_t);
+    if (num_restarts_ > max_restarts_allowed) {
       // The size is too small for NumRestarts()
       size_ = 0;
     } else {
-      restart_offset_ = size_ - (1 + NumRestarts()) * sizeof(uint32_t);
+      restart_offset_ = size_ - trailer - num_restarts_ * sizeof(uint32_t);
     }
   }
 }
 
 Block::~Block() {
   if (owned_) {
-    delete[] data_;
+    DeleteBlockBuffer(const_cast<char*>(data_), buffer_size_);
   }
 }
 
+size_t Block::usage() const {
+  return owned_ ? BlockBufferSize(buffer_size_) : size_;
+}
+
 // Helper routine: decode the next block entry starting at "p",
 // storing the number of shared key bytes, non_shared key bytes,
 // and the length of the value in "*shared", "*non_shared", and
@@ -190,8 +215,13 @@ class Block::Iter : public Iterator {
       }
     }
 
-    // Linear search (within restart block) for first key >= target
-    SeekToRestartPoint(left);
+    SeekInRestartRun(left, target);
+  }
+
+  // Linear search, from restart point "index" on, for the first key >=
+  // target.  REQUIRES: keys before that restart point are < target.
+  void SeekInRestartRun(uint32_t index, const Slice& target) {
+    SeekToRestartPoint(index);
     while (true) {
       if (!ParseNextKey()) {
         return;
@@ -265,4 +295,26 @@ Iterator* Block::NewIterator(const Comparator* cmp) {
   }
 }
 
+Iterator* Block::NewGetIterator(const Comparator* cmp, const Slice& key) {
+  if (size_ < sizeof(uint32_t)) {
+    return NewErrorIterator(Status::Corruption("bad block contents"));
+  }
+  const uint32_t num_restarts = NumRestarts();
+  if (num_restarts == 0) {
+    return NewEmptyIterator();
+  }
+  Iter* iter = new Iter(cmp, data_, restart_offset_, num_restarts);
+  const uint8_t bucket = (buckets_ == NULL) ? kBlockHashCollision
+      : buckets_[BlockKeyHash(key) % num_buckets_];
+  if (bucket == kBlockHashEmpty) {
+    // No entry has the user key; leave the iterator !Valid()
+  } else if (bucket == kBlockHashCollision || bucket >= num_restarts) {
+    iter->Seek(key);
+  } else {
+    // Every entry with the user key follows restart point "bucket"
+    iter->SeekInRestartRun(bucket, key);
+  }
+  return iter;
+}
+
 }  // namespace leveldb
@@ -22,15 +22,27 @@ class Block {
   ~Block();
 
   size_t size() const { return size_; }
+
+  // Bytes of memory the block holds, charged to the block cache
+  size_t usage() const;
   Iterator* NewIterator(const Comparator* comparator);
 
+  // Return an iterator for a point lookup of "key": positioned as by
+  // Seek(key) if an entry has the user key of "key" (the key without its
+  // last 8 bytes), else !Valid() or at an entry with another user key.
+  Iterator* NewGetIterator(const Comparator* comparator, const Slice& key);
+
  private:
   uint32_t NumRestarts() const;
 
   const char* data_;
   size_t size_;
   uint32_t restart_offset_;     // Offset in data_ of restart array
+  uint32_t num_restarts_;
+  const uint8_t* buckets_;      // Hash index, NULL if the block has none
+  uint32_t num_buckets_;
   bool owned_;                  // Block owns data_[]
+  size_t buffer_size_;          // Of data_[] if owned_
 
   // No copying allowed
   Block(const Block&);
@@ -25,6 +25,17 @@
 //     restarts: uint32[num_restarts]
 //     num_restarts: uint32
 // restarts[i] contains the offset within the block of the ith restart point.
+//
+// A data block with a hash index has the trailer
+//     restarts: uint32[num_restarts]
+//     buckets: uint8[num_buckets]
+//     num_buckets: uint32
+//     num_restarts | kBlockHashIndexFlag: uint32
+// The user key of every entry is hashed to a bucket, which holds the index
+// of the restart point the entry follows.  If keys of different restart
+// points share a bucket, it holds kBlockHashCollision, and a point lookup
+// falls back to the binary search; a bucket no key hashes to holds
+// kBlockHashEmpty.
 
 #include "table/block_builder.h"
 
@@ -32,13 +43,15 @@
 #include <assert.h>
 #include "leveldb/comparator.h"
 #include "leveldb/table_builder.h"
+#include "table/format.h"
 #include "util/coding.h"
 #include "leveldb/hlsm.h"
 
 namespace leveldb {
 
-BlockBuilder::BlockBuilder(const Options* options)
+BlockBuilder::BlockBuilder(const Options* options, bool data_block)
     : options_(options),
+      data_block_(data_block),
       restarts_(),
       counter_(0),
       finished_(false),
@@ -68,12 +81,23 @@ void BlockBuilder::Reset() {
   counter_ = 0;
   finished_ = false;
   last_key_.clear();
+  key_hashes_.clear();
+  key_restarts_.clear();
+}
+
+bool BlockBuilder::HasHashIndex() const {
+  return data_block_ && options_->data_block_hash_index &&
+         restarts_.size() <= kBlockHashMaxRestarts;
 }
 
 size_t BlockBuilder::CurrentSizeEstimate() const {
-  return (buffer_->size() +                        // Raw data buffer
-          restarts_.size() * sizeof(uint32_t) +   // Restart array
-          sizeof(uint32_t));                      // Restart array length
+  size_t estimate = (buffer_->size() +                 // Raw data buffer
+                     restarts_.size() * sizeof(uint32_t) + // Restart array
+                     sizeof(uint32_t));               // Restart array length
+  if (HasHashIndex()) {
+    estimate += key_hashes_.size() * 4 / 3 + 1 + sizeof(uint32_t);
+  }
+  return estimate;
 }
 
 Slice BlockBuilder::Finish() {
@@ -81,7 +105,25 @@ Slice BlockBuilder::Finish() {
   for (size_t i = 0; i < restarts_.size(); i++) {
     PutFixed32(buffer_, restarts_[i]);
   }
-  PutFixed32(buffer_, restarts_.size());
+  if (HasHashIndex() && !key_hashes_.empty()) {
+    // Buckets are at most 3/4 full
+    const uint32_t num_buckets = key_hashes_.size() * 4 / 3 + 1;
+    std::string buckets(num_buckets, static_cast<char>(kBlockHashEmpty));
+    for (size_t i = 0; i < key_hashes_.size(); i++) {
+      uint8_t* bucket = reinterpret_cast<uint8_t*>(
+          &buckets[key_hashes_[i] % num_buckets]);
+      if (*bucket == kBlockHashEmpty) {
+        *bucket = key_restarts_[i];
+      } else if (*bucket != key_restarts_[i]) {
+        *bucket = kBlockHashCollision;
+      }
+    }
+    buffer_->append(buckets);
+    PutFixed32(buffer_, num_buckets);
+    PutFixed32(buffer_, restarts_.size() | kBlockHashIndexFlag);
+  } else {
+    PutFixed32(buffer_, restarts_.size());
+  }
   finished_ = true;
   return Slice(reinterpret_cast<const std::string &>(*buffer_));
 }
@@ -105,6 +147,10 @@ void BlockBuilder::Add(const Slice& key, const Slice& value) {
     counter_ = 0;
   }
   const size_t non_shared = key.size() - shared;
+  if (HasHashIndex()) {
+    key_hashes_.push_back(BlockKeyHash(key));
+    key_restarts_.push_back(restarts_.size() - 1);
+  }
 
   // Add "<shared><non_shared><value_size>" to buffer_
   PutVarint32(buffer_, shared);
@@ -16,7 +16,8 @@ struct Options;
 
 class BlockBuilder {
  public:
-  explicit BlockBuilder(const Options* options);
+  // A data block gets a hash index if options->data_block_hash_index is set
+  explicit BlockBuilder(const Options* options, bool data_block = false);
 
   // Reset the contents as if the BlockBuilder was just constructed.
   void Reset();
@@ -42,12 +43,17 @@ class BlockBuilder {
   ~BlockBuilder();
 
  private:
+  bool HasHashIndex() const;
+
   const Options*        options_;
+  const bool            data_block_;
   std::string           *buffer_;      // Destination buffer
   std::vector<uint32_t> restarts_;    // Restart points
   int                   counter_;     // Number of entries emitted since restart
   bool                  finished_;    // Has Finish() been called?
   std::string           last_key_;
+  std::vector<uint32_t> key_hashes_;  // Hash of each user key added ...
+  std::vector<uint32_t> key_restarts_;  // ... and its restart point
 
   // No copying allowed
   BlockBuilder(const BlockBuilder&);
@@ -0,0 +1,177 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "table/block.h"
+
+#include "db/dbformat.h"
+#include "leveldb/cache.h"
+#include "leveldb/comparator.h"
+#include "leveldb/db.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/hlsm_param.h"
+#include "leveldb/options.h"
+#include "table/block_builder.h"
+#include "table/format.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static std::string Key(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return buf;
+}
+
+class HashIndexTest { };
+
+namespace {
+// Every key for an even i, two versions of each fourth
+std::string BuildBlock(const Options& options) {
+  BlockBuilder builder(&options, true);
+  for (int i = 0; i < 400; i += 2) {
+    InternalKey key(Key(i), 100, kTypeValue);
+    builder.Add(key.Encode(), Key(i) + "@100");
+    if (i % 4 == 0) {
+      InternalKey older(Key(i), 50, kTypeValue);
+      builder.Add(older.Encode(), Key(i) + "@50");
+    }
+  }
+  return builder.Finish().ToString();
+}
+
+// Number of lookups the hash index missed where Seek() finds another key
+int CheckLookups(Block* block, const Comparator* cmp) {
+  int misses = 0;
+  for (int i = 0; i < 401; i++) {
+    for (SequenceNumber seq = 25; seq <= 125; seq += 50) {
+      LookupKey lkey(Key(i), seq);
+      Iterator* seek = block->NewIterator(cmp);
+      Iterator* get = block->NewGetIterator(cmp, lkey.internal_key());
+      seek->Seek(lkey.internal_key());
+      const bool found = seek->Valid() &&
+          ExtractUserKey(seek->key()) == Slice(Key(i));
+      if (!get->Valid()) {
+        if (seek->Valid()) misses++;
+        ASSERT_TRUE(!found);
+      } else if (found || ExtractUserKey(get->key()) == Slice(Key(i))) {
+        ASSERT_TRUE(found);
+        ASSERT_EQ(seek->key().ToString(), get->key().ToString());
+        ASSERT_EQ(seek->value().ToString(), get->value().ToString());
+      }
+      ASSERT_OK(get->status());
+      delete seek;
+      delete get;
+    }
+  }
+  return misses;
+}
+}  // namespace
+
+TEST(HashIndexTest, PointLookups) {
+  InternalKeyComparator icmp(BytewiseComparator());
+  Options options;
+  options.comparator = &icmp;
+  const std::string plain = BuildBlock(options);
+  options.data_block_hash_index = true;
+  const std::string hashed = BuildBlock(options);
+  ASSERT_GT(hashed.size(), plain.size());
+
+  BlockContents contents;
+  contents.cachable = false;
+  contents.heap_allocated = false;
+  contents.data = plain;
+  Block plain_block(contents);
+  ASSERT_EQ(0, CheckLookups(&plain_block, &icmp));
+  contents.data = hashed;
+  Block hashed_block(contents);
+  ASSERT_GT(CheckLookups(&hashed_block, &icmp), 100);
+
+  // Scans see the same entries
+  Iterator* a = plain_block.NewIterator(&icmp);
+  Iterator* b = hashed_block.NewIterator(&icmp);
+  for (a->SeekToFirst(), b->SeekToFirst(); a->Valid(); a->Next(), b->Next()) {
+    ASSERT_TRUE(b->Valid());
+    ASSERT_EQ(a->key().ToString(), b->key().ToString());
+  }
+  ASSERT_TRUE(!b->Valid());
+  for (a->SeekToLast(), b->SeekToLast(); a->Valid(); a->Prev(), b->Prev()) {
+    ASSERT_TRUE(b->Valid());
+    ASSERT_EQ(a->key().ToString(), b->key().ToString());
+  }
+  ASSERT_TRUE(!b->Valid());
+  delete a;
+  delete b;
+}
+
+// Tables with a partitioned index and filters, written and read by a DB
+class PartitionTest { };
+
+static std::string Get(DB* db, int i) {
+  std::string value;
+  Status s = db->Get(ReadOptions(), Key(i), &value);
+  return s.ok() ? value : s.IsNotFound() ? "NOT_FOUND" : s.ToString();
+}
+
+TEST(PartitionTest, LookupsAndScans) {
+  const std::string dbname = test::TmpDir() + "/block_partition";
+  const FilterPolicy* policy = NewBloomFilterPolicy(10);
+  Options options;
+  options.create_if_missing = true;
+  options.block_size = 256;  // many partitions per table
+  options.block_cache = NewLRUCache(64 << 10);
+  options.filter_policy = policy;
+  options.partition_index_and_filters = true;
+  DestroyDB(dbname, options);
+  hlsm::config::primary_storage_path = dbname.c_str();
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname, &db));
+  for (int i = 0; i < 20000; i += 2) {
+    ASSERT_OK(db->Put(WriteOptions(), Key(i), Key(i) + "-value"));
+  }
+  db->CompactRange(NULL, NULL);
+
+  // The tables tell their layout; the options only apply to new tables
+  for (int reopen = 0; reopen < 2; reopen++) {
+    for (int i = 0; i < 20000; i++) {
+      ASSERT_EQ(i % 2 == 0 ? Key(i) + "-value" : "NOT_FOUND", Get(db, i));
+    }
+    Iterator* iter = db->NewIterator(ReadOptions());
+    int count = 0;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      ASSERT_EQ(Key(2 * count), iter->key().ToString());
+      count++;
+    }
+    ASSERT_EQ(10000, count);
+    iter->Seek(Key(12345));
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(Key(12346), iter->key().ToString());
+    iter->Prev();
+    ASSERT_EQ(Key(12344), iter->key().ToString());
+    delete iter;
+
+    Range ranges[2] = { Range(Key(0), Key(10000)),
+                        Range(Key(0), Key(20000)) };
+    uint64_t sizes[2];
+    db->GetApproximateSizes(ranges, 2, sizes);
+    ASSERT_GT(sizes[0], 0);
+    ASSERT_GT(sizes[1], sizes[0]);
+
+    delete db;
+    options.partition_index_and_filters = false;
+    options.filter_policy = NULL;
+    ASSERT_OK(DB::Open(options, dbname, &db));
+  }
+
+  delete db;
+  DestroyDB(dbname, options);
+  delete options.block_cache;
+  delete policy;
+  hlsm::config::primary_storage_path = NULL;
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -5,11 +5,16 @@
 #include "table/format.h"
 
 #include "leveldb/env.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/options.h"
+#include "leveldb/slice_transform.h"
 #include "leveldb/hlsm.h"
 #include "port/port.h"
 #include "table/block.h"
+#include "util/block_buffer.h"
 #include "util/coding.h"
 #include "util/crc32c.h"
+#include "util/hash.h"
 
 namespace leveldb {
 
@@ -64,6 +69,32 @@ Status Footer::DecodeFrom(Slice* input) {
   return result;
 }
 
+uint32_t BlockKeyHash(const Slice& key) {
+  const size_t n = (key.size() >= 8) ? key.size() - 8 : key.size();
+  return Hash(key.data(), n, 0xbc9f1d34);
+}
+
+bool PrefixFilterKey(const Options& options, const Slice& key,
+                     std::string* dst) {
+  const Slice user_key(key.data(), (key.size() >= 8) ? key.size() - 8 : 0);
+  const SliceTransform* prefix_extractor = options.prefix_extractor;
+  if (prefix_extractor == NULL || !prefix_extractor->InDomain(user_key)) {
+    return false;
+  }
+  const Slice prefix = prefix_extractor->Transform(user_key);
+  dst->assign(prefix.data(), prefix.size());
+  dst->append(8, '\0');
+  return true;
+}
+
+std::string PrefixFilterName(const Options& options) {
+  std::string name = "prefixfilter.";
+  name.append(options.filter_policy->Name());
+  name.push_back('.');
+  name.append(options.prefix_extractor->Name());
+  return name;
+}
+
 Status ReadBlock(RandomAccessFile* file,
                  const ReadOptions& options,
                  const BlockHandle& handle,
@@ -71,20 +102,22 @@ Status ReadBlock(RandomAccessFile* file,
   result->data = Slice();
   result->cachable = false;
   result->heap_allocated = false;
+  result->buffer_size = 0;
 
   // Read the block contents as well as the type/crc footer.
   // See table_builder.cc for the code that built this structure.
   size_t n = static_cast<size_t>(handle.size());
-  char* buf = new char[n + kBlockTrailerSize];
+  const size_t buf_size = n + kBlockTrailerSize;
+  char* buf = NewBlockBuffer(buf_size);
   Slice contents;
   Status s = file->Read(handle.offset(), n + kBlockTrailerSize, &contents, buf);
   DEBUG_INFO(3, "handle offset = %lu, size = %lu\n", handle.offset(), handle.size());
   if (!s.ok()) {
-    delete[] buf;
+    DeleteBlockBuffer(buf, buf_size);
     return s;
   }
   if (contents.size() != n + kBlockTrailerSize) {
-    delete[] buf;
+    DeleteBlockBuffer(buf, buf_size);
     DEBUG_INFO(1, "%s\n", file->GetFileName().c_str());
     return Status::Corruption("truncated block read");
   }
@@ -95,7 +128,7 @@ Status ReadBlock(RandomAccessFile* file,
     const uint32_t crc = crc32c::Unmask(DecodeFixed32(data + n + 1));
     const uint32_t actual = crc32c::Value(data, n + 1);
     if (actual != crc) {
-      delete[] buf;
+      DeleteBlockBuffer(buf, buf_size);
       s = Status::Corruption("block checksum mismatch");
       return s;
     }
@@ -107,13 +140,14 @@ Status ReadBlock(RandomAccessFile* file,
         // File implementation gave us pointer to some other data.
         // Use it directly under the assumption that it will be live
         // while the file is open.
-        delete[] buf;
+        DeleteBlockBuffer(buf, buf_size);
         result->data = Slice(data, n);
         result->heap_allocated = false;
         result->cachable = false;  // Do not double-cache
       } else {
         result->data = Slice(buf, n);
         result->heap_allocated = true;
+        result->buffer_size = buf_size;
         result->cachable = true;
       }
 
@@ -122,23 +156,24 @@ Status ReadBlock(RandomAccessFile* file,
     case kSnappyCompression: {
       size_t ulength = 0;
       if (!port::Snappy_GetUncompressedLength(data, n, &ulength)) {
-        delete[] buf;
+        DeleteBlockBuffer(buf, buf_size);
         return Status::Corruption("corrupted compressed block contents");
       }
-      char* ubuf = new char[ulength];
+      char* ubuf = NewBlockBuffer(ulength);
       if (!port::Snappy_Uncompress(data, n, ubuf)) {
-        delete[] buf;
-        delete[] ubuf;
+        DeleteBlockBuffer(buf, buf_size);
+        DeleteBlockBuffer(ubuf, ulength);
         return Status::Corruption("corrupted compressed block contents");
       }
-      delete[] buf;
+      DeleteBlockBuffer(buf, buf_size);
       result->data = Slice(ubuf, ulength);
       result->heap_allocated = true;
+      result->buffer_size = ulength;
       result->cachable = true;
       break;
     }
     default:
-      delete[] buf;
+      DeleteBlockBuffer(buf, buf_size);
       return Status::Corruption("bad block type");
   }
 
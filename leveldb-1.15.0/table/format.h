@@ -83,10 +83,33 @@ static const uint64_t kTableMagicNumber = 0xdb4775248b80fb57ull;
 // 1-byte type + 32-bit crc
 static const size_t kBlockTrailerSize = 5;
 
+// Hash index of a data block (see block_builder.cc): the top bit of
+// num_restarts flags it, a bucket holds the restart point of the keys
+// hashed to it, kBlockHashCollision or kBlockHashEmpty
+static const uint32_t kBlockHashIndexFlag = 1u << 31;
+static const uint32_t kBlockHashMaxRestarts = 253;
+static const uint8_t kBlockHashCollision = 254;
+static const uint8_t kBlockHashEmpty = 255;
+
+// Hash of the user key part of "key" for the hash index
+extern uint32_t BlockKeyHash(const Slice& key);
+
+// If the user key part of "key" has a prefix by options.prefix_extractor,
+// set *dst to the entry of the prefix in the prefix filter and return
+// true.  The entry is the prefix and 8 zero bytes, which the filter
+// policy of a database strips like those of an internal key.
+extern bool PrefixFilterKey(const Options& options, const Slice& key,
+                            std::string* dst);
+
+// Name of the prefix filter in the metaindex block.  Requires
+// options.filter_policy and options.prefix_extractor.
+extern std::string PrefixFilterName(const Options& options);
+
 struct BlockContents {
   Slice data;           // Actual contents of data
   bool cachable;        // True iff data can be cached
-  bool heap_allocated;  // True iff caller should delete[] data.data()
+  bool heap_allocated;  // True iff caller should DeleteBlockBuffer() data
+  size_t buffer_size;   // Size given to NewBlockBuffer() if heap_allocated
 };
 
 // Read the block identified by "handle" from "file".  On failure
@@ -4,6 +4,7 @@
 
 #include "leveldb/table.h"
 
+#include <algorithm>
 #include "leveldb/cache.h"
 #include "leveldb/comparator.h"
 #include "leveldb/env.h"
@@ -14,6 +15,7 @@
 #include "table/filter_block.h"
 #include "table/format.h"
 #include "table/two_level_iterator.h"
+#include "util/block_buffer.h"
 #include "util/coding.h"
 #include "db/hlsm_impl.h"
 
@@ -22,7 +24,10 @@ namespace leveldb {
 struct Table::Rep {
   ~Rep() {
     delete filter;
-    delete [] filter_data;
+    DeleteBlockBuffer(const_cast<char*>(filter_data), filter_data_size);
+    delete prefix_filter;
+    DeleteBlockBuffer(const_cast<char*>(prefix_filter_data),
+                      prefix_filter_data_size);
     delete index_block;
     DEBUG_INFO(2, "primary = %p, secondary = %p\n", 
 		primary_, secondary_);
@@ -44,6 +49,18 @@ struct Table::Rep {
 
   BlockHandle metaindex_handle;  // Handle to metaindex_block: saved from footer
   Block* index_block;
+
+  // index_block is the top-level index over index partitions, with
+  // filter partitions of options.filter_policy if partitioned_filter
+  bool partitioned_index;
+  bool partitioned_filter;
+  size_t filter_data_size;
+
+  // Filter of the prefixes of options.prefix_extractor, if the table has
+  // one by that extractor and options.filter_policy
+  FilterBlockReader* prefix_filter;
+  const char* prefix_filter_data;
+  size_t prefix_filter_data_size;
 };
 
 Status Table::Open(const Options& options,
@@ -88,7 +105,13 @@ Status Table::Open(const Options& options,
     rep->index_block = index_block;
     rep->cache_id = (options.block_cache ? options.block_cache->NewId() : 0);
     rep->filter_data = NULL;
+    rep->filter_data_size = 0;
     rep->filter = NULL;
+    rep->partitioned_index = false;
+    rep->partitioned_filter = false;
+    rep->prefix_filter = NULL;
+    rep->prefix_filter_data = NULL;
+    rep->prefix_filter_data_size = 0;
 
     if (hlsm::is_primary_file(file->GetFileName())) {
     	rep->primary_ = file;
@@ -98,7 +121,11 @@ Status Table::Open(const Options& options,
     }
 
     *table = new Table(rep);
-    (*table)->ReadMeta(footer);
+    s = (*table)->ReadMeta(footer);
+    if (!s.ok()) {
+      delete *table;
+      *table = NULL;
+    }
   } else {
     if (index_block) delete index_block;
   }
@@ -106,38 +133,67 @@ Status Table::Open(const Options& options,
   return s;
 }
 
-void Table::ReadMeta(const Footer& footer) {
-  if (rep_->options.filter_policy == NULL) {
-    return;  // Do not need any metadata
-  }
-
+// Only the layout of the index is needed for operation; errors reading
+// a filter are not propagated.  Unlike the filter, the metaindex cannot
+// be skipped: a partitioned top-level index read as a plain one would
+// send lookups to index partitions as if they were data blocks.
+Status Table::ReadMeta(const Footer& footer) {
   // TODO(sanjay): Skip this if footer.metaindex_handle() size indicates
   // it is an empty block.
   ReadOptions opt;
   BlockContents contents;
-  if (!ReadBlock(PickFileHandler(rep_), opt, footer.metaindex_handle(), &contents).ok()) {
-    // Do not propagate errors since meta info is not needed for operation
-    return;
+  Status s = ReadBlock(PickFileHandler(rep_), opt, footer.metaindex_handle(),
+                       &contents);
+  if (!s.ok()) {
+    return s;
   }
   Block* meta = new Block(contents);
   DEBUG_INFO(3, "metaindex size: %lu\n", contents.data.size());
 
   Iterator* iter = meta->NewIterator(BytewiseComparator());
-  std::string key = "filter.";
-  key.append(rep_->options.filter_policy->Name());
-  iter->Seek(key);
-  if (iter->Valid() && iter->key() == Slice(key)) {
-    ReadFilter(iter->value());
+  iter->Seek("partitionedindex");
+  if (iter->Valid() && iter->key() == Slice("partitionedindex")) {
+    rep_->partitioned_index = true;
+    rep_->partitioned_filter = (rep_->options.filter_policy != NULL &&
+        iter->value() == Slice(rep_->options.filter_policy->Name()));
+  } else if (rep_->options.filter_policy != NULL) {
+    std::string key = "filter.";
+    key.append(rep_->options.filter_policy->Name());
+    iter->Seek(key);
+    if (iter->Valid() && iter->key() == Slice(key)) {
+      ReadFilter(iter->value());
+    }
+  }
+  if (rep_->options.filter_policy != NULL &&
+      rep_->options.prefix_extractor != NULL) {
+    std::string key = PrefixFilterName(rep_->options);
+    iter->Seek(key);
+    if (iter->Valid() && iter->key() == Slice(key)) {
+      rep_->prefix_filter = ReadFilterBlock(iter->value(),
+                                            &rep_->prefix_filter_data,
+                                            &rep_->prefix_filter_data_size);
+    }
   }
+  s = iter->status();
   delete iter;
   delete meta;
+  return s;
 }
 
 void Table::ReadFilter(const Slice& filter_handle_value) {
+  rep_->filter = ReadFilterBlock(filter_handle_value, &rep_->filter_data,
+                                 &rep_->filter_data_size);
+}
+
+// Read the filter block at filter_handle_value.  Sets *data to the
+// buffer to free with DeleteBlockBuffer(*data, *data_size), if any.
+FilterBlockReader* Table::ReadFilterBlock(const Slice& filter_handle_value,
+                                          const char** data,
+                                          size_t* data_size) {
   Slice v = filter_handle_value;
   BlockHandle filter_handle;
   if (!filter_handle.DecodeFrom(&v).ok()) {
-    return;
+    return NULL;
   }
 
   // We might want to unify with ReadBlock() if we start
@@ -145,13 +201,14 @@ void Table::ReadFilter(const Slice& filter_handle_value) {
   ReadOptions opt;
   BlockContents block;
   if (!ReadBlock(PickFileHandler(rep_), opt, filter_handle, &block).ok()) {
-    return;
+    return NULL;
   }
   DEBUG_INFO(3, "filter size: %lu\n", block.data.size());
   if (block.heap_allocated) {
-    rep_->filter_data = block.data.data();     // Will need to delete later
+    *data = block.data.data();     // Will need to delete later
+    *data_size = block.buffer_size;
   }
-  rep_->filter = new FilterBlockReader(rep_->options.filter_policy, block.data);
+  return new FilterBlockReader(rep_->options.filter_policy, block.data);
 }
 
 Table::~Table() {
@@ -178,6 +235,13 @@ static void ReleaseBlock(void* arg, void* h) {
 Iterator* Table::BlockReader(void* arg,
                              const ReadOptions& options,
                              const Slice& index_value, bool is_sequential) {
+  return ReadBlockIterator(arg, options, index_value, is_sequential, NULL);
+}
+
+Iterator* Table::ReadBlockIterator(void* arg,
+                                   const ReadOptions& options,
+                                   const Slice& index_value, bool is_sequential,
+                                   const Slice* get_key) {
   Table* table = reinterpret_cast<Table*>(arg);
   Cache* block_cache = table->rep_->options.block_cache;
   Block* block = NULL;
@@ -200,19 +264,17 @@ Iterator* Table::BlockReader(void* arg,
       if (cache_handle != NULL) {
         block = reinterpret_cast<Block*>(block_cache->Value(cache_handle));
       } else {
-      	DEBUG_MEASURE_RECORD(3, (s = ReadBlock(PickFileHandler(table->rep_, is_sequential), options, handle, &contents)),
-      			"BlockReader--ReadBlock" );
+      	HLSM_MEASURE(hlsm::metrics::kTableReadBlock, (s = ReadBlock(PickFileHandler(table->rep_, is_sequential), options, handle, &contents)));
         if (s.ok()) {
           block = new Block(contents);
           if (contents.cachable && options.fill_cache) {
             cache_handle = block_cache->Insert(
-                key, block, block->size(), &DeleteCachedBlock);
+                key, block, block->usage(), &DeleteCachedBlock);
           }
         }
       }
     } else {
-    	DEBUG_MEASURE_RECORD(3, (s = ReadBlock(PickFileHandler(table->rep_, is_sequential), options, handle, &contents)),
-    			"BlockReader--ReadBlock" );
+    	HLSM_MEASURE(hlsm::metrics::kTableReadBlock, (s = ReadBlock(PickFileHandler(table->rep_, is_sequential), options, handle, &contents)));
       if (s.ok()) {
         block = new Block(contents);
       }
@@ -221,7 +283,9 @@ Iterator* Table::BlockReader(void* arg,
 
   Iterator* iter;
   if (block != NULL) {
-    iter = block->NewIterator(table->rep_->options.comparator);
+    const Comparator* cmp = table->rep_->options.comparator;
+    iter = (get_key == NULL) ? block->NewIterator(cmp)
+                             : block->NewGetIterator(cmp, *get_key);
     if (cache_handle == NULL) {
       iter->RegisterCleanup(&DeleteBlock, block, NULL);
     } else {
@@ -233,10 +297,86 @@ Iterator* Table::BlockReader(void* arg,
   return iter;
 }
 
+// Iterator over the entries of the index, through its partitions if
+// it is partitioned
+Iterator* Table::NewIndexIterator(const ReadOptions& options,
+                                  bool is_sequential) const {
+  Iterator* iter = rep_->index_block->NewIterator(rep_->options.comparator);
+  if (rep_->partitioned_index) {
+    iter = NewTwoLevelIterator(iter, &Table::BlockReader,
+                               const_cast<Table*>(this), options,
+                               is_sequential);
+  }
+  return iter;
+}
+
 Iterator* Table::NewIterator(const ReadOptions& options, bool is_sequential) const {
   return NewTwoLevelIterator(
-      rep_->index_block->NewIterator(rep_->options.comparator),
-      &Table::BlockReader, const_cast<Table*>(this), options, is_sequential);
+      NewIndexIterator(options, is_sequential),
+      &Table::BlockReader, &Table::PrefixFilter,
+      hlsm::config::iterator_prefetch ? &Table::Readahead : NULL,
+      const_cast<Table*>(this), options, is_sequential);
+}
+
+// Read ahead of a scan about to read the block of index_value, unless
+// an earlier readahead covered it.  The window starts at kMinReadahead
+// and doubles with each readahead up to hlsm::config::max_readahead_kb.
+void Table::Readahead(void* arg, const Slice& index_value, bool is_sequential,
+                      ReadaheadState* state) {
+  static const size_t kMinReadahead = 16 << 10;
+  Table* table = reinterpret_cast<Table*>(arg);
+  BlockHandle handle;
+  Slice input = index_value;
+  if (!handle.DecodeFrom(&input).ok()) {
+    return;
+  }
+  const uint64_t end = handle.offset() + handle.size() + kBlockTrailerSize;
+  if (end <= state->limit) {
+    return;
+  }
+  const size_t max_window = std::max<size_t>(
+      kMinReadahead, static_cast<size_t>(hlsm::config::max_readahead_kb) << 10);
+  state->window = (state->window == 0) ? kMinReadahead
+                  : std::min(2 * state->window, max_window);
+  const size_t n = std::max<size_t>(state->window, end - handle.offset());
+  PickFileHandler(table->rep_, is_sequential)->Readahead(handle.offset(), n);
+  state->limit = handle.offset() + n;
+  HLSM_COUNT(hlsm::metrics::kReadaheadBytes, n);
+}
+
+// Whether the table may have keys with the prefix of internal key "key";
+// true for keys without a prefix or tables without a prefix filter
+bool Table::PrefixMayMatch(const Slice& key) const {
+  std::string prefix_key;
+  return rep_->prefix_filter == NULL ||
+         !PrefixFilterKey(rep_->options, key, &prefix_key) ||
+         rep_->prefix_filter->KeyMayMatch(0, prefix_key);
+}
+
+bool Table::PrefixFilter(void* arg, const Slice& index_value,
+                         const Slice& target) {
+  return reinterpret_cast<Table*>(arg)->PrefixMayMatch(target);
+}
+
+// Whether the filter of the index partition of top_index_value may hold
+// key; true without partitioned filters or if the filter is unreadable
+bool Table::PartitionMayMatch(const ReadOptions& options,
+                              const Slice& top_index_value,
+                              const Slice& key, bool is_sequential) {
+  if (!rep_->partitioned_filter) {
+    return true;
+  }
+  Slice filter_handle = top_index_value;
+  BlockHandle index_handle;
+  if (!index_handle.DecodeFrom(&filter_handle).ok() || filter_handle.empty()) {
+    return true;
+  }
+  Iterator* iter = BlockReader(this, options, filter_handle, is_sequential);
+  iter->SeekToFirst();
+  const bool match = !iter->Valid() ||
+      rep_->options.filter_policy->KeyMayMatch(key, iter->value());
+  delete iter;
+  return match;
 }
 
 Status Table::InternalGet(const ReadOptions& options, const Slice& k,
@@ -245,7 +385,19 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k,
   Status s;
   Iterator* iiter = rep_->index_block->NewIterator(rep_->options.comparator);
   iiter->Seek(k);
-  if (iiter->Valid()) {
+  if (rep_->partitioned_index && iiter->Valid()) {
+    // Search the index partition unless its filter rules the key out
+    Iterator* top = iiter;
+    if (PartitionMayMatch(options, top->value(), k, is_sequential)) {
+      iiter = BlockReader(this, options, top->value(), is_sequential);
+      iiter->Seek(k);
+    } else {
+      iiter = NewEmptyIterator();
+    }
+    s = top->status();
+    delete top;
+  }
+  if (s.ok() && iiter->Valid()) {
     Slice handle_value = iiter->value();
     FilterBlockReader* filter = rep_->filter;
     BlockHandle handle;
@@ -255,9 +407,7 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k,
       // Not found
     } else {
       Iterator* block_iter; 
-      DEBUG_MEASURE_RECORD(1, (block_iter = BlockReader(this, options, iiter->value(), is_sequential)),
-	"InternalGet--BlockReader");
-      block_iter->Seek(k);
+      HLSM_MEASURE(hlsm::metrics::kTableBlockReader, (block_iter = ReadBlockIterator(this, options, iiter->value(), is_sequential, &k)));
       if (block_iter->Valid()) {
         (*saver)(arg, block_iter->key(), block_iter->value());
       }
@@ -274,8 +424,7 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k,
 
 
 uint64_t Table::ApproximateOffsetOf(const Slice& key) const {
-  Iterator* index_iter =
-      rep_->index_block->NewIterator(rep_->options.comparator);
+  Iterator* index_iter = NewIndexIterator(ReadOptions(), false);
   index_iter->Seek(key);
   uint64_t result;
   if (index_iter->Valid()) {
@@ -42,6 +42,24 @@ struct TableBuilder::Rep {
   bool pending_index_entry;
   BlockHandle pending_handle;  // Handle to add to index block
 
+  // With options.partition_index_and_filters, index_block holds the
+  // current index partition and top_index_block an entry per partition:
+  // the last key of the partition, then the handles of the partition and
+  // of its filter.  A filter partition is a block whose single entry
+  // holds the filter of all keys the index partition covers.
+  bool partitioned;
+  BlockBuilder top_index_block;
+  BlockBuilder filter_partition;
+  std::string partition_key;            // Last key in index_block
+  std::string filter_keys;              // Keys of the partition, flattened
+  std::vector<size_t> filter_key_starts;
+
+  // With options.prefix_extractor, a filter of the distinct prefixes of
+  // the keys: a filter block with a single filter for the whole table
+  FilterBlockBuilder* prefix_filter;
+  std::string last_prefix;              // Entry last added to prefix_filter
+  std::string prefix_key;
+
   std::string compressed_output;
 
   Rep(const Options& opt, WritableFile* f)
@@ -49,13 +67,18 @@ struct TableBuilder::Rep {
         index_block_options(opt),
         file(f),
         offset(0),
-        data_block(&options),
+        data_block(&options, true),
         index_block(&index_block_options),
         num_entries(0),
         closed(false),
-        filter_block(opt.filter_policy == NULL ? NULL
-                     : new FilterBlockBuilder(opt.filter_policy)),
-        pending_index_entry(false) {
+        filter_block(opt.filter_policy == NULL || opt.partition_index_and_filters
+                     ? NULL : new FilterBlockBuilder(opt.filter_policy)),
+        pending_index_entry(false),
+        partitioned(opt.partition_index_and_filters),
+        top_index_block(&index_block_options),
+        filter_partition(&index_block_options),
+        prefix_filter(opt.filter_policy == NULL || opt.prefix_extractor == NULL
+                      ? NULL : new FilterBlockBuilder(opt.filter_policy)) {
     index_block_options.block_restart_interval = 1;
   }
 };
@@ -70,6 +93,7 @@ TableBuilder::TableBuilder(const Options& options, WritableFile* file)
 TableBuilder::~TableBuilder() {
   assert(rep_->closed);  // Catch errors where caller forgot to call Finish()
   delete rep_->filter_block;
+  delete rep_->prefix_filter;
   delete rep_;
 }
 
@@ -80,6 +104,10 @@ Status TableBuilder::ChangeOptions(const Options& options) {
   if (options.comparator != rep_->options.comparator) {
     return Status::InvalidArgument("changing comparator while building table");
   }
+  if (options.prefix_extractor != rep_->options.prefix_extractor) {
+    return Status::InvalidArgument(
+        "changing prefix extractor while building table");
+  }
 
   // Note that any live BlockBuilders point to rep_->options and therefore
   // will automatically pick up the updated options.
@@ -104,10 +132,25 @@ void TableBuilder::Add(const Slice& key, const Slice& value) {
     r->pending_handle.EncodeTo(&handle_encoding);
     r->index_block.Add(r->last_key, Slice(handle_encoding));
     r->pending_index_entry = false;
+    if (r->partitioned) {
+      r->partition_key = r->last_key;
+      if (r->index_block.CurrentSizeEstimate() >= r->options.block_size) {
+        FlushPartition();
+      }
+    }
   }
 
   if (r->filter_block != NULL) {
     r->filter_block->AddKey(key);
+  } else if (r->partitioned && r->options.filter_policy != NULL) {
+    r->filter_key_starts.push_back(r->filter_keys.size());
+    r->filter_keys.append(key.data(), key.size());
+  }
+  if (r->prefix_filter != NULL &&
+      PrefixFilterKey(r->options, key, &r->prefix_key) &&
+      r->prefix_key != r->last_prefix) {
+    r->prefix_filter->AddKey(r->prefix_key);
+    r->last_prefix.swap(r->prefix_key);
   }
 
   r->last_key.assign(key.data(), key.size());
@@ -136,6 +179,40 @@ void TableBuilder::Flush() {
   }
 }
 
+// Write the current index partition and its filter, and add their entry
+// to the top-level index
+void TableBuilder::FlushPartition() {
+  Rep* r = rep_;
+  if (!ok() || r->index_block.empty()) return;
+  std::string handles;
+  BlockHandle handle;
+  WriteBlock(&r->index_block, &handle);
+  handle.EncodeTo(&handles);
+
+  if (ok() && r->options.filter_policy != NULL &&
+      !r->filter_key_starts.empty()) {
+    const size_t num_keys = r->filter_key_starts.size();
+    r->filter_key_starts.push_back(r->filter_keys.size());  // Simplify length computation
+    std::vector<Slice> keys(num_keys);
+    for (size_t i = 0; i < num_keys; i++) {
+      const size_t start = r->filter_key_starts[i];
+      keys[i] = Slice(r->filter_keys.data() + start,
+                      r->filter_key_starts[i+1] - start);
+    }
+    std::string filter;
+    r->options.filter_policy->CreateFilter(&keys[0], num_keys, &filter);
+    r->filter_partition.Add("filter", filter);
+    WriteBlock(&r->filter_partition, &handle);
+    handle.EncodeTo(&handles);
+  }
+  r->filter_keys.clear();
+  r->filter_key_starts.clear();
+
+  if (ok()) {
+    r->top_index_block.Add(r->partition_key, handles);
+  }
+}
+
 void TableBuilder::WriteBlock(BlockBuilder* block, BlockHandle* handle) {
   // File format contains a sequence of blocks where each block has:
   //    block_data: uint8[n]
@@ -205,6 +282,7 @@ Status TableBuilder::Finish() {
   r->closed = true;
 
   BlockHandle filter_block_handle, metaindex_block_handle, index_block_handle;
+  BlockHandle prefix_filter_handle;
 
   // Write filter block
   if (ok() && r->filter_block != NULL) {
@@ -212,6 +290,12 @@ Status TableBuilder::Finish() {
                   &filter_block_handle);
   }
 
+  // Write prefix filter block
+  if (ok() && r->prefix_filter != NULL) {
+    WriteRawBlock(r->prefix_filter->Finish(), kNoCompression,
+                  &prefix_filter_handle);
+  }
+
   // Write metaindex block
   if (ok()) {
     BlockBuilder meta_index_block(&r->options);
@@ -224,6 +308,19 @@ Status TableBuilder::Finish() {
       meta_index_block.Add(key, handle_encoding);
     }
 
+    if (r->partitioned) {
+      // The index is partitioned, with filters of this policy if named
+      meta_index_block.Add("partitionedindex",
+                           r->options.filter_policy == NULL ? ""
+                           : r->options.filter_policy->Name());
+    }
+
+    if (r->prefix_filter != NULL) {
+      std::string handle_encoding;
+      prefix_filter_handle.EncodeTo(&handle_encoding);
+      meta_index_block.Add(PrefixFilterName(r->options), handle_encoding);
+    }
+
     // TODO(postrelease): Add stats and other meta blocks
     WriteBlock(&meta_index_block, &metaindex_block_handle);
   }
@@ -236,8 +333,16 @@ Status TableBuilder::Finish() {
       r->pending_handle.EncodeTo(&handle_encoding);
       r->index_block.Add(r->last_key, Slice(handle_encoding));
       r->pending_index_entry = false;
+      r->partition_key = r->last_key;
+    }
+    if (r->partitioned) {
+      FlushPartition();
+      if (ok()) {
+        WriteBlock(&r->top_index_block, &index_block_handle);
+      }
+    } else {
+      WriteBlock(&r->index_block, &index_block_handle);
     }
-    WriteBlock(&r->index_block, &index_block_handle);
   }
 
   // Write footer
@@ -15,12 +15,19 @@ namespace leveldb {
 namespace {
 
 typedef Iterator* (*BlockFunction)(void*, const ReadOptions&, const Slice&, const bool is_sequential);
+typedef bool (*FilterFunction)(void*, const Slice&, const Slice&);
+typedef void (*ReadaheadFunction)(void*, const Slice&, bool, ReadaheadState*);
+
+// Blocks reached by Next() in a row before a scan reads ahead
+static const int kReadaheadAfterBlocks = 2;
 
 class TwoLevelIterator: public Iterator {
  public:
   TwoLevelIterator(
     Iterator* index_iter,
     BlockFunction block_function,
+    FilterFunction filter_function,
+    ReadaheadFunction readahead_function,
     void* arg,
     const ReadOptions& options,
     bool is_sequential = false);
@@ -63,12 +70,22 @@ class TwoLevelIterator: public Iterator {
   void SkipEmptyDataBlocksBackward();
   void SetDataIterator(Iterator* data_iter);
   void InitDataBlock();
+  void EndScan() {
+    scan_blocks_ = 0;
+    readahead_.limit = 0;
+    readahead_.window = 0;
+  }
   void PrefetchDataBlock();
   void InitPrefetchedDataBlock();
 
   BlockFunction block_function_;
+  FilterFunction filter_function_;  // NULL unless in prefix mode
+  ReadaheadFunction readahead_function_;
   void* arg_;
   const ReadOptions options_;
+  ReadOptions scan_options_;        // options_ without filling the cache
+  int scan_blocks_;                 // Blocks reached by Next() in a row
+  ReadaheadState readahead_;
   Status status_;
   IteratorWrapper index_iter_;
   IteratorWrapper data_iter_; // May be NULL
@@ -81,28 +98,43 @@ class TwoLevelIterator: public Iterator {
 TwoLevelIterator::TwoLevelIterator(
     Iterator* index_iter,
     BlockFunction block_function,
+    FilterFunction filter_function,
+    ReadaheadFunction readahead_function,
     void* arg,
     const ReadOptions& options,
     bool is_sequential)
     : block_function_(block_function),
+      filter_function_(options.prefix_same_as_start ? filter_function : NULL),
+      readahead_function_(readahead_function),
       arg_(arg),
       options_(options),
+      scan_options_(options),
       index_iter_(index_iter),
       data_iter_(NULL),
       is_sequential_(is_sequential) {
+  scan_options_.fill_cache = false;
+  EndScan();
 }
 
 TwoLevelIterator::~TwoLevelIterator() {
 }
 
 void TwoLevelIterator::Seek(const Slice& target) {
+  EndScan();
   index_iter_.Seek(target);
+  if (filter_function_ != NULL && index_iter_.Valid() &&
+      !(*filter_function_)(arg_, index_iter_.value(), target)) {
+    // No key with the prefix of target follows it
+    SetDataIterator(NULL);
+    return;
+  }
   InitDataBlock();
   if (data_iter_.iter() != NULL) data_iter_.Seek(target);
   SkipEmptyDataBlocksForward();
 }
 
 void TwoLevelIterator::SeekToFirst() {
+  EndScan();
   index_iter_.SeekToFirst();
   InitDataBlock();
   if (data_iter_.iter() != NULL) data_iter_.SeekToFirst();
@@ -110,6 +142,7 @@ void TwoLevelIterator::SeekToFirst() {
 }
 
 void TwoLevelIterator::SeekToLast() {
+  EndScan();
   index_iter_.SeekToLast();
   InitDataBlock();
   if (data_iter_.iter() != NULL) data_iter_.SeekToLast();
@@ -124,6 +157,7 @@ void TwoLevelIterator::Next() {
 
 void TwoLevelIterator::Prev() {
   assert(Valid());
+  EndScan();
   data_iter_.Prev();
   SkipEmptyDataBlocksBackward();
 }
@@ -137,6 +171,11 @@ void TwoLevelIterator::SkipEmptyDataBlocksForward() {
       return;
     }
     index_iter_.Next();
+    if (readahead_function_ != NULL && ++scan_blocks_ >= kReadaheadAfterBlocks &&
+        index_iter_.Valid()) {
+      (*readahead_function_)(arg_, index_iter_.value(), is_sequential_,
+                             &readahead_);
+    }
     InitDataBlock();
     if (data_iter_.iter() != NULL) data_iter_.SeekToFirst();
   }
@@ -169,7 +208,9 @@ void TwoLevelIterator::InitDataBlock() {
       // data_iter_ is already constructed with this iterator, so
       // no need to change anything
     } else {
-      Iterator* iter = (*block_function_)(arg_, options_, handle, is_sequential_);
+      Iterator* iter = (*block_function_)(
+          arg_, (scan_blocks_ >= kReadaheadAfterBlocks) ? scan_options_ : options_,
+          handle, is_sequential_);
       data_block_handle_.assign(handle.data(), handle.size());
       SetDataIterator(iter);
     }
@@ -184,7 +225,20 @@ Iterator* NewTwoLevelIterator(
     void* arg,
     const ReadOptions& options,
     const bool is_sequential) {
-  return new TwoLevelIterator(index_iter, block_function, arg, options, is_sequential);
+  return new TwoLevelIterator(index_iter, block_function, NULL, NULL, arg,
+                              options, is_sequential);
+}
+
+Iterator* NewTwoLevelIterator(
+    Iterator* index_iter,
+    BlockFunction block_function,
+    FilterFunction filter_function,
+    ReadaheadFunction readahead_function,
+    void* arg,
+    const ReadOptions& options,
+    const bool is_sequential) {
+  return new TwoLevelIterator(index_iter, block_function, filter_function,
+                              readahead_function, arg, options, is_sequential);
 }
 
 }  // namespace leveldb
@@ -5,12 +5,20 @@
 #ifndef STORAGE_LEVELDB_TABLE_TWO_LEVEL_ITERATOR_H_
 #define STORAGE_LEVELDB_TABLE_TWO_LEVEL_ITERATOR_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include "leveldb/iterator.h"
 
 namespace leveldb {
 
 struct ReadOptions;
 
+// Read ahead of a sequential scan so far
+struct ReadaheadState {
+  uint64_t limit;  // End of the bytes read ahead
+  size_t window;   // Size of the last readahead; 0 before the first
+};
+
 // Return a new two level iterator.  A two-level iterator contains an
 // index iterator whose values point to a sequence of blocks where
 // each block is itself a sequence of key,value pairs.  The returned
@@ -31,6 +39,37 @@ extern Iterator* NewTwoLevelIterator(
     const ReadOptions& options,
     bool is_sequential = false);
 
+// As above.  In ReadOptions::prefix_same_as_start mode, Seek(target) also
+// leaves the iterator invalid, without reading a block, if
+// (*filter_function)(arg, index_value, target) says that the block of the
+// index entry found for target has no key with the prefix of target.
+// The caller ensures that no such key follows in later blocks then.
+//
+// Once Next() has moved on to a couple of blocks in a row, the iterator
+// calls (*readahead_function)(arg, index_value, is_sequential, state)
+// before each further block, and reads these blocks without filling the
+// block cache.  Any other move ends the run and resets *state.  Either
+// function may be NULL.
+extern Iterator* NewTwoLevelIterator(
+    Iterator* index_iter,
+    Iterator* (*block_function)(
+        void* arg,
+        const ReadOptions& options,
+        const Slice& index_value,
+        const bool is_sequential),
+    bool (*filter_function)(
+        void* arg,
+        const Slice& index_value,
+        const Slice& target),
+    void (*readahead_function)(
+        void* arg,
+        const Slice& index_value,
+        bool is_sequential,
+        ReadaheadState* state),
+    void* arg,
+    const ReadOptions& options,
+    bool is_sequential = false);
+
 }  // namespace leveldb
 
 #endif  // STORAGE_LEVELDB_TABLE_TWO_LEVEL_ITERATOR_H_
@@ -0,0 +1,169 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/block_buffer.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "leveldb/hlsm_metrics.h"
+#include "port/port.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+namespace {
+
+const size_t kFineStep = 512;
+const int kFineClasses = 32;     // kFineStep apart up to 16KB
+const int kCoarseShift = 14;     // 16KB
+const int kNumClasses = kFineClasses + 4 * 8;  // up to kMaxPooledBlockBuffer
+const int kThreadCacheDepth = 4;
+
+// Free buffers kept by one thread
+struct ThreadCache {
+  char* free[kNumClasses][kThreadCacheDepth];
+  int count[kNumClasses];
+  size_t bytes;  // at most kThreadBlockBufferBytes
+};
+
+// Never destroyed: background threads may free buffers during exit
+port::Mutex* shared_mu;
+std::vector<char*>* shared;  // kNumClasses lists of free buffers
+size_t shared_bytes;
+pthread_key_t cache_key;
+pthread_once_t once = PTHREAD_ONCE_INIT;
+__thread ThreadCache* tls_cache = NULL;
+
+// Size class of n, or -1 if n is too large to pool.  Classes are
+// multiples of kFineStep up to 16KB, then 1.25, 1.5, 1.75 and 2 times a
+// power of two.
+inline int SizeClass(size_t n) {
+  if (n > kMaxPooledBlockBuffer) return -1;
+  if (n <= kFineClasses * kFineStep) {
+    return n == 0 ? 0 : static_cast<int>((n - 1) / kFineStep);
+  }
+  int shift = kCoarseShift;
+  while ((static_cast<size_t>(2) << shift) < n) shift++;
+  const size_t base = static_cast<size_t>(1) << shift;
+  const size_t quarter = base >> 2;
+  const int step = static_cast<int>((n - base + quarter - 1) / quarter);
+  return kFineClasses + 4 * (shift - kCoarseShift) + step - 1;
+}
+
+inline size_t ClassSize(int c) {
+  if (c < kFineClasses) {
+    return (c + 1) * kFineStep;
+  }
+  const int shift = kCoarseShift + (c - kFineClasses) / 4;
+  const int step = (c - kFineClasses) % 4 + 1;
+  return (static_cast<size_t>(1) << shift) +
+         step * (static_cast<size_t>(1) << (shift - 2));
+}
+
+char* Allocate(size_t n) {
+  void* mem = NULL;
+  if (posix_memalign(&mem, kPageSize, n) != 0) {
+    fprintf(stderr, "cannot allocate a block buffer of %zu bytes\n", n);
+    abort();
+  }
+  HLSM_COUNT(hlsm::metrics::kBlockBufferAllocBytes, n);
+  return reinterpret_cast<char*>(mem);
+}
+
+// Keep buf for all threads if there is room
+void ReleaseShared(int c, char* buf) {
+  {
+    MutexLock l(shared_mu);
+    if (shared_bytes + ClassSize(c) <= kSharedBlockBufferBytes) {
+      shared[c].push_back(buf);
+      shared_bytes += ClassSize(c);
+      return;
+    }
+  }
+  free(buf);
+}
+
+// Hand the buffers of an exiting thread to the others
+void ReleaseThreadCache(void* arg) {
+  ThreadCache* cache = reinterpret_cast<ThreadCache*>(arg);
+  for (int c = 0; c < kNumClasses; c++) {
+    for (int i = 0; i < cache->count[c]; i++) {
+      ReleaseShared(c, cache->free[c][i]);
+    }
+  }
+  tls_cache = NULL;
+  delete cache;
+}
+
+void InitPool() {
+  shared_mu = new port::Mutex;
+  shared = new std::vector<char*>[kNumClasses];
+  shared_bytes = 0;
+  pthread_key_create(&cache_key, ReleaseThreadCache);
+}
+
+inline ThreadCache* ThisCache() {
+  ThreadCache* cache = tls_cache;
+  if (cache == NULL) {
+    pthread_once(&once, InitPool);
+    cache = new ThreadCache;
+    memset(cache, 0, sizeof(ThreadCache));
+    pthread_setspecific(cache_key, cache);
+    tls_cache = cache;
+  }
+  return cache;
+}
+
+}  // namespace
+
+char* NewBlockBuffer(size_t n) {
+  const int c = SizeClass(n);
+  if (c < 0) {
+    return Allocate(n);
+  }
+  ThreadCache* cache = ThisCache();
+  if (cache->count[c] > 0) {
+    cache->bytes -= ClassSize(c);
+    return cache->free[c][--cache->count[c]];
+  }
+  {
+    MutexLock l(shared_mu);
+    if (!shared[c].empty()) {
+      char* buf = shared[c].back();
+      shared[c].pop_back();
+      shared_bytes -= ClassSize(c);
+      return buf;
+    }
+  }
+  return Allocate(ClassSize(c));
+}
+
+size_t BlockBufferSize(size_t n) {
+  const int c = SizeClass(n);
+  return c < 0 ? n : ClassSize(c);
+}
+
+void DeleteBlockBuffer(char* buf, size_t n) {
+  if (buf == NULL) {
+    return;
+  }
+  const int c = SizeClass(n);
+  if (c < 0) {
+    free(buf);
+    return;
+  }
+  ThreadCache* cache = ThisCache();
+  if (cache->count[c] < kThreadCacheDepth &&
+      cache->bytes + ClassSize(c) <= kThreadBlockBufferBytes) {
+    cache->free[c][cache->count[c]++] = buf;
+    cache->bytes += ClassSize(c);
+  } else {
+    ReleaseShared(c, buf);
+  }
+}
+
+}  // namespace leveldb
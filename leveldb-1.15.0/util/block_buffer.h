@@ -0,0 +1,37 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_LEVELDB_UTIL_BLOCK_BUFFER_H_
+#define STORAGE_LEVELDB_UTIL_BLOCK_BUFFER_H_
+
+#include <stddef.h>
+
+namespace leveldb {
+
+// Buffers for reading and uncompressing blocks, aligned to a page.
+//
+// Sizes are rounded up to a multiple of 512 bytes up to 16KB, and to a
+// quarter of a power of two above that up to 4MB, so a block wastes
+// little of its buffer.  Freed buffers are kept for reuse: a few of each
+// size by every thread, without locking, up to kThreadBlockBufferBytes
+// per thread, and up to kSharedBlockBufferBytes more for all threads.  So
+// most block reads allocate no memory.  Larger buffers are allocated and
+// freed on each call.
+static const size_t kPageSize = 4096;
+static const size_t kMaxPooledBlockBuffer = 4 << 20;
+static const size_t kThreadBlockBufferBytes = 1 << 20;
+static const size_t kSharedBlockBufferBytes = 32 << 20;
+
+// Return a buffer of at least n bytes
+extern char* NewBlockBuffer(size_t n);
+
+// Free buf, returned by NewBlockBuffer(n) with the same n
+extern void DeleteBlockBuffer(char* buf, size_t n);
+
+// Bytes of memory held by a buffer returned by NewBlockBuffer(n)
+extern size_t BlockBufferSize(size_t n);
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_UTIL_BLOCK_BUFFER_H_
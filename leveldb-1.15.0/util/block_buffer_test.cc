@@ -0,0 +1,110 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/block_buffer.h"
+
+#include <stdint.h>
+#include <string.h>
+#include "leveldb/env.h"
+#include "port/port.h"
+#include "util/mutexlock.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class BlockBufferTest { };
+
+TEST(BlockBufferTest, AlignmentAndReuse) {
+  char* a = NewBlockBuffer(5000);
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(a) % kPageSize);
+  memset(a, 'x', 5000);
+  DeleteBlockBuffer(a, 5000);
+
+  // Same size class, so the freed buffer comes back
+  char* b = NewBlockBuffer(5100);
+  ASSERT_TRUE(a == b);
+  char* c = NewBlockBuffer(5100);
+  ASSERT_TRUE(b != c);
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(c) % kPageSize);
+  DeleteBlockBuffer(b, 5100);
+  DeleteBlockBuffer(c, 5100);
+
+  // A 4KB block and its trailer take little more than 4KB
+  ASSERT_EQ(4608, BlockBufferSize(4096 + 5));
+  ASSERT_EQ(16384, BlockBufferSize(16384));
+  ASSERT_EQ(20480, BlockBufferSize(16385));
+  ASSERT_EQ(114688, BlockBufferSize(100000));
+  ASSERT_EQ(kMaxPooledBlockBuffer, BlockBufferSize(kMaxPooledBlockBuffer));
+  for (size_t n = 1; n <= kMaxPooledBlockBuffer; n += n / 7 + 1) {
+    ASSERT_TRUE(BlockBufferSize(n) >= n);
+    ASSERT_TRUE(BlockBufferSize(n) <= n + n / 4 + 512);
+  }
+
+  const size_t big = kMaxPooledBlockBuffer + 1;
+  char* d = NewBlockBuffer(big);
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(d) % kPageSize);
+  memset(d, 'y', big);
+  DeleteBlockBuffer(d, big);
+}
+
+namespace {
+struct OtherThread {
+  port::Mutex mu;
+  port::CondVar cv;
+  size_t n;
+  char* buf;
+  bool done;
+  OtherThread() : cv(&mu), n(0), buf(NULL), done(false) { }
+};
+
+void NewInOtherThread(void* arg) {
+  OtherThread* t = reinterpret_cast<OtherThread*>(arg);
+  char* buf = NewBlockBuffer(t->n);
+  MutexLock l(&t->mu);
+  t->buf = buf;
+  t->done = true;
+  t->cv.Signal();
+}
+
+// A buffer of n bytes returned by NewBlockBuffer() on another thread
+char* NewBlockBufferInOtherThread(size_t n) {
+  OtherThread t;
+  t.n = n;
+  Env::Default()->StartThread(&NewInOtherThread, &t);
+  MutexLock l(&t.mu);
+  while (!t.done) {
+    t.cv.Wait();
+  }
+  return t.buf;
+}
+}  // namespace
+
+TEST(BlockBufferTest, ThreadCacheLimit) {
+  // A thread keeps at most kThreadBlockBufferBytes, so the third buffer
+  // goes to the buffers of all threads
+  const size_t n = kThreadBlockBufferBytes / 8 * 3;
+  ASSERT_EQ(n, BlockBufferSize(n));
+  char* a = NewBlockBuffer(n);
+  char* b = NewBlockBuffer(n);
+  char* c = NewBlockBuffer(n);
+  DeleteBlockBuffer(a, n);
+  DeleteBlockBuffer(b, n);
+  DeleteBlockBuffer(c, n);
+  char* d = NewBlockBufferInOtherThread(n);
+  ASSERT_TRUE(d == c);
+  DeleteBlockBuffer(d, n);
+
+  // The buffers this thread kept come back to it
+  char* e = NewBlockBuffer(n);
+  char* f = NewBlockBuffer(n);
+  ASSERT_TRUE((e == a && f == b) || (e == b && f == a));
+  DeleteBlockBuffer(e, n);
+  DeleteBlockBuffer(f, n);
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <algorithm>
 #include <deque>
 #include <set>
 #include <string>
@@ -21,6 +22,10 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(OS_LINUX)
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 #if defined(LEVELDB_PLATFORM_ANDROID)
 #include <sys/stat.h>
 #endif
@@ -44,17 +49,20 @@ class PosixSequentialFile: public SequentialFile {
  private:
   std::string filename_;
   FILE* file_;
+  hlsm::IoAccount io_;
 
  public:
   PosixSequentialFile(const std::string& fname, FILE* f)
-      : filename_(fname), file_(f) {
+      : filename_(fname), file_(f), io_(fname) {
     DEBUG_INFO(2, "%s\n", fname.c_str());
   }
   virtual ~PosixSequentialFile() { fclose(file_); }
 
   virtual Status Read(size_t n, Slice* result, char* scratch) {
     Status s;
+    const uint64_t start = hlsm::metrics::IoStart();
     size_t r = fread_unlocked(scratch, 1, n, file_);
+    io_.record(hlsm::metrics::kIoRead, r, start);
     *result = Slice(scratch, r);
     if (r < n) {
       if (feof(file_)) {
@@ -79,10 +87,11 @@ class PosixSequentialFile: public SequentialFile {
 class PosixRandomAccessFile: public RandomAccessFile {
  private:
   int fd_;
+  hlsm::IoAccount io_;
 
  public:
   PosixRandomAccessFile(const std::string& fname, int fd)
-      : fd_(fd) { filename_ = fname;
+      : fd_(fd), io_(fname) { filename_ = fname;
     DEBUG_INFO(3, "%s\n", fname.c_str());
   }
   virtual ~PosixRandomAccessFile() { close(fd_); }
@@ -90,7 +99,9 @@ class PosixRandomAccessFile: public RandomAccessFile {
   virtual Status Read(uint64_t offset, size_t n, Slice* result,
                       char* scratch) const {
     Status s;
+    const uint64_t start = hlsm::metrics::IoStart();
     ssize_t r = pread(fd_, scratch, n, static_cast<off_t>(offset));
+    io_.record(hlsm::metrics::kIoRead, (r < 0) ? 0 : r, start);
     *result = Slice(scratch, (r < 0) ? 0 : r);
     if (r < 0) {
       // An error: return a non-ok status
@@ -98,6 +109,10 @@ class PosixRandomAccessFile: public RandomAccessFile {
     }
     return s;
   }
+
+  virtual void Readahead(uint64_t offset, size_t n) const {
+    posix_fadvise(fd_, static_cast<off_t>(offset), n, POSIX_FADV_WILLNEED);
+  }
 };
 
 // Helper class to limit mmap file usage so that we do not end up
@@ -155,13 +170,14 @@ class PosixMmapReadableFile: public RandomAccessFile {
   void* mmapped_region_;
   size_t length_;
   MmapLimiter* limiter_;
+  hlsm::IoAccount io_;
 
  public:
   // base[0,length-1] contains the mmapped contents of the file.
   PosixMmapReadableFile(const std::string& fname, void* base, size_t length,
                         MmapLimiter* limiter)
       : mmapped_region_(base), length_(length),
-        limiter_(limiter) { filename_ = fname;
+        limiter_(limiter), io_(fname) { filename_ = fname;
     	DEBUG_INFO(2, "%s\n", fname.c_str());
   }
 
@@ -179,20 +195,32 @@ class PosixMmapReadableFile: public RandomAccessFile {
       s = IOError(filename_, EINVAL);
     } else {
       *result = Slice(reinterpret_cast<char*>(mmapped_region_) + offset, n);
+      io_.record(hlsm::metrics::kIoRead, n, 0); // page faults are not timed
     }
 	DEBUG_INFO(3, "END\t%s\t%lu\t%lu\n", filename_.c_str(), offset, n);
     return s;
   }
+
+  virtual void Readahead(uint64_t offset, size_t n) const {
+    if (offset >= length_) {
+      return;
+    }
+    const uint64_t start = offset & ~static_cast<uint64_t>(getpagesize() - 1);
+    const uint64_t end = std::min<uint64_t>(offset + n, length_);
+    madvise(reinterpret_cast<char*>(mmapped_region_) + start, end - start,
+            MADV_WILLNEED);
+  }
 };
 
 class PosixWritableFile : public WritableFile {
  private:
   std::string filename_;
   FILE* file_;
+  hlsm::IoAccount io_;
 
  public:
   PosixWritableFile(const std::string& fname, FILE* f)
-      : filename_(fname), file_(f) { }
+      : filename_(fname), file_(f), io_(fname) { }
 
   ~PosixWritableFile() {
     if (file_ != NULL) {
@@ -202,7 +230,9 @@ class PosixWritableFile : public WritableFile {
   }
 
   virtual Status Append(const Slice& data, bool delayed_buf_reset = false) {
+    const uint64_t start = hlsm::metrics::IoStart();
     size_t r = fwrite_unlocked(data.data(), 1, data.size(), file_);
+    io_.record(hlsm::metrics::kIoWrite, r, start);
     if (r != data.size()) {
       return IOError(filename_, errno);
     }
@@ -259,10 +289,12 @@ class PosixWritableFile : public WritableFile {
     if (!s.ok()) {
       return s;
     }
+    const uint64_t start = hlsm::metrics::IoStart();
     if (fflush_unlocked(file_) != 0 ||
         fdatasync(fileno(file_)) != 0) {
       s = Status::IOError(filename_, strerror(errno));
     }
+    io_.record(hlsm::metrics::kIoSync, 0, start);
     return s;
   }
 };
@@ -302,6 +334,177 @@ class PosixLockTable {
   }
 };
 
+static void PthreadCall(const char* label, int result) {
+  if (result != 0) {
+    fprintf(stderr, "pthread %s: %s\n", label, strerror(result));
+    abort();
+  }
+}
+
+// A set of background threads serving one Env::Priority.  Threads are
+// started lazily by the first Schedule() call.
+class PosixThreadPool {
+ public:
+  PosixThreadPool()
+      : target_threads_(1),
+        num_threads_(0),
+        io_class_(-1),
+        io_level_(0),
+        attr_generation_(0) {
+    PthreadCall("mutex_init", pthread_mutex_init(&mu_, NULL));
+    PthreadCall("cvar_init", pthread_cond_init(&bgsignal_, NULL));
+  }
+
+  void Schedule(void (*function)(void*), void* arg);
+  void SetBackgroundThreads(int num);
+  void SetAffinity(const std::vector<int>& cpus);
+  void SetIOPriority(int io_class, int io_level);
+  int QueueLen();
+
+ private:
+  // BGThread() is the body of a background thread
+  void BGThread();
+  static void* BGThreadWrapper(void* arg) {
+    reinterpret_cast<PosixThreadPool*>(arg)->BGThread();
+    return NULL;
+  }
+
+  void StartThreads();          // REQUIRES: mu_ held
+  void ApplyThreadAttributes(); // REQUIRES: mu_ held, called by the thread itself
+
+  pthread_mutex_t mu_;
+  pthread_cond_t bgsignal_;
+  int target_threads_;
+  int num_threads_;             // Threads started and not yet exited
+
+  // Attributes applied by every thread whenever attr_generation_ changes
+  std::vector<int> cpus_;
+  int io_class_;
+  int io_level_;
+  uint64_t attr_generation_;
+
+  // Entry per Schedule() call
+  struct BGItem { void* arg; void (*function)(void*); };
+  typedef std::deque<BGItem> BGQueue;
+  BGQueue queue_;
+};
+
+void PosixThreadPool::StartThreads() {
+  while (num_threads_ < target_threads_) {
+    num_threads_++;
+    pthread_t t;
+    PthreadCall(
+        "create thread",
+        pthread_create(&t, NULL,  &PosixThreadPool::BGThreadWrapper, this));
+    PthreadCall("detach thread", pthread_detach(t));
+  }
+}
+
+void PosixThreadPool::Schedule(void (*function)(void*), void* arg) {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+
+  // Start background threads if necessary
+  StartThreads();
+
+  // Add to priority queue
+  queue_.push_back(BGItem());
+  queue_.back().function = function;
+  queue_.back().arg = arg;
+
+  PthreadCall("signal", pthread_cond_signal(&bgsignal_));
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
+
+void PosixThreadPool::SetBackgroundThreads(int num) {
+  if (num < 1) num = 1;
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  target_threads_ = num;
+  if (num_threads_ > 0) {
+    StartThreads();
+  }
+  // Wake up idle threads so that surplus ones can exit
+  PthreadCall("broadcast", pthread_cond_broadcast(&bgsignal_));
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
+
+void PosixThreadPool::SetAffinity(const std::vector<int>& cpus) {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  cpus_ = cpus;
+  attr_generation_++;
+  PthreadCall("broadcast", pthread_cond_broadcast(&bgsignal_));
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
+
+void PosixThreadPool::SetIOPriority(int io_class, int io_level) {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  io_class_ = io_class;
+  io_level_ = io_level;
+  attr_generation_++;
+  PthreadCall("broadcast", pthread_cond_broadcast(&bgsignal_));
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
+
+int PosixThreadPool::QueueLen() {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  int len = queue_.size();
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+  return len;
+}
+
+void PosixThreadPool::ApplyThreadAttributes() {
+#if defined(OS_LINUX)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (cpus_.empty()) {
+    for (int i = 0; i < CPU_SETSIZE; i++) CPU_SET(i, &set);
+  } else {
+    for (size_t i = 0; i < cpus_.size(); i++) CPU_SET(cpus_[i], &set);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+  // ioprio_set(IOPRIO_WHO_PROCESS, 0, ...) applies to the calling thread;
+  // class 0 (IOPRIO_CLASS_NONE) falls back to the CPU nice value.
+  const int kIOPrioWhoProcess = 1;
+  const int kIOPrioClassShift = 13;
+  int prio = (io_class_ < 0) ? 0 : ((io_class_ << kIOPrioClassShift) | io_level_);
+  syscall(SYS_ioprio_set, kIOPrioWhoProcess, 0, prio);
+#endif
+}
+
+void PosixThreadPool::BGThread() {
+  uint64_t generation = 0;
+  while (true) {
+    // Wait until there is an item that is ready to run
+    PthreadCall("lock", pthread_mutex_lock(&mu_));
+    while (queue_.empty() && num_threads_ <= target_threads_ &&
+           generation == attr_generation_) {
+      PthreadCall("wait", pthread_cond_wait(&bgsignal_, &mu_));
+    }
+    if (generation != attr_generation_) {
+      generation = attr_generation_;
+      ApplyThreadAttributes();
+    }
+    if (num_threads_ > target_threads_) {
+      // Surplus thread; whichever thread gets here first leaves, so that
+      // threads still busy after a shrink leave when they are done
+      num_threads_--;
+      PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+      break;
+    }
+    if (queue_.empty()) {
+      PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+      continue;
+    }
+
+    void (*function)(void*) = queue_.front().function;
+    void* arg = queue_.front().arg;
+    queue_.pop_front();
+
+    PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+    (*function)(arg);
+  }
+}
+
 class PosixEnv : public Env {
  public:
   PosixEnv();
@@ -372,6 +575,11 @@ class PosixEnv : public Env {
     	  *result = new hlsm::FullMirror_PosixWritableFile(fname, f);
       else
     	  *result = new PosixWritableFile(fname, f);
+      if (FILE_HAS_SUFFIX(fname, ".ldb")) {
+    	  hlsm::runtime::placement.add_copy(hlsm::table_name_to_number(fname),
+    			  hlsm::is_primary_file(fname) ? hlsm::PlacementRegistry::kPrimary
+    					  : hlsm::PlacementRegistry::kSecondary);
+      }
     }
     return s;
   }
@@ -394,9 +602,17 @@ class PosixEnv : public Env {
     }
     closedir(d);
 
-    if (hlsm::config::secondary_storage_path != NULL) {
-    	DIR* sd = opendir(hlsm::config::secondary_storage_path);
-
+    // Files of every secondary path but tables; before the first open the
+    //	path is still an unsplit list
+    std::vector<std::string> spaths = hlsm::runtime::secondary_paths;
+    if (spaths.empty() && hlsm::config::secondary_storage_path != NULL) {
+    	spaths.push_back(hlsm::config::secondary_storage_path);
+    }
+    for (size_t p = 0; p < spaths.size(); p++) {
+    	DIR* sd = NULL;
+    	if (spaths[p] == dir || (sd = opendir(spaths[p].c_str())) == NULL) {
+    		continue;
+    	}
     	while ((entry = readdir(sd)) != NULL) { // ldb
     		if (!FILE_HAS_SUFFIX(std::string(entry->d_name), ".ldb"))
     			result->push_back(entry->d_name);
@@ -416,10 +632,15 @@ class PosixEnv : public Env {
     }
     if (hlsm::is_mirrored_write(fname, true)) {
     	if (!hlsm::runtime::delete_primary_only) {
-    		OPQ_ADD_DELETE(hlsm::runtime::op_queue,
+    		// behind the pending writes of the copy on its device
+    		OPQ_ADD_DELETE(hlsm::table_queue(hlsm::table_name_to_number(fname)),
     				new std::string(PRIMARY_TO_SECONDARY_FILE(fname)));
     	}
-    	hlsm::runtime::table_level.remove(hlsm::table_name_to_number(fname));
+    	hlsm::runtime::placement.remove(hlsm::table_name_to_number(fname));
+    } else if (FILE_HAS_SUFFIX(fname, ".ldb")) {
+    	hlsm::runtime::placement.drop_copy(hlsm::table_name_to_number(fname),
+    			hlsm::is_primary_file(fname) ? hlsm::PlacementRegistry::kPrimary
+    					: hlsm::PlacementRegistry::kSecondary);
     }
     DEBUG_INFO(2, "%s\n", fname.c_str());
     return Status::OK();
@@ -464,6 +685,16 @@ class PosixEnv : public Env {
     return result;
   }
 
+  virtual Status LinkFile(const std::string& src_, const std::string& target_) {
+	std::string src = hlsm::relocate_file(src_);
+	std::string target = hlsm::relocate_file(target_);
+    Status result;
+    if (link(src.c_str(), target.c_str()) != 0) {
+      result = IOError(src, errno);
+    }
+    return result;
+  }
+
   virtual Status LockFile(const std::string& fname_, FileLock** lock) {
 	std::string fname = hlsm::relocate_file(fname_);
     *lock = NULL;
@@ -499,7 +730,36 @@ class PosixEnv : public Env {
     return result;
   }
 
-  virtual void Schedule(void (*function)(void*), void* arg);
+  virtual void Schedule(void (*function)(void*), void* arg) {
+    Schedule(function, arg, LOW);
+  }
+
+  virtual void Schedule(void (*function)(void*), void* arg, Priority pri) {
+    assert(pri >= LOW && pri < TOTAL);
+    pools_[pri].Schedule(function, arg);
+  }
+
+  virtual void SetBackgroundThreads(int num, Priority pri) {
+    assert(pri >= LOW && pri < TOTAL);
+    pools_[pri].SetBackgroundThreads(num);
+  }
+
+  virtual void SetBackgroundThreadsAffinity(const std::vector<int>& cpus,
+                                            Priority pri) {
+    assert(pri >= LOW && pri < TOTAL);
+    pools_[pri].SetAffinity(cpus);
+  }
+
+  virtual void SetBackgroundThreadsIOPriority(int io_class, int io_level,
+                                              Priority pri) {
+    assert(pri >= LOW && pri < TOTAL);
+    pools_[pri].SetIOPriority(io_class, io_level);
+  }
+
+  virtual int GetThreadPoolQueueLen(Priority pri) {
+    assert(pri >= LOW && pri < TOTAL);
+    return pools_[pri].QueueLen();
+  }
 
   virtual void StartThread(void (*function)(void* arg), void* arg);
 
@@ -547,80 +807,13 @@ class PosixEnv : public Env {
   }
 
  private:
-  void PthreadCall(const char* label, int result) {
-    if (result != 0) {
-      fprintf(stderr, "pthread %s: %s\n", label, strerror(result));
-      abort();
-    }
-  }
-
-  // BGThread() is the body of the background thread
-  void BGThread();
-  static void* BGThreadWrapper(void* arg) {
-    reinterpret_cast<PosixEnv*>(arg)->BGThread();
-    return NULL;
-  }
-
-  pthread_mutex_t mu_;
-  pthread_cond_t bgsignal_;
-  pthread_t bgthread_;
-  bool started_bgthread_;
-
-  // Entry per Schedule() call
-  struct BGItem { void* arg; void (*function)(void*); };
-  typedef std::deque<BGItem> BGQueue;
-  BGQueue queue_;
+  PosixThreadPool pools_[TOTAL];
 
   PosixLockTable locks_;
   MmapLimiter mmap_limit_;
 };
 
-PosixEnv::PosixEnv() : started_bgthread_(false) {
-  PthreadCall("mutex_init", pthread_mutex_init(&mu_, NULL));
-  PthreadCall("cvar_init", pthread_cond_init(&bgsignal_, NULL));
-}
-
-void PosixEnv::Schedule(void (*function)(void*), void* arg) {
-  PthreadCall("lock", pthread_mutex_lock(&mu_));
-
-  // Start background thread if necessary
-  if (!started_bgthread_) {
-    started_bgthread_ = true;
-    PthreadCall(
-        "create thread",
-        pthread_create(&bgthread_, NULL,  &PosixEnv::BGThreadWrapper, this));
-  }
-
-  // If the queue is currently empty, the background thread may currently be
-  // waiting.
-  if (queue_.empty()) {
-    PthreadCall("signal", pthread_cond_signal(&bgsignal_));
-  }
-
-  // Add to priority queue
-  queue_.push_back(BGItem());
-  queue_.back().function = function;
-  queue_.back().arg = arg;
-
-  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
-}
-
-void PosixEnv::BGThread() {
-  while (true) {
-    // Wait until there is an item that is ready to run
-    PthreadCall("lock", pthread_mutex_lock(&mu_));
-    while (queue_.empty()) {
-      PthreadCall("wait", pthread_cond_wait(&bgsignal_, &mu_));
-    }
-
-    void (*function)(void*) = queue_.front().function;
-    void* arg = queue_.front().arg;
-    queue_.pop_front();
-
-    PthreadCall("unlock", pthread_mutex_unlock(&mu_));
-    (*function)(arg);
-  }
-}
+PosixEnv::PosixEnv() { }
 
 namespace {
 struct StartThreadState {
@@ -0,0 +1,368 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/env_sim.h"
+
+#include <string.h>
+#include <algorithm>
+#include "leveldb/env.h"
+#include "leveldb/status.h"
+#include "util/mutexlock.h"
+#include "leveldb/hlsm.h"
+
+namespace leveldb {
+
+SimDeviceOptions::SimDeviceOptions()
+    : seek_micros(8500),
+      rpm(7200),
+      read_latency_micros(0),
+      write_latency_micros(0),
+      read_mb_per_sec(120),
+      write_mb_per_sec(120),
+      channels(1),
+      queue_depth(32) {
+}
+
+SimDeviceOptions SimSSDOptions() {
+  SimDeviceOptions o;
+  o.seek_micros = 0;
+  o.rpm = 0;
+  o.read_latency_micros = 90;
+  o.write_latency_micros = 250;
+  o.read_mb_per_sec = 500;
+  o.write_mb_per_sec = 300;
+  o.channels = 8;
+  o.queue_depth = 32;
+  return o;
+}
+
+SimDevice::SimDevice(const SimDeviceOptions& options, FILE* trace)
+    : options_(options),
+      trace_(trace),
+      channel_free_(std::max(options.channels, 1), 0),
+      head_offset_(0),
+      ops_(0),
+      bytes_(0),
+      busy_micros_(0) {
+}
+
+SimDevice::~SimDevice() {
+  if (trace_ != NULL) {
+    fclose(trace_);
+  }
+}
+
+uint64_t SimDevice::ServiceMicros(char op, const std::string& fname,
+                                  uint64_t offset, size_t n) {
+  uint64_t t = (op == 'R') ? options_.read_latency_micros
+                           : options_.write_latency_micros;
+  if (op != 'S' && (fname != head_file_ || offset != head_offset_)) {
+    t += options_.seek_micros;
+    if (options_.rpm > 0) {
+      t += 30000000 / options_.rpm;  // Half a rotation
+    }
+  }
+  const int mb_per_sec = (op == 'R') ? options_.read_mb_per_sec
+                                     : options_.write_mb_per_sec;
+  if (n > 0 && mb_per_sec > 0) {
+    t += static_cast<uint64_t>(n * 1e6 / (mb_per_sec * 1048576.0));
+  }
+  if (op != 'S') {
+    head_file_ = fname;
+    head_offset_ = offset + n;
+  }
+  return t;
+}
+
+uint64_t SimDevice::Submit(char op, const std::string& fname,
+                           uint64_t offset, size_t n, uint64_t now) {
+  MutexLock l(&mu_);
+
+  // Requests completed by now no longer occupy a queue slot
+  while (!inflight_.empty() && *inflight_.begin() <= now) {
+    inflight_.erase(inflight_.begin());
+  }
+  uint64_t start = now;
+  if (options_.queue_depth > 0 &&
+      inflight_.size() >= static_cast<size_t>(options_.queue_depth)) {
+    std::multiset<uint64_t>::iterator it = inflight_.begin();
+    std::advance(it, inflight_.size() - options_.queue_depth);
+    start = *it;
+  }
+
+  std::vector<uint64_t>::iterator ch =
+      std::min_element(channel_free_.begin(), channel_free_.end());
+  start = std::max(start, *ch);
+  const uint64_t service = ServiceMicros(op, fname, offset, n);
+  const uint64_t done = start + service;
+  *ch = done;
+  inflight_.insert(done);
+
+  ops_++;
+  bytes_ += n;
+  busy_micros_ += service;
+  if (trace_ != NULL) {
+    fprintf(trace_, "%llu %c %s %llu %llu %llu\n",
+            static_cast<unsigned long long>(now), op, fname.c_str(),
+            static_cast<unsigned long long>(offset),
+            static_cast<unsigned long long>(n),
+            static_cast<unsigned long long>(done - now));
+  }
+  return done;
+}
+
+uint64_t SimDevice::ops() const {
+  MutexLock l(&mu_);
+  return ops_;
+}
+
+uint64_t SimDevice::bytes() const {
+  MutexLock l(&mu_);
+  return bytes_;
+}
+
+uint64_t SimDevice::busy_micros() const {
+  MutexLock l(&mu_);
+  return busy_micros_;
+}
+
+namespace {
+
+// Simulated time of one SimEnv: the real time since the env was created
+// plus the device time waited for so far.  Waiting moves the clock forward
+// instead of sleeping, so requests that overlap on the devices overlap in
+// simulated time too.  Starting from zero keeps the devices and traces of
+// a run independent of when it ran and of other SimEnvs in the process.
+class SimClock {
+ public:
+  explicit SimClock(Env* base)
+      : base_(base), start_(base->NowMicros()), skipped_(0) { }
+
+  uint64_t NowMicros() const { return Elapsed() + skipped_; }
+
+  void WaitUntil(uint64_t t) {
+    while (true) {
+      const uint64_t skipped = skipped_;
+      const uint64_t now = Elapsed() + skipped;
+      if (t <= now ||
+          __sync_bool_compare_and_swap(&skipped_, skipped, skipped + (t - now))) {
+        return;
+      }
+    }
+  }
+
+ private:
+  uint64_t Elapsed() const { return base_->NowMicros() - start_; }
+
+  Env* const base_;
+  const uint64_t start_;
+  volatile uint64_t skipped_;
+};
+
+// Charge a request to dev and, if wait is set, wait until it completes.
+static void Charge(SimClock* clock, SimDevice* dev, char op,
+                   const std::string& fname, uint64_t offset, size_t n,
+                   bool wait) {
+  const uint64_t now = clock->NowMicros();
+  const uint64_t done = dev->Submit(op, fname, offset, n, now);
+  if (wait) {
+    clock->WaitUntil(done);
+  }
+}
+
+class SimSequentialFile: public SequentialFile {
+ private:
+  SequentialFile* base_;
+  SimClock* clock_;
+  SimDevice* dev_;
+  std::string fname_;
+  uint64_t pos_;
+
+ public:
+  SimSequentialFile(SequentialFile* base, SimClock* clock, SimDevice* dev,
+                    const std::string& fname)
+      : base_(base), clock_(clock), dev_(dev), fname_(fname), pos_(0) { }
+  virtual ~SimSequentialFile() { delete base_; }
+
+  virtual Status Read(size_t n, Slice* result, char* scratch) {
+    Status s = base_->Read(n, result, scratch);
+    if (s.ok() && result->size() > 0) {
+      Charge(clock_, dev_, 'R', fname_, pos_, result->size(), true);
+      pos_ += result->size();
+    }
+    return s;
+  }
+
+  virtual Status Skip(uint64_t n) {
+    pos_ += n;
+    return base_->Skip(n);
+  }
+};
+
+class SimRandomAccessFile: public RandomAccessFile {
+ private:
+  RandomAccessFile* base_;
+  SimClock* clock_;
+  SimDevice* dev_;
+
+ public:
+  SimRandomAccessFile(RandomAccessFile* base, SimClock* clock, SimDevice* dev)
+      : base_(base), clock_(clock), dev_(dev) {
+    // Table::Open decides between the primary and secondary handle by name
+    filename_ = base->GetFileName();
+  }
+  virtual ~SimRandomAccessFile() { delete base_; }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const {
+    Status s = base_->Read(offset, n, result, scratch);
+    if (s.ok() && result->size() > 0) {
+      Charge(clock_, dev_, 'R', filename_, offset, result->size(), true);
+    }
+    return s;
+  }
+  virtual void Readahead(uint64_t offset, size_t n) const {
+    base_->Readahead(offset, n);
+  }
+};
+
+// Appends reach the device when the file is flushed, synced or closed.
+class SimWritableFile: public WritableFile {
+ private:
+  WritableFile* base_;
+  SimClock* clock_;
+  SimDevice* dev_;
+  SimDevice* mirror_;  // Non-NULL if the file is mirrored to this device
+  std::string fname_;
+  uint64_t written_;   // Bytes already charged
+  uint64_t pending_;   // Bytes appended since the last charge
+
+  void ChargePending() {
+    if (pending_ > 0) {
+      if (mirror_ != NULL) {
+        Charge(clock_, mirror_, 'W', fname_, written_, pending_, false);
+      }
+      Charge(clock_, dev_, 'W', fname_, written_, pending_, true);
+      written_ += pending_;
+      pending_ = 0;
+    }
+  }
+
+ public:
+  SimWritableFile(WritableFile* base, SimClock* clock, SimDevice* dev,
+                  SimDevice* mirror, const std::string& fname)
+      : base_(base), clock_(clock), dev_(dev), mirror_(mirror), fname_(fname),
+        written_(0), pending_(0) { }
+  virtual ~SimWritableFile() { delete base_; }
+
+  virtual Status Append(const Slice& data, bool delayed_buf_rest) {
+    pending_ += data.size();
+    return base_->Append(data, delayed_buf_rest);
+  }
+
+  virtual Status Close() {
+    ChargePending();
+    return base_->Close();
+  }
+
+  virtual Status Flush() {
+    ChargePending();
+    return base_->Flush();
+  }
+
+  virtual Status Sync() {
+    ChargePending();
+    Charge(clock_, dev_, 'S', fname_, written_, 0, true);
+    return base_->Sync();
+  }
+
+  virtual std::string GetFileName() { return base_->GetFileName(); }
+};
+
+class SimEnv : public EnvWrapper {
+ public:
+  SimEnv(Env* base_env, const SimDeviceOptions& primary,
+         const SimDeviceOptions& secondary, const std::string& trace_prefix)
+      : EnvWrapper(base_env),
+        clock_(base_env),
+        primary_(primary, OpenTrace(trace_prefix, ".primary")),
+        secondary_(secondary, OpenTrace(trace_prefix, ".secondary")) {
+  }
+
+  virtual uint64_t NowMicros() { return clock_.NowMicros(); }
+
+  virtual Status NewSequentialFile(const std::string& fname,
+                                   SequentialFile** result) {
+    SequentialFile* file;
+    Status s = target()->NewSequentialFile(fname, &file);
+    if (s.ok()) {
+      *result = new SimSequentialFile(file, &clock_, DeviceFor(fname),
+                                      hlsm::relocate_file(fname));
+    }
+    return s;
+  }
+
+  virtual Status NewRandomAccessFile(const std::string& fname,
+                                     RandomAccessFile** result) {
+    RandomAccessFile* file;
+    Status s = target()->NewRandomAccessFile(fname, &file);
+    if (s.ok()) {
+      *result = new SimRandomAccessFile(file, &clock_, DeviceFor(fname));
+    }
+    return s;
+  }
+
+  virtual Status NewWritableFile(const std::string& fname,
+                                 WritableFile** result) {
+    WritableFile* file;
+    Status s = target()->NewWritableFile(fname, &file);
+    if (s.ok()) {
+      const std::string actual = hlsm::relocate_file(fname);
+      SimDevice* dev = DeviceFor(fname);
+      SimDevice* mirror = NULL;
+      if (dev == &primary_ && hlsm::is_mirrored_write(actual)) {
+        mirror = &secondary_;
+      }
+      *result = new SimWritableFile(file, &clock_, dev, mirror, actual);
+    }
+    return s;
+  }
+
+ private:
+  static FILE* OpenTrace(const std::string& prefix, const char* suffix) {
+    if (prefix.empty()) {
+      return NULL;
+    }
+    std::string fname = prefix + suffix;
+    FILE* f = fopen(fname.c_str(), "w");
+    if (f == NULL) {
+      fprintf(stderr, "cannot open trace file %s\n", fname.c_str());
+    }
+    return f;
+  }
+
+  // Files are placed by the posix environment after relocation.  All
+  // secondary paths share one simulated device.
+  SimDevice* DeviceFor(const std::string& fname) {
+    if (hlsm::is_secondary_file(hlsm::relocate_file(fname))) {
+      return &secondary_;
+    }
+    return &primary_;
+  }
+
+  SimClock clock_;
+  SimDevice primary_;
+  SimDevice secondary_;
+};
+
+}  // namespace
+
+Env* NewSimEnv(Env* base_env,
+               const SimDeviceOptions& primary,
+               const SimDeviceOptions& secondary,
+               const std::string& trace_prefix) {
+  return new SimEnv(base_env, primary, secondary, trace_prefix);
+}
+
+}  // namespace leveldb
@@ -0,0 +1,113 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// An Env that keeps files on the underlying file system but charges every
+// file access to a simulated storage device, so that the hybrid modes can
+// be compared on a single machine.  Files under
+// hlsm::config::secondary_storage_path go to the secondary device and
+// everything else to the primary device.
+
+#ifndef STORAGE_LEVELDB_UTIL_ENV_SIM_H_
+#define STORAGE_LEVELDB_UTIL_ENV_SIM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <set>
+#include <string>
+#include <vector>
+#include "port/port.h"
+
+namespace leveldb {
+
+class Env;
+
+struct SimDeviceOptions {
+  // Average seek charged whenever an access does not continue the previous
+  // one on the device.  Zero for flash.
+  int seek_micros;
+
+  // Spindle speed.  Half a rotation is charged together with every seek.
+  // Zero for flash.
+  int rpm;
+
+  // Fixed per-request cost, e.g. controller and flash access time.
+  int read_latency_micros;
+  int write_latency_micros;
+
+  // Media transfer rate.
+  int read_mb_per_sec;
+  int write_mb_per_sec;
+
+  // Number of requests serviced in parallel (flash channels).
+  int channels;
+
+  // Maximum number of outstanding requests.  Later submitters wait for
+  // earlier requests to complete.
+  int queue_depth;
+
+  // A 7200rpm disk.
+  SimDeviceOptions();
+};
+
+// A flash device with 8 channels and slower writes than reads.
+extern SimDeviceOptions SimSSDOptions();
+
+// Timing model of one device.  Thread-safe.
+class SimDevice {
+ public:
+  // If trace is non-NULL, one line per request is appended to it:
+  //   <submit micros> <op> <file> <offset> <bytes> <latency micros>
+  SimDevice(const SimDeviceOptions& options, FILE* trace);
+  ~SimDevice();
+
+  // Reserve device time for a request submitted at "now" and return the
+  // time at which it completes.  op is 'R', 'W' or 'S' (sync).
+  uint64_t Submit(char op, const std::string& fname, uint64_t offset,
+                  size_t n, uint64_t now);
+
+  uint64_t ops() const;
+  uint64_t bytes() const;
+  uint64_t busy_micros() const;
+
+ private:
+  uint64_t ServiceMicros(char op, const std::string& fname,
+                         uint64_t offset, size_t n);
+
+  const SimDeviceOptions options_;
+  FILE* trace_;
+
+  mutable port::Mutex mu_;
+  std::vector<uint64_t> channel_free_;  // Time each channel becomes idle
+  std::multiset<uint64_t> inflight_;     // Completion time of queued requests
+  std::string head_file_;                // Position after the last request
+  uint64_t head_offset_;
+  uint64_t ops_;
+  uint64_t bytes_;
+  uint64_t busy_micros_;
+
+  // No copying allowed
+  SimDevice(const SimDevice&);
+  void operator=(const SimDevice&);
+};
+
+// Returns a new environment that stores files through base_env and delays
+// each read, write and sync by the time the simulated device holding the
+// file needs to service it.  The delay moves the clock of the environment
+// (NowMicros()) forward rather than sleeping, so runs take little more
+// than their CPU time; time the workload with this clock.  The clock of
+// each environment starts at zero.  Writes to
+// mirrored tables are additionally charged to the secondary device
+// without delaying the writer.  If
+// trace_prefix is non-empty, per-device traces are written to
+// <trace_prefix>.primary and <trace_prefix>.secondary.  The caller must
+// delete the result when it is no longer needed.
+// *base_env must remain live while the result is in use.
+extern Env* NewSimEnv(Env* base_env,
+                      const SimDeviceOptions& primary,
+                      const SimDeviceOptions& secondary,
+                      const std::string& trace_prefix);
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_UTIL_ENV_SIM_H_
@@ -0,0 +1,161 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/env_sim.h"
+
+#include "leveldb/env.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class SimDeviceTest { };
+
+TEST(SimDeviceTest, DiskSeeks) {
+  SimDeviceOptions options;
+  options.read_mb_per_sec = 0;
+  SimDevice disk(options, NULL);
+  const uint64_t seek = options.seek_micros + 30000000 / options.rpm;
+
+  // The first access and every jump pays a seek; sequential access does not
+  ASSERT_EQ(seek, disk.Submit('R', "a", 0, 4096, 0));
+  ASSERT_EQ(seek, disk.Submit('R', "a", 4096, 4096, seek));
+  ASSERT_EQ(2 * seek, disk.Submit('R', "b", 0, 4096, seek));
+  ASSERT_EQ(3 * seek, disk.Submit('R', "b", 0, 4096, 2 * seek));
+  ASSERT_EQ(4, disk.ops());
+  ASSERT_EQ(4 * 4096, disk.bytes());
+}
+
+TEST(SimDeviceTest, FlashChannels) {
+  SimDeviceOptions options = SimSSDOptions();
+  options.channels = 2;
+  options.write_mb_per_sec = 0;
+  SimDevice ssd(options, NULL);
+  const uint64_t w = options.write_latency_micros;
+
+  // Two requests proceed in parallel, the third waits for a channel
+  ASSERT_EQ(w, ssd.Submit('W', "a", 0, 100, 0));
+  ASSERT_EQ(w, ssd.Submit('W', "b", 0, 100, 0));
+  ASSERT_EQ(2 * w, ssd.Submit('W', "c", 0, 100, 0));
+  ASSERT_EQ(options.read_latency_micros + 2 * w,
+            ssd.Submit('R', "a", 0, 100, 2 * w));
+}
+
+TEST(SimDeviceTest, QueueDepth) {
+  SimDeviceOptions options = SimSSDOptions();
+  options.channels = 4;
+  options.queue_depth = 1;
+  options.read_mb_per_sec = 0;
+  SimDevice ssd(options, NULL);
+  const uint64_t r = options.read_latency_micros;
+
+  // Free channels do not help once the queue is full
+  ASSERT_EQ(r, ssd.Submit('R', "a", 0, 100, 0));
+  ASSERT_EQ(2 * r, ssd.Submit('R', "b", 0, 100, 0));
+  ASSERT_EQ(3 * r, ssd.Submit('R', "c", 0, 100, r + 10));
+}
+
+TEST(SimDeviceTest, Bandwidth) {
+  SimDeviceOptions options = SimSSDOptions();
+  options.read_latency_micros = 0;
+  options.read_mb_per_sec = 1;
+  SimDevice ssd(options, NULL);
+  ASSERT_EQ(1000000, ssd.Submit('R', "a", 0, 1048576, 0));
+  ASSERT_EQ(1000000, ssd.busy_micros());
+}
+
+TEST(SimDeviceTest, EnvCharges) {
+  std::string dir;
+  ASSERT_OK(Env::Default()->GetTestDirectory(&dir));
+  const std::string fname = dir + "/sim_env_file";
+  const std::string trace = dir + "/sim_env_trace";
+
+  Env* env = NewSimEnv(Env::Default(), SimSSDOptions(), SimSSDOptions(),
+                       trace);
+  WritableFile* wfile;
+  ASSERT_OK(env->NewWritableFile(fname, &wfile));
+  ASSERT_OK(wfile->Append("hello world"));
+  ASSERT_OK(wfile->Sync());
+  ASSERT_OK(wfile->Close());
+  delete wfile;
+
+  RandomAccessFile* rfile;
+  ASSERT_OK(env->NewRandomAccessFile(fname, &rfile));
+  char scratch[16];
+  Slice result;
+  ASSERT_OK(rfile->Read(6, 5, &result, scratch));
+  ASSERT_EQ("world", result.ToString());
+  delete rfile;
+  delete env;
+
+  // write, sync, read
+  std::string data;
+  ASSERT_OK(ReadFileToString(Env::Default(), trace + ".primary", &data));
+  int lines = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    if (data[i] == '\n') lines++;
+  }
+  ASSERT_EQ(3, lines);
+  ASSERT_OK(Env::Default()->DeleteFile(fname));
+  ASSERT_OK(Env::Default()->DeleteFile(trace + ".primary"));
+  ASSERT_OK(Env::Default()->DeleteFile(trace + ".secondary"));
+}
+
+TEST(SimDeviceTest, VirtualClock) {
+  std::string dir;
+  ASSERT_OK(Env::Default()->GetTestDirectory(&dir));
+  const std::string fname = dir + "/sim_env_clock";
+
+  // Reading the file takes a simulated second
+  SimDeviceOptions options = SimSSDOptions();
+  options.read_latency_micros = 0;
+  options.read_mb_per_sec = 1;
+  options.write_mb_per_sec = 1000;
+  Env* env = NewSimEnv(Env::Default(), options, options, "");
+  ASSERT_OK(WriteStringToFile(env, std::string(1048576, 'x'), fname));
+  RandomAccessFile* rfile;
+  ASSERT_OK(env->NewRandomAccessFile(fname, &rfile));
+  std::string scratch(1048576, '\0');
+  Slice result;
+  const uint64_t real_start = Env::Default()->NowMicros();
+  const uint64_t start = env->NowMicros();
+  ASSERT_OK(rfile->Read(0, 1048576, &result, &scratch[0]));
+  ASSERT_EQ(1048576, result.size());
+  ASSERT_TRUE(env->NowMicros() - start >= 1000000);
+  ASSERT_TRUE(Env::Default()->NowMicros() - real_start < 500000);
+  delete rfile;
+  delete env;
+  ASSERT_OK(Env::Default()->DeleteFile(fname));
+}
+
+TEST(SimDeviceTest, ClockPerEnv) {
+  std::string dir;
+  ASSERT_OK(Env::Default()->GetTestDirectory(&dir));
+  const std::string fname = dir + "/sim_env_clock";
+
+  // Time skipped by one env does not show in another
+  SimDeviceOptions options = SimSSDOptions();
+  options.read_latency_micros = 0;
+  options.read_mb_per_sec = 1;
+  Env* env = NewSimEnv(Env::Default(), options, options, "");
+  ASSERT_TRUE(env->NowMicros() < 500000);
+  ASSERT_OK(WriteStringToFile(env, std::string(1048576, 'x'), fname));
+  RandomAccessFile* rfile;
+  ASSERT_OK(env->NewRandomAccessFile(fname, &rfile));
+  std::string scratch(1048576, '\0');
+  Slice result;
+  ASSERT_OK(rfile->Read(0, 1048576, &result, &scratch[0]));
+  ASSERT_TRUE(env->NowMicros() >= 1000000);
+  Env* other = NewSimEnv(Env::Default(), options, options, "");
+  ASSERT_TRUE(other->NowMicros() < 500000);
+  delete other;
+  delete rfile;
+  delete env;
+  ASSERT_OK(Env::Default()->DeleteFile(fname));
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -97,6 +97,78 @@ TEST(EnvPosixTest, StartThread) {
   ASSERT_EQ(state.val, 3);
 }
 
+// Jobs that block until released, counting how many run at once
+struct Gate {
+  port::Mutex mu;
+  port::CondVar cv;
+  int running;
+  int released;
+  Gate() : cv(&mu), running(0), released(0) { }
+};
+
+static void BlockOnGate(void* arg) {
+  Gate* g = reinterpret_cast<Gate*>(arg);
+  g->mu.Lock();
+  g->running++;
+  while (g->released == 0) {
+    g->cv.Wait();
+  }
+  g->released--;
+  g->running--;
+  g->mu.Unlock();
+}
+
+static void ReleaseGate(Gate* g, int n) {
+  g->mu.Lock();
+  g->released += n;
+  g->cv.SignalAll();
+  g->mu.Unlock();
+}
+
+// Whether the number of jobs running reaches n within a second
+static bool WaitForRunning(Gate* g, int n) {
+  for (int i = 0; i < 100; i++) {
+    g->mu.Lock();
+    int running = g->running;
+    g->mu.Unlock();
+    if (running == n) {
+      return true;
+    }
+    Env::Default()->SleepForMicroseconds(10000);
+  }
+  return false;
+}
+
+TEST(EnvPosixTest, ResizePoolWhileBusy) {
+  const Env::Priority pri = Env::HIGH;
+  Gate gate;
+  for (int round = 0; round < 5; round++) {
+    env_->SetBackgroundThreads(3, pri);
+    for (int i = 0; i < 3; i++) env_->Schedule(&BlockOnGate, &gate, pri);
+    ASSERT_TRUE(WaitForRunning(&gate, 3));
+
+    // Regrow while surplus threads are still busy
+    env_->SetBackgroundThreads(1, pri);
+    ReleaseGate(&gate, 1);
+    ASSERT_TRUE(WaitForRunning(&gate, 2));
+    env_->SetBackgroundThreads(3, pri);
+    env_->Schedule(&BlockOnGate, &gate, pri);
+    ASSERT_TRUE(WaitForRunning(&gate, 3));
+    ReleaseGate(&gate, 3);
+    ASSERT_TRUE(WaitForRunning(&gate, 0));
+
+    // Shrinking keeps exactly the requested number of threads
+    env_->SetBackgroundThreads(2, pri);
+    for (int i = 0; i < 3; i++) env_->Schedule(&BlockOnGate, &gate, pri);
+    ASSERT_TRUE(WaitForRunning(&gate, 2));
+    Env::Default()->SleepForMicroseconds(kDelayMicros);
+    ASSERT_TRUE(WaitForRunning(&gate, 2));
+    ReleaseGate(&gate, 3);
+    ASSERT_TRUE(WaitForRunning(&gate, 0));
+  }
+  env_->SetBackgroundThreads(1, pri);
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
@@ -0,0 +1,246 @@
+#include "leveldb/hlsm_metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "port/port.h"
+#include "util/mutexlock.h"
+
+namespace hlsm {
+namespace metrics {
+
+namespace {
+
+struct MetricInfo {
+	const char* name;
+	Kind kind;
+};
+
+const MetricInfo kMetrics[kNumMetrics] = {
+#define HLSM_METRIC_INFO(id, kind, name) { name, kind },
+	HLSM_METRICS(HLSM_METRIC_INFO)
+#undef HLSM_METRIC_INFO
+};
+
+// Samples of one thread; aligned to a cache line so that two threads
+//	never write to the same line.
+struct Slot {
+	Stats stats[kNumMetrics];
+	IoStats io;
+	Slot* prev;
+	Slot* next;
+} __attribute__((aligned(64)));
+
+leveldb::port::Mutex slots_mu;	// guards the slot list, retired and the epoch
+Slot slots;			// list head
+Slot retired;			// samples of threads that have exited
+uint64_t epoch_ticks;		// Now() and the monotonic clock in ns when the
+uint64_t epoch_nanos;		//	first slot was made, to calibrate the ticks
+pthread_key_t slot_key;
+pthread_once_t once = PTHREAD_ONCE_INIT;
+__thread Slot* tls_slot = NULL;
+
+uint64_t MonotonicNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void Merge(Stats* to, const Stats& from) {
+	to->count += from.count;
+	to->sum += from.sum;
+	for (int b = 0; b < kNumBuckets; b++)
+		to->buckets[b] += from.buckets[b];
+}
+
+void MergeIo(IoStats* to, const IoStats& from) {
+	for (int d = 0; d < kMaxDevices; d++) {
+		for (int l = 0; l < kNumIoLevels; l++) {
+			for (int op = 0; op < kNumIoOps; op++) {
+				to->ops[d][l][op] += from.ops[d][l][op];
+				to->bytes[d][l][op] += from.bytes[d][l][op];
+			}
+		}
+		for (int op = 0; op < kNumIoOps; op++)
+			Merge(&to->latency[d][op], from.latency[d][op]);
+	}
+}
+
+// Keep what an exiting thread recorded
+void RetireSlot(void* arg) {
+	Slot* slot = reinterpret_cast<Slot*>(arg);
+	{
+		leveldb::MutexLock l(&slots_mu);
+		for (int m = 0; m < kNumMetrics; m++)
+			Merge(&retired.stats[m], slot->stats[m]);
+		MergeIo(&retired.io, slot->io);
+		slot->prev->next = slot->next;
+		slot->next->prev = slot->prev;
+	}
+	free(slot);
+}
+
+void InitSlots() {
+	memset(&retired, 0, sizeof(retired));
+	slots.prev = slots.next = &slots;
+	epoch_ticks = Now();
+	epoch_nanos = MonotonicNanos();
+	pthread_key_create(&slot_key, RetireSlot);
+}
+
+Slot* NewSlot() {
+	pthread_once(&once, InitSlots);
+	void* mem = NULL;
+	if (posix_memalign(&mem, 64, sizeof(Slot)) != 0) {
+		fprintf(stderr, "cannot allocate a metrics slot\n");
+		abort();
+	}
+	Slot* slot = reinterpret_cast<Slot*>(mem);
+	memset(slot, 0, sizeof(Slot));
+	{
+		leveldb::MutexLock l(&slots_mu);
+		slot->next = slots.next;
+		slot->prev = &slots;
+		slots.next->prev = slot;
+		slots.next = slot;
+	}
+	pthread_setspecific(slot_key, slot);
+	tls_slot = slot;
+	return slot;
+}
+
+inline Slot* ThisSlot() {
+	Slot* slot = tls_slot;
+	if (slot == NULL)
+		slot = NewSlot();
+	return slot;
+}
+
+inline Stats* ThisThread(Metric m) {
+	return &ThisSlot()->stats[m];
+}
+
+inline int Bucket(uint64_t ticks) {
+	int b = (ticks == 0) ? 0 : 63 - __builtin_clzll(ticks);
+	return (b < kNumBuckets) ? b : kNumBuckets - 1;
+}
+
+inline void Sample(Stats* stats, uint64_t ticks) {
+	stats->count++;
+	stats->sum += ticks;
+	stats->buckets[Bucket(ticks)]++;
+}
+
+} // namespace
+
+const char* Name(Metric m) {
+	return kMetrics[m].name;
+}
+
+Kind KindOf(Metric m) {
+	return kMetrics[m].kind;
+}
+
+void Record(Metric m, uint64_t ticks) {
+	Sample(ThisThread(m), ticks);
+}
+
+void Add(Metric m, uint64_t n) {
+	Stats* stats = ThisThread(m);
+	stats->count++;
+	stats->sum += n;
+}
+
+void Get(Metric m, Stats* stats) {
+	pthread_once(&once, InitSlots);
+	memset(stats, 0, sizeof(Stats));
+	leveldb::MutexLock l(&slots_mu);
+	Merge(stats, retired.stats[m]);
+	for (Slot* slot = slots.next; slot != &slots; slot = slot->next)
+		Merge(stats, slot->stats[m]);
+}
+
+double TicksPerMicro() {
+	pthread_once(&once, InitSlots);
+	const uint64_t nanos = MonotonicNanos() - epoch_nanos;
+	const uint64_t ticks = Now() - epoch_ticks;
+	if (nanos < 1000 || ticks == 0)
+		return 1000;	// assume 1GHz until a microsecond has passed
+	return ticks * 1000.0 / nanos;
+}
+
+double Percentile(const Stats& stats, double p) {
+	if (stats.count == 0)
+		return 0;
+	const double threshold = stats.count * p / 100.0;
+	uint64_t seen = 0;
+	int b = 0;
+	for (; b < kNumBuckets - 1; b++) {
+		seen += stats.buckets[b];
+		if (seen >= threshold)
+			break;
+	}
+	// report the upper bound of the bucket
+	return static_cast<double>(2ULL << b) / TicksPerMicro();
+}
+
+void Report(std::string* out) {
+	const double tpm = TicksPerMicro();
+	char buf[256];
+	for (int i = 0; i < kNumMetrics; i++) {
+		const Metric m = static_cast<Metric>(i);
+		Stats stats;
+		Get(m, &stats);
+		if (stats.count == 0)
+			continue;
+		if (KindOf(m) == kLatency) {
+			snprintf(buf, sizeof(buf),
+					"%-46s count %10llu avg %10.2f us p50 %10.2f p99 %10.2f p99.9 %10.2f\n",
+					Name(m), (unsigned long long) stats.count,
+					stats.sum / tpm / stats.count, Percentile(stats, 50),
+					Percentile(stats, 99), Percentile(stats, 99.9));
+		} else {
+			snprintf(buf, sizeof(buf), "%-46s count %10llu sum %16llu\n",
+					Name(m), (unsigned long long) stats.count,
+					(unsigned long long) stats.sum);
+		}
+		out->append(buf);
+	}
+}
+
+// Threads may record while the slots are cleared; their samples are lost
+void Reset() {
+	pthread_once(&once, InitSlots);
+	leveldb::MutexLock l(&slots_mu);
+	memset(retired.stats, 0, sizeof(retired.stats));
+	memset(&retired.io, 0, sizeof(retired.io));
+	for (Slot* slot = slots.next; slot != &slots; slot = slot->next) {
+		memset(slot->stats, 0, sizeof(slot->stats));
+		memset(&slot->io, 0, sizeof(slot->io));
+	}
+}
+
+void RecordIo(int device, int level, IoOp op, uint64_t bytes, uint64_t start) {
+	if (device >= kMaxDevices)
+		device = kMaxDevices - 1;
+	if (level < 0 || level >= kNumIoLevels)
+		level = kUnleveledIoLevel;
+	IoStats* io = &ThisSlot()->io;
+	io->ops[device][level][op]++;
+	io->bytes[device][level][op] += bytes;
+	if (start != 0)
+		Sample(&io->latency[device][op], Now() - start);
+}
+
+void GetIo(IoStats* stats) {
+	pthread_once(&once, InitSlots);
+	memset(stats, 0, sizeof(IoStats));
+	leveldb::MutexLock l(&slots_mu);
+	MergeIo(stats, retired.io);
+	for (Slot* slot = slots.next; slot != &slots; slot = slot->next)
+		MergeIo(stats, slot->io);
+}
+
+} // metrics
+} // hlsm
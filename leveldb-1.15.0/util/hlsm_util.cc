@@ -8,16 +8,23 @@
 #include <unistd.h>        // close
 #include <sys/stat.h>      // fstat
 #include <sys/types.h>     // fstat
+#include <sys/ioctl.h>     // FICLONE
+#include <sys/syscall.h>   // copy_file_range
+#include <sys/statvfs.h>   // statvfs
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
 
 #include "leveldb/hlsm.h"
 #include "leveldb/slice.h"
 #include "leveldb/status.h"
 #include "leveldb/env.h"
 #include "leveldb/table.h"
+#include "db/filename.h"
+#include "util/mutexlock.h"
 
 #define USE_OPQ hlsm::runtime::use_opq_thread
 #define SSPATH hlsm::config::secondary_storage_path
-#define OPQ_HELPER hlsm::runtime::opq_helper
 #define OPQ hlsm::runtime::op_queue
 #define HOPQ hlsm::runtime::hop_queue
 
@@ -33,148 +40,473 @@ static Status IOError(const std::string& context, int err_number) {
   return Status::IOError(context, strerror(err_number));
 }
 
-int copy_file(const char *dst, const char *src){
-	int source = open(src, O_RDONLY, S_IRUSR);
-	int dest = open(dst, O_WRONLY | O_CREAT /*| O_TRUNC/**/, 0644);
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// The table is cold once it moves down, so neither copy is kept in the
+//	page cache.
+Status migrate_table(const std::string& src, const std::string& dst,
+		uint64_t fnum) {
+	int sfd = open(src.c_str(), O_RDONLY);
+	if (sfd < 0) {
+		return IOError(src, errno);
+	}
+	// readers may hold an older, mirrored copy of dst open, so the new copy
+	//	only replaces it once complete
+	const std::string tmp = leveldb::TempFileName(dst.substr(0, dst.find_last_of("/")), fnum);
+	int dfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dfd < 0) {
+		Status s = IOError(tmp, errno);
+		close(sfd);
+		return s;
+	}
 
-	assert(source >= 0 || dest >= 0);
-	// struct required, rationale: function stat() exists also
-	struct stat stat_source;
-	fstat(source, &stat_source);
-	ssize_t copied = sendfile(dest, source, 0, stat_source.st_size);
+	Status s;
+	struct stat sstat, dstat;
+	if (fstat(sfd, &sstat) != 0 || fstat(dfd, &dstat) != 0) {
+		s = IOError(src, errno);
+	}
+	const uint64_t size = s.ok() ? sstat.st_size : 0;
+	const bool same_fs = s.ok() && sstat.st_dev == dstat.st_dev;
+	runtime::placement.update_migration(fnum, 0, size);
 
-	close(source);
-	close(dest);
+	uint64_t copied = 0;
+	if (same_fs && ioctl(dfd, FICLONE, sfd) == 0) {
+		copied = size; // the copy shares the extents of the source
+	}
 
-	return copied;
+	// copy_file_range() keeps the data in the kernel and may be offloaded by
+	//	the file system; sendfile() serves the other cases
+	bool use_range = same_fs;
+	const size_t chunk = std::max(hlsm::config::migration_chunk_size, BLKSIZE);
+	const IoAccount from(io_device(src), fnum), to(io_device(dst), fnum);
+	posix_fadvise(sfd, 0, size, POSIX_FADV_SEQUENTIAL);
+	while (s.ok() && copied < size) {
+		const size_t n = std::min(static_cast<uint64_t>(chunk), size - copied);
+		const uint64_t start = metrics::IoStart();
+		ssize_t r = -1;
+#ifdef SYS_copy_file_range
+		if (use_range) {
+			r = syscall(SYS_copy_file_range, sfd, NULL, dfd, NULL, n, 0);
+			if (r < 0 && (errno == ENOSYS || errno == EXDEV ||
+					errno == EINVAL || errno == EOPNOTSUPP)) {
+				use_range = false;
+			}
+		}
+#else
+		use_range = false;
+#endif
+		if (!use_range) {
+			r = sendfile(dfd, sfd, NULL, n);
+		}
+		if (r < 0) {
+			if (errno != EINTR) {
+				s = IOError(tmp, errno);
+			}
+			continue;
+		} else if (r == 0) {
+			s = Status::IOError(src, "file shrank during migration");
+			break;
+		}
+
+		// start the write-back of the chunk, drop what we have read
+		sync_file_range(dfd, copied, r, SYNC_FILE_RANGE_WRITE);
+		posix_fadvise(sfd, copied, r, POSIX_FADV_DONTNEED);
+		from.record(metrics::kIoRead, r, 0);	// the copy is timed as a write
+		to.record(metrics::kIoWrite, r, start);
+		copied += r;
+		runtime::placement.update_migration(fnum, copied, size);
+		HLSM_COUNT(metrics::kMigratedBytes, r);
+		if (runtime::migration_throttler != NULL) {
+			runtime::migration_throttler->add(r);
+			runtime::migration_throttler->throttle();
+		}
+	}
+
+	if (s.ok()) {
+		const uint64_t start = metrics::IoStart();
+		if (fsync(dfd) != 0) {
+			s = IOError(tmp, errno);
+		}
+		to.record(metrics::kIoSync, 0, start);
+	}
+	if (s.ok()) {
+		posix_fadvise(dfd, 0, size, POSIX_FADV_DONTNEED); // clean pages only
+	}
+	close(sfd);
+	if (close(dfd) != 0 && s.ok()) {
+		s = IOError(tmp, errno);
+	}
+	if (s.ok() && rename(tmp.c_str(), dst.c_str()) != 0) {
+		s = IOError(dst, errno);
+	}
+	if (!s.ok()) {
+		unlink(tmp.c_str());
+	}
+	return s;
+}
+
+// Helpers run on the Env's IO pool.  A helper is scheduled by OPQ_ADD()
+// whenever it is not already running and returns once its queues are
+// empty, so each queue is drained by at most one helper and its ops keep
+// their order.  Helper 0 serves op_queue and hop_queue; with several
+// secondary paths, helper k serves device_queues[k-1], so that the devices
+// copy and write in parallel.
+static pthread_mutex_t helper_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t helper_idle = PTHREAD_COND_INITIALIZER;
+static std::vector<char> helper_scheduled(1, 0);
+
+static bool helper_has_work(int h) {
+	if (h == 0) {
+		return OPQ_NONEMPTY(HOPQ) || OPQ_NONEMPTY(OPQ);
+	}
+	return OPQ_NONEMPTY(runtime::device_queues[h - 1]);
 }
 
-static void *opq_helper(void * arg) {
-	opq op_queue = (opq) arg;
+static void opq_helper(void * arg) {
+	const int h = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+	opq q = (h == 0) ? OPQ : runtime::device_queues[h - 1];
 	mio_op op;
 	leveldb::WritableFile *sfp;
 	int c = 0;
 
-	DEBUG_INFO(1, "Start OPQ Helper\tQueue: %p\n", op_queue);
+	DEBUG_INFO(1, "Start OPQ Helper %d\tQueue: %p\n", h, q);
 	while(1) {
-		if (OPQ_NONEMPTY(op_queue) || OPQ_NONEMPTY(HOPQ) ) {
-
-			if (OPQ_NONEMPTY(HOPQ)) { //get operation first from high priority queue
-				OPQ_POP(HOPQ, op);
-			} else {
-				OPQ_POP(op_queue, op);
+		if (h == 0 && OPQ_NONEMPTY(HOPQ)) { //get operation first from high priority queue
+			OPQ_POP(HOPQ, op);
+		} else if (OPQ_NONEMPTY(q)) {
+			OPQ_POP(q, op);
+		} else {
+			// Re-check under helper_mu: an OPQ_ADD() that raced with us
+			// either is visible here or finds helper_scheduled cleared.
+			pthread_mutex_lock(&helper_mu);
+			if (!helper_has_work(h)) {
+				helper_scheduled[h] = 0;
+				pthread_cond_broadcast(&helper_idle);
+				pthread_mutex_unlock(&helper_mu);
+				break;
 			}
+			pthread_mutex_unlock(&helper_mu);
+			continue;
+		}
 
-			DEBUG_INFO(3, "OPQ POP\ttype: %d\top: %p\n", op->type, op);
-
-			if (op->type == MSync) {
-				sfp = (WritableFile*) op->ptr1;	//file handler
-				Status s = sfp->Sync();
-				DEBUG_INFO(3, "MSync\tfp: %p\tstatus: %s\n", sfp, s.ToString().c_str());
-
-			} else if (op->type == MBufSync) {
-				char* buf = (char*) op->ptr1;	//buffer to sync
-				size_t size = op->size;	//buffer size
-				int fd = op->fd;	//file descriptor
-				uint64_t offset = op->offset;	//corresponding offset
-				ssize_t ret = pwrite(fd, buf, size, offset);
-				free(buf);
-
-			} else if (op->type == MDeleteStrBuffer) {
-				std::string* buf = (std::string*) op->ptr1;	//buffer to sync
-				DEBUG_INFO(3, "MDeleteStrBuffer, size = %lu\n", buf->size());
-				delete buf;
-
-			} else if (op->type == MBufClose) {
-				FILE * fp = (FILE *) op->ptr1;
-				std::string *fname = (std::string*) (op->ptr2);
-				runtime::FileNameHash::drop(*fname);
-				assert(fclose(fp) == 0);
-				DEBUG_INFO(2, "MBufClose\tfp: %p\n", fp);
-				delete fname;
-
-			} else if (op->type == MTruncate) {
-				size_t size = op->size;	//file size
-				int fd = op->fd;	//file descriptor
-				int ret = ftruncate(fd, size);
-
-			} else if (op->type == MAppend) {
-				sfp = (WritableFile*) op->ptr1;	//file handler
-				Status s = sfp->Append(*((const Slice *) op->ptr2));
-				free((void*) (((const Slice *) op->ptr2)->data() ));	//it is malloc-ed
-				delete ((Slice *) op->ptr2);
-				DEBUG_INFO(3, "MAppend\tsize: %ld\tstatus: %s\n", ((const Slice *) op->ptr2)->size(), s.ToString().c_str());
-
-			} else if (op->type == MAppendOnly) {
-				sfp = (WritableFile*) op->ptr1;	//file handler
-				Status s = sfp->Append((const Slice &) op->slice);
-				DEBUG_INFO(3, "MAppendOnly\tsize: %ld\tstatus: %s\n", ((const Slice &) op->slice).size(), s.ToString().c_str());
-
-			} else if (op->type == MClose) {
-				sfp = (WritableFile *) op->ptr1;	//file handler
-				Status s = sfp->Close();
-				DEBUG_INFO(2, "MClose\t%s\top: %p\tstatus: %s\n", 
-					sfp->GetFileName().c_str(), op, s.ToString().c_str());
-				delete sfp;
-
-			} else if (op->type == MIterPrefetch) {
-				Iterator* iter = (Iterator* ) op->ptr1;	//file handler
-				ReadOptions* opt = (ReadOptions*) op->ptr2;
-				DEBUG_INFO(2, "MIterPrefetch\n");
-				for (iter->SeekToFirst(); iter->Valid(); iter->Next() ) ;
-				delete iter;
-				delete opt;
-
-			} else if (op->type == MRawPrefetch) {
-				RandomAccessFile* file = (RandomAccessFile*) op->ptr1;	//file handler
-				uint64_t fsize = (uint64_t) op->lu_int;
-				DEBUG_INFO(2, "MRawPrefetch, file_size = %lu\n", fsize);
-				Table::PrefetchTable(file, fsize);
-
-			} else if (op->type == MDelete) {
-				std::string *fname = (std::string*) (op->ptr1);
-				int ret = unlink(fname->c_str());
-				DEBUG_INFO(2, "MDelete\tfname: %s\n", fname->c_str());
-				delete fname;
-
-			} else if (op->type == MCopyFile) {
-				std::string *fname = (std::string*) (op->ptr1);
-				std::string sfname = PRIMARY_TO_SECONDARY_FILE((*fname));
-				bool file_exists = hlsm::runtime::env_->FileExists(sfname);
-				DEBUG_INFO(2, "MCopyFile\tfname: %s, exists: %d\n", fname->c_str(), file_exists);
-				if(!file_exists || hlsm::config::force_file_copy) {
-					assert(copy_file(sfname.c_str(), fname->c_str()) > 0);
-				}
-				uint64_t fnum = op->offset; // just for convenience
-				delete fname;
-				hlsm::runtime::moving_tables_.erase(fnum);
-
-			} else if (op->type == MHalt) {
-				DEBUG_INFO(2, "MHalt\t#elem in Queue: %lu\n", OPQ_GET_LENGTH(op_queue));
-				if (OPQ_GET_LENGTH(op_queue) == 0) { //due to multi-threading, it may not be empty
-					free(op);
-					break;
-				} else {
-					OPQ_ADD_HALT(hlsm::runtime::op_queue);
+		DEBUG_INFO(3, "OPQ POP\ttype: %d\top: %p\n", op->type, op);
+		DEBUG_INFO(3, "Helper Count: %d\n", c++);
+		if (op->type == MSync) {
+			sfp = (WritableFile*) op->ptr1;	//file handler
+			Status s = sfp->Sync();
+			DEBUG_INFO(3, "MSync\tfp: %p\tstatus: %s\n", sfp, s.ToString().c_str());
+
+		} else if (op->type == MBufSync) {
+			char* buf = (char*) op->ptr1;	//buffer to sync
+			size_t size = op->size;	//buffer size
+			int fd = op->fd;	//file descriptor
+			uint64_t offset = op->offset;	//corresponding offset
+			uint64_t fnum = op->lu_int;	//table number
+			const uint64_t start = metrics::IoStart();
+			ssize_t ret = pwrite(fd, buf, size, offset);
+			IoAccount(secondary_io_device(fnum), fnum).record(metrics::kIoWrite,
+					(ret < 0) ? 0 : ret, start);
+			free(buf);
+
+		} else if (op->type == MDeleteStrBuffer) {
+			std::string* buf = (std::string*) op->ptr1;	//buffer to sync
+			DEBUG_INFO(3, "MDeleteStrBuffer, size = %lu\n", buf->size());
+			delete buf;
+
+		} else if (op->type == MBufClose) {
+			FILE * fp = (FILE *) op->ptr1;
+			std::string *fname = (std::string*) (op->ptr2);
+			int ret = fclose(fp);
+			runtime::placement.end_secondary_write(table_name_to_number(*fname));
+			assert(ret == 0);
+			DEBUG_INFO(2, "MBufClose\tfp: %p\n", fp);
+			delete fname;
+
+		} else if (op->type == MTruncate) {
+			size_t size = op->size;	//file size
+			int fd = op->fd;	//file descriptor
+			int ret = ftruncate(fd, size);
+
+		} else if (op->type == MAppend) {
+			sfp = (WritableFile*) op->ptr1;	//file handler
+			Status s = sfp->Append(*((const Slice *) op->ptr2));
+			free((void*) (((const Slice *) op->ptr2)->data() ));	//it is malloc-ed
+			delete ((Slice *) op->ptr2);
+			DEBUG_INFO(3, "MAppend\tsize: %ld\tstatus: %s\n", ((const Slice *) op->ptr2)->size(), s.ToString().c_str());
+
+		} else if (op->type == MAppendOnly) {
+			sfp = (WritableFile*) op->ptr1;	//file handler
+			Status s = sfp->Append((const Slice &) op->slice);
+			DEBUG_INFO(3, "MAppendOnly\tsize: %ld\tstatus: %s\n", ((const Slice &) op->slice).size(), s.ToString().c_str());
+
+		} else if (op->type == MClose) {
+			sfp = (WritableFile *) op->ptr1;	//file handler
+			Status s = sfp->Close();
+			DEBUG_INFO(2, "MClose\t%s\top: %p\tstatus: %s\n", 
+				sfp->GetFileName().c_str(), op, s.ToString().c_str());
+			if (!hlsm::config::secondary_use_buffer_file) { // otherwise done by MBufClose
+				runtime::placement.end_secondary_write(table_name_to_number(sfp->GetFileName()));
+			}
+			delete sfp;
+
+		} else if (op->type == MRawPrefetch) {
+			RandomAccessFile* file = (RandomAccessFile*) op->ptr1;	//file handler
+			uint64_t fsize = (uint64_t) op->lu_int;
+			DEBUG_INFO(2, "MRawPrefetch, file_size = %lu\n", fsize);
+			Table::PrefetchTable(file, fsize);
+
+		} else if (op->type == MDelete) {
+			std::string *fname = (std::string*) (op->ptr1);
+			int ret = unlink(fname->c_str());
+			DEBUG_INFO(2, "MDelete\tfname: %s\n", fname->c_str());
+			delete fname;
+
+		} else if (op->type == MCopyFile) {
+			std::string *fname = (std::string*) (op->ptr1);
+			std::string sfname = PRIMARY_TO_SECONDARY_FILE((*fname));
+			bool file_exists = hlsm::runtime::env_->FileExists(sfname);
+			DEBUG_INFO(2, "MCopyFile\tfname: %s, exists: %d\n", fname->c_str(), file_exists);
+			uint64_t fnum = op->offset; // just for convenience
+			Status s;
+			if(!file_exists || hlsm::config::force_file_copy) {
+				s = migrate_table(*fname, sfname, fnum);
+				if (!s.ok()) {
+					fprintf(stderr, "MCopyFile %s: %s\n", fname->c_str(), s.ToString().c_str());
 				}
 			}
+			delete fname;
+			hlsm::runtime::placement.end_migration(fnum, s.ok());
 
-			free(op);
-			continue;
 		}
 
-		OPQ_WAIT(op_queue);
-		DEBUG_INFO(3, "Helper Count: %d\n", c++);
+		free(op);
 	} // while(1)
 
-	DEBUG_INFO(1, "Stop OPQ Helper\tQueue: %p\n", op_queue);
-  return NULL;
+	DEBUG_INFO(1, "Stop OPQ Helper %d\tQueue: %p\n", h, q);
+}
+
+void schedule_opq_helper(int h) {
+	pthread_mutex_lock(&helper_mu);
+	if (!helper_scheduled[h]) {
+		helper_scheduled[h] = 1;
+		hlsm::runtime::env_->Schedule(&opq_helper, reinterpret_cast<void*>(h),
+				leveldb::Env::IO);
+	}
+	pthread_mutex_unlock(&helper_mu);
+}
+
+void wait_opq_helper() {
+	pthread_mutex_lock(&helper_mu);
+	while (std::find(helper_scheduled.begin(), helper_scheduled.end(), 1)
+			!= helper_scheduled.end()) {
+		pthread_cond_wait(&helper_idle, &helper_mu);
+	}
+	pthread_mutex_unlock(&helper_mu);
 }
 
 int init_opq_helpler() {
-	hlsm::runtime::hop_queue = OPQ_MALLOC;
-	OPQ_INIT(hlsm::runtime::hop_queue);
-	INIT_HELPER_AND_QUEUE(OPQ_HELPER, OPQ);
+	if (OPQ == NULL) {
+		OPQ = OPQ_MALLOC;
+		OPQ_INIT(OPQ);
+		HOPQ = OPQ_MALLOC;
+		OPQ_INIT(HOPQ);
+	}
+	// Queues are never freed; paths added by a later open get new ones
+	const size_t paths = runtime::secondary_paths.size();
+	pthread_mutex_lock(&helper_mu);
+	while (paths > 1 && runtime::device_queues.size() < paths) {
+		opq q = OPQ_MALLOC;
+		OPQ_INIT(q);
+		q->helper = runtime::device_queues.size() + 1;
+		runtime::device_queues.push_back(q);
+		helper_scheduled.push_back(0);
+	}
+	pthread_mutex_unlock(&helper_mu);
+	return 0;
+}
+
+/*
+ * Secondary paths
+ */
+
+void init_secondary_paths() {
+	if (SSPATH == NULL) {
+		runtime::secondary_paths.clear();
+		return;
+	}
+	if (!runtime::secondary_paths.empty() &&
+			SSPATH == runtime::secondary_paths[0].c_str()) {
+		return; // already split by an earlier open
+	}
+	runtime::secondary_paths.clear();
+	const std::string list(SSPATH);
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos) end = list.size();
+		if (end > start) {
+			runtime::secondary_paths.push_back(list.substr(start, end - start));
+		}
+		start = end + 1;
+	}
+	if (runtime::secondary_paths.empty()) {
+		runtime::secondary_paths.push_back(list);
+	}
+	SSPATH = runtime::secondary_paths[0].c_str();
+}
+
+// Free bytes per queued operation, so that a busy device is passed over
+//	until it drains and an idle one fills up evenly with its peers
+static double stripe_score(int stripe) {
+	struct statvfs st;
+	double free_bytes = 0;
+	if (statvfs(runtime::secondary_paths[stripe].c_str(), &st) == 0) {
+		free_bytes = static_cast<double>(st.f_bavail) * st.f_frsize;
+	}
+	const size_t queued = runtime::device_queues.empty() ? 0
+			: OPQ_GET_LENGTH(runtime::device_queues[stripe]);
+	return free_bytes / (1.0 + queued);
+}
+
+int secondary_stripe(uint64_t fnum) {
+	const int n = runtime::secondary_paths.size();
+	if (n <= 1) {
+		return 0;
+	}
+	int stripe = runtime::placement.stripe(fnum);
+	if (stripe >= 0) {
+		return stripe;
+	}
+
+	// Opened before the table was placed in this run
+	for (int i = 0; i < n; i++) {
+		std::string fname = leveldb::TableFileName(runtime::secondary_paths[i], fnum);
+		if (access(fname.c_str(), F_OK) == 0) {
+			return runtime::placement.assign_stripe(fnum, i);
+		}
+	}
+
+	// Ties go round robin, so equal devices take turns
+	static volatile uint32_t next = 0;
+	const int first = __sync_fetch_and_add(&next, 1) % n;
+	double best_score = -1;
+	for (int k = 0; k < n; k++) {
+		const int i = (first + k) % n;
+		const double score = stripe_score(i);
+		if (score > best_score) {
+			best_score = score;
+			stripe = i;
+		}
+	}
+	return runtime::placement.assign_stripe(fnum, stripe);
+}
+
+std::string secondary_table_file(uint64_t fnum) {
+	if (runtime::secondary_paths.size() <= 1) {
+		return leveldb::TableFileName(SSPATH, fnum);
+	}
+	return leveldb::TableFileName(runtime::secondary_paths[secondary_stripe(fnum)], fnum);
+}
+
+std::string secondary_file(const std::string& fname) {
+	if (runtime::secondary_paths.size() > 1 && FILE_HAS_SUFFIX(fname, ".ldb")) {
+		return secondary_table_file(table_name_to_number(fname));
+	}
+	return std::string(SSPATH) + fname.substr(fname.find_last_of("/"));
+}
+
+// Whether fname is dir or lies under it; "/ssd1" does not hold "/ssd10/x"
+static bool in_dir(const std::string& fname, const std::string& dir) {
+	if (fname.compare(0, dir.size(), dir) != 0) {
+		return false;
+	}
+	return fname.size() == dir.size() || fname[dir.size()] == '/' ||
+			(!dir.empty() && dir[dir.size() - 1] == '/');
+}
+
+bool is_secondary_file(const std::string& fname) {
+	for (size_t i = 0; i < runtime::secondary_paths.size(); i++) {
+		if (in_dir(fname, runtime::secondary_paths[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int io_device(const std::string& fname) {
+	for (size_t i = 0; i < runtime::secondary_paths.size(); i++) {
+		if (in_dir(fname, runtime::secondary_paths[i])) {
+			return 1 + i;
+		}
+	}
+	return 0;
+}
+
+IoAccount::IoAccount(const std::string& fname)
+	: device_(io_device(fname)), fnum_(0), level_(metrics::kMetaIoLevel) {
+	if (FILE_HAS_SUFFIX(fname, ".ldb") || FILE_HAS_SUFFIX(fname, ".sst")) {
+		fnum_ = table_name_to_number(fname);
+	} else if (FILE_HAS_SUFFIX(fname, ".log")) {
+		level_ = metrics::kLogIoLevel;
+	}
+}
+
+IoAccount::IoAccount(int device, uint64_t fnum)
+	: device_(device), fnum_(fnum), level_(metrics::kMetaIoLevel) {
+}
+
+void IoAccount::record(metrics::IoOp op, uint64_t bytes, uint64_t start) const {
+	const int level = (fnum_ == 0) ? level_ : runtime::placement.level(fnum_);
+	metrics::RecordIo(device_, level, op, bytes, start);
+}
+
+opq table_queue(uint64_t fnum) {
+	if (runtime::device_queues.empty()) {
+		return OPQ;
+	}
+	return runtime::device_queues[secondary_stripe(fnum)];
+}
+
+uint64_t secondary_free_bytes() {
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < runtime::secondary_paths.size(); i++) {
+		struct statvfs st;
+		if (statvfs(runtime::secondary_paths[i].c_str(), &st) == 0) {
+			bytes += static_cast<uint64_t>(st.f_bavail) * st.f_frsize;
+		}
+	}
+	return bytes;
+}
+
+/*
+ * Ending two-phase compaction one level earlier turns the deltas of the
+ *	end level into one mirrored copy per table, which frees secondary space
+ *	and spares lookups the probes into the deltas.  Ending it later keeps
+ *	the compactions of one more level off the secondary.  Space comes
+ *	first; read heat and mirrored writes only decide between the two while
+ *	the secondary stays within its watermarks.
+ */
+int tune_two_phase_end_level(const LevelTuning& t) {
+	const double high = t.capacity * config::secondary_high_watermark;
+	const double low = t.capacity * config::secondary_low_watermark;
+	const bool can_shrink = t.level > 1 && t.shrink_gain > 0;
+	const bool can_extend = t.level < runtime::kMaxTwoPhaseEndLevel;
+	// most lookups that probe several tables start in the end level's deltas
+	const bool hot_deltas = t.seeks > 0 && t.delta_seeks * 2 > t.seeks;
+	// at least half of the background writes also go to the secondary
+	const bool write_heavy = t.write_bytes > 0 && t.mirror_bytes * 2 >= t.write_bytes;
+
+	if (t.used > high) {
+		return can_shrink ? -1 : 0;
+	}
+	if (hot_deltas && !write_heavy) {
+		return can_shrink ? -1 : 0;
+	}
+	if (write_heavy && !hot_deltas && can_extend && t.used + t.extend_cost <= low) {
+		return 1;
+	}
 	return 0;
 }
 
@@ -183,10 +515,11 @@ class PosixWritableFile : public leveldb::WritableFile {
  private:
   std::string filename_;
   FILE* file_;
+  IoAccount io_;
 
  public:
   PosixWritableFile(const std::string& fname, FILE* f)
-      : filename_(fname), file_(f) { }
+      : filename_(fname), file_(f), io_(fname) { }
 
   ~PosixWritableFile() {
     if (file_ != NULL) {
@@ -196,7 +529,9 @@ class PosixWritableFile : public leveldb::WritableFile {
   }
 
   virtual Status Append(const Slice& data, bool delayed_buf_reset = false) {
+    const uint64_t start = metrics::IoStart();
     size_t r = fwrite_unlocked(data.data(), 1, data.size(), file_);
+    io_.record(metrics::kIoWrite, r, start);
     if (r != data.size()) {
       return IOError(filename_, errno);
     }
@@ -212,6 +547,8 @@ class PosixWritableFile : public leveldb::WritableFile {
     return result;
   }
 
+  virtual std::string GetFileName() { return filename_; }
+
   virtual Status Flush() {
     if (fflush_unlocked(file_) != 0) {
       return IOError(filename_, errno);
@@ -252,10 +589,12 @@ class PosixWritableFile : public leveldb::WritableFile {
     if (!s.ok()) {
       return s;
     }
+    const uint64_t start = metrics::IoStart();
     if (fflush_unlocked(file_) != 0 ||
         fdatasync(fileno(file_)) != 0) {
       s = Status::IOError(filename_, strerror(errno));
     }
+    io_.record(metrics::kIoSync, 0, start);
     return s;
   }
 };
@@ -264,7 +603,7 @@ class PosixWritableFile : public leveldb::WritableFile {
 
 PosixBufferFile::PosixBufferFile(const std::string& fname, FILE* f)
  	 : filename_(fname), file_(f),
-       file_offset_(0){
+       file_offset_(0), number_(table_name_to_number(fname)) {
 		buffer_size_ = 4<<20;
 		base_ = (char*) memalign(BLKSIZE, buffer_size_);
 		dst_ = base_;
@@ -293,7 +632,7 @@ PosixBufferFile::~PosixBufferFile() {
       assert(dst_ <= limit_);
       size_t avail = limit_ - dst_;
       if (avail == 0) {
-    	  OPQ_ADD_BUF_SYNC(OPQ, base_, dst_-base_, fd_, file_offset_);
+    	  OPQ_ADD_BUF_SYNC(table_queue(number_), base_, dst_-base_, fd_, file_offset_, number_);
     	  file_offset_ += limit_ - base_;
     	  base_ = (char*) memalign(BLKSIZE,buffer_size_);
     	  dst_ = base_;
@@ -312,9 +651,10 @@ PosixBufferFile::~PosixBufferFile() {
 
   Status PosixBufferFile::Close() {
     Status s;
-    OPQ_ADD_BUF_SYNC(OPQ, base_, Roundup(dst_-base_, BLKSIZE), fd_, file_offset_);
-    OPQ_ADD_TRUNCATE(OPQ, fd_, file_offset_ + dst_-base_);
-    OPQ_ADD_BUF_CLOSE(OPQ, file_, new std::string(filename_)); // pass file_ to make a clean closure
+    opq q = table_queue(number_);
+    OPQ_ADD_BUF_SYNC(q, base_, Roundup(dst_-base_, BLKSIZE), fd_, file_offset_, number_);
+    OPQ_ADD_TRUNCATE(q, fd_, file_offset_ + dst_-base_);
+    OPQ_ADD_BUF_CLOSE(q, file_, new std::string(filename_)); // pass file_ to make a clean closure
 
     file_=NULL;
     base_ = NULL;
@@ -334,7 +674,7 @@ PosixBufferFile::~PosixBufferFile() {
 
 FullMirror_PosixWritableFile::FullMirror_PosixWritableFile(const std::string& fname, FILE* f)
  	 : filename_(fname), file_(f) {
-	sfilename_ = std::string(SSPATH) + fname.substr(fname.find_last_of("/"));
+	sfilename_ = secondary_file(fname);
 	if (hlsm::config::direct_write_on_secondary) {
 		sfd_ = open(sfilename_.c_str(), O_CREAT | O_RDWR | O_TRUNC| O_DIRECT, 0777);
 		sfile_ = fdopen(sfd_, "w" );
@@ -344,7 +684,7 @@ FullMirror_PosixWritableFile::FullMirror_PosixWritableFile(const std::string& fn
 	}
 	DEBUG_INFO(2,"Primary: %s\t%p\tSecondary: %s\t%p\t%d\n",filename_.c_str(), file_, sfilename_.c_str(), sfile_, sfd_);
 
-	runtime::FileNameHash::add(sfilename_);
+	runtime::placement.begin_secondary_write(table_name_to_number(sfilename_));
 	if (hlsm::config::secondary_use_buffer_file) {
 		sfp_ = new PosixBufferFile(sfilename_, sfile_);
 
@@ -370,17 +710,17 @@ FullMirror_PosixWritableFile::~FullMirror_PosixWritableFile() {
   			OPQ_ADD_APPEND_ONLY(OPQ, sfp_, data );
   		} else { // make a copy and append
       	Slice *sdata;
-      	DEBUG_MEASURE_RECORD(2, (sdata = data.clone()), "Append--clone");
+      	HLSM_MEASURE(hlsm::metrics::kSecondaryClone, (sdata = data.clone()));
       	OPQ_ADD_APPEND(OPQ, sfp_, sdata);
   		}
 
   	} else if (USE_OPQ && hlsm::config::append_by_opq) {
     	Slice *sdata;
-    	DEBUG_MEASURE_RECORD(2, (sdata = data.clone()), "Append--clone");
+    	HLSM_MEASURE(hlsm::metrics::kSecondaryClone, (sdata = data.clone()));
     	OPQ_ADD_APPEND(OPQ, sfp_, sdata);
     } else {
     	Status ss;
-    	DEBUG_MEASURE_RECORD(2, (ss = sfp_->Append(data)), "sfp_->Append");
+    	HLSM_MEASURE(hlsm::metrics::kSecondaryAppend, (ss = sfp_->Append(data)));
     	if (!ss.ok())
     		return ss;
     }
@@ -395,6 +735,9 @@ FullMirror_PosixWritableFile::~FullMirror_PosixWritableFile() {
 		OPQ_ADD_CLOSE(OPQ, sfp_);
 	} else {
 		Status ss = sfp_->Close();
+		if (!hlsm::config::secondary_use_buffer_file) {
+			runtime::placement.end_secondary_write(table_name_to_number(sfilename_));
+		}
 		if (!ss.ok())
 			return ss;
 	}
@@ -424,49 +767,102 @@ FullMirror_PosixWritableFile::~FullMirror_PosixWritableFile() {
 
   /********* defined in hlsm_util.h *********/
 
-  void YCSBKeyGenerator::sort(long long *num, int top, int bottom)
-  {
-  	int middle;
-  	if (top < bottom)
-  	{
-  		middle = partition(num, top, bottom);
-  		sort(num, top, middle);   // sort first section
-  		sort(num, middle+1, bottom);    // sort second section
+  const double ZipfianGenerator::kZipfianConstant = 0.99;
+
+  ZipfianGenerator::ZipfianGenerator(long long min, long long max, uint64_t seed,
+  		double theta, double zetan)
+  	: YCSBGenerator(seed), min_(min), items_(max - min + 1), theta_(theta),
+  	  alpha_(1.0 / (1.0 - theta)), zeta2theta_(zeta(0, 2, theta, 0)),
+  	  zetan_(zetan), eta_(0), count_for_zeta_(items_) {
+  	if (zetan_ == 0)
+  		zetan_ = zeta(0, items_, theta_, 0);
+  	eta_ = (1 - pow(2.0 / items_, 1 - theta_)) / (1 - zeta2theta_ / zetan_);
+  }
+
+  // Sum of 1/i^theta for i in (from, to], added to sum
+  double ZipfianGenerator::zeta(long long from, long long to, double theta, double sum) {
+  	for (long long i = from; i < to; i++)
+  		sum += 1 / pow(i + 1.0, theta);
+  	return sum;
+  }
+
+  void ZipfianGenerator::setItems(long long items) {
+  	if (items > count_for_zeta_)
+  		zetan_ = zeta(count_for_zeta_, items, theta_, zetan_);
+  	else
+  		zetan_ = zeta(0, items, theta_, 0);
+  	count_for_zeta_ = items;
+  	eta_ = (1 - pow(2.0 / items, 1 - theta_)) / (1 - zeta2theta_ / zetan_);
+  }
+
+  long long ZipfianGenerator::next(long long items) {
+  	if (items != count_for_zeta_)
+  		setItems(items);
+
+  	const double u = rand_.nextDouble();
+  	const double uz = u * zetan_;
+  	if (uz < 1.0)
+  		return min_;
+  	if (uz < 1.0 + pow(0.5, theta_))
+  		return min_ + 1;
+  	long long ret = min_ + (long long)(items * pow(eta_ * u - eta_ + 1, alpha_));
+  	return std::min(ret, min_ + items - 1);
+  }
+
+  const long long ScrambledZipfianGenerator::kItemCount = 10000000000LL;
+  const double ScrambledZipfianGenerator::kZetan = 26.46902820178302;
+
+  ScrambledZipfianGenerator::ScrambledZipfianGenerator(long long min, long long max, uint64_t seed)
+  	: YCSBGenerator(seed), min_(min), items_(max - min + 1),
+  	  zipfian_(0, kItemCount, seed, ZipfianGenerator::kZipfianConstant, kZetan) {
+  }
+
+  long long ScrambledZipfianGenerator::next() {
+  	return min_ + YCSBKey_hash(zipfian_.next()) % items_;
+  }
+
+  SkewedLatestGenerator::SkewedLatestGenerator(const volatile long long* last, uint64_t seed)
+  	: YCSBGenerator(seed), last_(last), zipfian_(0, *last, seed) {
+  }
+
+  long long SkewedLatestGenerator::next() {
+  	const long long last = *last_;
+  	return last - zipfian_.next(last + 1);
+  }
+
+  void AcknowledgedCounter::reset(long long start) {
+  	leveldb::MutexLock l(&mutex_);
+  	next_ = start;
+  	last_ = start - 1;
+  	acked_.clear();
+  }
+
+  void AcknowledgedCounter::acknowledge(long long item) {
+  	leveldb::MutexLock l(&mutex_);
+  	if (item != last_ + 1) {
+  		acked_.insert(item);
+  		return;
   	}
-  	return;
+  	long long last = item;
+  	while (!acked_.empty() && *acked_.begin() == last + 1) {
+  		acked_.erase(acked_.begin());
+  		last++;
+  	}
+  	last_ = last;
   }
 
-  int YCSBKeyGenerator::partition(long long *array, int top, int bottom)
-  {
-  	long long x = array[top];
-  	int i = top - 1;
-  	int j = bottom + 1;
-  	long long temp;
-  	do
-  	{
-  		do
-  		{
-  			j--;
-  		}while (x >array[j]);
-
-  		do
-  		{
-  			i++;
-  		} while (x <array[i]);
-
-  		if (i < j)
-  		{
-  			temp = array[i];
-  			array[i] = array[j];
-  			array[j] = temp;
-  		}
-  	}while (i < j);
-  	return j;           // returns middle subscript
+  HotspotGenerator::HotspotGenerator(long long min, long long max, uint64_t seed,
+  		double hot_set_fraction, double hot_op_fraction)
+  	: YCSBGenerator(seed), min_(min), hot_op_fraction_(hot_op_fraction) {
+  	const long long items = max - min + 1;
+  	hot_items_ = std::max(1LL, (long long)(items * hot_set_fraction));
+  	cold_items_ = std::max(0LL, items - hot_items_);
   }
 
-  long long YCSBKeyGenerator::nextKey()
-  {
-  	return keypool[index++];
+  long long HotspotGenerator::next() {
+  	if (cold_items_ == 0 || rand_.nextDouble() < hot_op_fraction_)
+  		return min_ + rand_.next64() % hot_items_;
+  	return min_ + hot_items_ + rand_.next64() % cold_items_;
   }
 
 
@@ -492,6 +888,321 @@ FullMirror_PosixWritableFile::~FullMirror_PosixWritableFile() {
 	}
 
 
+/*
+ * PlacementRegistry
+ */
+
+static const size_t kPlacementInitialSlots = 1024;
+
+static inline size_t placement_hash(uint64_t fnum) {
+	return static_cast<size_t>((fnum * 0x9E3779B97F4A7C15ull) >> 20);
+}
+
+PlacementRegistry::PlacementRegistry() : epoch_(0), latest_(0) {
+	readers_[0] = readers_[1] = 0;
+	Table* t = new Table;
+	t->mask = kPlacementInitialSlots - 1;
+	t->used = 0;
+	t->slots = new Slot[kPlacementInitialSlots];
+	memset(t->slots, 0, sizeof(Slot) * kPlacementInitialSlots);
+	table_.Release_Store(t);
+}
+
+PlacementRegistry::~PlacementRegistry() {
+	Table* t = reinterpret_cast<Table*>(table_.NoBarrier_Load());
+	delete[] t->slots;
+	delete t;
+}
+
+void PlacementRegistry::read_slot(const Slot* slot, Slot* copy) {
+	uint32_t seq;
+	do {
+		seq = slot->seq;
+		leveldb::port::MemoryBarrier();
+		copy->fnum = slot->fnum;
+		copy->removed = slot->removed;
+		copy->p = slot->p;
+		leveldb::port::MemoryBarrier();
+	} while ((seq & 1) || seq != slot->seq);
+}
+
+void PlacementRegistry::write_slot(Slot* slot, uint64_t fnum, bool removed,
+		const TablePlacement& p) {
+	slot->seq++;
+	leveldb::port::MemoryBarrier();
+	slot->fnum = fnum;
+	slot->removed = removed;
+	slot->p = p;
+	leveldb::port::MemoryBarrier();
+	slot->seq++;
+}
+
+// A reader announces itself in the current epoch; resize() flips the epoch
+//	after publishing a new table and frees the old one once the readers of
+//	the previous epoch are done.
+const PlacementRegistry::Table* PlacementRegistry::begin_read(int* epoch) const {
+	while (true) {
+		const int e = epoch_;
+		__sync_add_and_fetch(&readers_[e], 1);
+		if (e == epoch_) {
+			*epoch = e;
+			return reinterpret_cast<const Table*>(table_.Acquire_Load());
+		}
+		__sync_sub_and_fetch(&readers_[e], 1);
+	}
+}
+
+void PlacementRegistry::end_read(int epoch) const {
+	__sync_sub_and_fetch(&readers_[epoch], 1);
+}
+
+bool PlacementRegistry::lookup(uint64_t fnum, TablePlacement* p) const {
+	int epoch;
+	const Table* t = begin_read(&epoch);
+	bool found = false;
+	size_t i = placement_hash(fnum) & t->mask;
+	for (size_t n = 0; n <= t->mask; n++, i = (i + 1) & t->mask) {
+		Slot copy;
+		read_slot(&t->slots[i], &copy);
+		if (copy.fnum == fnum) {
+			found = !copy.removed;
+			*p = copy.p;
+			break;
+		} else if (copy.fnum == 0) {
+			break;
+		}
+	}
+	end_read(epoch);
+	return found;
+}
+
+int PlacementRegistry::stripe(uint64_t fnum) const {
+	TablePlacement p;
+	return lookup(fnum, &p) ? p.stripe : -1;
+}
+
+int PlacementRegistry::level(uint64_t fnum) const {
+	TablePlacement p;
+	return lookup(fnum, &p) ? p.level : -1;
+}
+
+bool PlacementRegistry::writing_secondary(uint64_t fnum) const {
+	TablePlacement p;
+	return lookup(fnum, &p) && p.writing_secondary;
+}
+
+void PlacementRegistry::get_migrating(std::set<uint64_t>* fnums) const {
+	int epoch;
+	const Table* t = begin_read(&epoch);
+	for (size_t i = 0; i <= t->mask; i++) {
+		Slot copy;
+		read_slot(&t->slots[i], &copy);
+		if (copy.fnum != 0 && !copy.removed && copy.p.migrations > 0) {
+			fnums->insert(copy.fnum);
+		}
+	}
+	end_read(epoch);
+}
+
+uint64_t PlacementRegistry::migration_pending_bytes() const {
+	int epoch;
+	const Table* t = begin_read(&epoch);
+	uint64_t bytes = 0;
+	for (size_t i = 0; i <= t->mask; i++) {
+		Slot copy;
+		read_slot(&t->slots[i], &copy);
+		if (copy.fnum != 0 && !copy.removed && copy.p.migrations > 0) {
+			bytes += copy.p.size - copy.p.copied;
+		}
+	}
+	end_read(epoch);
+	return bytes;
+}
+
+// REQUIRES: mutex_ held
+PlacementRegistry::Slot* PlacementRegistry::find(uint64_t fnum, bool create) {
+	Table* t = reinterpret_cast<Table*>(table_.NoBarrier_Load());
+	Slot* reuse = NULL;
+	size_t i = placement_hash(fnum) & t->mask;
+	for (size_t n = 0; n <= t->mask; n++, i = (i + 1) & t->mask) {
+		Slot* slot = &t->slots[i];
+		if (slot->fnum == fnum) {
+			if (!slot->removed) return slot;
+			reuse = slot;
+			break;
+		} else if (slot->fnum == 0) {
+			break;
+		} else if (slot->removed && reuse == NULL) {
+			reuse = slot;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	TablePlacement p;
+	memset(&p, 0, sizeof(p));
+	p.level = -1;
+	p.stripe = -1;
+	if (reuse == NULL) {
+		if ((t->used + 1) * 2 > t->mask + 1) {
+			resize((t->mask + 1) * 2);
+			return find(fnum, create);
+		}
+		reuse = &t->slots[i];
+		t->used++;
+	}
+	write_slot(reuse, fnum, false, p);
+	return reuse;
+}
+
+// REQUIRES: mutex_ held
+void PlacementRegistry::resize(size_t capacity) {
+	Table* old = reinterpret_cast<Table*>(table_.NoBarrier_Load());
+	size_t live = 0;
+	for (size_t i = 0; i <= old->mask; i++) {
+		if (old->slots[i].fnum != 0 && !old->slots[i].removed) live++;
+	}
+	// Many removed slots: rebuilding at the same size is enough
+	while (capacity > kPlacementInitialSlots && live * 4 < capacity) {
+		capacity /= 2;
+	}
+
+	Table* t = new Table;
+	t->mask = capacity - 1;
+	t->used = 0;
+	t->slots = new Slot[capacity];
+	memset(t->slots, 0, sizeof(Slot) * capacity);
+	for (size_t i = 0; i <= old->mask; i++) {
+		const Slot& slot = old->slots[i];
+		if (slot.fnum == 0 || slot.removed) continue;
+		size_t j = placement_hash(slot.fnum) & t->mask;
+		while (t->slots[j].fnum != 0) j = (j + 1) & t->mask;
+		t->slots[j].fnum = slot.fnum;
+		t->slots[j].p = slot.p;
+		t->used++;
+	}
+
+	table_.Release_Store(t);
+	const int e = epoch_;
+	epoch_ = 1 - e;
+	__sync_synchronize();
+	while (readers_[e] != 0) {
+		sched_yield();
+	}
+	delete[] old->slots;
+	delete old;
+}
+
+void PlacementRegistry::set_level(uint64_t fnum, int level) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, true);
+	TablePlacement p = slot->p;
+	p.level = level;
+	write_slot(slot, fnum, false, p);
+	latest_ = fnum;
+	DEBUG_INFO(3, "level: %d\tfile number: %lu\n", level, fnum);
+}
+
+void PlacementRegistry::remove(uint64_t fnum) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, false);
+	if (slot == NULL) return;
+	if (slot->p.migrations > 0) {
+		// keep the migration visible to HLSMDeleteObsoleteFiles
+		TablePlacement p = slot->p;
+		p.level = -1;
+		p.on_primary = p.on_secondary = false;
+		write_slot(slot, fnum, false, p);
+	} else {
+		write_slot(slot, fnum, true, slot->p);
+	}
+}
+
+void PlacementRegistry::add_copy(uint64_t fnum, Device d) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, true);
+	TablePlacement p = slot->p;
+	if (d == kPrimary) p.on_primary = true;
+	else p.on_secondary = true;
+	write_slot(slot, fnum, false, p);
+}
+
+void PlacementRegistry::drop_copy(uint64_t fnum, Device d) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, false);
+	if (slot == NULL) return;
+	TablePlacement p = slot->p;
+	const bool known = p.copies_known();
+	if (d == kPrimary) p.on_primary = false;
+	else p.on_secondary = false;
+	const bool gone = known && !p.copies_known() &&
+			!p.writing_secondary && p.migrations == 0;
+	write_slot(slot, fnum, gone, p);
+}
+
+void PlacementRegistry::begin_secondary_write(uint64_t fnum) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, true);
+	TablePlacement p = slot->p;
+	p.writing_secondary = true;
+	p.on_secondary = true;
+	write_slot(slot, fnum, false, p);
+}
+
+void PlacementRegistry::end_secondary_write(uint64_t fnum) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, false);
+	if (slot == NULL) return;
+	TablePlacement p = slot->p;
+	p.writing_secondary = false;
+	write_slot(slot, fnum, false, p);
+}
+
+void PlacementRegistry::begin_migration(uint64_t fnum) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, true);
+	TablePlacement p = slot->p;
+	p.migrations++;
+	write_slot(slot, fnum, false, p);
+}
+
+void PlacementRegistry::update_migration(uint64_t fnum, uint64_t copied, uint64_t size) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, false);
+	if (slot == NULL) return;
+	TablePlacement p = slot->p;
+	p.copied = copied;
+	p.size = size;
+	write_slot(slot, fnum, false, p);
+	DEBUG_INFO(3, "table %lu: %lu of %lu bytes\n", fnum, copied, size);
+}
+
+void PlacementRegistry::end_migration(uint64_t fnum, bool ok) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, false);
+	if (slot == NULL) return;
+	TablePlacement p = slot->p;
+	if (p.migrations > 0) p.migrations--;
+	if (ok) p.on_secondary = true;
+	if (p.migrations == 0) p.copied = p.size = 0;
+	// a table removed during its failed migration has nothing left to track
+	const bool gone = p.migrations == 0 && p.level == -1 &&
+			!p.copies_known() && !p.writing_secondary;
+	write_slot(slot, fnum, gone, p);
+}
+
+int PlacementRegistry::assign_stripe(uint64_t fnum, int stripe) {
+	leveldb::MutexLock l(&mutex_);
+	Slot* slot = find(fnum, true);
+	TablePlacement p = slot->p;
+	if (p.stripe < 0) {
+		p.stripe = stripe;
+		write_slot(slot, fnum, false, p);
+	}
+	return p.stripe;
+}
+
 } // hlsm
 
 
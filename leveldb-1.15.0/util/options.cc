@@ -17,12 +17,19 @@ Options::Options()
       env(Env::Default()),
       info_log(NULL),
       write_buffer_size(4<<20),
+      max_immutable_memtables(1),
+      memtable_rep(kSkipListRep),
+      memtable_hash_buckets(32768),
       max_open_files(1000),
       block_cache(NULL),
+      row_cache(NULL),
       block_size(4096),
       block_restart_interval(16),
+      data_block_hash_index(false),
+      partition_index_and_filters(false),
       compression(kSnappyCompression),
-      filter_policy(NULL) {
+      filter_policy(NULL),
+      prefix_extractor(NULL) {
 }
 
 